@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <psched/priority_scheduler.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace psched;
+
+/*
+Throughput and latency benchmarks for psched
+
+Usage: psched_bench [--quick]
+
+Results are written to stdout as one JSON document:
+
+  {"version": "1.9.0", "benchmarks": [{"name": ..., <parameters>, <results>}, ...]}
+
+Durations are reported in nanoseconds and rates in tasks per second.
+*/
+
+typedef std::chrono::steady_clock Clock;
+
+static size_t scale = 1; // Divides the amount of work with --quick
+
+static int64_t nanoseconds_since(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+// Burns roughly `ns` nanoseconds of CPU
+static void busy_work(int64_t ns) {
+  const auto start = Clock::now();
+  while (nanoseconds_since(start) < ns)
+    ;
+}
+
+static void wait_for(const std::atomic<size_t> &counter, size_t value) {
+  while (counter.load(std::memory_order_acquire) < value)
+    std::this_thread::yield();
+}
+
+// One benchmark result, written as a flat JSON object
+class Result {
+  std::ostringstream fields_;
+
+public:
+  explicit Result(const std::string &name) { fields_ << "{\"name\": \"" << name << "\""; }
+
+  template <class T> Result &add(const char *key, T value) {
+    fields_ << ", \"" << key << "\": " << value;
+    return *this;
+  }
+
+  Result &add(const char *key, const char *value) {
+    fields_ << ", \"" << key << "\": \"" << value << "\"";
+    return *this;
+  }
+
+  // Adds p50/p90/p99/p99.9/max of `samples` (in nanoseconds) with a key prefix
+  Result &percentiles(const std::string &prefix, std::vector<int64_t> samples) {
+    if (samples.empty())
+      return *this;
+    std::sort(samples.begin(), samples.end());
+    const auto at = [&samples](double q) {
+      return samples[std::min(samples.size() - 1, static_cast<size_t>(q * samples.size()))];
+    };
+    add((prefix + "_p50_ns").c_str(), at(0.5));
+    add((prefix + "_p90_ns").c_str(), at(0.9));
+    add((prefix + "_p99_ns").c_str(), at(0.99));
+    add((prefix + "_p999_ns").c_str(), at(0.999));
+    add((prefix + "_max_ns").c_str(), samples.back());
+    return *this;
+  }
+
+  std::string str() const { return fields_.str() + "}"; }
+};
+
+static std::vector<std::string> results;
+
+// Empty tasks scheduled by one producer, executed by T workers
+template <size_t T> void throughput_empty_tasks() {
+  const size_t tasks = 1000000 / scale;
+  std::atomic<size_t> done{0};
+  int64_t elapsed;
+  {
+    PriorityScheduler<threads<T>, queues<3>, aging_policy<>> scheduler;
+    const auto start = Clock::now();
+    for (size_t i = 0; i < tasks; ++i)
+      scheduler.template schedule<priority<1>>(
+          [&done] { done.fetch_add(1, std::memory_order_release); });
+    wait_for(done, tasks);
+    elapsed = nanoseconds_since(start);
+  }
+  results.push_back(Result("throughput_empty_tasks")
+                        .add("threads", T)
+                        .add("tasks", tasks)
+                        .add("elapsed_ns", elapsed)
+                        .add("tasks_per_second", tasks * 1e9 / elapsed)
+                        .str());
+}
+
+// Cost of one schedule() call with `producers` threads scheduling at once
+static void schedule_cost(size_t producers) {
+  const size_t per_producer = 400000 / scale / producers;
+  std::atomic<size_t> done{0};
+  std::vector<int64_t> elapsed(producers);
+  {
+    PriorityScheduler<threads<4>, queues<3>, aging_policy<>> scheduler;
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; ++p) {
+      threads.emplace_back([&, p] {
+        while (!go)
+          std::this_thread::yield();
+        const auto start = Clock::now();
+        for (size_t i = 0; i < per_producer; ++i)
+          scheduler.schedule(i % 3, [&done] { done.fetch_add(1, std::memory_order_release); });
+        elapsed[p] = nanoseconds_since(start);
+      });
+    }
+    go = true;
+    for (auto &t : threads)
+      t.join();
+    wait_for(done, per_producer * producers);
+  }
+  int64_t total = 0;
+  for (auto e : elapsed)
+    total += e;
+  results.push_back(Result("schedule_cost")
+                        .add("producers", producers)
+                        .add("tasks_per_producer", per_producer)
+                        .add("ns_per_schedule",
+                             static_cast<double>(total) / (producers * per_producer))
+                        .str());
+}
+
+// Cost of one schedule() call with `producers` registered producers, each on
+// its own lanes
+static void producer_lane_cost(size_t producers) {
+  const size_t per_producer = 400000 / scale / producers;
+  std::atomic<size_t> done{0};
+  std::vector<int64_t> elapsed(producers);
+  {
+    // Lanes large enough that producers seldom fall back to the shared queues
+    PriorityScheduler<threads<4>, queues<3>, aging_policy<>, producer_lanes<16, 4096>> scheduler;
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; ++p) {
+      threads.emplace_back([&, p] {
+        auto producer = scheduler.register_producer();
+        while (!go)
+          std::this_thread::yield();
+        const auto start = Clock::now();
+        for (size_t i = 0; i < per_producer; ++i)
+          producer.schedule(i % 3, [&done] { done.fetch_add(1, std::memory_order_release); });
+        elapsed[p] = nanoseconds_since(start);
+      });
+    }
+    go = true;
+    for (auto &t : threads)
+      t.join();
+    wait_for(done, per_producer * producers);
+  }
+  int64_t total = 0;
+  for (auto e : elapsed)
+    total += e;
+  results.push_back(Result("producer_lane_cost")
+                        .add("producers", producers)
+                        .add("tasks_per_producer", per_producer)
+                        .add("ns_per_schedule",
+                             static_cast<double>(total) / (producers * per_producer))
+                        .str());
+}
+
+// Time from schedule() to the start of the task when workers are idle
+static void wakeup_latency() {
+  const size_t samples = 20000 / scale;
+  std::vector<int64_t> latency(samples);
+  std::atomic<size_t> done{0};
+  {
+    PriorityScheduler<threads<4>, queues<3>, aging_policy<>> scheduler;
+    for (size_t i = 0; i < samples; ++i) {
+      // Give workers time to go idle (and park) between samples
+      if (i % 16 == 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+      const auto scheduled = Clock::now();
+      scheduler.schedule<priority<1>>([&, i, scheduled] {
+        latency[i] = nanoseconds_since(scheduled);
+        done.fetch_add(1, std::memory_order_release);
+      });
+      wait_for(done, i + 1);
+    }
+  }
+  results.push_back(
+      Result("wakeup_latency").add("samples", samples).percentiles("latency", latency).str());
+}
+
+// Waiting time of high-priority tasks while low-priority work saturates every worker
+//
+// Aging is effectively disabled so that low-priority tasks stay low.
+static void priority_inversion() {
+  const size_t low_tasks = 40000 / scale;
+  const size_t high_tasks = 2000 / scale;
+  const int64_t work_ns = 10000;
+  std::vector<int64_t> low_wait(low_tasks), high_wait(high_tasks);
+  std::atomic<size_t> done{0};
+  {
+    PriorityScheduler<threads<4>, queues<3>,
+                      aging_policy<task_starvation_after<std::chrono::hours, 1>>>
+        scheduler;
+    for (size_t i = 0; i < low_tasks; ++i) {
+      const auto scheduled = Clock::now();
+      scheduler.schedule<priority<0>>([&, i, scheduled] {
+        low_wait[i] = nanoseconds_since(scheduled);
+        busy_work(work_ns);
+        done.fetch_add(1, std::memory_order_release);
+      });
+    }
+    for (size_t i = 0; i < high_tasks; ++i) {
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+      const auto scheduled = Clock::now();
+      scheduler.schedule<priority<2>>([&, i, scheduled] {
+        high_wait[i] = nanoseconds_since(scheduled);
+        done.fetch_add(1, std::memory_order_release);
+      });
+    }
+    wait_for(done, low_tasks + high_tasks);
+  }
+  results.push_back(Result("priority_inversion")
+                        .add("low_tasks", low_tasks)
+                        .add("high_tasks", high_tasks)
+                        .add("low_work_ns", work_ns)
+                        .percentiles("high_wait", high_wait)
+                        .percentiles("low_wait", low_wait)
+                        .str());
+}
+
+// Throughput of short tasks spread over `levels` levels for a starvation threshold
+//
+// With a threshold of one hour no task starves within the run, which gives the
+// baseline; with 1ms the aging thread keeps promoting tasks.
+template <class starvation> void aging_overhead(size_t levels, const char *threshold) {
+  const size_t tasks = 400000 / scale;
+  std::atomic<size_t> done{0};
+  int64_t elapsed;
+  MetricsSnapshot metrics;
+  {
+    PriorityScheduler<threads<4>, queues<dynamic_queues>, aging_policy<starvation>,
+                      collect_metrics<>>
+        scheduler(levels);
+    const auto start = Clock::now();
+    for (size_t i = 0; i < tasks; ++i)
+      scheduler.schedule(i % levels, [&done] {
+        busy_work(200);
+        done.fetch_add(1, std::memory_order_release);
+      });
+    wait_for(done, tasks);
+    elapsed = nanoseconds_since(start);
+    metrics = scheduler.metrics_snapshot();
+  }
+  size_t promoted = 0;
+  for (auto &level : metrics.levels)
+    promoted += level.promoted;
+  results.push_back(Result("aging_overhead")
+                        .add("levels", levels)
+                        .add("starvation_after", threshold)
+                        .add("tasks", tasks)
+                        .add("promoted", promoted)
+                        .add("tasks_per_second", tasks * 1e9 / elapsed)
+                        .str());
+}
+
+// Fraction of tasks discarded by a bounded queue under overload
+template <discard policy> void discard_rate(const char *name) {
+  const size_t tasks = 200000 / scale;
+  MetricsSnapshot metrics;
+  {
+    PriorityScheduler<threads<1>, queues<1, maintain_size<1024, policy>>, aging_policy<>,
+                      collect_metrics<>>
+        scheduler;
+    for (size_t i = 0; i < tasks; ++i)
+      scheduler.template schedule<priority<0>>([] { busy_work(1000); });
+    metrics = scheduler.metrics_snapshot();
+  }
+  const auto &level = metrics.levels[0];
+  results.push_back(Result("discard_rate")
+                        .add("policy", name)
+                        .add("queue_size", 1024)
+                        .add("tasks", tasks)
+                        .add("dropped", level.dropped)
+                        .add("discard_fraction", static_cast<double>(level.dropped) / tasks)
+                        .str());
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--quick") == 0)
+      scale = 10;
+  }
+
+  throughput_empty_tasks<1>();
+  throughput_empty_tasks<2>();
+  throughput_empty_tasks<4>();
+  throughput_empty_tasks<8>();
+  for (size_t producers : {1, 2, 4, 8})
+    schedule_cost(producers);
+  for (size_t producers : {1, 2, 4, 8})
+    producer_lane_cost(producers);
+  wakeup_latency();
+  priority_inversion();
+  for (size_t levels : {2, 8, 32, 128}) {
+    aging_overhead<task_starvation_after<std::chrono::hours, 1>>(levels, "1h");
+    aging_overhead<task_starvation_after<std::chrono::milliseconds, 1>>(levels, "1ms");
+  }
+  discard_rate<discard::oldest_task>("oldest_task");
+  discard_rate<discard::newest_task>("newest_task");
+  discard_rate<discard::block>("block");
+
+  std::cout << "{\"version\": \"" << PSCHED_VERSION << "\", \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); ++i)
+    std::cout << "  " << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+  std::cout << "]}\n";
+}
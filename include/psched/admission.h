@@ -0,0 +1,61 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace psched {
+
+namespace detail {
+
+// Token bucket limiting the rate at which tasks are admitted to one level
+//
+// Implemented as a generic cell rate algorithm: instead of a token count,
+// a single atomic holds the time at which the bucket will be full again
+// (`next_`). Admitting `n` tasks pushes it `n` intervals into the future,
+// and is refused if that would put it more than `burst` intervals ahead of
+// now. An interval of zero means the level is not limited.
+class AdmissionLimit {
+  std::atomic<int64_t> interval_{0};  // Nanoseconds per token, 0 if unlimited
+  std::atomic<int64_t> tolerance_{0}; // `burst` intervals, in nanoseconds
+  std::atomic<int64_t> next_{0};      // Theoretical arrival time, steady_clock nanoseconds
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+public:
+  // `tasks_per_second` of zero removes the limit
+  void set(double tasks_per_second, size_t burst) {
+    const int64_t interval =
+        tasks_per_second > 0 ? std::max<int64_t>(1, static_cast<int64_t>(1e9 / tasks_per_second))
+                             : 0;
+    tolerance_.store(interval * static_cast<int64_t>(std::max<size_t>(burst, 1)),
+                     std::memory_order_relaxed);
+    next_.store(0, std::memory_order_relaxed);
+    interval_.store(interval, std::memory_order_release);
+  }
+
+  bool try_acquire(size_t count = 1) {
+    const int64_t interval = interval_.load(std::memory_order_acquire);
+    if (interval == 0)
+      return true;
+    const int64_t tolerance = tolerance_.load(std::memory_order_relaxed);
+    const int64_t t = now();
+    int64_t next = next_.load(std::memory_order_relaxed);
+    while (true) {
+      const int64_t updated = std::max(next, t) + interval * static_cast<int64_t>(count);
+      if (updated - t > tolerance)
+        return false;
+      if (next_.compare_exchange_weak(next, updated, std::memory_order_relaxed))
+        return true;
+    }
+  }
+};
+
+} // namespace detail
+
+} // namespace psched
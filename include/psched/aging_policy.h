@@ -1,6 +1,8 @@
 
 #pragma once
+#include <algorithm>
 #include <chrono>
+#include <stddef.h>
 
 namespace psched {
 
@@ -19,10 +21,32 @@ template <class D = std::chrono::milliseconds, size_t P = 0> struct task_starvat
 
 template <size_t P> struct increment_priority_by { constexpr static size_t value = P; };
 
-template <class T = task_starvation_after<>, class I = increment_priority_by<1>>
+// How often the aging thread looks for starved tasks
+//
+// The default (zero) checks twice per `task_starvation_after` period, and at
+// most once per millisecond.
+template <class D = std::chrono::milliseconds, size_t P = 0> struct aging_interval {
+  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
+  typedef D type;
+  constexpr static D value = D(P);
+};
+
+template <class T = task_starvation_after<>, class I = increment_priority_by<1>,
+          class A = aging_interval<>>
 struct aging_policy {
   typedef T task_starvation_after;
   typedef I increment_priority_by;
+  typedef A aging_interval;
+
+  // Period of the aging thread
+  static std::chrono::steady_clock::duration interval() {
+    typedef std::chrono::steady_clock::duration duration;
+    const auto configured = std::chrono::duration_cast<duration>(A::value);
+    if (configured > duration::zero())
+      return configured;
+    return std::max<duration>(std::chrono::duration_cast<duration>(T::value) / 2,
+                              std::chrono::milliseconds(1));
+  }
 };
 
 } // namespace psched
\ No newline at end of file
@@ -0,0 +1,33 @@
+#pragma once
+#include <atomic>
+#include <memory>
+
+namespace psched {
+
+namespace detail {
+struct CancellationState {
+  std::atomic_bool cancelled{false};
+};
+} // namespace detail
+
+// Shared flag used to withdraw scheduled tasks and to stop running ones
+//
+// A task with a token (see `Task::set_cancellation`) that is cancelled while
+// it waits in a queue is skipped by the worker that dequeues it, which calls
+// the task's `on_dropped` callback: cancelling is O(1) and never touches the
+// queue. A task that is already running keeps running, but can poll
+// `is_cancelled()` on a copy of the token and return early. Copies share the
+// same flag, so one token can cancel every task spawned for a request.
+class CancellationToken {
+  std::shared_ptr<detail::CancellationState> state_{
+      std::make_shared<detail::CancellationState>()};
+
+  friend class Task;
+
+public:
+  void cancel() { state_->cancelled.store(true, std::memory_order_release); }
+
+  bool is_cancelled() const { return state_->cancelled.load(std::memory_order_acquire); }
+};
+
+} // namespace psched
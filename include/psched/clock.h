@@ -0,0 +1,135 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <psched/task_stats.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PSCHED_HAS_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define PSCHED_HAS_TSC 1
+#endif
+
+namespace psched {
+
+// Reads std::chrono::steady_clock
+struct steady_clock_source {
+  static TaskStats::TimePoint now() { return std::chrono::steady_clock::now(); }
+};
+
+// Reads the CPU's time stamp counter, calibrated against steady_clock
+//
+// A `rdtsc` costs a fraction of a `clock_gettime` call. The counter is
+// calibrated once, on first use, and converted to steady_clock time points,
+// so timestamps from both clocks can be compared. Requires an invariant TSC
+// (any x86 CPU from the last decade); falls back to steady_clock on other
+// architectures.
+struct tsc_clock_source {
+#if defined(PSCHED_HAS_TSC)
+private:
+  struct Calibration {
+    TaskStats::TimePoint base;
+    uint64_t base_ticks;
+    double nanoseconds_per_tick;
+
+    Calibration() {
+      // Measure the tick rate over ~2ms of steady_clock time
+      const auto start = std::chrono::steady_clock::now();
+      const uint64_t start_ticks = __rdtsc();
+      auto end = start;
+      while (end - start < std::chrono::milliseconds(2))
+        end = std::chrono::steady_clock::now();
+      const uint64_t end_ticks = __rdtsc();
+      nanoseconds_per_tick =
+          static_cast<double>(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) /
+          static_cast<double>(end_ticks - start_ticks);
+      base = end;
+      base_ticks = end_ticks;
+    }
+  };
+
+public:
+  static TaskStats::TimePoint now() {
+    static const Calibration calibration;
+    const auto ticks = static_cast<int64_t>(__rdtsc() - calibration.base_ticks);
+    const auto ns = static_cast<int64_t>(static_cast<double>(ticks) *
+                                         calibration.nanoseconds_per_tick);
+    return calibration.base + std::chrono::duration_cast<TaskStats::TimePoint::duration>(
+                                  std::chrono::nanoseconds(ns));
+  }
+#else
+  static TaskStats::TimePoint now() { return std::chrono::steady_clock::now(); }
+#endif
+};
+
+// Reads a time point published every `N` `D`s by a ticker thread
+//
+// Reading the clock is a single relaxed load, at the cost of timestamps that
+// lag by about one period (more if the OS sleeps coarsely). The ticker
+// thread is started on first use and runs until the program exits.
+template <class D = std::chrono::microseconds, size_t N = 100> struct coarse_clock_source {
+private:
+  struct Ticker {
+    std::atomic<TaskStats::TimePoint::rep> now{
+        std::chrono::steady_clock::now().time_since_epoch().count()};
+    std::atomic_bool running{true};
+    std::thread thread{[this] {
+      while (running.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(D(N));
+        now.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                  std::memory_order_relaxed);
+      }
+    }};
+
+    ~Ticker() {
+      running = false;
+      thread.join();
+    }
+  };
+
+public:
+  static TaskStats::TimePoint now() {
+    static Ticker ticker;
+    return TaskStats::TimePoint(
+        TaskStats::TimePoint::duration(ticker.now.load(std::memory_order_relaxed)));
+  }
+};
+
+} // namespace psched
+
+// Clock used to timestamp tasks: `psched::steady_clock_source` (default),
+// `psched::tsc_clock_source` or `psched::coarse_clock_source<D, N>`
+// Define before including psched to change the clock
+#ifndef PSCHED_CLOCK
+#define PSCHED_CLOCK psched::steady_clock_source
+#endif
+
+// Define as 0 before including psched to compile out task timestamps
+#ifndef PSCHED_TASK_TIMESTAMPS
+#define PSCHED_TASK_TIMESTAMPS 1
+#endif
+
+namespace psched {
+
+// Clock read by tasks and queues for TaskStats timestamps
+//
+// With PSCHED_TASK_TIMESTAMPS set to 0, `now()` returns the epoch without
+// reading any clock: arrival, start and end times are left unset, aging is
+// disabled and deadline misses are not detected. Deadlines set relative to
+// now still read `source`.
+struct TaskClock {
+  typedef PSCHED_CLOCK source;
+  constexpr static bool enabled = PSCHED_TASK_TIMESTAMPS != 0;
+
+  static TaskStats::TimePoint now() {
+    if (enabled)
+      return source::now();
+    return TaskStats::TimePoint();
+  }
+};
+
+} // namespace psched
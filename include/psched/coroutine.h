@@ -0,0 +1,180 @@
+#pragma once
+// Coroutine support is only available when compiling as C++20 (or later)
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define PSCHED_HAS_COROUTINES 1
+#endif
+#endif
+
+#if defined(PSCHED_HAS_COROUTINES)
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <optional>
+#include <psched/future.h>
+#include <stddef.h>
+#include <utility>
+
+namespace psched {
+
+template <class T = void> class CoTask;
+
+namespace detail {
+
+// Promise state shared by every CoTask<T>
+struct CoTaskPromiseBase {
+  std::coroutine_handle<> continuation{}; // Coroutine awaiting this one, if any
+  std::exception_ptr error{};
+
+  // Transfers control to the awaiting coroutine, if any, when the body finishes
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    template <class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      const auto continuation = h.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+  };
+
+  // A CoTask does not run until it is awaited
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <class T> struct CoTaskPromise : CoTaskPromiseBase {
+  std::optional<T> value{};
+
+  CoTask<T> get_return_object();
+  template <class U> void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+
+  T result() {
+    if (error)
+      std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+template <> struct CoTaskPromise<void> : CoTaskPromiseBase {
+  CoTask<void> get_return_object();
+  void return_void() {}
+
+  void result() {
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+// Coroutine that owns its own frame and runs to completion unobserved
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() const noexcept { return {}; }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+};
+
+} // namespace detail
+
+// Lazily started coroutine returning T
+//
+// A CoTask starts when it is `co_await`ed, on the awaiting thread, and
+// resumes its awaiter when it completes. To run one on a scheduler, pass it
+// to `PriorityScheduler::spawn`, which returns a Future for its result.
+template <class T> class CoTask {
+public:
+  typedef detail::CoTaskPromise<T> promise_type;
+
+private:
+  std::coroutine_handle<promise_type> handle_{};
+
+public:
+  CoTask() = default;
+  explicit CoTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+  CoTask(CoTask &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  CoTask &operator=(CoTask other) noexcept {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+  CoTask(const CoTask &) = delete;
+  ~CoTask() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  bool done() const { return !handle_ || handle_.done(); }
+
+  auto operator co_await() && noexcept {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> handle;
+      bool await_ready() const noexcept { return !handle || handle.done(); }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+      }
+      T await_resume() { return handle.promise().result(); }
+    };
+    return Awaiter{handle_};
+  }
+};
+
+namespace detail {
+
+template <class T> CoTask<T> CoTaskPromise<T>::get_return_object() {
+  return CoTask<T>(std::coroutine_handle<CoTaskPromise<T>>::from_promise(*this));
+}
+
+inline CoTask<void> CoTaskPromise<void>::get_return_object() {
+  return CoTask<void>(std::coroutine_handle<CoTaskPromise<void>>::from_promise(*this));
+}
+
+// Awaitable that suspends the coroutine and queues its resumption at a level
+//
+// The task that resumes the coroutine only captures the coroutine handle and
+// the awaiter, so it is stored inline in the queue node and needs no
+// allocation of its own. If a bounded queue discards the task, the coroutine
+// is resumed right away, on the discarding thread, and `co_await` throws
+// std::future_error (std::future_errc::broken_promise), so that the frames
+// awaiting it unwind and are destroyed instead of staying suspended forever.
+template <class Scheduler> struct ResumeOn {
+  Scheduler &scheduler;
+  size_t level;
+  bool dropped{false};
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle) {
+    Task task([handle] { handle.resume(); });
+    task.on_dropped([this, handle](const TaskStats &) {
+      dropped = true;
+      handle.resume();
+    });
+    scheduler.schedule(level, std::move(task));
+  }
+  void await_resume() const {
+    if (dropped)
+      throw std::future_error(std::future_errc::broken_promise);
+  }
+};
+
+// Hops onto `level`, runs `task` there and fulfills `state` with its result
+template <class Scheduler, class T, class S>
+Detached drive(Scheduler &scheduler, size_t level, CoTask<T> task, StateRef<S> state) {
+  try {
+    co_await ResumeOn<Scheduler>{scheduler, level};
+    if constexpr (std::is_void<T>::value) {
+      co_await std::move(task);
+      state->set_value();
+    } else {
+      state->set_value(co_await std::move(task));
+    }
+  } catch (...) {
+    state->set_exception(std::current_exception());
+  }
+}
+
+} // namespace detail
+
+} // namespace psched
+#endif
@@ -0,0 +1,252 @@
+#pragma once
+#include <chrono>
+#include <iterator>
+#include <mutex>
+#include <psched/queue_size.h>
+#include <psched/task.h>
+#include <stdint.h>
+#include <vector>
+
+namespace psched {
+
+// Task queue ordered by deadline: a binary min-heap protected by a mutex
+//
+// Tasks are popped in order of their absolute deadline (`Task::set_deadline`);
+// tasks without a deadline come after every task that has one. Ties are broken
+// by arrival order, so a queue of tasks without deadlines behaves like a FIFO.
+//
+// Tasks live in a slab of slots that is recycled through a free list, and the
+// heap only moves small (deadline, sequence, slot) keys around. Queued slots
+// are also linked in arrival order, and every slot knows where its key is in
+// the heap, so the oldest task can be removed in O(log n).
+//
+// If the queue policy bounds the queue, `discard::newest_task` (and
+// `discard::block`, when the scheduler cannot wait) drops the incoming task
+// and `discard::oldest_task` drops the task that arrived first.
+template <class queue_policy> class DeadlineQueue {
+  constexpr static size_t none = static_cast<size_t>(-1);
+
+  struct Key {
+    int64_t deadline;  // Absolute deadline, steady_clock ticks
+    uint64_t sequence; // Arrival order, breaks deadline ties
+    size_t slot;       // Index of the task in `tasks_`
+
+    // Is this key popped before `other`?
+    bool before(const Key &other) const {
+      return deadline != other.deadline ? deadline < other.deadline : sequence < other.sequence;
+    }
+  };
+
+  // Per-slot bookkeeping, next to the slab of tasks
+  struct Link {
+    size_t position; // Index of the slot's key in `heap_`
+    size_t older;    // Previous slot in arrival order, or `none`
+    size_t newer;    // Next slot in arrival order, or `none`
+  };
+
+  std::vector<Key> heap_;    // Min-heap of the keys of the queued tasks
+  std::vector<Task> tasks_;  // Slab of task slots
+  std::vector<Link> links_;  // Indexed like `tasks_`
+  std::vector<size_t> free_; // Unused slots in `tasks_`
+  size_t oldest_{none};      // Queued slots in arrival order, oldest first
+  size_t newest_{none};
+  uint64_t sequence_{0}; // Next arrival sequence number
+  std::mutex mutex_;     // Protects everything above
+
+  void place(size_t i, const Key &key) {
+    heap_[i] = key;
+    links_[key.slot].position = i;
+  }
+
+  void sift_up(size_t i) {
+    const Key key = heap_[i];
+    while (i > 0 && key.before(heap_[(i - 1) / 2])) {
+      place(i, heap_[(i - 1) / 2]);
+      i = (i - 1) / 2;
+    }
+    place(i, key);
+  }
+
+  void sift_down(size_t i) {
+    const Key key = heap_[i];
+    const size_t size = heap_.size();
+    while (true) {
+      size_t child = 2 * i + 1;
+      if (child >= size)
+        break;
+      if (child + 1 < size && heap_[child + 1].before(heap_[child]))
+        child += 1;
+      if (!heap_[child].before(key))
+        break;
+      place(i, heap_[child]);
+      i = child;
+    }
+    place(i, key);
+  }
+
+  // Unlinks the task in `slot` from the heap and the arrival list and moves it out
+  Task remove(size_t slot) {
+    const size_t i = links_[slot].position;
+    const Key last = heap_.back();
+    heap_.pop_back();
+    if (i < heap_.size()) {
+      place(i, last);
+      sift_up(i);
+      sift_down(links_[last.slot].position);
+    }
+    Link &link = links_[slot];
+    (link.older == none ? oldest_ : links_[link.older].newer) = link.newer;
+    (link.newer == none ? newest_ : links_[link.newer].older) = link.older;
+    Task task = std::move(tasks_[slot]);
+    release(slot);
+    return task;
+  }
+
+  bool full() const {
+    return queue_policy::bounded_or_not &&
+           heap_.size() >= queue_policy::maintain_size::bounded_queue_size;
+  }
+
+  // Called with the lock held; discarded tasks are moved to `dropped` so that
+  // their callbacks can run once the lock is released
+  bool push_locked(Task &&task, size_t &discarded, std::vector<Task> &dropped) {
+    if (full()) {
+      if (queue_policy::maintain_size::discard_policy != discard::oldest_task) {
+        discarded += 1;
+        dropped.emplace_back(std::move(task));
+        return false;
+      }
+      dropped.emplace_back(remove(oldest_));
+      discarded += 1;
+    }
+
+    size_t slot;
+    if (free_.empty()) {
+      slot = tasks_.size();
+      tasks_.emplace_back(std::move(task));
+      links_.emplace_back();
+    } else {
+      slot = free_.back();
+      free_.pop_back();
+      tasks_[slot] = std::move(task);
+    }
+    links_[slot].older = newest_;
+    links_[slot].newer = none;
+    (newest_ == none ? oldest_ : links_[newest_].newer) = slot;
+    newest_ = slot;
+    heap_.push_back(
+        Key{tasks_[slot].stats_.deadline.time_since_epoch().count(), sequence_++, slot});
+    sift_up(heap_.size() - 1);
+    return true;
+  }
+
+  static void drop_all(std::vector<Task> &dropped) {
+    for (auto &task : dropped)
+      task.drop();
+  }
+
+  // Called with the lock held
+  void pop_locked(Task &task) { task = remove(heap_.front().slot); }
+
+  void release(size_t slot) {
+    tasks_[slot] = Task();
+    free_.push_back(slot);
+  }
+
+public:
+  // Tasks taken off the queue together, e.g., by `pop_arrived_before`
+  typedef std::vector<Task> Batch;
+
+  // A bounded queue allocates all of its slots up front
+  DeadlineQueue() {
+    const size_t size = queue_policy::maintain_size::bounded_queue_size;
+    heap_.reserve(size);
+    tasks_.reserve(size);
+    links_.reserve(size);
+    free_.reserve(size);
+  }
+
+  // Blocks on the queue mutex; only fails if the queue is empty
+  bool try_pop(Task &task) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (heap_.empty())
+      return false;
+    pop_locked(task);
+    return true;
+  }
+
+  bool empty() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    return heap_.empty();
+  }
+
+  // `discarded` is set to the number of tasks dropped to maintain the queue
+  // size; returns false if `task` itself was dropped
+  bool try_push(Task &&task, size_t &discarded) {
+    discarded = 0;
+    std::vector<Task> dropped;
+    bool pushed;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      task.save_arrival_time();
+      pushed = push_locked(std::move(task), discarded, dropped);
+    }
+    drop_all(dropped);
+    return pushed;
+  }
+
+  // Never discards a task; `task` is left untouched if the queue is full
+  bool try_push_if_not_full(Task &&task) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (full())
+      return false;
+    task.save_arrival_time();
+    size_t discarded = 0;
+    std::vector<Task> dropped;
+    return push_locked(std::move(task), discarded, dropped);
+  }
+
+  // Pushes every task in [first, last) under a single lock with one arrival time
+  template <class Iterator>
+  size_t try_push_bulk(Iterator first, Iterator last, size_t &discarded) {
+    discarded = 0;
+    size_t pushed = 0;
+    std::vector<Task> dropped;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      const auto now = TaskClock::now();
+      for (; first != last; ++first, ++pushed) {
+        Task task(*first);
+        task.stats_.arrival_time = now;
+        push_locked(std::move(task), discarded, dropped);
+      }
+    }
+    drop_all(dropped);
+    return pushed;
+  }
+
+  // Pushes every task of `batch` like `try_push_bulk`, leaving `batch` empty
+  size_t push_batch(Batch &batch, size_t &discarded) {
+    const size_t pushed = try_push_bulk(std::make_move_iterator(batch.begin()),
+                                        std::make_move_iterator(batch.end()), discarded);
+    batch.clear();
+    return pushed;
+  }
+
+  void done() {}
+
+  // Moves every task that arrived before `cutoff` to the back of `starved`,
+  // oldest first; returns the number of tasks moved
+  size_t pop_arrived_before(TaskStats::TimePoint cutoff, std::vector<Task> &starved) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    // Tasks are linked in arrival order, so the starved tasks come first
+    size_t count = 0;
+    while (oldest_ != none && tasks_[oldest_].stats_.arrival_time < cutoff) {
+      starved.emplace_back(remove(oldest_));
+      count += 1;
+    }
+    return count;
+  }
+};
+
+} // namespace psched
@@ -0,0 +1,21 @@
+#pragma once
+#include <psched/deadline_queue.h>
+
+namespace psched {
+
+struct task_order_tag {};
+
+// Order tasks within each priority level by deadline
+//
+// When enabled, every priority queue is a DeadlineQueue: a worker still serves
+// the highest non-empty priority level first, but within that level it runs the
+// task with the earliest deadline (`Task::set_deadline`) instead of the oldest
+// one. Use a single priority level (`queues<1>`) for global EDF scheduling.
+//
+// Tasks in work-stealing deques keep their LIFO/FIFO order.
+template <bool enabled = true> struct earliest_deadline_first {
+  typedef task_order_tag option_tag;
+  constexpr static bool value = enabled;
+};
+
+} // namespace psched
@@ -0,0 +1,54 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <psched/aging_policy.h>
+#include <stddef.h>
+
+namespace psched {
+
+struct elastic_pool_tag {};
+
+// How long an extra worker may stay idle before it exits
+template <class D = std::chrono::seconds, size_t N = 30> struct retire_after {
+  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
+  typedef D type;
+  constexpr static D value = D(N);
+};
+
+// How long a worker may run a single task before it counts as blocked
+template <class D = std::chrono::milliseconds, size_t N = 100> struct blocked_after {
+  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
+  typedef D type;
+  constexpr static D value = D(N);
+};
+
+// Grow the worker pool from `threads<N>` up to `max_workers` under load
+//
+// A pool manager thread checks the scheduler a few times per `blocked_after`
+// period and starts one extra worker per check while
+//   * more than `grow_when_queued` tasks are waiting, or
+//   * some task is waiting and a worker has been running the same task for
+//     longer than `blocked_after` (e.g., blocked on I/O).
+// An extra worker that finds nothing to do for `retire_after` exits. The
+// `threads<N>` workers always stay.
+//
+// Only the extra workers are affected by the option; `elastic_pool<0>` (the
+// default) keeps the pool fixed.
+template <size_t max_workers, size_t grow_when_queued = 64, class R = retire_after<>,
+          class B = blocked_after<>>
+struct elastic_pool {
+  typedef elastic_pool_tag option_tag;
+  typedef R retire_after;
+  typedef B blocked_after;
+  constexpr static size_t value = max_workers;
+  constexpr static size_t queued_threshold = grow_when_queued;
+
+  // Period of the pool manager
+  static std::chrono::steady_clock::duration interval() {
+    typedef std::chrono::steady_clock::duration duration;
+    return std::max<duration>(std::chrono::duration_cast<duration>(B::value) / 4,
+                              std::chrono::milliseconds(1));
+  }
+};
+
+} // namespace psched
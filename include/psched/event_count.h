@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace psched {
+
+// Eventcount: lets idle threads park without a lost-wakeup race
+//
+// A waiter announces itself with `prepare_wait()`, re-checks its wait
+// condition, and then either `cancel_wait()`s or `commit_wait()`s. Notifiers
+// bump the epoch, which releases every waiter that prepared before the bump.
+// The mutex is only touched when at least one thread is actually parked, so
+// notifying with no waiters costs a fence and a load.
+class EventCount {
+  constexpr static uint64_t waiter_mask = 0xFFFFFFFF;
+  constexpr static uint64_t epoch_increment = uint64_t(1) << 32;
+
+  std::atomic<uint64_t> state_{0}; // epoch (high 32 bits) | number of waiters (low 32 bits)
+  std::mutex mutex_;
+  std::condition_variable parked_;
+
+  static uint32_t epoch(uint64_t state) { return static_cast<uint32_t>(state >> 32); }
+
+public:
+  using Key = uint32_t;
+
+  Key prepare_wait() {
+    const auto previous = state_.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return epoch(previous);
+  }
+
+  void cancel_wait() { state_.fetch_sub(1, std::memory_order_seq_cst); }
+
+  void commit_wait(Key key) {
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      parked_.wait(lock, [&] { return epoch(state_.load(std::memory_order_seq_cst)) != key; });
+    }
+    state_.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+  // Like `commit_wait`, but gives up after `timeout`; returns false if it timed out
+  template <class Rep, class Period>
+  bool commit_wait_for(Key key, std::chrono::duration<Rep, Period> timeout) {
+    bool notified;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      notified = parked_.wait_for(
+          lock, timeout, [&] { return epoch(state_.load(std::memory_order_seq_cst)) != key; });
+    }
+    state_.fetch_sub(1, std::memory_order_seq_cst);
+    return notified;
+  }
+
+  // Wake up to `count` parked threads; returns false if no thread was waiting
+  bool notify(size_t count) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const uint64_t waiters = state_.load(std::memory_order_relaxed) & waiter_mask;
+    if (waiters == 0 || count == 0)
+      return false; // fast path: nobody to wake up
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      state_.fetch_add(epoch_increment, std::memory_order_seq_cst);
+    }
+    if (count >= waiters) {
+      parked_.notify_all();
+    } else {
+      for (size_t i = 0; i < count; ++i)
+        parked_.notify_one();
+    }
+    return true;
+  }
+
+  bool notify_one() { return notify(1); }
+
+  bool notify_all() { return notify(waiter_mask); }
+};
+
+} // namespace psched
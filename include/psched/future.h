@@ -0,0 +1,258 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <psched/idle_policy.h>
+#include <psched/inplace_function.h>
+#include <psched/task.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+
+namespace psched {
+
+template <class T> class Future;
+class TaskGraph;
+
+namespace detail {
+
+// Shared state between a Future and the task that fulfills it
+//
+// One allocation holds the result, the callable that produces it, and an
+// optional continuation. The fast path (result set before anyone waits) is
+// lock-free; the mutex and condition variable are only used when a thread
+// actually blocks in `Future::get()`.
+template <class T> class FutureState {
+  enum : uint8_t { pending, has_continuation, ready };
+
+  std::atomic<uint32_t> references_{1};
+  std::atomic<uint8_t> status_{pending};
+  std::atomic_bool waiting_{false}; // Is a thread blocked in `wait()`?
+  std::exception_ptr error_{};
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type value_;
+  InplaceFunction<void()> continuation_{};
+  std::mutex mutex_{};
+  std::condition_variable ready_{};
+
+  void run_continuation() {
+    // Drop the continuation (and the references it holds) once it has run
+    auto continuation = std::move(continuation_);
+    continuation();
+  }
+
+  void publish() {
+    const auto previous = status_.exchange(ready, std::memory_order_seq_cst);
+    if (previous == has_continuation)
+      run_continuation();
+    if (waiting_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      ready_.notify_all();
+    }
+  }
+
+public:
+  virtual ~FutureState() {
+    if (status_.load(std::memory_order_relaxed) == ready && !error_)
+      reinterpret_cast<T *>(&value_)->~T();
+  }
+
+  // Runs the callable and fulfills the state (see TaskFutureState)
+  virtual void run() {}
+
+  void retain() { references_.fetch_add(1, std::memory_order_relaxed); }
+
+  void release() {
+    if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete this;
+  }
+
+  template <class... U> void set_value(U &&... value) {
+    new (&value_) T(std::forward<U>(value)...);
+    publish();
+  }
+
+  void set_exception(std::exception_ptr error) {
+    error_ = std::move(error);
+    publish();
+  }
+
+  // Fails the state with std::future_errc::broken_promise, e.g., because the
+  // task that would have fulfilled it was discarded
+  void break_promise() {
+    set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+  }
+
+  bool is_ready() const { return status_.load(std::memory_order_acquire) == ready; }
+
+  void wait() {
+    for (size_t i = 0; i < 64; ++i) {
+      if (is_ready())
+        return;
+      cpu_relax();
+    }
+    waiting_.store(true, std::memory_order_seq_cst);
+    std::unique_lock<std::mutex> lock{mutex_};
+    ready_.wait(lock, [this] { return status_.load(std::memory_order_seq_cst) == ready; });
+  }
+
+  std::exception_ptr error() const { return error_; }
+
+  T &value() {
+    if (error_)
+      std::rethrow_exception(error_);
+    return *reinterpret_cast<T *>(&value_);
+  }
+
+  // Calls `fn` once the state is ready: right away if it already is,
+  // otherwise on the thread that fulfills it
+  void on_ready(InplaceFunction<void()> fn) {
+    continuation_ = std::move(fn);
+    uint8_t expected = pending;
+    if (!status_.compare_exchange_strong(expected, has_continuation, std::memory_order_seq_cst))
+      run_continuation(); // already ready
+  }
+};
+
+// `void` results are stored as an empty struct
+struct Unit {};
+
+template <class T> struct state_type { typedef T type; };
+template <> struct state_type<void> { typedef Unit type; };
+
+template <class T, class F> class TaskFutureState : public FutureState<T> {
+  F fn_;
+
+public:
+  explicit TaskFutureState(F fn) : fn_(std::move(fn)) {}
+
+  void run() override {
+    try {
+      if constexpr (std::is_same<T, Unit>::value) {
+        fn_();
+        this->set_value();
+      } else {
+        this->set_value(fn_());
+      }
+    } catch (...) {
+      this->set_exception(std::current_exception());
+    }
+  }
+};
+
+// Counted reference to a FutureState
+template <class T> class StateRef;
+
+// Task that runs `state`, or breaks its promise if a bounded queue discards it
+template <class T> Task fulfilling_task(const StateRef<T> &state) {
+  Task task([state] { state->run(); });
+  task.on_dropped([state](const TaskStats &) { state->break_promise(); });
+  return task;
+}
+
+template <class T> class StateRef {
+  FutureState<T> *state_{nullptr};
+
+public:
+  StateRef() = default;
+  explicit StateRef(FutureState<T> *state) : state_(state) {}
+  StateRef(const StateRef &other) : state_(other.state_) {
+    if (state_)
+      state_->retain();
+  }
+  StateRef(StateRef &&other) noexcept : state_(other.state_) { other.state_ = nullptr; }
+  StateRef &operator=(StateRef other) {
+    std::swap(state_, other.state_);
+    return *this;
+  }
+  ~StateRef() {
+    if (state_)
+      state_->release();
+  }
+
+  FutureState<T> *operator->() const { return state_; }
+  explicit operator bool() const { return state_ != nullptr; }
+};
+
+} // namespace detail
+
+// Result of `PriorityScheduler::submit`
+//
+// A lightweight, single-consumer future: `get()` blocks until the task has
+// run and returns its result, or rethrows the exception the task threw. If
+// the task is discarded to maintain the size of a bounded queue, `get()`
+// throws std::future_error with std::future_errc::broken_promise.
+template <class T> class Future {
+  typedef typename detail::state_type<T>::type stored_type;
+
+  detail::StateRef<stored_type> state_;
+
+  template <class U> friend class Future;
+  template <class threads, class queues, class aging_policy, class... options>
+  friend class PriorityScheduler;
+  friend class TaskGraph;
+
+  explicit Future(detail::StateRef<stored_type> state) : state_(std::move(state)) {}
+
+  // Allocates the shared state for a result computed by `fn`
+  template <class F> static detail::StateRef<stored_type> make_state(F fn) {
+    return detail::StateRef<stored_type>(
+        new detail::TaskFutureState<stored_type, F>(std::move(fn)));
+  }
+
+public:
+  Future() = default;
+
+  bool valid() const { return static_cast<bool>(state_); }
+
+  bool is_ready() const { return state_->is_ready(); }
+
+  void wait() const { state_->wait(); }
+
+  // Waits for the result and moves it out of the future
+  T get() {
+    if (!state_)
+      throw std::logic_error("psched::Future has no state");
+    auto state = std::move(state_);
+    state->wait();
+    if constexpr (std::is_void<T>::value) {
+      state->value();
+    } else {
+      return std::move(state->value());
+    }
+  }
+
+  // Schedules `fn(result)` at `level` once this future is ready and returns
+  // a future for its result. If this future holds an exception, `fn` is not
+  // called and the exception is forwarded.
+  template <class Scheduler, class F> auto then(Scheduler &scheduler, size_t level, F &&fn) {
+    if (!state_)
+      throw std::logic_error("psched::Future has no state");
+    auto antecedent = std::move(state_);
+
+    auto body = [fn = typename std::decay<F>::type(std::forward<F>(fn)), antecedent]() mutable {
+      if constexpr (std::is_void<T>::value) {
+        antecedent->value();
+        return fn();
+      } else {
+        return fn(std::move(antecedent->value()));
+      }
+    };
+    typedef decltype(body()) R;
+    auto next = Future<R>::make_state(std::move(body));
+
+    auto *raw = antecedent.operator->();
+    raw->on_ready([&scheduler, level, next] {
+      scheduler.schedule(level, detail::fulfilling_task(next));
+    });
+    return Future<R>(std::move(next));
+  }
+
+  template <class priority, class Scheduler, class F> auto then(Scheduler &scheduler, F &&fn) {
+    return then(scheduler, priority::value, std::forward<F>(fn));
+  }
+};
+
+} // namespace psched
@@ -0,0 +1,48 @@
+#pragma once
+#include <stddef.h>
+#include <thread>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace psched {
+
+// Hint to the CPU that the calling thread is busy-waiting
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield");
+#endif
+}
+
+struct idle_policy_tag {};
+
+template <size_t S> struct spin { constexpr static size_t value = S; };
+
+template <size_t Y> struct yield { constexpr static size_t value = Y; };
+
+// What an idle worker does before parking
+//
+// A worker that finds no ready task first spins `spin` times (cheapest wake-up,
+// burns the core), then calls std::this_thread::yield `yield` times, and then
+// parks until a task is scheduled.
+template <class S = spin<64>, class Y = yield<8>> struct idle_policy {
+  typedef idle_policy_tag option_tag;
+  typedef S spin;
+  typedef Y yield;
+
+  static void wait(size_t round) {
+    if (round < S::value)
+      cpu_relax();
+    else
+      std::this_thread::yield();
+  }
+
+  // Number of rounds after which the worker parks
+  constexpr static size_t park_after = S::value + Y::value;
+};
+
+} // namespace psched
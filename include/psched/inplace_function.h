@@ -0,0 +1,171 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// Inline storage (in bytes) for each callable held by a psched::Task
+// Define before including psched to fit larger lambda captures
+#ifndef PSCHED_TASK_INLINE_SIZE
+#define PSCHED_TASK_INLINE_SIZE 64
+#endif
+
+namespace psched {
+
+template <class Signature, size_t capacity = PSCHED_TASK_INLINE_SIZE,
+          size_t alignment = alignof(std::max_align_t)>
+class InplaceFunction;
+
+// Type-erased callable with fixed-size inline storage
+//
+// Like std::function, but a callable that fits in `capacity` bytes (and can
+// be moved without throwing) is stored inside the object, so constructing,
+// copying and moving it never allocate. Larger callables are stored on the
+// heap; moving them only moves a pointer.
+//
+// Move-only callables are accepted too; copying an InplaceFunction that holds
+// one throws std::logic_error.
+template <class R, class... Args, size_t capacity, size_t alignment>
+class InplaceFunction<R(Args...), capacity, alignment> {
+  static_assert(capacity >= sizeof(void *), "capacity must fit a pointer");
+
+  struct VTable {
+    R (*invoke)(void *, Args &&...);
+    void (*copy)(void *, const void *); // Null if the callable is move-only
+    void (*move)(void *, void *) noexcept;
+    void (*destroy)(void *) noexcept;
+  };
+
+  // Move-only callables get no `copy` in their vtable
+  template <class F> using copyable = std::is_copy_constructible<F>;
+
+  template <class F> struct Operations {
+    static R invoke(void *f, Args &&... args) {
+      return (*static_cast<F *>(f))(std::forward<Args>(args)...);
+    }
+    static void copy(void *dst, const void *src) {
+      if constexpr (copyable<F>::value)
+        new (dst) F(*static_cast<const F *>(src));
+    }
+    static void move(void *dst, void *src) noexcept {
+      new (dst) F(std::move(*static_cast<F *>(src)));
+      static_cast<F *>(src)->~F();
+    }
+    static void destroy(void *f) noexcept { static_cast<F *>(f)->~F(); }
+
+    constexpr static VTable vtable{&invoke, copyable<F>::value ? &copy : nullptr, &move,
+                                   &destroy};
+  };
+
+  // Operations on a callable stored on the heap; the storage holds a `F *`
+  template <class F> struct HeapOperations {
+    static F *&get(void *f) { return *static_cast<F **>(f); }
+    static R invoke(void *f, Args &&... args) { return (*get(f))(std::forward<Args>(args)...); }
+    static void copy(void *dst, const void *src) {
+      if constexpr (copyable<F>::value)
+        new (dst) F *(new F(**static_cast<F *const *>(src)));
+    }
+    static void move(void *dst, void *src) noexcept { new (dst) F *(get(src)); }
+    static void destroy(void *f) noexcept { delete get(f); }
+
+    constexpr static VTable vtable{&invoke, copyable<F>::value ? &copy : nullptr, &move,
+                                   &destroy};
+  };
+
+  template <class F>
+  using fits_inline =
+      std::integral_constant<bool, sizeof(F) <= capacity && alignment % alignof(F) == 0 &&
+                                       std::is_nothrow_move_constructible<F>::value>;
+
+  // Empty function pointers, std::functions, etc. produce an empty InplaceFunction
+  template <class F> static auto is_null(const F &f, int) -> decltype(f == nullptr) {
+    return f == nullptr;
+  }
+  template <class F> static bool is_null(const F &, long) { return false; }
+
+  const VTable *vtable_{nullptr};
+  typename std::aligned_storage<capacity, alignment>::type storage_;
+
+  template <class D, class F> void store(F &&f, std::true_type) {
+    new (&storage_) D(std::forward<F>(f));
+    vtable_ = &Operations<D>::vtable;
+  }
+
+  template <class D, class F> void store(F &&f, std::false_type) {
+    new (&storage_) D *(new D(std::forward<F>(f)));
+    vtable_ = &HeapOperations<D>::vtable;
+  }
+
+  void reset() noexcept {
+    if (vtable_) {
+      vtable_->destroy(&storage_);
+      vtable_ = nullptr;
+    }
+  }
+
+public:
+  InplaceFunction() noexcept {}
+
+  InplaceFunction(std::nullptr_t) noexcept {}
+
+  template <class F, class D = typename std::decay<F>::type,
+            class = typename std::enable_if<!std::is_same<D, InplaceFunction>::value>::type>
+  InplaceFunction(F &&f) {
+    if (is_null(f, 0))
+      return;
+    store<D>(std::forward<F>(f), fits_inline<D>());
+  }
+
+  InplaceFunction(const InplaceFunction &other) {
+    if (other.vtable_) {
+      if (!other.vtable_->copy)
+        throw std::logic_error("psched: cannot copy a move-only callable");
+      other.vtable_->copy(&storage_, &other.storage_);
+      vtable_ = other.vtable_;
+    }
+  }
+
+  InplaceFunction(InplaceFunction &&other) noexcept {
+    if (other.vtable_) {
+      other.vtable_->move(&storage_, &other.storage_);
+      vtable_ = other.vtable_;
+      other.vtable_ = nullptr;
+    }
+  }
+
+  InplaceFunction &operator=(const InplaceFunction &other) {
+    if (this != &other)
+      *this = InplaceFunction(other);
+    return *this;
+  }
+
+  InplaceFunction &operator=(InplaceFunction &&other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.vtable_) {
+        other.vtable_->move(&storage_, &other.storage_);
+        vtable_ = other.vtable_;
+        other.vtable_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  ~InplaceFunction() { reset(); }
+
+  explicit operator bool() const noexcept { return vtable_ != nullptr; }
+
+  // False if the callable is move-only
+  bool can_copy() const noexcept { return !vtable_ || vtable_->copy; }
+
+  R operator()(Args... args) const {
+    if (!vtable_)
+      throw std::bad_function_call();
+    return vtable_->invoke(const_cast<void *>(static_cast<const void *>(&storage_)),
+                           std::forward<Args>(args)...);
+  }
+};
+
+} // namespace psched
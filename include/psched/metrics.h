@@ -0,0 +1,186 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <psched/occupancy_bitmap.h>
+#include <psched/ring_buffer.h>
+#include <psched/task_stats.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace psched {
+
+struct metrics_tag {};
+
+// Per-priority latency histograms and counters
+//
+// When enabled, every worker records the wait, burst and turnaround time of
+// each task it runs into its own histograms, one set per priority level, so
+// recording never contends with other workers. `metrics_snapshot()` merges
+// them while the workers keep running.
+template <bool enabled = true> struct collect_metrics {
+  typedef metrics_tag option_tag;
+  constexpr static bool value = enabled;
+};
+
+// Merged latency distribution
+//
+// Values are bucketed logarithmically: each power of two is split into 8
+// linear sub-buckets, so a reported value is within 12.5% of the true one.
+struct HistogramSnapshot {
+  constexpr static size_t sub_bucket_bits = 3;
+  constexpr static size_t sub_buckets = size_t(1) << sub_bucket_bits;
+  constexpr static size_t max_bit = 47; // Longer durations (~39h) land in the last bucket
+  constexpr static size_t buckets = (max_bit - sub_bucket_bits + 2) * sub_buckets;
+
+  uint64_t count{0}; // Number of recorded values
+  uint64_t total{0}; // Sum of recorded values, in nanoseconds
+  std::vector<uint64_t> counts = std::vector<uint64_t>(buckets); // Per-bucket counts
+
+  static size_t bucket_of(uint64_t ns) {
+    if (ns < sub_buckets)
+      return static_cast<size_t>(ns);
+    const size_t msb = most_significant_bit(ns);
+    if (msb > max_bit)
+      return buckets - 1;
+    const size_t shift = msb - sub_bucket_bits;
+    const size_t sub = static_cast<size_t>((ns >> shift) & (sub_buckets - 1));
+    return (shift + 1) * sub_buckets + sub;
+  }
+
+  // Largest value that falls into `bucket`
+  static uint64_t upper_bound(size_t bucket) {
+    if (bucket < sub_buckets)
+      return bucket;
+    const size_t shift = bucket / sub_buckets - 1;
+    const uint64_t sub = sub_buckets + bucket % sub_buckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  // Value below which a fraction `q` (e.g., 0.99) of the recorded values fall
+  std::chrono::nanoseconds percentile(double q) const {
+    if (count == 0)
+      return std::chrono::nanoseconds(0);
+    const uint64_t rank =
+        std::max<uint64_t>(1, static_cast<uint64_t>(q * static_cast<double>(count) + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets; ++i) {
+      seen += counts[i];
+      if (seen >= rank)
+        return std::chrono::nanoseconds(upper_bound(i));
+    }
+    return std::chrono::nanoseconds(upper_bound(buckets - 1));
+  }
+
+  std::chrono::nanoseconds mean() const {
+    return std::chrono::nanoseconds(count ? total / count : 0);
+  }
+};
+
+// Scheduler activity at one priority level
+struct LevelMetrics {
+  uint64_t enqueued{0};  // Tasks scheduled at this level
+  uint64_t dropped{0};   // Tasks discarded to maintain the queue size
+  uint64_t promoted{0};  // Tasks moved up from this level by aging
+  uint64_t cancelled{0}; // Tasks skipped because they were cancelled while queued
+  uint64_t rejected{0};  // Tasks refused by `try_schedule`
+  uint64_t stolen{0};    // Tasks at this level stolen from another worker's deque
+  uint64_t executed{0};  // Tasks run at this level
+  HistogramSnapshot waiting_time;
+  HistogramSnapshot burst_time;
+  HistogramSnapshot turnaround_time;
+};
+
+// Size of the worker pool (see `elastic_pool`)
+struct PoolMetrics {
+  size_t workers{0};   // Workers currently running
+  uint64_t started{0}; // Extra workers started under load
+  uint64_t retired{0}; // Extra workers that exited after idling
+};
+
+struct MetricsSnapshot {
+  std::vector<LevelMetrics> levels; // Indexed by priority level
+  PoolMetrics pool;
+};
+
+namespace detail {
+
+// Counter with a single writer; increments are plain loads and stores
+class LocalCounter {
+  std::atomic<uint64_t> value_{0};
+
+public:
+  void add(uint64_t n) {
+    value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+  uint64_t load() const { return value_.load(std::memory_order_relaxed); }
+};
+
+// Histogram with a single writer, readable while it is being written
+class LatencyHistogram {
+  LocalCounter total_;
+  std::unique_ptr<LocalCounter[]> counts_{new LocalCounter[HistogramSnapshot::buckets]};
+
+public:
+  void record(std::chrono::steady_clock::duration d) {
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    const uint64_t value = ns < 0 ? 0 : static_cast<uint64_t>(ns);
+    total_.add(value);
+    counts_[HistogramSnapshot::bucket_of(value)].add(1);
+  }
+
+  void merge_into(HistogramSnapshot &snapshot) const {
+    snapshot.total += total_.load();
+    for (size_t i = 0; i < HistogramSnapshot::buckets; ++i) {
+      const uint64_t n = counts_[i].load();
+      snapshot.counts[i] += n;
+      snapshot.count += n;
+    }
+  }
+};
+
+// Metrics recorded by one worker at one priority level
+struct WorkerLevelMetrics {
+  LatencyHistogram waiting_time;
+  LatencyHistogram burst_time;
+  LatencyHistogram turnaround_time;
+  LocalCounter stolen;
+  LocalCounter cancelled;
+
+  void record(const TaskStats &stats) {
+    waiting_time.record(stats.start_time - stats.arrival_time);
+    burst_time.record(stats.end_time - stats.start_time);
+    turnaround_time.record(stats.end_time - stats.arrival_time);
+  }
+
+  void merge_into(LevelMetrics &level) const {
+    waiting_time.merge_into(level.waiting_time);
+    burst_time.merge_into(level.burst_time);
+    turnaround_time.merge_into(level.turnaround_time);
+    level.stolen += stolen.load();
+    level.cancelled += cancelled.load();
+  }
+};
+
+// Counters updated by producers and the aging thread at one priority level
+struct alignas(cache_line_size) SharedLevelMetrics {
+  std::atomic<uint64_t> enqueued{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> promoted{0};
+  std::atomic<uint64_t> cancelled{0};
+  std::atomic<uint64_t> rejected{0};
+
+  void merge_into(LevelMetrics &level) const {
+    level.enqueued += enqueued.load(std::memory_order_relaxed);
+    level.dropped += dropped.load(std::memory_order_relaxed);
+    level.promoted += promoted.load(std::memory_order_relaxed);
+    level.cancelled += cancelled.load(std::memory_order_relaxed);
+    level.rejected += rejected.load(std::memory_order_relaxed);
+  }
+};
+
+} // namespace detail
+
+} // namespace psched
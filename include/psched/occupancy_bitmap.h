@@ -0,0 +1,101 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace psched {
+
+// Index of the most significant set bit in a non-zero word
+inline size_t most_significant_bit(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - static_cast<size_t>(__builtin_clzll(word));
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanReverse64(&index, word);
+  return static_cast<size_t>(index);
+#else
+  size_t index = 0;
+  while (word >>= 1)
+    index += 1;
+  return index;
+#endif
+}
+
+// Atomic bitmap of non-empty priority levels
+//
+// Producers set the bit for a level after enqueuing a task; consumers clear
+// it when they find the level empty. A worker can then jump straight to the
+// highest occupied level instead of probing every queue.
+class OccupancyBitmap {
+  constexpr static size_t bits_per_word = 64;
+
+  size_t number_of_words_;
+  std::unique_ptr<std::atomic<uint64_t>[]> words_;
+
+  static uint64_t mask(size_t level) { return uint64_t(1) << (level % bits_per_word); }
+
+public:
+  constexpr static size_t npos = static_cast<size_t>(-1);
+
+  explicit OccupancyBitmap(size_t levels)
+      : number_of_words_((levels + bits_per_word - 1) / bits_per_word),
+        words_(new std::atomic<uint64_t>[number_of_words_]) {
+    for (size_t i = 0; i < number_of_words_; ++i)
+      words_[i].store(0, std::memory_order_relaxed);
+  }
+
+  // The fences order the caller's preceding push/pop against the bit so that a
+  // concurrent `clear` followed by an emptiness re-check cannot lose a `set`
+  void set(size_t level) {
+    auto &word = words_[level / bits_per_word];
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // Avoid the read-modify-write (and the cache line transfer) if already set
+    if (!(word.load(std::memory_order_relaxed) & mask(level)))
+      word.fetch_or(mask(level), std::memory_order_acq_rel);
+  }
+
+  void clear(size_t level) {
+    words_[level / bits_per_word].fetch_and(~mask(level), std::memory_order_acq_rel);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  bool test(size_t level) const {
+    return words_[level / bits_per_word].load(std::memory_order_acquire) & mask(level);
+  }
+
+  // Highest occupied level, or `npos` if every level is empty
+  size_t highest() const {
+    for (size_t i = number_of_words_; i > 0; --i) {
+      const uint64_t word = words_[i - 1].load(std::memory_order_acquire);
+      if (word)
+        return (i - 1) * bits_per_word + most_significant_bit(word);
+    }
+    return npos;
+  }
+
+  // Highest occupied level below `level`, or `npos` if there is none
+  size_t highest_below(size_t level) const {
+    if (level == 0)
+      return npos;
+    size_t i = (level - 1) / bits_per_word;
+    const size_t bit = (level - 1) % bits_per_word;
+    uint64_t word = words_[i].load(std::memory_order_acquire);
+    if (bit + 1 < bits_per_word)
+      word &= (uint64_t(1) << (bit + 1)) - 1;
+    while (true) {
+      if (word)
+        return i * bits_per_word + most_significant_bit(word);
+      if (i == 0)
+        return npos;
+      word = words_[--i].load(std::memory_order_acquire);
+    }
+  }
+
+  bool empty() const { return highest() == npos; }
+};
+
+} // namespace psched
@@ -0,0 +1,20 @@
+#pragma once
+#include <type_traits>
+
+namespace psched {
+
+// Find the scheduler option tagged `Tag` in `Options...`, or `Default`
+//
+// Optional scheduler policies (e.g., `idle_policy<...>`) are passed as trailing
+// template arguments to PriorityScheduler, in any order. Each one declares an
+// `option_tag` typedef that identifies which policy it configures.
+template <class Tag, class Default, class... Options> struct find_option { typedef Default type; };
+
+template <class Tag, class Default, class Option, class... Options>
+struct find_option<Tag, Default, Option, Options...> {
+  typedef typename std::conditional<
+      std::is_same<typename Option::option_tag, Tag>::value, Option,
+      typename find_option<Tag, Default, Options...>::type>::type type;
+};
+
+} // namespace psched
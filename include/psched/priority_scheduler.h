@@ -1,13 +1,42 @@
 
 #pragma once
-#include <array>
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
 #include <mutex>
+#include <ostream>
+#include <psched/admission.h>
 #include <psched/aging_policy.h>
+#include <psched/cancellation.h>
+#include <psched/clock.h>
+#include <psched/coroutine.h>
+#include <psched/earliest_deadline_first.h>
+#include <psched/elastic_pool.h>
+#include <psched/event_count.h>
+#include <psched/future.h>
+#include <psched/idle_policy.h>
+#include <psched/metrics.h>
+#include <psched/occupancy_bitmap.h>
+#include <psched/options.h>
+#include <psched/producer_lanes.h>
+#include <psched/strand.h>
 #include <psched/task.h>
+#include <psched/task_graph.h>
+#include <psched/task_pool.h>
 #include <psched/task_queue.h>
+#include <psched/timer_wheel.h>
+#include <psched/tracing.h>
+#include <psched/weighted_fair_queuing.h>
+#include <psched/work_stealing.h>
+#include <psched/worker_groups.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 namespace psched {
@@ -16,107 +45,1472 @@ template <size_t T> struct threads { constexpr static size_t value = T; };
 
 template <size_t P> struct priority { constexpr static size_t value = P; };
 
-template <class threads, class queues, class aging_policy> class PriorityScheduler {
-  constexpr static size_t priority_levels = queues::number_of_queues;
-
-  std::vector<std::thread> threads_{};                               // Scheduler thread pool
-  std::array<TaskQueue<queues>, priority_levels> priority_queues_{}; // Array of task queues
-  std::atomic_bool running_{false};                                  // Is the scheduler running?
-  std::mutex mutex_{};                                               // Mutex to protect `enqueued_`
-  std::condition_variable ready_{}; // Signal to notify task enqueued
-  std::atomic_size_t enqueued_{0};  // Incremented when a task is scheduled
-
-  void run() {
-    while (running_ || enqueued_ > 0) {
-      // Wait for the `enqueued` signal
-      {
-        std::unique_lock<std::mutex> lock{mutex_};
-        ready_.wait(lock, [this] { return enqueued_ > 0 || !running_; });
-      }
-
-      Task t;
-
-      // Handle task starvation at lower priorities
-      // Modulate priorities based on age
-      // Start from the lowest priority till (highest_priority - 1)
-      for (size_t i = 0; i < priority_levels - 1; i++) {
-        // Check if the front of the queue has a starving task
-        if (priority_queues_[i]
-                .template try_pop_if_starved<typename aging_policy::task_starvation_after>(t)) {
-          // task has been starved, reschedule at a higher priority
-          while (running_) {
-            const auto new_priority =
-                std::min(i + aging_policy::increment_priority_by::value, priority_levels - 1);
-            if (priority_queues_[new_priority].try_push(t)) {
-              break;
-            }
-          }
-        }
+template <class threads, class queues, class aging_policy, class... options>
+class PriorityScheduler {
+  // Task graphs hand a ready node straight to the worker that readied it
+  template <class Scheduler> friend class detail::GraphRun;
+
+  // Number of priority levels if fixed at compile time, else `dynamic_queues`
+  constexpr static size_t static_levels = queues::number_of_queues;
+
+  typedef typename find_option<idle_policy_tag, idle_policy<>, options...>::type idle;
+  typedef typename find_option<work_stealing_tag, work_stealing<false>, options...>::type stealing;
+  typedef typename find_option<task_order_tag, earliest_deadline_first<false>, options...>::type
+      deadline_order;
+  typedef typename std::conditional<deadline_order::value, DeadlineQueue<queues>,
+                                    TaskQueue<queues>>::type Queue;
+
+  // Producers may wait for room in a bounded queue
+  constexpr static bool bounded = queues::bounded_or_not;
+  constexpr static bool blocking =
+      bounded && queues::maintain_size::discard_policy == discard::block;
+  typedef typename find_option<timer_resolution_tag, timer_resolution<>, options...>::type
+      resolution;
+  typedef typename find_option<metrics_tag, collect_metrics<false>, options...>::type metrics;
+  static_assert(!metrics::value || TaskClock::enabled,
+                "collect_metrics needs task timestamps (PSCHED_TASK_TIMESTAMPS)");
+  typedef typename find_option<worker_groups_tag, worker_groups<>, options...>::type groups;
+
+  static_assert(groups::reserved_workers <= threads::value,
+                "worker groups need more workers than threads<N> provides");
+  static_assert(groups::reserved_workers < threads::value || groups::serves_every_level,
+                "no worker group serves priority level 0");
+
+  typedef typename find_option<elastic_pool_tag, elastic_pool<0>, options...>::type pool;
+  typedef typename find_option<tracing_tag, trace_events<false>, options...>::type tracing;
+  typedef typename find_option<producer_lanes_tag, producer_lanes<0>, options...>::type lanes;
+  constexpr static bool has_lanes = lanes::value > 0;
+  typedef detail::LaneRing<lanes::capacity> LaneRing;
+
+  // Weighted fair queuing instead of strict priority
+  typedef typename find_option<service_order_tag, strict_priority, options...>::type service;
+  constexpr static bool fair = service::value;
+  static_assert(!fair || service::number_of_weights == 0 || static_levels == dynamic_queues ||
+                    service::number_of_weights == static_levels,
+                "weighted_fair_queuing needs one weight per priority level");
+
+  // Virtual time of a level advances by `stride_scale / weight` per unit of cost
+  constexpr static uint64_t stride_scale = uint64_t(1) << 20;
+
+  // Workers beyond `threads::value` are started and retired by the pool manager
+  constexpr static size_t max_workers = std::max(threads::value, pool::value);
+  constexpr static bool elastic = max_workers > threads::value;
+
+  // One parking lot per worker group, plus one for the workers left over
+  constexpr static size_t number_of_lots = groups::number_of_groups + 1;
+
+  // Hands batches of expired timers to the priority queues (one at a time,
+  // waiting for room, with `discard::block`)
+  struct TimerDispatch {
+    PriorityScheduler *scheduler;
+    template <class Iterator> void operator()(size_t level, Iterator first, Iterator last) {
+      scheduler->schedule_bulk(level, first, last);
+    }
+  };
+
+  // State owned by one worker thread
+  struct Worker {
+    PriorityScheduler *scheduler;
+    // One deque per priority level, and the nodes of the tasks pushed onto
+    // them (work stealing only)
+    std::unique_ptr<WorkStealingDeque<detail::TaskNode *>[]> deques;
+    detail::TaskPool pool;
+    OccupancyBitmap occupancy; // Non-empty deques, as seen by the owner
+    size_t next_victim{0};     // Where the next stealing round starts
+    size_t next_lane{0};       // Producer lane visited last (producer lanes only)
+    // One set of histograms per priority level (metrics only)
+    std::unique_ptr<detail::WorkerLevelMetrics[]> metrics;
+    const size_t min_level; // Lowest priority level this worker serves
+    const size_t lot;       // Parking lot of the worker's group
+    const size_t index;     // Position in `workers_`
+    // Elastic pool only: when the running task started, 0 if idle; and
+    // whether an extra worker's thread is running
+    std::atomic<int64_t> busy_since{0};
+    std::atomic_bool active{false};
+    // Set once `set_up` has allocated the state above; until then, other
+    // threads skip the worker's deques and metrics
+    std::atomic_bool ready{false};
+
+    Worker(PriorityScheduler *s, size_t index, const WorkerPlacement &placement)
+        : scheduler(s), pool(0), occupancy(0), next_victim(index),
+          min_level(std::min(placement.min_level, s->levels_ - 1)), lot(placement.group),
+          index(index) {}
+
+    // Allocates the deques, node pool, occupancy bitmap and histograms. Called
+    // on the worker's own thread once it has been pinned, so that the memory
+    // the worker writes most is first touched, and placed, on its own node;
+    // an extra worker keeps its state when it retires.
+    void set_up() {
+      if (ready.load(std::memory_order_relaxed))
+        return;
+      const size_t levels = scheduler->levels_;
+      if (stealing::value) {
+        deques.reset(new WorkStealingDeque<detail::TaskNode *>[levels]);
+        pool.reserve(detail::TaskPool::slab_size);
       }
+      occupancy = OccupancyBitmap(levels);
+      if (metrics::value)
+        metrics.reset(new detail::WorkerLevelMetrics[levels]);
+      ready.store(true, std::memory_order_release);
+    }
+  };
+
+  const size_t levels_;                                  // Number of priority levels
+  std::vector<std::thread> threads_{};                   // Scheduler thread pool
+  std::vector<std::unique_ptr<Worker>> workers_{};       // Per-worker state
+  std::unique_ptr<Queue[]> priority_queues_;             // Array of task queues
+  OccupancyBitmap occupancy_;                            // Non-empty task queues
+  OccupancyBitmap stealable_;       // Levels with tasks in some worker deque
+  std::atomic_bool running_{false}; // Is the scheduler running?
+  std::atomic<size_t> started_{0};  // Workers that have set up their state
+  // Parking lots for idle workers, one per worker group
+  std::unique_ptr<EventCount[]> idle_workers_{new EventCount[number_of_lots]};
+  size_t lot_min_level_[number_of_lots]; // Lowest level served by each lot's workers
+  size_t wake_order_[number_of_lots];    // Lots by descending lowest level
+  // Counters shared by producers, one per level (metrics only)
+  std::unique_ptr<detail::SharedLevelMetrics[]> level_metrics_;
+  // Producers waiting for room, one per level (bounded queues only)
+  std::unique_ptr<EventCount[]> room_;
+  std::unique_ptr<detail::AdmissionLimit[]> admission_; // Per-level limits for `try_schedule`
+  // Weighted fair queuing only: per-level virtual time and its increment per
+  // unit of cost, and the virtual time of the last task started
+  std::unique_ptr<std::atomic<uint64_t>[]> pass_;
+  std::unique_ptr<std::atomic<uint64_t>[]> stride_;
+  std::atomic<uint64_t> virtual_time_{0};
+  detail::StrandTable strands_; // Tasks scheduled with a key
+  std::unique_ptr<Tracer<>> tracer_; // Per-thread event rings (trace_events only)
 
+  // Lanes of one registered producer, one per priority level (producer lanes only)
+  struct Lane {
+    std::unique_ptr<LaneRing[]> rings; // Allocated on first registration, then reused
+    bool registered{false};            // Protected by `lanes_mutex_`
+  };
+  std::unique_ptr<Lane[]> lanes_;
+  std::vector<OccupancyBitmap> lanes_with_work_; // Per level: producers with tasks in their lane
+  OccupancyBitmap lane_levels_;                  // Levels with tasks in some lane
+  std::mutex lanes_mutex_;                       // Serializes registration
+  std::unique_ptr<TimerWheel<resolution, TimerDispatch>> timers_; // Started on first use
+  std::thread aging_thread_{};                // Promotes starved tasks
+  EventCount aging_idle_;                     // Parks the aging thread while nothing can starve
+  std::thread pool_thread_{};                 // Grows the pool (elastic pool only)
+  std::mutex background_mutex_;               // Protects `background_running_`
+  std::condition_variable background_wakeup_; // Signals shutdown to the threads above
+  bool background_running_{true};
+  std::atomic<int64_t> queued_{0}; // Tasks waiting to run (elastic pool only)
+  std::atomic<size_t> active_workers_{threads::value};
+  std::atomic<uint64_t> workers_started_{0};
+  std::atomic<uint64_t> workers_retired_{0};
+  std::once_flag timers_started_;
+
+  inline static thread_local Worker *current_worker_{nullptr}; // Worker running on this thread
+
+  static bool serves(size_t highest, size_t min_level) {
+    return highest != OccupancyBitmap::npos && highest >= min_level;
+  }
+
+  // Highest level below `below` (or at all, if `below` is `npos`) with a task
+  // in a shared queue or a producer lane
+  size_t highest_shared(size_t below = OccupancyBitmap::npos) const {
+    const auto highest = [below](const OccupancyBitmap &bits) {
+      return below == OccupancyBitmap::npos ? bits.highest() : bits.highest_below(below);
+    };
+    const size_t queued = highest(occupancy_);
+    if (!has_lanes)
+      return queued;
+    const size_t laned = highest(lane_levels_);
+    if (queued == OccupancyBitmap::npos || laned == OccupancyBitmap::npos)
+      return queued == OccupancyBitmap::npos ? laned : queued;
+    return std::max(queued, laned);
+  }
+
+  // Is there a task that `self` may run anywhere in the scheduler?
+  bool has_work(const Worker &self) const {
+    return serves(highest_shared(), self.min_level) ||
+           serves(stealable_.highest(), self.min_level);
+  }
+
+  // Wake up to `count` parked workers that serve `level`, preferring the
+  // group reserved for the highest levels
+  void notify(size_t level, size_t count) {
+    for (size_t lot : wake_order_) {
+      if (lot_min_level_[lot] <= level && idle_workers_[lot].notify(count))
+        return;
+    }
+  }
+
+  void start(size_t index) {
+    const auto placement = groups::placement(index);
+    pin_current_thread(placement.cpus);
+    if (tracing::value)
+      tracer_->register_thread("worker " + std::to_string(index));
+    workers_[index]->set_up();
+    started_.fetch_add(1, std::memory_order_release);
+    // Peers are needed for stealing
+    while (started_.load(std::memory_order_acquire) != threads::value)
+      std::this_thread::yield();
+    workers_[index]->active.store(true, std::memory_order_relaxed);
+    run(*workers_[index]);
+  }
+
+  void run(Worker &self) {
+    current_worker_ = &self;
+    auto &lot = idle_workers_[self.lot];
+    Task t;
+    size_t idle_rounds = 0;
+
+    while (true) {
       // Run the highest priority ready task
-      bool dequeued = false;
-
-      while (!dequeued) {
-        for (size_t i = priority_levels; i > 0; --i) {
-          // Try to pop an item
-          if (priority_queues_[i - 1].try_pop(t)) {
-            dequeued = true;
-            if (enqueued_ > 0) {
-              enqueued_ -= 1;
-            }
-            // execute task
-            t();
+      if (try_run_one(self, t)) {
+        idle_rounds = 0;
+        continue;
+      }
+
+      if (!running_ && !has_work(self))
+        break;
+
+      // Nothing to do: spin, then yield, then park
+      if (idle_rounds < idle::park_after) {
+        idle::wait(idle_rounds++);
+        continue;
+      }
+      idle_rounds = 0;
+      const auto key = lot.prepare_wait();
+      if (has_work(self) || !running_) {
+        lot.cancel_wait();
+        continue;
+      }
+      trace(trace_event::park, 0, self.min_level);
+      if (!elastic || self.index < threads::value) {
+        lot.commit_wait(key);
+        trace(trace_event::unpark, 0, self.min_level);
+        continue;
+      }
+      // Extra workers retire once they have been idle for long enough
+      const bool woken = lot.commit_wait_for(key, pool::retire_after::value);
+      trace(trace_event::unpark, 0, self.min_level);
+      if (!woken && !has_work(self) && running_)
+        break;
+    }
+
+    if (elastic && self.index >= threads::value && running_) {
+      active_workers_.fetch_sub(1, std::memory_order_relaxed);
+      workers_retired_.fetch_add(1, std::memory_order_relaxed);
+      self.active.store(false, std::memory_order_release);
+    }
+    current_worker_ = nullptr;
+  }
+
+  // Pool manager (elastic pool only)
+  //
+  // Starts one extra worker per round while tasks pile up or a worker is
+  // stuck on a long task and others are waiting.
+  void manage_pool() {
+    std::unique_lock<std::mutex> lock{background_mutex_};
+    while (!background_wakeup_.wait_for(lock, pool::interval(),
+                                        [this] { return !background_running_; })) {
+      const int64_t queued = queued_.load(std::memory_order_relaxed);
+      if (queued <= 0 || active_workers_.load(std::memory_order_relaxed) >= max_workers)
+        continue;
+      bool grow = queued > static_cast<int64_t>(pool::queued_threshold);
+      if (!grow) {
+        const int64_t blocked_since =
+            (std::chrono::steady_clock::now() -
+             std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                 pool::blocked_after::value))
+                .time_since_epoch()
+                .count();
+        for (auto &worker : workers_) {
+          const int64_t busy = worker->busy_since.load(std::memory_order_relaxed);
+          if (busy != 0 && busy < blocked_since) {
+            grow = true;
             break;
           }
         }
-        if (!(running_ || enqueued_ > 0))
-          break;
       }
+      if (grow)
+        start_extra_worker();
     }
   }
 
-public:
-  PriorityScheduler() {
-    running_ = true;
-    for (unsigned n = 0; n != threads::value; ++n) {
-      threads_.emplace_back([this] { run(); });
+  void start_extra_worker() {
+    for (size_t n = threads::value; n < max_workers; ++n) {
+      Worker &worker = *workers_[n];
+      if (worker.active.load(std::memory_order_acquire))
+        continue;
+      // Reap the thread of a worker that has retired
+      if (threads_[n].joinable())
+        threads_[n].join();
+      worker.active.store(true, std::memory_order_relaxed);
+      active_workers_.fetch_add(1, std::memory_order_relaxed);
+      workers_started_.fetch_add(1, std::memory_order_relaxed);
+      threads_[n] = std::thread([this, &worker] {
+        pin_current_thread(groups::placement(worker.index).cpus);
+        if (tracing::value)
+          tracer_->register_thread("worker " + std::to_string(worker.index));
+        worker.set_up();
+        run(worker);
+        // The next extra worker records into this thread's ring
+        if (tracing::value)
+          tracer_->unregister_thread();
+      });
+      return;
     }
   }
 
-  ~PriorityScheduler() {
-    running_ = false;
-    ready_.notify_all();
-    for (auto &q : priority_queues_)
-      q.done();
-    for (auto &t : threads_)
-      if (t.joinable())
-        t.join();
+  // Handle task starvation at lower priorities
+  //
+  // Runs on its own thread every `aging_policy::interval()`, off the workers'
+  // dequeue path. Every task that has waited longer than
+  // `task_starvation_after` at a level below the highest one is moved up by
+  // `increment_priority_by` levels; the promoted tasks keep their relative
+  // order and restart their wait at the new level. While no such task is
+  // queued, the thread parks until one is scheduled.
+  void age() {
+    typedef typename aging_policy::task_starvation_after starvation;
+    typename Queue::Batch starved;
+    std::vector<Task> starved_in_lanes;
+    std::unique_lock<std::mutex> lock{background_mutex_};
+    while (true) {
+      if (!may_starve()) {
+        lock.unlock();
+        const auto key = aging_idle_.prepare_wait();
+        // `stop` notifies after clearing `background_running_` under the lock
+        lock.lock();
+        const bool stopping = !background_running_;
+        lock.unlock();
+        if (stopping || may_starve())
+          aging_idle_.cancel_wait();
+        else
+          aging_idle_.commit_wait(key);
+        lock.lock();
+      }
+      if (background_wakeup_.wait_for(lock, aging_policy::interval(),
+                                      [this] { return !background_running_; }))
+        return;
+      // Promoting may wait for room in a bounded queue; `stop` and the pool
+      // manager must not wait with it
+      lock.unlock();
+      const auto cutoff =
+          TaskClock::now() -
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(starvation::value);
+      // Highest levels first, so a task is promoted at most once per round
+      for (size_t i = levels_ - 1; i-- > 0;) {
+        const auto new_priority =
+            std::min(i + aging_policy::increment_priority_by::value, levels_ - 1);
+        if (has_lanes && lane_levels_.test(i))
+          age_lanes(i, new_priority, cutoff, starved_in_lanes);
+        // Skip empty queues without touching them
+        if (!occupancy_.test(i))
+          continue;
+        if (priority_queues_[i].pop_arrived_before(cutoff, starved) == 0)
+          continue;
+        if (bounded)
+          room_[i].notify(starved.size());
+        promote(i, new_priority, starved);
+        mark_if_empty(i);
+      }
+      lock.lock();
+    }
   }
 
-  template <class priority> void schedule(Task &task) {
-    static_assert(priority::value <= priority_levels, "priority out of range");
+  // Is a task queued below the highest level, where it could starve?
+  bool may_starve() const {
+    return occupancy_.highest_below(levels_ - 1) != OccupancyBitmap::npos ||
+           (has_lanes && lane_levels_.highest_below(levels_ - 1) != OccupancyBitmap::npos);
+  }
+
+  // Wakes the aging thread, if it is parked, for a task queued at `level`
+  void wake_aging(size_t level) {
+    if (ages() && level + 1 < levels_)
+      aging_idle_.notify_one();
+  }
+
+  // Promotes the starved tasks of the producer lanes at level `i`
+  //
+  // A lane that a worker is draining is skipped until the next round.
+  void age_lanes(size_t i, size_t new_priority, TaskStats::TimePoint cutoff,
+                 std::vector<Task> &starved) {
+    const auto starving = [cutoff](const Task &t) { return t.stats_.arrival_time < cutoff; };
+    auto &producers = lanes_with_work_[i];
+    Task task;
+    for (size_t p = producers.highest(); p != OccupancyBitmap::npos;
+         p = producers.highest_below(p)) {
+      LaneRing &ring = lanes_[p].rings[i];
+      if (!ring.try_lock())
+        continue;
+      while (ring.try_pop_if(task, starving))
+        starved.emplace_back(std::move(task));
+      ring.unlock();
+    }
+    promote(i, new_priority, starved);
+    for (size_t p = producers.highest(); p != OccupancyBitmap::npos;
+         p = producers.highest_below(p))
+      mark_lane_if_empty(p, i);
+    lane_levels_.clear(i);
+    if (!producers.empty())
+      lane_levels_.set(i);
+  }
+
+  // Moves the starved tasks taken from level `from` to the back of the queue
+  // at `new_priority`, leaving `starved` empty; cancelled tasks are dropped
+  // instead
+  template <class Batch> void promote(size_t from, size_t new_priority, Batch &starved) {
+    count_cancelled(from, remove_cancelled(starved));
+    if (starved.empty())
+      return;
+    const size_t promoted = starved.size();
+    for (auto &task : starved)
+      trace(trace_event::promote, task.trace_id_, new_priority, from);
+    size_t discarded = 0;
+    if (blocking) {
+      // Wait for room like any other producer; workers drain the higher level first
+      for (auto &task : starved) {
+        if (!push_when_not_full(new_priority, task,
+                                std::chrono::steady_clock::time_point::max())) {
+          task.drop();
+          discarded += 1;
+        }
+      }
+    } else {
+      // Unbounded queues relink the tasks' nodes
+      priority_queues_[new_priority].push_batch(starved, discarded);
+    }
+    if (metrics::value)
+      level_metrics_[from].promoted.fetch_add(promoted, std::memory_order_relaxed);
+    count_dropped(new_priority, discarded);
+    // Set the new bit before the caller clears the old one so workers never
+    // see the scheduler empty and park in between
+    occupancy_.set(new_priority);
+    // Workers reserved for higher levels may be parked
+    notify(new_priority, promoted);
+    starved.clear();
+  }
+
+  bool try_run_one(Worker &self, Task &t) {
+    size_t level;
+    if (!stealing::value) {
+      if (!(fair ? try_pop_weighted(self, t, level) : try_pop_highest(self, t, level)))
+        return false;
+      return execute(self, t, level);
+    }
+
+    detail::TaskNode *node = nullptr;
+    if (fair) {
+      // Serve the level whose next task starts first in virtual time, from
+      // the local deque, the shared queue or a peer, in that order
+      const uint64_t now = virtual_time_.load(std::memory_order_relaxed);
+      uint64_t start = 0;
+      size_t i = earliest_level(self.occupancy, self.min_level, now, OccupancyBitmap::npos, start);
+      i = earliest_level(occupancy_, self.min_level, now, i, start);
+      i = earliest_level(stealable_, self.min_level, now, i, start);
+      if (has_lanes)
+        i = earliest_level(lane_levels_, self.min_level, now, i, start);
+      if (i == OccupancyBitmap::npos)
+        return false;
+      level = i;
+      if (self.occupancy.test(i) && self.deques[i].pop(node))
+        return run_node(self, node, level);
+      if (try_pop_level(self, t, i))
+        return execute(self, t, level);
+      if (stealable_.test(i) && try_steal_at(self, node, i)) {
+        if (metrics::value)
+          self.metrics[level].stolen.add(1);
+        return run_node(self, node, level);
+      }
+      // Raced with another worker; fall back to any level
+      if (try_pop_local(self, node, level))
+        return run_node(self, node, level);
+      if (try_pop_weighted(self, t, level))
+        return execute(self, t, level);
+      if (!try_steal(self, node, level))
+        return false;
+      if (metrics::value)
+        self.metrics[level].stolen.add(1);
+      return run_node(self, node, level);
+    }
+
+    // Serve whichever of the local deques, the shared queues (and producer
+    // lanes) and the peers' deques has the highest priority task, falling
+    // back to the others
+    const auto rank = [&self](size_t level) {
+      return serves(level, self.min_level) ? static_cast<long>(level) : -1;
+    };
+    const long local = rank(self.occupancy.highest());
+    const long shared = rank(highest_shared());
+    const long remote = rank(stealable_.highest());
+
+    if (local >= 0 && local >= shared && local >= remote && try_pop_local(self, node, level))
+      return run_node(self, node, level);
+    if (shared >= 0 && shared >= remote && try_pop_highest(self, t, level))
+      return execute(self, t, level);
+    if (try_steal(self, node, level)) {
+      if (metrics::value)
+        self.metrics[level].stolen.add(1);
+      return run_node(self, node, level);
+    }
+    if (try_pop_local(self, node, level))
+      return run_node(self, node, level);
+    if (try_pop_highest(self, t, level))
+      return execute(self, t, level);
+    return false;
+  }
+
+  // Runs a task taken from `level` and records its latencies
+  bool execute(Worker &self, Task &t, size_t level) {
+    if (elastic)
+      queued_.fetch_sub(1, std::memory_order_relaxed);
+    if (tracing::value) {
+      // Tasks scheduled in a batch get their id here
+      if (!t.trace_id_)
+        t.trace_id_ = tracer_->next_id();
+      trace(trace_event::dequeue, t.trace_id_, level);
+    }
+    if (t.is_cancelled()) {
+      trace(trace_event::cancel, t.trace_id_, level);
+      if (metrics::value)
+        self.metrics[level].cancelled.add(1);
+      t.drop();
+      return true;
+    }
+    if (fair)
+      charge(level, t.cost_);
+    // A task run while its worker waits for room in a full queue nests in
+    // another task; the outer task is busy again once it returns
+    const int64_t outer = elastic ? self.busy_since.load(std::memory_order_relaxed) : 0;
+    if (elastic) {
+      self.busy_since.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                            std::memory_order_relaxed);
+    }
+    trace(trace_event::start, t.trace_id_, level);
+    t();
+    trace(trace_event::end, t.trace_id_, level);
+    if (elastic)
+      self.busy_since.store(outer, std::memory_order_relaxed);
+    if (metrics::value)
+      self.metrics[level].record(t.stats_);
+    return true;
+  }
+
+  // Runs a task taken from a deque and returns its node to the pool it came from
+  bool run_node(Worker &self, detail::TaskNode *node, size_t level) {
+    execute(self, node->task, level);
+    self.pool.release(node);
+    return true;
+  }
+
+  // Drops the cancelled tasks, calling their `on_dropped` callbacks
+  static bool drop_if_cancelled(Task &t) {
+    if (!t.is_cancelled())
+      return false;
+    t.drop();
+    return true;
+  }
+
+  static size_t remove_cancelled(std::vector<Task> &tasks) {
+    const size_t count = tasks.size();
+    tasks.erase(std::remove_if(tasks.begin(), tasks.end(), drop_if_cancelled), tasks.end());
+    return count - tasks.size();
+  }
+
+  static size_t remove_cancelled(detail::TaskList &tasks) {
+    return tasks.release_if(drop_if_cancelled);
+  }
+
+  bool try_pop_local(Worker &self, detail::TaskNode *&node, size_t &level) {
+    for (size_t i = self.occupancy.highest(); i != self.occupancy.npos;
+         i = self.occupancy.highest()) {
+      if (self.deques[i].pop(node)) {
+        level = i;
+        return true;
+      }
+      // Only the owner pushes onto its deques, so an empty deque stays empty
+      self.occupancy.clear(i);
+    }
+    return false;
+  }
+
+  // One stealing round: try every worker at the highest stealable level
+  bool try_steal(Worker &self, detail::TaskNode *&node, size_t &level) {
+    for (size_t i = stealable_.highest(); serves(i, self.min_level); i = stealable_.highest()) {
+      if (try_steal_at(self, node, i)) {
+        level = i;
+        return true;
+      }
+      if (stealable_.test(i))
+        return false;
+    }
+    return false;
+  }
+
+  // Tries every worker at level `i`, clearing its stealable bit if all are empty
+  bool try_steal_at(Worker &self, detail::TaskNode *&node, size_t i) {
+    const size_t n = workers_.size();
+    for (size_t k = 0; k < n; ++k) {
+      const size_t victim = (self.next_victim + k) % n;
+      if (!workers_[victim]->ready.load(std::memory_order_acquire))
+        continue;
+      if (workers_[victim]->deques[i].steal(node)) {
+        self.next_victim = victim;
+        return true;
+      }
+    }
+    // Nothing left at this level; restore the bit if a push raced with the round
+    stealable_.clear(i);
+    for (auto &worker : workers_) {
+      if (worker->ready.load(std::memory_order_acquire) && !worker->deques[i].empty()) {
+        stealable_.set(i);
+        return false;
+      }
+    }
+    return false;
+  }
+
+  // Pops from the highest non-empty queue (or producer lane) that `self` serves
+  bool try_pop_highest(Worker &self, Task &t, size_t &level) {
+    // Jump straight to the highest non-empty queue
+    size_t i = highest_shared();
+    while (serves(i, self.min_level)) {
+      if (try_pop_level(self, t, i)) {
+        level = i;
+        return true;
+      }
+      // Lanes that other workers are draining keep their bit; look lower
+      i = has_lanes && lane_levels_.test(i) ? highest_shared(i) : highest_shared();
+    }
+    return false;
+  }
+
+  // Pops from the shared queue at level `i`, else from one of its producer lanes
+  bool try_pop_level(Worker &self, Task &t, size_t i) {
+    if (occupancy_.test(i) && try_pop_at(t, i))
+      return true;
+    if (!has_lanes || !lane_levels_.test(i))
+      return false;
+    if (try_pop_lane(self, t, i))
+      return true;
+    lane_levels_.clear(i);
+    if (!lanes_with_work_[i].empty())
+      lane_levels_.set(i);
+    return false;
+  }
+
+  // Pops from a producer lane at level `i`, visiting the lanes round-robin
+  // so that every producer is served; lanes locked by another worker are skipped
+  bool try_pop_lane(Worker &self, Task &t, size_t i) {
+    auto &producers = lanes_with_work_[i];
+    const size_t last = self.next_lane;
+    const auto visit = [&](size_t p) {
+      LaneRing &ring = lanes_[p].rings[i];
+      if (!ring.try_lock())
+        return false;
+      const bool popped = ring.try_pop(t);
+      ring.unlock();
+      if (popped) {
+        self.next_lane = p;
+        return true;
+      }
+      mark_lane_if_empty(p, i);
+      return false;
+    };
+    for (size_t p = producers.highest_below(last); p != OccupancyBitmap::npos;
+         p = producers.highest_below(p)) {
+      if (visit(p))
+        return true;
+    }
+    for (size_t p = producers.highest(); p != OccupancyBitmap::npos && p >= last;
+         p = producers.highest_below(p)) {
+      if (visit(p))
+        return true;
+    }
+    return false;
+  }
+
+  // Clear the bit of an empty producer lane; see `mark_if_empty`
+  void mark_lane_if_empty(size_t producer, size_t i) {
+    lanes_with_work_[i].clear(producer);
+    if (!lanes_[producer].rings[i].empty())
+      lanes_with_work_[i].set(producer);
+  }
+
+  // Pops from the queue at level `i`, clearing its occupancy bit if it is empty
+  bool try_pop_at(Task &t, size_t i) {
+    if (priority_queues_[i].try_pop(t)) {
+      if (bounded)
+        room_[i].notify(1);
+      return true;
+    }
+    mark_if_empty(i);
+    return false;
+  }
+
+  // Wrap-around safe comparison of virtual times
+  static bool before(uint64_t a, uint64_t b) { return static_cast<int64_t>(a - b) < 0; }
+
+  // Virtual time at which the next task of `level` starts; a level that was
+  // idle restarts at the current virtual time instead of using up credit
+  uint64_t start_of(size_t level, uint64_t now) const {
+    const uint64_t pass = pass_[level].load(std::memory_order_relaxed);
+    return before(pass, now) ? now : pass;
+  }
+
+  // Of `best` and the levels set in `bits` at or above `min_level`, the one
+  // whose next task starts first in virtual time; ties go to the higher level
+  size_t earliest_level(const OccupancyBitmap &bits, size_t min_level, uint64_t now, size_t best,
+                        uint64_t &best_start) const {
+    for (size_t i = bits.highest(); serves(i, min_level); i = bits.highest_below(i)) {
+      const uint64_t start = start_of(i, now);
+      if (best == OccupancyBitmap::npos || before(start, best_start) ||
+          (start == best_start && i > best)) {
+        best = i;
+        best_start = start;
+      }
+    }
+    return best;
+  }
+
+  // Pops from the shared queue (or producer lane) that `self` serves whose
+  // next task starts first in virtual time
+  bool try_pop_weighted(Worker &self, Task &t, size_t &level) {
+    while (true) {
+      const uint64_t now = virtual_time_.load(std::memory_order_relaxed);
+      uint64_t start = 0;
+      size_t i = earliest_level(occupancy_, self.min_level, now, OccupancyBitmap::npos, start);
+      if (has_lanes)
+        i = earliest_level(lane_levels_, self.min_level, now, i, start);
+      if (i == OccupancyBitmap::npos)
+        return false;
+      if (try_pop_level(self, t, i)) {
+        level = i;
+        return true;
+      }
+      // Lanes that other workers are draining
+      if (has_lanes && lane_levels_.test(i))
+        return false;
+    }
+  }
+
+  // Advances the virtual time of `level` past a task of `cost` that starts now
+  void charge(size_t level, uint64_t cost) {
+    const uint64_t now = virtual_time_.load(std::memory_order_relaxed);
+    const uint64_t stride = stride_[level].load(std::memory_order_relaxed);
+    uint64_t pass = pass_[level].load(std::memory_order_relaxed);
+    uint64_t start;
+    do {
+      start = before(pass, now) ? now : pass;
+    } while (!pass_[level].compare_exchange_weak(pass, start + stride * cost,
+                                                 std::memory_order_relaxed));
+    // The scheduler's virtual time is the latest start among running tasks
+    uint64_t current = now;
+    while (before(current, start) &&
+           !virtual_time_.compare_exchange_weak(current, start, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Clear the occupancy bit of an empty queue
+  //
+  // A producer may push between the failed pop and the clear, so the queue is
+  // checked again afterwards and the bit restored if it is no longer empty.
+  void mark_if_empty(size_t i) {
+    occupancy_.clear(i);
+    if (!priority_queues_[i].empty())
+      occupancy_.set(i);
+  }
+
+  void count_enqueued(size_t level, size_t count) {
+    if (elastic)
+      queued_.fetch_add(static_cast<int64_t>(count), std::memory_order_relaxed);
+    if (metrics::value)
+      level_metrics_[level].enqueued.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void count_dropped(size_t level, size_t count) {
+    if (tracing::value && count > 0)
+      trace(trace_event::drop, 0, level, count);
+    if (elastic && count > 0)
+      queued_.fetch_sub(static_cast<int64_t>(count), std::memory_order_relaxed);
+    if (metrics::value && count > 0)
+      level_metrics_[level].dropped.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void count_rejected(size_t level) {
+    if (metrics::value)
+      level_metrics_[level].rejected.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void count_cancelled(size_t level, size_t count) {
+    if (elastic && count > 0)
+      queued_.fetch_sub(static_cast<int64_t>(count), std::memory_order_relaxed);
+    if (metrics::value && count > 0)
+      level_metrics_[level].cancelled.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void trace(trace_event type, uint64_t id, size_t level, uint64_t arg = 0) {
+    if (tracing::value)
+      tracer_->record(type, id, level, arg);
+  }
+
+  // Gives `task` a trace id and records that it is being enqueued
+  void trace_enqueue(Task &task, size_t level) {
+    if (!tracing::value)
+      return;
+    task.trace_id_ = tracer_->next_id();
+    trace(trace_event::enqueue, task.trace_id_, level, 1);
+  }
+
+  static size_t checked_levels(size_t levels) {
+    if (levels == 0)
+      throw std::invalid_argument("psched: a scheduler needs at least one priority level");
+    if (static_levels != dynamic_queues && levels != static_levels)
+      throw std::invalid_argument("psched: number of levels is fixed by queues<count>");
+    return levels;
+  }
+
+  // Enqueue a task at a level known to be in range
+  // Tasks scheduled from inside a running task stay on the worker's own
+  // deque, unless the worker is reserved for higher levels or the queues are
+  // bounded (deques would hold tasks beyond the bound)
+  Worker *local_worker(size_t level) const {
+    Worker *self = current_worker_;
+    if (!stealing::value || bounded || !self || self->scheduler != this || level < self->min_level)
+      return nullptr;
+    return self;
+  }
+
+  bool try_push_local(size_t level, Task &task) {
+    Worker *self = local_worker(level);
+    if (!self)
+      return false;
+    task.save_arrival_time();
+    self->deques[level].push(self->pool.allocate(std::move(task)));
+    self->occupancy.set(level);
+    stealable_.set(level);
+    count_enqueued(level, 1);
+    notify(level, 1);
+    return true;
+  }
+
+  // Pushes `task` once its queue has room, waiting until `until` at the most;
+  // `task` is left untouched if this fails
+  bool push_when_not_full(size_t level, Task &task, std::chrono::steady_clock::time_point until) {
+    auto &queue = priority_queues_[level];
+    if (queue.try_push_if_not_full(std::move(task)))
+      return true;
+    if (!bounded)
+      return false;
+    while (true) {
+      const auto key = room_[level].prepare_wait();
+      if (queue.try_push_if_not_full(std::move(task))) {
+        room_[level].cancel_wait();
+        return true;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (!running_ || now >= until) {
+        room_[level].cancel_wait();
+        return false;
+      }
+      if (until == std::chrono::steady_clock::time_point::max())
+        room_[level].commit_wait(key);
+      else
+        room_[level].commit_wait_for(key, until - now);
+    }
+  }
+
+  // Runs `task` on the calling worker as if it had been scheduled at `level`
+  // and dequeued right away, skipping the queue; fails unless the caller is a
+  // worker of this scheduler that serves `level` and no task waits at a
+  // higher level
+  bool run_here(size_t level, Task &task) {
+    Worker *self = current_worker_;
+    level = clamp(level);
+    if (!self || self->scheduler != this || level < self->min_level)
+      return false;
+    const auto above = [level](size_t highest) {
+      return highest != OccupancyBitmap::npos && highest > level;
+    };
+    if (above(highest_shared()) ||
+        (stealing::value && (above(stealable_.highest()) || above(self->occupancy.highest()))))
+      return false;
+    trace_enqueue(task, level);
+    task.save_arrival_time();
+    count_enqueued(level, 1);
+    execute(*self, task, level);
+    return true;
+  }
+
+  // Pushes `task` once its queue has room, from a worker: waiting could wait
+  // for itself, so the worker runs queued tasks, highest priority first, until
+  // the task fits; fails once the scheduler is stopping
+  bool push_from_worker(Worker &self, size_t level, Task &task) {
+    Task next;
+    while (!priority_queues_[level].try_push_if_not_full(std::move(task))) {
+      if (!running_)
+        return false;
+      // Queues this worker does not serve are drained by other workers
+      if (!try_run_one(self, next))
+        std::this_thread::yield();
+    }
+    return true;
+  }
+
+  void schedule_at(size_t level, Task &&task) {
+    trace_enqueue(task, level);
+    if (try_push_local(level, task))
+      return;
 
     // Enqueue task
-    while (running_) {
-      if (priority_queues_[priority::value].try_push(task)) {
+    size_t discarded = 0;
+    if (!blocking) {
+      priority_queues_[level].try_push(std::move(task), discarded);
+    } else if (current_worker_ && current_worker_->scheduler == this) {
+      if (!push_from_worker(*current_worker_, level, task)) {
+        task.drop();
+        discarded = 1;
+      }
+    } else if (!push_when_not_full(level, task, std::chrono::steady_clock::time_point::max())) {
+      // Only fails once the scheduler is stopping
+      task.drop();
+      discarded = 1;
+    }
+    occupancy_.set(level);
+    wake_aging(level);
+    count_enqueued(level, 1);
+    count_dropped(level, discarded);
+
+    // Wake up a parked worker, if any
+    notify(level, 1);
+  }
+
+  // Pushes onto the lane of a registered producer, or onto the shared queue
+  // if the lane is full
+  void schedule_on_lane(size_t producer, size_t level, Task &&task) {
+    uint64_t id = 0;
+    if (tracing::value)
+      task.trace_id_ = id = tracer_->next_id();
+    task.save_arrival_time();
+    if (!lanes_[producer].rings[level].try_push(std::move(task)))
+      return schedule_at(level, std::move(task));
+    trace(trace_event::enqueue, id, level, 1);
+    lanes_with_work_[level].set(producer);
+    lane_levels_.set(level);
+    wake_aging(level);
+    count_enqueued(level, 1);
+    notify(level, 1);
+  }
+
+  void unregister_producer(size_t producer) {
+    std::lock_guard<std::mutex> lock{lanes_mutex_};
+    lanes_[producer].registered = false;
+  }
+
+  // Schedules the next turn of the strand of `key`; if a bounded queue
+  // discards the turn, the strand's tasks are discarded with it
+  void schedule_turn(uint64_t key, size_t level) {
+    Task turn([this, key] { run_turn(key); });
+    turn.on_dropped([this, key](const TaskStats &) { strands_.drop(key); });
+    schedule_at(level, std::move(turn));
+  }
+
+  // Runs a batch of tasks from the strand of `key`, yielding the worker to
+  // other tasks if more are left
+  void run_turn(uint64_t key) {
+    Task task;
+    size_t level;
+    strands_.take_front(key, task);
+    for (size_t n = 1;; ++n) {
+      task();
+      const bool more = n < detail::StrandTable::batch_size;
+      if (!strands_.advance(key, level, more ? &task : nullptr))
+        return;
+      if (!more)
         break;
+    }
+    schedule_turn(key, level);
+  }
+
+  // Enqueues `task` unless `level` is over its admission limit or its queue
+  // stays full until `until`; never discards a task
+  bool try_schedule_at(size_t level, Task &&task, std::chrono::steady_clock::time_point until) {
+    if (!admission_[level].try_acquire()) {
+      count_rejected(level);
+      return false;
+    }
+    trace_enqueue(task, level);
+    if (try_push_local(level, task))
+      return true;
+    if (!push_when_not_full(level, task, until)) {
+      count_rejected(level);
+      return false;
+    }
+    occupancy_.set(level);
+    wake_aging(level);
+    count_enqueued(level, 1);
+    notify(level, 1);
+    return true;
+  }
+
+  template <class Iterator> void schedule_bulk_at(size_t level, Iterator first, Iterator last) {
+    size_t count = 0;
+    if (Worker *self = local_worker(level)) {
+      const auto now = TaskClock::now();
+      for (; first != last; ++first, ++count) {
+        detail::TaskNode *node = self->pool.allocate(Task(*first));
+        node->task.stats_.arrival_time = now;
+        self->deques[level].push(node);
       }
+      self->occupancy.set(level);
+      stealable_.set(level);
+    } else {
+      size_t discarded = 0;
+      count = priority_queues_[level].try_push_bulk(first, last, discarded);
+      occupancy_.set(level);
+      wake_aging(level);
+      count_dropped(level, discarded);
     }
+    count_enqueued(level, count);
+    trace(trace_event::enqueue, 0, level, count);
 
-    // Send `enqueued` signal to worker threads
-    {
-      std::unique_lock<std::mutex> lock{mutex_};
-      enqueued_ += 1;
-      ready_.notify_one();
+    notify(level, count);
+  }
+
+  // Levels above the highest one are clamped to it
+  size_t clamp(size_t level) const { return std::min(level, levels_ - 1); }
+
+  // Does the scheduler run an aging thread? Without timestamps every task
+  // would look starved; weighted fair queuing starves no level
+  bool ages() const { return levels_ > 1 && TaskClock::enabled && !fair; }
+
+  TimerWheel<resolution, TimerDispatch> &timers() {
+    std::call_once(timers_started_, [this] {
+      timers_.reset(new TimerWheel<resolution, TimerDispatch>(TimerDispatch{this}, levels_));
+    });
+    return *timers_;
+  }
+
+  template <class priority> static void check_priority() {
+    static_assert(static_levels == dynamic_queues || priority::value < static_levels,
+                  "priority out of range");
+  }
+
+public:
+  // `levels` is only needed with `queues<dynamic_queues>`
+  explicit PriorityScheduler(size_t levels = static_levels)
+      : levels_(checked_levels(levels)), priority_queues_(new Queue[levels_]),
+        occupancy_(levels_), stealable_(levels_),
+        level_metrics_(metrics::value ? new detail::SharedLevelMetrics[levels_] : nullptr),
+        room_(bounded ? new EventCount[levels_] : nullptr),
+        admission_(new detail::AdmissionLimit[levels_]),
+        pass_(fair ? new std::atomic<uint64_t>[levels_] : nullptr),
+        stride_(fair ? new std::atomic<uint64_t>[levels_] : nullptr),
+        tracer_(tracing::value ? new Tracer<>(tracing::capacity) : nullptr),
+        lanes_(has_lanes ? new Lane[lanes::value] : nullptr), lane_levels_(levels_) {
+    for (size_t i = 0; has_lanes && i < levels_; ++i)
+      lanes_with_work_.emplace_back(lanes::value);
+    for (size_t i = 0; fair && i < levels_; ++i) {
+      pass_[i].store(0, std::memory_order_relaxed);
+      stride_[i].store(stride_scale / service::weight_of(i), std::memory_order_relaxed);
+    }
+    for (size_t lot = 0; lot < number_of_lots; ++lot) {
+      lot_min_level_[lot] = std::min(groups::min_level_of(lot), levels_ - 1);
+      wake_order_[lot] = lot;
+    }
+    std::stable_sort(wake_order_, wake_order_ + number_of_lots, [this](size_t a, size_t b) {
+      return lot_min_level_[a] > lot_min_level_[b];
+    });
+    running_ = true;
+    workers_.resize(max_workers);
+    threads_.resize(max_workers);
+    // Every worker exists up front, so that it can be looked at while its
+    // thread is not running; its thread allocates the rest (see `set_up`)
+    for (size_t n = 0; n != max_workers; ++n)
+      workers_[n].reset(new Worker(this, n, groups::placement(n)));
+    for (size_t n = 0; n != threads::value; ++n) {
+      threads_[n] = std::thread([this, n] { start(n); });
+    }
+    while (started_.load(std::memory_order_acquire) != threads::value)
+      std::this_thread::yield();
+    if (ages())
+      aging_thread_ = std::thread([this] {
+        if (tracing::value)
+          tracer_->register_thread("aging");
+        age();
+      });
+    if (elastic)
+      pool_thread_ = std::thread([this] { manage_pool(); });
+  }
+
+  ~PriorityScheduler() { stop(); }
+
+  size_t levels() const { return levels_; }
+
+  // Schedules a copy of `task`; the same Task can be scheduled again later
+  template <class priority> void schedule(Task &task) { schedule<priority>(Task(task)); }
+
+  template <class priority> void schedule(const Task &task) { schedule<priority>(Task(task)); }
+
+  // Schedules a callable directly, e.g., `schedule<priority<1>>([] { ... })`
+  template <class priority, class F,
+            class = typename std::enable_if<
+                !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+  void schedule(F &&fn) {
+    schedule<priority>(Task(std::forward<F>(fn)));
+  }
+
+  template <class priority> void schedule(Task &&task) {
+    check_priority<priority>();
+    schedule_at(static_levels == dynamic_queues ? clamp(priority::value) : priority::value,
+                std::move(task));
+  }
+
+  // Schedules at a priority level computed at runtime; levels above the
+  // highest one are clamped to it
+  void schedule(size_t level, Task &&task) { schedule_at(clamp(level), std::move(task)); }
+
+  void schedule(size_t level, const Task &task) { schedule_at(clamp(level), Task(task)); }
+
+  template <class F, class = typename std::enable_if<
+                         !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+  void schedule(size_t level, F &&fn) {
+    schedule_at(clamp(level), Task(std::forward<F>(fn)));
+  }
+
+  // Scheduling handle of one producer thread, with a private lane per level
+  //
+  // Returned by `register_producer`. A producer's tasks go onto its own
+  // lanes, without a lock, unless a lane is full, in which case they go onto
+  // the shared queue. A Producer must not be used by two threads at the same
+  // time; destroying it frees its lanes for another producer, and the tasks
+  // still in them run as usual.
+  class Producer {
+    PriorityScheduler *scheduler_;
+    size_t index_;
+
+    friend class PriorityScheduler;
+    Producer(PriorityScheduler *scheduler, size_t index) : scheduler_(scheduler), index_(index) {}
+
+  public:
+    Producer(Producer &&other) noexcept : scheduler_(other.scheduler_), index_(other.index_) {
+      other.scheduler_ = nullptr;
+    }
+
+    Producer &operator=(Producer &&) = delete;
+
+    ~Producer() {
+      if (scheduler_)
+        scheduler_->unregister_producer(index_);
+    }
+
+    template <class priority, class F> void schedule(F &&fn) {
+      check_priority<priority>();
+      schedule(priority::value, std::forward<F>(fn));
+    }
+
+    template <class F> void schedule(size_t level, F &&fn) {
+      scheduler_->schedule_on_lane(index_, scheduler_->clamp(level), Task(std::forward<F>(fn)));
+    }
+  };
+
+  // Registers the calling producer thread; requires the `producer_lanes` option
+  //
+  // Throws std::out_of_range if `producer_lanes<N>` producers are already
+  // registered.
+  Producer register_producer() {
+    static_assert(has_lanes, "register_producer needs the producer_lanes option");
+    std::lock_guard<std::mutex> lock{lanes_mutex_};
+    for (size_t p = 0; p < lanes::value; ++p) {
+      Lane &lane = lanes_[p];
+      if (lane.registered)
+        continue;
+      if (!lane.rings)
+        lane.rings.reset(new LaneRing[levels_]);
+      lane.registered = true;
+      return Producer(this, p);
+    }
+    throw std::out_of_range("psched: every producer lane is taken (see producer_lanes<N>)");
+  }
+
+  // Schedules a task (or callable) on the strand of `key`
+  //
+  // Tasks scheduled with the same key never run at the same time and start in
+  // the order they were scheduled, so they can share state without a lock;
+  // tasks with different keys run in parallel. A worker that picks up a key
+  // runs up to 16 of its tasks in a row before yielding. Metrics count each
+  // such batch as a single task.
+  template <class priority, class F> void schedule(uint64_t key, F &&fn) {
+    check_priority<priority>();
+    schedule(priority::value, key, std::forward<F>(fn));
+  }
+
+  template <class F> void schedule(size_t level, uint64_t key, F &&fn) {
+    level = clamp(level);
+    if (strands_.push(key, Task(std::forward<F>(fn)), level))
+      schedule_turn(key, level);
+  }
+
+  // Schedules a task (or callable) unless it would overload `priority`
+  //
+  // Returns false, without discarding any queued task, if the level is over
+  // its admission limit (see `limit_admission`) or its bounded queue is full.
+  // A refused task is dropped without calling its `on_dropped` callback; the
+  // caller is expected to handle the refusal, e.g., by replying "busy".
+  template <class priority, class F> bool try_schedule(F &&fn) {
+    check_priority<priority>();
+    return try_schedule(priority::value, std::forward<F>(fn));
+  }
+
+  template <class F> bool try_schedule(size_t level, F &&fn) {
+    return try_schedule_at(clamp(level), Task(std::forward<F>(fn)),
+                           std::chrono::steady_clock::time_point::min());
+  }
+
+  // Like `try_schedule`, but waits up to `timeout` for room in a full queue
+  template <class priority, class Rep, class Period, class F>
+  bool try_schedule_for(std::chrono::duration<Rep, Period> timeout, F &&fn) {
+    check_priority<priority>();
+    return try_schedule_for(priority::value, timeout, std::forward<F>(fn));
+  }
+
+  template <class Rep, class Period, class F>
+  bool try_schedule_for(size_t level, std::chrono::duration<Rep, Period> timeout, F &&fn) {
+    return try_schedule_at(
+        clamp(level), Task(std::forward<F>(fn)),
+        std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+  }
+
+  // Limits `try_schedule` at `priority` to `tasks_per_second`, with bursts of
+  // up to `burst` tasks; a rate of zero removes the limit
+  //
+  // The limit is a token bucket kept in a single atomic. `schedule`, and the
+  // tasks the scheduler creates itself (continuations, graph nodes, timers),
+  // are never refused.
+  template <class priority> void limit_admission(double tasks_per_second, size_t burst = 1) {
+    check_priority<priority>();
+    limit_admission(priority::value, tasks_per_second, burst);
+  }
+
+  void limit_admission(size_t level, double tasks_per_second, size_t burst = 1) {
+    admission_[clamp(level)].set(tasks_per_second, burst);
+  }
+
+  // Changes the weight of `priority` (weighted fair queuing only)
+  //
+  // Takes effect from the next task run at the level; virtual time already
+  // used up is not rescaled.
+  template <class priority> void set_weight(size_t weight) {
+    check_priority<priority>();
+    set_weight(priority::value, weight);
+  }
+
+  void set_weight(size_t level, size_t weight) {
+    static_assert(fair, "set_weight needs the weighted_fair_queuing option");
+    if (weight == 0 || weight > stride_scale)
+      throw std::invalid_argument("psched: a weight must be between 1 and 2^20");
+    stride_[clamp(level)].store(stride_scale / weight, std::memory_order_relaxed);
+  }
+
+  // Schedules a task (or callable) that can be withdrawn until it starts
+  //
+  // Cancelling the returned token makes the worker that dequeues the task
+  // skip it and call its `on_dropped` callback. The task can keep a copy of the token to stop early once it has
+  // started. To cancel several tasks at once, give them the same token with
+  // `Task::set_cancellation` and schedule them as usual.
+  template <class priority, class F> CancellationToken schedule_cancellable(F &&fn) {
+    check_priority<priority>();
+    return schedule_cancellable(priority::value, std::forward<F>(fn));
+  }
+
+  template <class F> CancellationToken schedule_cancellable(size_t level, F &&fn) {
+    CancellationToken token;
+    Task task(std::forward<F>(fn));
+    task.set_cancellation(token);
+    schedule_at(clamp(level), std::move(task));
+    return token;
+  }
+
+  // Schedules `fn(args...)` and returns a Future for its result
+  //
+  // The callable, its arguments and the result share a single allocation; an
+  // exception thrown by `fn` is rethrown by `Future::get()`.
+  template <class priority, class F, class... Args> auto submit(F &&fn, Args &&... args) {
+    check_priority<priority>();
+    return submit(priority::value, std::forward<F>(fn), std::forward<Args>(args)...);
+  }
+
+  template <class F, class... Args> auto submit(size_t level, F &&fn, Args &&... args) {
+    auto body = [fn = typename std::decay<F>::type(std::forward<F>(fn)),
+                 arguments = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+      return std::apply(fn, std::move(arguments));
+    };
+    typedef decltype(body()) R;
+    auto state = Future<R>::make_state(std::move(body));
+    schedule_at(clamp(level), detail::fulfilling_task(state));
+    return Future<R>(std::move(state));
+  }
+
+#if defined(PSCHED_HAS_COROUTINES)
+  // Awaitable that resumes the calling coroutine as a task at `priority`
+  //
+  //   co_await scheduler.resume_on<priority<2>>();
+  //   // ... now running on a worker, at priority 2
+  template <class priority> detail::ResumeOn<PriorityScheduler> resume_on() {
+    check_priority<priority>();
+    return resume_on(priority::value);
+  }
+
+  detail::ResumeOn<PriorityScheduler> resume_on(size_t level) {
+    return detail::ResumeOn<PriorityScheduler>{*this, clamp(level)};
+  }
+
+  // Runs a CoTask on a worker at `priority` and returns a Future for its result
+  //
+  // Every time the coroutine suspends on `resume_on`, it is resumed by the
+  // worker that picks up its task; otherwise it runs until it completes.
+  template <class priority, class T> Future<T> spawn(CoTask<T> task) {
+    check_priority<priority>();
+    return spawn(priority::value, std::move(task));
+  }
+
+  template <class T> Future<T> spawn(size_t level, CoTask<T> task) {
+    typedef typename detail::state_type<T>::type stored_type;
+    detail::StateRef<stored_type> state(new detail::FutureState<stored_type>());
+    detail::drive(*this, clamp(level), std::move(task), state);
+    return Future<T>(std::move(state));
+  }
+#endif
+
+  // Schedules every task in [first, last) with a single queue operation and
+  // wakes up at most one idle worker per task
+  //
+  // With `discard::block`, tasks are pushed one at a time, waiting for room.
+  template <class priority, class Iterator> void schedule_bulk(Iterator first, Iterator last) {
+    check_priority<priority>();
+    schedule_bulk(static_levels == dynamic_queues ? clamp(priority::value) : priority::value,
+                  first, last);
+  }
+
+  template <class Iterator> void schedule_bulk(size_t level, Iterator first, Iterator last) {
+    level = clamp(level);
+    if (blocking) {
+      for (; first != last; ++first)
+        schedule_at(level, Task(*first));
+      return;
     }
+    schedule_bulk_at(level, first, last);
+  }
+
+  template <class priority> void schedule_bulk(std::initializer_list<Task> tasks) {
+    schedule_bulk<priority>(tasks.begin(), tasks.end());
+  }
+
+  // Schedules every task in a container; tasks are moved out of an rvalue container
+  template <class priority, class Range> void schedule_bulk(Range &&tasks) {
+    if constexpr (std::is_lvalue_reference<Range>::value) {
+      schedule_bulk<priority>(std::begin(tasks), std::end(tasks));
+    } else {
+      schedule_bulk<priority>(std::make_move_iterator(std::begin(tasks)),
+                              std::make_move_iterator(std::end(tasks)));
+    }
+  }
+
+  // Schedules `task` once `delay` has elapsed
+  //
+  // All timers share one thread running a hierarchical timing wheel, so
+  // adding a timer is O(1). Expirations fire on a tick boundary of the
+  // `timer_resolution` option (1ms by default) and never early.
+  template <class priority, class Rep, class Period, class F>
+  Timer schedule_after(std::chrono::duration<Rep, Period> delay, F &&task) {
+    check_priority<priority>();
+    return schedule_after(priority::value, delay, std::forward<F>(task));
+  }
+
+  template <class Rep, class Period, class F>
+  Timer schedule_after(size_t level, std::chrono::duration<Rep, Period> delay, F &&task) {
+    return timers().add(Task(std::forward<F>(task)), clamp(level),
+                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay),
+                        std::chrono::steady_clock::duration::zero(), timer_mode::fixed_rate);
+  }
+
+  // Schedules `task` every `period`, starting one period from now
+  //
+  // With `timer_mode::fixed_rate`, expirations stay on the original grid and
+  // periods missed while the timer thread fell behind are counted as overruns.
+  // With `timer_mode::fixed_delay`, the next period starts when a run completes
+  // or is discarded by a bounded queue (counted as an overrun).
+  template <class priority, class Rep, class Period, class F>
+  Timer schedule_every(std::chrono::duration<Rep, Period> period, F &&task,
+                       timer_mode mode = timer_mode::fixed_rate) {
+    check_priority<priority>();
+    return schedule_every(priority::value, period, std::forward<F>(task), mode);
+  }
+
+  template <class Rep, class Period, class F>
+  Timer schedule_every(size_t level, std::chrono::duration<Rep, Period> period, F &&task,
+                       timer_mode mode = timer_mode::fixed_rate) {
+    const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+    if (interval <= std::chrono::steady_clock::duration::zero())
+      throw std::invalid_argument("psched: a periodic timer needs a positive period");
+    Task periodic(std::forward<F>(task));
+    // Every expiration runs a copy of the task
+    if (!periodic.can_copy())
+      throw std::invalid_argument("psched: a periodic timer needs a copyable task");
+    return timers().add(std::move(periodic), clamp(level), interval, interval, mode);
+  }
+
+  // Merges the per-worker histograms and counters of every priority level
+  //
+  // Workers keep running while the snapshot is taken, so counters read at
+  // slightly different times may not add up exactly. Requires the
+  // `collect_metrics` option; otherwise every level reads as zero.
+  MetricsSnapshot metrics_snapshot() const {
+    MetricsSnapshot snapshot;
+    snapshot.levels.resize(levels_);
+    snapshot.pool.workers = active_workers_.load(std::memory_order_relaxed);
+    snapshot.pool.started = workers_started_.load(std::memory_order_relaxed);
+    snapshot.pool.retired = workers_retired_.load(std::memory_order_relaxed);
+    if (!metrics::value)
+      return snapshot;
+    for (size_t i = 0; i < levels_; ++i) {
+      auto &level = snapshot.levels[i];
+      level_metrics_[i].merge_into(level);
+      for (auto &worker : workers_) {
+        if (worker->ready.load(std::memory_order_acquire))
+          worker->metrics[i].merge_into(level);
+      }
+      level.executed = level.turnaround_time.count;
+    }
+    return snapshot;
+  }
+
+  // Writes the events recorded so far as Chrome trace-event JSON, which can
+  // be opened in Perfetto or chrome://tracing; requires the `trace_events`
+  // option. Workers keep running and recording meanwhile.
+  void write_trace(std::ostream &out) const {
+    static_assert(tracing::value, "write_trace needs the trace_events option");
+    tracer_->write(out);
   }
 
   void stop() {
+    // Stop timers first so no expiration races with the workers shutting down
+    if (timers_)
+      timers_->stop();
+    {
+      std::lock_guard<std::mutex> lock{background_mutex_};
+      background_running_ = false;
+    }
+    background_wakeup_.notify_all();
+    aging_idle_.notify_one();
+    if (aging_thread_.joinable())
+      aging_thread_.join();
+    if (pool_thread_.joinable())
+      pool_thread_.join();
     running_ = false;
-    ready_.notify_all();
-    for (auto &q : priority_queues_)
-      q.done();
+    for (size_t lot = 0; lot < number_of_lots; ++lot)
+      idle_workers_[lot].notify_all();
+    // Producers blocked on a full queue give up
+    for (size_t i = 0; bounded && i < levels_; ++i)
+      room_[i].notify_all();
+    for (size_t i = 0; i < levels_; ++i)
+      priority_queues_[i].done();
     for (auto &t : threads_)
       if (t.joinable())
         t.join();
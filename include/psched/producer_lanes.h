@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <psched/ring_buffer.h>
+#include <psched/task.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
+namespace psched {
+
+struct producer_lanes_tag {};
+
+// Give up to `max_producers` registered producer threads a private lane per
+// priority level (see `PriorityScheduler::register_producer`)
+//
+// A lane is a single-producer ring of `lane_capacity` tasks, so a registered
+// producer enqueues without a lock or a read-modify-write on memory that
+// other producers write. Workers drain the lanes in priority order, along
+// with the shared queues.
+template <size_t max_producers = 0, size_t lane_capacity = 256> struct producer_lanes {
+  typedef producer_lanes_tag option_tag;
+  constexpr static size_t value = max_producers;
+  constexpr static size_t capacity = lane_capacity;
+  static_assert(lane_capacity >= 2 && (lane_capacity & (lane_capacity - 1)) == 0,
+                "lane_capacity must be a power of two");
+};
+
+namespace detail {
+
+// Single-producer ring of tasks with a try-lock for its consumers
+//
+// The producer never waits: it writes a slot and publishes the new tail.
+// Any worker may consume, one at a time, by taking the lane's lock with
+// `try_lock`; a worker that finds the lane locked moves on to another one.
+// Each side caches the other's index, so the shared indices are only read
+// when the ring looks full (producer) or empty (consumer).
+template <size_t capacity> class LaneRing {
+  constexpr static uint64_t mask = capacity - 1;
+
+  alignas(cache_line_size) std::atomic<uint64_t> tail_{0}; // Next slot to write
+  uint64_t cached_head_{0};                                // Producer's copy of `head_`
+  alignas(cache_line_size) std::atomic<uint64_t> head_{0}; // Next slot to read
+  uint64_t cached_tail_{0};                                // Consumers' copy of `tail_`
+  std::atomic_bool locked_{false};                         // Held by the consuming worker
+  std::unique_ptr<Task[]> slots_{new Task[capacity]};
+
+public:
+  // Producer only; leaves `task` untouched if the ring is full
+  bool try_push(Task &&task) {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == capacity) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ == capacity)
+        return false;
+    }
+    slots_[tail & mask] = std::move(task);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_lock() {
+    return !locked_.load(std::memory_order_relaxed) &&
+           !locked_.exchange(true, std::memory_order_acquire);
+  }
+
+  void unlock() { locked_.store(false, std::memory_order_release); }
+
+  // Lock holder only
+  bool try_pop(Task &task) {
+    return try_pop_if(task, [](const Task &) { return true; });
+  }
+
+  // Lock holder only; pops the front task if `predicate(task)` holds
+  template <class Predicate> bool try_pop_if(Task &task, Predicate predicate) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_)
+        return false;
+    }
+    Task &front = slots_[head & mask];
+    if (!predicate(front))
+      return false;
+    task = std::move(front);
+    // Destroy the callables before handing the slot back to the producer
+    front = Task();
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+  }
+};
+
+} // namespace detail
+
+} // namespace psched
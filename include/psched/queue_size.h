@@ -4,13 +4,21 @@
 
 namespace psched {
 
-enum class discard { oldest_task, newest_task };
+// What a bounded queue does when a task is scheduled while it is full
+//
+// `oldest_task` and `newest_task` discard a task (see `Task::on_dropped`);
+// `block` makes `schedule` wait until a worker has made room.
+enum class discard { oldest_task, newest_task, block };
 
 template <size_t queue_size, discard policy> struct maintain_size {
   constexpr static size_t bounded_queue_size = queue_size;
   constexpr static discard discard_policy = policy;
 };
 
+// Use as `queues<dynamic_queues>` to choose the number of priority levels
+// when the scheduler is constructed
+constexpr size_t dynamic_queues = 0;
+
 template <size_t count, class M = maintain_size<0, discard::oldest_task>> struct queues {
   constexpr static bool bounded_or_not = (M::bounded_queue_size > 0);
   constexpr static size_t number_of_queues = count;
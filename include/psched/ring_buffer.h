@@ -0,0 +1,165 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+
+namespace psched {
+
+// Size of a cache line, used to pad shared atomics and avoid false sharing
+constexpr size_t cache_line_size = 64;
+
+// Bounded, lock-free, multi-producer multi-consumer ring buffer
+//
+// Based on Dmitry Vyukov's sequence-slot algorithm: every cell carries a
+// sequence number that tells producers and consumers whether the cell is
+// ready to be written or read for the current lap around the ring.
+//
+// Every cell also carries an atomic `key` (e.g., an arrival timestamp) that
+// consumers can inspect without taking ownership of the element.
+template <class T, size_t capacity> class RingBuffer {
+  // With a single cell, a full cell and a cell free for the next lap would
+  // carry the same sequence number
+  static_assert(capacity > 1, "RingBuffer capacity must be at least 2");
+
+  struct alignas(cache_line_size) Cell {
+    std::atomic_size_t sequence{0};
+    std::atomic<int64_t> key{0};
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+    T *get() { return reinterpret_cast<T *>(&storage); }
+  };
+
+  std::unique_ptr<Cell[]> cells_;                             // Preallocated storage
+  alignas(cache_line_size) std::atomic_size_t enqueue_pos_{0}; // Next cell to write
+  alignas(cache_line_size) std::atomic_size_t dequeue_pos_{0}; // Next cell to read
+
+  static intptr_t difference(size_t a, size_t b) {
+    return static_cast<intptr_t>(a) - static_cast<intptr_t>(b);
+  }
+
+  // Claim the cell at the head of the ring if `predicate(key)` holds
+  // Returns nullptr if the ring is empty or the predicate fails
+  template <class Predicate> Cell *claim_head(Predicate &&predicate, size_t &pos) {
+    pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell *cell = &cells_[pos % capacity];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const intptr_t diff = difference(sequence, pos + 1);
+      if (diff == 0) {
+        if (!predicate(cell->key.load(std::memory_order_relaxed)))
+          return nullptr;
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          return cell;
+      } else if (diff < 0) {
+        return nullptr; // empty
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+public:
+  RingBuffer() : cells_(new Cell[capacity]) {
+    for (size_t i = 0; i < capacity; ++i)
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  ~RingBuffer() {
+    size_t pos;
+    while (Cell *cell = claim_head([](int64_t) { return true; }, pos)) {
+      cell->get()->~T();
+      cell->sequence.store(pos + capacity, std::memory_order_release);
+    }
+  }
+
+  RingBuffer(const RingBuffer &) = delete;
+  RingBuffer &operator=(const RingBuffer &) = delete;
+
+  template <class U> bool try_push(U &&value, int64_t key = 0) {
+    Cell *cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos % capacity];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const intptr_t diff = difference(sequence, pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false; // full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    new (&cell->storage) T(std::forward<U>(value));
+    cell->key.store(key, std::memory_order_relaxed);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Push up to `count` elements, produced in order by `make()`, claiming all
+  // of their cells with a single CAS. Returns the number of elements pushed.
+  template <class Make> size_t try_push_n(size_t count, int64_t key, Make &&make) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    size_t claimed = 0;
+    while (count > 0) {
+      // Count the consecutive free cells starting at `pos`
+      bool stale = false;
+      for (claimed = 0; claimed < count; ++claimed) {
+        const Cell &cell = cells_[(pos + claimed) % capacity];
+        const intptr_t diff =
+            difference(cell.sequence.load(std::memory_order_acquire), pos + claimed);
+        if (diff < 0)
+          break; // full from here on
+        if (diff > 0) {
+          stale = true; // another producer got there first
+          break;
+        }
+      }
+      if (stale) {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (claimed == 0)
+        return 0;
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + claimed, std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < claimed; ++i) {
+      Cell &cell = cells_[(pos + i) % capacity];
+      new (&cell.storage) T(make());
+      cell.key.store(key, std::memory_order_relaxed);
+      cell.sequence.store(pos + i + 1, std::memory_order_release);
+    }
+    return claimed;
+  }
+
+  bool try_pop(T &value) {
+    return try_pop_if(value, [](int64_t) { return true; });
+  }
+
+  // Pop the element at the head of the ring only if `predicate(key)` is true
+  template <class Predicate> bool try_pop_if(T &value, Predicate &&predicate) {
+    size_t pos;
+    Cell *cell = claim_head(predicate, pos);
+    if (!cell)
+      return false;
+    T *element = cell->get();
+    value = std::move(*element);
+    element->~T();
+    cell->sequence.store(pos + capacity, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate; may be stale by the time the caller acts on it
+  bool empty() const {
+    return dequeue_pos_.load(std::memory_order_relaxed) >=
+           enqueue_pos_.load(std::memory_order_relaxed);
+  }
+};
+
+} // namespace psched
@@ -0,0 +1,103 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <psched/task.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+
+namespace psched {
+
+namespace detail {
+
+// Serial queues of tasks, one per key (see `PriorityScheduler::schedule(key, task)`)
+//
+// A key with waiting tasks has a strand: a FIFO queue of tasks and a single
+// turn task in the scheduler's queues. A turn runs up to `batch_size` of the
+// strand's tasks back to back on one worker, then schedules the next turn if
+// tasks are left. Tasks of one key never overlap and start in order, while
+// different keys run in parallel. Keys are spread over independently locked
+// shards, so producers of different keys rarely contend.
+class StrandTable {
+public:
+  constexpr static size_t batch_size = 16; // Tasks run per turn
+
+private:
+  constexpr static size_t number_of_shards = 64;
+
+  struct Entry {
+    Task task;
+    size_t level;
+  };
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::deque<Entry>> strands;
+  };
+
+  std::unique_ptr<Shard[]> shards_{new Shard[number_of_shards]};
+
+  Shard &shard_of(uint64_t key) {
+    // Fibonacci hashing, so that sequential keys land on different shards
+    return shards_[(key * 0x9E3779B97F4A7C15ull) >> 58];
+  }
+
+public:
+  // Queues `task` at the back of the strand of `key`; returns true if the
+  // strand was idle, in which case the caller schedules its first turn
+  bool push(uint64_t key, Task &&task, size_t level) {
+    task.save_arrival_time();
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    auto &strand = shard.strands[key];
+    strand.push_back(Entry{std::move(task), level});
+    return strand.size() == 1;
+  }
+
+  // Takes the task at the front of the strand of `key`, leaving its entry in
+  // place so that tasks pushed while it runs wait for this turn
+  void take_front(uint64_t key, Task &task) {
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    task = std::move(shard.strands.find(key)->second.front().task);
+  }
+
+  // Removes the entry of the task that has just run. Returns false, removing
+  // the strand, if it was the last one; else sets `level` to that of the next
+  // task and, if `next` is not null, takes it like `take_front`
+  bool advance(uint64_t key, size_t &level, Task *next) {
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    auto it = shard.strands.find(key);
+    auto &strand = it->second;
+    strand.pop_front();
+    if (strand.empty()) {
+      shard.strands.erase(it);
+      return false;
+    }
+    level = strand.front().level;
+    if (next)
+      *next = std::move(strand.front().task);
+    return true;
+  }
+
+  // Discards every task of the strand of `key`, whose turn was discarded
+  void drop(uint64_t key) {
+    std::deque<Entry> dropped;
+    {
+      auto &shard = shard_of(key);
+      std::lock_guard<std::mutex> lock{shard.mutex};
+      auto it = shard.strands.find(key);
+      dropped.swap(it->second);
+      shard.strands.erase(it);
+    }
+    for (auto &entry : dropped)
+      entry.task.drop();
+  }
+};
+
+} // namespace detail
+
+} // namespace psched
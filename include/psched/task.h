@@ -1,80 +1,158 @@
 
 #pragma once
-#include <atomic>
-#include <functional>
+#include <exception>
+#include <memory>
+#include <psched/cancellation.h>
+#include <psched/clock.h>
+#include <psched/inplace_function.h>
 #include <psched/task_stats.h>
+#include <stdint.h>
+#include <utility>
 
 namespace psched {
 
+namespace detail {
+template <class Scheduler> class GraphRun;
+class StrandTable;
+} // namespace detail
+
 class Task {
+public:
+  typedef InplaceFunction<void()> Function;
+  typedef InplaceFunction<void(const TaskStats &)> CompletionFunction;
+  typedef InplaceFunction<void(const char *)> ErrorFunction;
+
+private:
   // Called when the task is (finally) executed by an executor thread
-  std::function<void()> task_main_;
+  Function task_main_;
 
   // Called after the task has completed executing.
   // In case of exception, `task_error` is called first
   //
   // TaskStats argument can be used to get task computation_time
   // and task response_time.
-  std::function<void(const TaskStats &)> task_end_;
+  CompletionFunction task_end_;
 
   // Called if `task_main()` throws an exception
-  std::function<void(const char *)> task_error_;
+  ErrorFunction task_error_;
+
+  // Called after the task has completed executing past its deadline,
+  // before `task_end`
+  CompletionFunction task_deadline_miss_;
+
+  // Called instead of `task_main` if the task is discarded to maintain the
+  // size of a bounded queue, or skipped because it was cancelled
+  CompletionFunction task_dropped_;
 
   // Temporal behavior of Task
   // Stats includes arrival_time, start_time, end_time
   // Stats can be used to calculate waiting_time, burst_time, turnaround_time
   TaskStats stats_;
 
-  template <class enforce_queue_size> friend class TaskQueue;
+  // Set by `CancellationToken::cancel()`; null if the task cannot be cancelled
+  std::shared_ptr<detail::CancellationState> cancellation_;
+
+  // Share of its level's weight used by the task (weighted fair queuing only)
+  uint32_t cost_{1};
+
+  // Identifies the task in traces (trace_events only), 0 until it is scheduled
+  uint64_t trace_id_{0};
+
+  template <class queue_policy, bool bounded> friend class TaskQueue;
+  template <class queue_policy> friend class DeadlineQueue;
+  template <class Scheduler> friend class detail::GraphRun;
+  friend class detail::StrandTable;
+  template <class threads, class queues, class aging_policy, class... options>
+  friend class PriorityScheduler;
 
 protected:
-  void save_arrival_time() { stats_.arrival_time = std::chrono::steady_clock::now(); }
+  void save_arrival_time() { stats_.arrival_time = TaskClock::now(); }
 
-public:
-  Task(const std::function<void()> &task_main = {},
-       const std::function<void(const TaskStats &)> &task_end = {},
-       const std::function<void(const char *)> &task_error = {})
-      : task_main_(task_main), task_end_(task_end), task_error_(task_error) {}
-
-  Task(const Task &other) {
-    task_main_ = other.task_main_;
-    task_end_ = other.task_end_;
-    task_error_ = other.task_error_;
-    stats_ = other.stats_;
+  void drop() {
+    if (task_dropped_)
+      task_dropped_(stats_);
   }
 
-  Task &operator=(Task other) {
-    std::swap(task_main_, other.task_main_);
-    std::swap(task_end_, other.task_end_);
-    std::swap(task_error_, other.task_error_);
-    std::swap(stats_, other.stats_);
-    return *this;
+  // False if one of the callables is move-only, so copying the task throws
+  bool can_copy() const {
+    return task_main_.can_copy() && task_end_.can_copy() && task_error_.can_copy() &&
+           task_deadline_miss_.can_copy() && task_dropped_.can_copy();
+  }
+
+public:
+  // Callables of up to PSCHED_TASK_INLINE_SIZE bytes are stored inline, so
+  // creating, moving and copying a Task with them never allocates. Callables
+  // may be move-only, e.g., capture a std::unique_ptr; copying a Task that
+  // holds one throws std::logic_error.
+  Task(Function task_main = {}, CompletionFunction task_end = {}, ErrorFunction task_error = {})
+      : task_main_(std::move(task_main)), task_end_(std::move(task_end)),
+        task_error_(std::move(task_error)) {}
+
+  void on_execute(Function fn) { task_main_ = std::move(fn); }
+
+  void on_complete(CompletionFunction fn) { task_end_ = std::move(fn); }
+
+  void on_error(ErrorFunction fn) { task_error_ = std::move(fn); }
+
+  void on_deadline_miss(CompletionFunction fn) { task_deadline_miss_ = std::move(fn); }
+
+  void on_dropped(CompletionFunction fn) { task_dropped_ = std::move(fn); }
+
+  // Absolute time point by which the task should complete
+  //
+  // With the `earliest_deadline_first` option, tasks at the same priority
+  // level run in order of their deadlines.
+  void set_deadline(TaskStats::TimePoint deadline) { stats_.deadline = deadline; }
+
+  // Deadline relative to now
+  template <class Rep, class Period> void set_deadline(std::chrono::duration<Rep, Period> d) {
+    stats_.deadline = TaskClock::source::now() +
+                      std::chrono::duration_cast<std::chrono::steady_clock::duration>(d);
   }
 
-  void on_execute(const std::function<void()> &fn) { task_main_ = fn; }
+  TaskStats::TimePoint deadline() const { return stats_.deadline; }
+
+  // Skip the task if `token` is cancelled before it starts; a skipped task
+  // calls its `on_dropped` callback instead
+  void set_cancellation(const CancellationToken &token) { cancellation_ = token.state_; }
+
+  bool is_cancelled() const {
+    return cancellation_ && cancellation_->cancelled.load(std::memory_order_acquire);
+  }
 
-  void on_complete(const std::function<void(const TaskStats &)> &fn) { task_end_ = fn; }
+  // Estimated cost of the task, e.g., in microseconds; with the
+  // `weighted_fair_queuing` option, a task of cost 2 uses as much of its
+  // level's share as two tasks of cost 1. A cost of 0 counts as 1, so that
+  // every task uses up some of its level's share.
+  void set_cost(uint32_t cost) { cost_ = cost > 0 ? cost : 1; }
 
-  void on_error(const std::function<void(const char *)> &fn) { task_error_ = fn; }
+  uint32_t cost() const { return cost_; }
 
   void operator()() {
-    stats_.start_time = std::chrono::steady_clock::now();
+    if (is_cancelled()) {
+      drop();
+      return;
+    }
+    stats_.start_time = TaskClock::now();
     try {
       if (task_main_) {
         task_main_();
       }
-      stats_.end_time = std::chrono::steady_clock::now();
+      stats_.end_time = TaskClock::now();
     } catch (std::exception &e) {
-      stats_.end_time = std::chrono::steady_clock::now();
+      stats_.end_time = TaskClock::now();
       if (task_error_) {
         task_error_(e.what());
       }
     } catch (...) {
-      stats_.end_time = std::chrono::steady_clock::now();
+      stats_.end_time = TaskClock::now();
       if (task_error_) {
         task_error_("Unknown exception");
       }
     }
+    if (task_deadline_miss_ && stats_.missed_deadline()) {
+      task_deadline_miss_(stats_);
+    }
     if (task_end_) {
       task_end_(stats_);
     }
@@ -0,0 +1,268 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <psched/future.h>
+#include <psched/task.h>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace psched {
+
+class TaskGraph;
+
+namespace detail {
+
+// State of one execution of a TaskGraph
+//
+// Every node has an atomic count of unfinished predecessors. The worker that
+// brings counts to zero keeps the most urgent ready successor and runs it
+// right away, without a trip through the queues, unless a more urgent task is
+// waiting or the worker does not serve its level; it schedules the others
+// like any other task. Either way nodes get the scheduler's worker groups,
+// metrics, tracing and cancellation checks.
+//
+// If a bounded queue discards a node, no further node is scheduled and the
+// run fails with std::future_errc::broken_promise once the nodes already
+// scheduled have finished.
+template <class Scheduler> class GraphRun {
+  TaskGraph &graph_;
+  Scheduler &scheduler_;
+  std::unique_ptr<std::atomic<size_t>[]> pending_; // Unfinished predecessors per node
+  std::vector<size_t> levels_;                     // Priority level per node
+  std::atomic<size_t> active_{0};                  // Nodes scheduled but not finished
+  std::atomic_bool failed_{false};                 // Has a node been discarded?
+  StateRef<Unit> done_;                            // Fulfilled when every node has run
+
+  constexpr static size_t none = static_cast<size_t>(-1);
+
+  // Called once per scheduled node, after it has run or been discarded
+  void finish() {
+    if (active_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+      return;
+    if (failed_.load(std::memory_order_acquire))
+      done_->break_promise();
+    else
+      done_->run();
+  }
+
+public:
+  GraphRun(TaskGraph &graph, Scheduler &scheduler, std::vector<size_t> levels,
+           StateRef<Unit> done);
+
+  // Task running `node` with its deadline and cost
+  template <class F> Task node_task(size_t node, F &&run) const;
+
+  // The caller has already counted the node in `active_`
+  void schedule(const std::shared_ptr<GraphRun> &self, size_t node);
+
+  // Counts and schedules the successors of `node` that became ready, except
+  // the most urgent one, which is returned (or `none`)
+  size_t release(const std::shared_ptr<GraphRun> &self, size_t node);
+
+  void start(const std::shared_ptr<GraphRun> &self);
+
+  void execute(const std::shared_ptr<GraphRun> &self, size_t node);
+};
+
+} // namespace detail
+
+// Directed acyclic graph of tasks
+//
+// Nodes are tasks with a priority level; an edge `precede(a, b)` makes `b`
+// wait until `a` has completed. `run` schedules every node whose
+// predecessors have all completed, and returns a Future that becomes ready
+// once the whole graph has run:
+//
+//   TaskGraph graph;
+//   auto a = graph.add<priority<1>>([] { /* ... */ });
+//   auto b = graph.add<priority<1>>([] { /* ... */ });
+//   auto c = graph.add<priority<2>>([] { /* ... */ });
+//   graph.precede(a, c);
+//   graph.precede(b, c);
+//   graph.run(scheduler).wait();
+//
+// With `inherit_priority`, a node runs at the highest level of any node that
+// (transitively) depends on it, so the path leading to an urgent node is not
+// held back by its lower priority predecessors.
+//
+// A graph can be run again once a run has completed, but must not be modified
+// or destroyed while it runs. If a bounded queue discards one of its nodes,
+// the nodes that depend on it do not run, and the Future throws
+// std::future_error (std::future_errc::broken_promise) once the nodes already
+// scheduled have finished.
+class TaskGraph {
+  struct Node {
+    Task task;
+    size_t level;
+    std::vector<size_t> successors{};
+    size_t predecessors{0};
+  };
+
+  std::vector<Node> nodes_;
+
+  template <class Scheduler> friend class detail::GraphRun;
+
+  // Nodes in dependency order; throws if the graph has a cycle
+  std::vector<size_t> topological_order() const {
+    std::vector<size_t> pending(nodes_.size());
+    std::vector<size_t> order;
+    order.reserve(nodes_.size());
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      pending[i] = nodes_[i].predecessors;
+      if (pending[i] == 0)
+        order.push_back(i);
+    }
+    for (size_t k = 0; k < order.size(); ++k) {
+      for (size_t successor : nodes_[order[k]].successors) {
+        if (--pending[successor] == 0)
+          order.push_back(successor);
+      }
+    }
+    if (order.size() != nodes_.size())
+      throw std::invalid_argument("psched: task graph has a cycle");
+    return order;
+  }
+
+  void check(size_t node) const {
+    if (node >= nodes_.size())
+      throw std::out_of_range("psched: no such task graph node");
+  }
+
+public:
+  typedef size_t NodeId;
+
+  size_t size() const { return nodes_.size(); }
+
+  // Adds a task run at priority `level`
+  template <class F> NodeId add(size_t level, F &&task) {
+    nodes_.push_back(Node{Task(std::forward<F>(task)), level});
+    return nodes_.size() - 1;
+  }
+
+  template <class priority, class F> NodeId add(F &&task) {
+    return add(priority::value, std::forward<F>(task));
+  }
+
+  // `after` runs once `before` has completed
+  void precede(NodeId before, NodeId after) {
+    check(before);
+    check(after);
+    if (before == after)
+      throw std::invalid_argument("psched: a task graph node cannot precede itself");
+    nodes_[before].successors.push_back(after);
+    nodes_[after].predecessors += 1;
+  }
+
+  template <class Scheduler>
+  Future<void> run(Scheduler &scheduler, bool inherit_priority = false) {
+    const auto order = topological_order();
+    std::vector<size_t> levels(nodes_.size());
+    for (size_t i = 0; i < nodes_.size(); ++i)
+      levels[i] = nodes_[i].level;
+    if (inherit_priority) {
+      // Walk the graph backwards so every successor is final before its predecessors
+      for (auto i = order.rbegin(); i != order.rend(); ++i) {
+        for (size_t successor : nodes_[*i].successors)
+          levels[*i] = std::max(levels[*i], levels[successor]);
+      }
+    }
+
+    auto done = Future<void>::make_state([] {});
+    auto run = std::make_shared<detail::GraphRun<Scheduler>>(*this, scheduler, std::move(levels),
+                                                             done);
+    run->start(run);
+    return Future<void>(std::move(done));
+  }
+};
+
+namespace detail {
+
+template <class Scheduler>
+GraphRun<Scheduler>::GraphRun(TaskGraph &graph, Scheduler &scheduler, std::vector<size_t> levels,
+                              StateRef<Unit> done)
+    : graph_(graph), scheduler_(scheduler), pending_(new std::atomic<size_t>[graph.size()]),
+      levels_(std::move(levels)), done_(std::move(done)) {
+  for (size_t i = 0; i < graph.size(); ++i)
+    pending_[i].store(graph.nodes_[i].predecessors, std::memory_order_relaxed);
+}
+
+template <class Scheduler>
+template <class F>
+Task GraphRun<Scheduler>::node_task(size_t node, F &&run) const {
+  const Task &original = graph_.nodes_[node].task;
+  Task task(std::forward<F>(run));
+  task.set_deadline(original.deadline());
+  task.set_cost(original.cost());
+  return task;
+}
+
+template <class Scheduler>
+void GraphRun<Scheduler>::schedule(const std::shared_ptr<GraphRun> &self, size_t node) {
+  Task task = node_task(node, [self, node] { self->execute(self, node); });
+  task.on_dropped([self](const TaskStats &) {
+    self->failed_.store(true, std::memory_order_release);
+    self->finish();
+  });
+  scheduler_.schedule(levels_[node], std::move(task));
+}
+
+template <class Scheduler> void GraphRun<Scheduler>::start(const std::shared_ptr<GraphRun> &self) {
+  if (graph_.size() == 0) {
+    done_->run();
+    return;
+  }
+  // Count every source first, so the run cannot complete before all are scheduled
+  size_t sources = 0;
+  for (size_t i = 0; i < graph_.size(); ++i)
+    sources += graph_.nodes_[i].predecessors == 0;
+  active_.store(sources, std::memory_order_relaxed);
+  for (size_t i = 0; i < graph_.size(); ++i) {
+    if (graph_.nodes_[i].predecessors == 0) {
+      graph_.nodes_[i].task.save_arrival_time();
+      schedule(self, i);
+    }
+  }
+}
+
+template <class Scheduler>
+size_t GraphRun<Scheduler>::release(const std::shared_ptr<GraphRun> &self, size_t node) {
+  size_t next = none;
+  for (size_t successor : graph_.nodes_[node].successors) {
+    if (pending_[successor].fetch_sub(1, std::memory_order_acq_rel) != 1 ||
+        failed_.load(std::memory_order_acquire))
+      continue;
+    graph_.nodes_[successor].task.save_arrival_time();
+    active_.fetch_add(1, std::memory_order_relaxed);
+    if (next == none) {
+      next = successor;
+    } else if (levels_[successor] > levels_[next]) {
+      schedule(self, next);
+      next = successor;
+    } else {
+      schedule(self, successor);
+    }
+  }
+  return next;
+}
+
+template <class Scheduler>
+void GraphRun<Scheduler>::execute(const std::shared_ptr<GraphRun> &self, size_t node) {
+  graph_.nodes_[node].task();
+  // Run the most urgent ready successor on this worker, in a loop rather than
+  // nested, so long chains do not grow the stack
+  for (size_t next; (next = release(self, node)) != none; node = next) {
+    finish();
+    Task task = node_task(next, [this, next] { graph_.nodes_[next].task(); });
+    if (!scheduler_.run_here(levels_[next], task)) {
+      schedule(self, next);
+      return;
+    }
+  }
+  finish();
+}
+
+} // namespace detail
+
+} // namespace psched
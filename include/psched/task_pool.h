@@ -0,0 +1,177 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <psched/task.h>
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+namespace psched {
+
+namespace detail {
+
+class TaskPool;
+
+// A task in a pool's slab, linked into a queue or a free list
+struct TaskNode {
+  Task task;
+  TaskNode *next{nullptr};
+  TaskPool *owner{nullptr}; // Pool whose slab the node lives in
+};
+
+// Slab allocator of TaskNodes
+//
+// Nodes are allocated `slab_size` at a time and are only returned to the
+// system when the pool is destroyed, so a scheduler in a steady state never
+// calls malloc to enqueue a task. One thread at a time allocates and
+// releases (the owner, or whoever holds the lock protecting the pool); any
+// other thread hands nodes back through a lock-free stack, which the owner
+// takes over with a single exchange once its own free list runs out.
+class TaskPool {
+  std::vector<std::unique_ptr<TaskNode[]>> slabs_;
+  TaskNode *free_{nullptr};                      // Owner only
+  std::atomic<TaskNode *> remote_free_{nullptr}; // Nodes released by other threads
+
+  void add_slab() {
+    std::unique_ptr<TaskNode[]> slab(new TaskNode[slab_size]);
+    for (size_t i = 0; i < slab_size; ++i) {
+      slab[i].owner = this;
+      slab[i].next = free_;
+      free_ = &slab[i];
+    }
+    slabs_.emplace_back(std::move(slab));
+  }
+
+public:
+  constexpr static size_t slab_size = 64;
+
+  // Preallocates room for at least `tasks` tasks
+  explicit TaskPool(size_t tasks = slab_size) { reserve(tasks); }
+
+  // Adds room for at least `tasks` more tasks; owner only
+  void reserve(size_t tasks) {
+    for (size_t n = 0; n < tasks; n += slab_size)
+      add_slab();
+  }
+
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  TaskNode *allocate(Task &&task) {
+    if (!free_)
+      free_ = remote_free_.exchange(nullptr, std::memory_order_acquire);
+    if (!free_)
+      add_slab();
+    TaskNode *node = free_;
+    free_ = node->next;
+    node->next = nullptr;
+    node->task = std::move(task);
+    return node;
+  }
+
+  // Returns `node`, which may come from any pool, to the pool it came from
+  void release(TaskNode *node) {
+    if (node->owner != this)
+      return give_back(node);
+    // Destroy the callables now rather than when the node is reused
+    node->task = Task();
+    node->next = free_;
+    free_ = node;
+  }
+
+  // Returns `node` to its pool from a thread that does not own that pool
+  static void give_back(TaskNode *node) {
+    node->task = Task();
+    TaskPool *owner = node->owner;
+    node->next = owner->remote_free_.load(std::memory_order_relaxed);
+    while (!owner->remote_free_.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                                      std::memory_order_relaxed)) {
+    }
+  }
+};
+
+// FIFO list of TaskNodes, linked through `TaskNode::next`
+//
+// Used to move tasks between queues (e.g., on aging promotion) by relinking
+// nodes instead of moving the tasks themselves.
+struct TaskList {
+  TaskNode *head{nullptr};
+  TaskNode *tail{nullptr};
+  size_t count{0};
+
+  struct iterator {
+    TaskNode *node;
+    Task &operator*() const { return node->task; }
+    iterator &operator++() {
+      node = node->next;
+      return *this;
+    }
+    bool operator!=(const iterator &other) const { return node != other.node; }
+  };
+
+  iterator begin() const { return iterator{head}; }
+  iterator end() const { return iterator{nullptr}; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  void push_back(TaskNode *node) {
+    node->next = nullptr;
+    if (tail)
+      tail->next = node;
+    else
+      head = node;
+    tail = node;
+    count += 1;
+  }
+
+  TaskNode *pop_front() {
+    TaskNode *node = head;
+    head = node->next;
+    if (!head)
+      tail = nullptr;
+    count -= 1;
+    node->next = nullptr;
+    return node;
+  }
+
+  // Moves every node of `other` to the back of this list
+  void splice(TaskList &other) {
+    if (other.empty())
+      return;
+    if (tail)
+      tail->next = other.head;
+    else
+      head = other.head;
+    tail = other.tail;
+    count += other.count;
+    other = TaskList();
+  }
+
+  // Returns the nodes for which `predicate(task)` holds to their pools;
+  // returns how many there were
+  template <class Predicate> size_t release_if(Predicate predicate) {
+    TaskList kept;
+    size_t released = 0;
+    while (!empty()) {
+      TaskNode *node = pop_front();
+      if (predicate(node->task)) {
+        TaskPool::give_back(node);
+        released += 1;
+      } else {
+        kept.push_back(node);
+      }
+    }
+    *this = kept;
+    return released;
+  }
+
+  // Returns every node to its pool
+  void clear() {
+    while (!empty())
+      TaskPool::give_back(pop_front());
+  }
+};
+
+} // namespace detail
+
+} // namespace psched
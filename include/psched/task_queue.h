@@ -1,76 +1,247 @@
 
 #pragma once
-#include <condition_variable>
-#include <deque>
+#include <atomic>
 #include <functional>
+#include <iterator>
 #include <mutex>
 #include <psched/queue_size.h>
+#include <psched/ring_buffer.h>
 #include <psched/task.h>
+#include <psched/task_pool.h>
+#include <vector>
 
 namespace psched {
 
-template <class queue_policy> class TaskQueue {
-  std::deque<Task> queue_;        // Internal queue data structure
-  bool done_{false};              // Set to true when no more tasks are expected
-  std::mutex mutex_;              // Mutex for the internal queue
-  std::condition_variable ready_; // Signal for when a task is enqueued
+// Unbounded task queue: an intrusive list of pooled nodes protected by a mutex
+//
+// Nodes come from the queue's own pool and go back to it when their task is
+// popped, so pushes stop allocating once the queue has reached its largest
+// size. Aging moves starved tasks to another queue by relinking their nodes.
+template <class queue_policy, bool bounded = queue_policy::bounded_or_not> class TaskQueue {
+  detail::TaskPool pool_;  // Nodes of the queued tasks
+  detail::TaskList queue_; // Internal queue data structure
+  bool done_{false};       // Set to true when no more tasks are expected
+  std::mutex mutex_;       // Mutex for the internal queue
 
 public:
+  // Tasks taken off the queue together, e.g., by `pop_arrived_before`
+  typedef detail::TaskList Batch;
+
+  // Blocks on the queue mutex; only fails if the queue is empty
   bool try_pop(Task &task) {
-    std::unique_lock<std::mutex> lock{mutex_, std::try_to_lock};
-    if (!lock || queue_.empty())
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (queue_.empty())
       return false;
-    task = std::move(queue_.front());
-    queue_.pop_front();
+    detail::TaskNode *node = queue_.pop_front();
+    task = std::move(node->task);
+    pool_.release(node);
     return true;
   }
 
-  bool try_push(Task &task) {
-    {
-      std::unique_lock<std::mutex> lock{mutex_, std::try_to_lock};
-      if (!lock)
-        return false;
-      task.save_arrival_time();
-      queue_.emplace_back(task);
-
-      // Is the queue bounded?
-      if (queue_policy::bounded_or_not) {
-        while (queue_.size() > queue_policy::maintain_size::bounded_queue_size) {
-          // Queue size greater than bound
-          if (queue_policy::maintain_size::discard_policy == discard::newest_task) {
-            queue_.pop_back(); // newest task is in the back of the queue
-          } else if (queue_policy::maintain_size::discard_policy == discard::oldest_task) {
-            queue_.pop_front(); // oldest task is in the front of the queue
-          }
-        }
-      }
-    }
-    ready_.notify_one();
+  bool empty() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    return queue_.empty();
+  }
+
+  // Blocks on the queue mutex; never fails
+  bool try_push(Task &&task, size_t &discarded) {
+    discarded = 0;
+    return try_push_if_not_full(std::move(task));
+  }
+
+  // The queue is never full
+  bool try_push_if_not_full(Task &&task) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    task.save_arrival_time();
+    queue_.push_back(pool_.allocate(std::move(task)));
     return true;
   }
 
+  // Pushes every task in [first, last) under a single lock with one arrival time
+  template <class Iterator>
+  size_t try_push_bulk(Iterator first, Iterator last, size_t &discarded) {
+    discarded = 0;
+    size_t pushed = 0;
+    std::unique_lock<std::mutex> lock{mutex_};
+    const auto now = TaskClock::now();
+    for (; first != last; ++first, ++pushed) {
+      queue_.push_back(pool_.allocate(Task(*first)));
+      queue_.tail->task.stats_.arrival_time = now;
+    }
+    return pushed;
+  }
+
+  // Links every task of `batch` at the back of the queue with one arrival
+  // time, leaving `batch` empty; never discards a task
+  size_t push_batch(Batch &batch, size_t &discarded) {
+    discarded = 0;
+    const size_t pushed = batch.size();
+    const auto now = TaskClock::now();
+    for (auto &task : batch)
+      task.stats_.arrival_time = now;
+    std::unique_lock<std::mutex> lock{mutex_};
+    queue_.splice(batch);
+    return pushed;
+  }
+
+  // Pushes every task of `batch` like `try_push_bulk`, leaving `batch` empty
+  size_t push_batch(std::vector<Task> &batch, size_t &discarded) {
+    const size_t pushed = try_push_bulk(std::make_move_iterator(batch.begin()),
+                                        std::make_move_iterator(batch.end()), discarded);
+    batch.clear();
+    return pushed;
+  }
+
   void done() {
-    {
-      std::unique_lock<std::mutex> lock{mutex_};
-      done_ = true;
+    std::unique_lock<std::mutex> lock{mutex_};
+    done_ = true;
+  }
+
+  // Moves every task that arrived before `cutoff` to the back of `starved`,
+  // oldest first; returns the number of tasks moved
+  //
+  // Tasks are pushed in arrival order, so the starved tasks are a prefix of the queue.
+  size_t pop_arrived_before(TaskStats::TimePoint cutoff, Batch &starved) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    size_t count = 0;
+    while (!queue_.empty() && queue_.head->task.stats_.arrival_time < cutoff) {
+      starved.push_back(queue_.pop_front());
+      count += 1;
     }
-    ready_.notify_all();
+    return count;
+  }
+};
+
+// Bounded task queue: a preallocated, lock-free MPMC ring buffer
+//
+// The arrival time of every task is stored alongside it in the ring so that
+// starvation can be checked without taking the task off the queue.
+template <class queue_policy> class TaskQueue<queue_policy, true> {
+  // The ring needs at least two cells; a queue of size 1 gets two cells and
+  // holds a single task by claiming `occupied_` before every push
+  constexpr static bool single = queue_policy::maintain_size::bounded_queue_size < 2;
+  constexpr static size_t capacity = single ? 2 : queue_policy::maintain_size::bounded_queue_size;
+  constexpr static discard discard_policy = queue_policy::maintain_size::discard_policy;
+
+  RingBuffer<Task, capacity> queue_;  // Internal queue data structure
+  std::atomic_bool occupied_{false}; // Size 1 only: a task is queued or being pushed
+
+  // Pushes onto the ring unless it already holds as many tasks as allowed
+  bool push(Task &&task, int64_t arrival) {
+    if (!single)
+      return queue_.try_push(std::move(task), arrival);
+    if (occupied_.exchange(true, std::memory_order_acquire))
+      return false;
+    // The last task was popped before `occupied_` was cleared, so both cells are free
+    queue_.try_push(std::move(task), arrival);
+    return true;
+  }
+
+  void popped() {
+    if (single)
+      occupied_.store(false, std::memory_order_release);
+  }
+
+public:
+  // Tasks taken off the queue together, e.g., by `pop_arrived_before`
+  typedef std::vector<Task> Batch;
+
+  bool try_pop(Task &task) {
+    if (!queue_.try_pop(task))
+      return false;
+    popped();
+    return true;
   }
 
-  template <class A> bool try_pop_if_starved(Task &task) {
-    std::unique_lock<std::mutex> lock{mutex_, std::try_to_lock};
-    if (!lock || queue_.empty())
+  // `discarded` is set to the number of tasks dropped to maintain the queue
+  // size; returns false if `task` itself was dropped
+  bool try_push(Task &&task, size_t &discarded) {
+    discarded = 0;
+    task.save_arrival_time();
+    const auto arrival = task.stats_.arrival_time.time_since_epoch().count();
+    if (discard_policy != discard::oldest_task) {
+      // If the queue is full, the incoming task is the newest task and is dropped
+      if (push(std::move(task), arrival))
+        return true;
+      discarded = 1;
+      task.drop();
       return false;
-    task = queue_.front();
-    const auto now = std::chrono::steady_clock::now();
-    const auto diff = std::chrono::duration_cast<typename A::type>(now - task.stats_.arrival_time);
-    if (diff > A::value) {
-      // pop the task so it can be enqueued at a higher priority
-      task = std::move(queue_.front());
-      queue_.pop_front();
-      return true;
     }
-    return false;
+    // Make room by discarding the oldest task(s) at the front of the queue
+    // (the incoming task is only moved from once the push succeeds)
+    Task oldest;
+    while (!push(std::move(task), arrival)) {
+      if (try_pop(oldest)) {
+        discarded += 1;
+        oldest.drop();
+      }
+    }
+    return true;
+  }
+
+  // Never discards a task; `task` is left untouched if the queue is full
+  bool try_push_if_not_full(Task &&task) {
+    task.save_arrival_time();
+    const auto arrival = task.stats_.arrival_time.time_since_epoch().count();
+    return push(std::move(task), arrival);
+  }
+
+  // Pushes every task in [first, last) with one arrival time, claiming as many
+  // ring cells as possible at once; the overflow, if any, follows the discard policy
+  template <class Iterator>
+  size_t try_push_bulk(Iterator first, Iterator last, size_t &discarded) {
+    discarded = 0;
+    const auto now = TaskClock::now();
+    const auto arrival = now.time_since_epoch().count();
+    size_t remaining = static_cast<size_t>(std::distance(first, last));
+    const size_t pushed = remaining;
+    while (!single && remaining > 0) {
+      const size_t n = queue_.try_push_n(remaining, arrival, [&] {
+        Task task(*first);
+        ++first;
+        task.stats_.arrival_time = now;
+        return task;
+      });
+      if (n == 0)
+        break;
+      remaining -= n;
+    }
+    // Queue is full (or holds a single task)
+    for (; first != last; ++first) {
+      size_t dropped = 0;
+      try_push(Task(*first), dropped);
+      discarded += dropped;
+    }
+    return pushed;
+  }
+
+  // Pushes every task of `batch` like `try_push_bulk`, leaving `batch` empty
+  size_t push_batch(Batch &batch, size_t &discarded) {
+    const size_t pushed = try_push_bulk(std::make_move_iterator(batch.begin()),
+                                        std::make_move_iterator(batch.end()), discarded);
+    batch.clear();
+    return pushed;
+  }
+
+  void done() {}
+
+  bool empty() const { return queue_.empty(); }
+
+  // Moves every task that arrived before `cutoff` to the back of `starved`,
+  // oldest first; returns the number of tasks moved
+  //
+  // Only the arrival time stored alongside each task in the ring is inspected.
+  size_t pop_arrived_before(TaskStats::TimePoint cutoff, std::vector<Task> &starved) {
+    const auto limit = cutoff.time_since_epoch().count();
+    const auto starving = [limit](int64_t arrival) { return arrival < limit; };
+    size_t count = 0;
+    Task task;
+    while (queue_.try_pop_if(task, starving)) {
+      popped();
+      starved.emplace_back(std::move(task));
+      count += 1;
+    }
+    return count;
   }
 };
 
@@ -9,6 +9,11 @@ struct TaskStats {
   TimePoint arrival_time; // time point when the task is marked as 'ready' (queued)
   TimePoint start_time;   // time point when the task is about to execute (dequeued)
   TimePoint end_time;     // time point when the task completes execution
+  // time point by which the task should complete; max() if it has no deadline
+  TimePoint deadline{TimePoint::max()};
+
+  // Did the task complete after its deadline?
+  bool missed_deadline() const { return end_time > deadline; }
 
   // Waiting time is the amount of time spent by a task waiting
   // in the ready queue for getting the CPU.
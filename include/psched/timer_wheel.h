@@ -0,0 +1,297 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <psched/aging_policy.h>
+#include <psched/task.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace psched {
+
+struct timer_resolution_tag {};
+
+// Tick length of the timer wheel behind `schedule_after`/`schedule_every`
+template <class D = std::chrono::milliseconds, size_t N = 1> struct timer_resolution {
+  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
+  static_assert(N > 0, "Timer resolution must be greater than zero");
+  typedef timer_resolution_tag option_tag;
+  typedef D type;
+  constexpr static D value = D(N);
+};
+
+// What a periodic timer does when a period elapses
+enum class timer_mode {
+  fixed_rate, // fire every `period` after the first expiration; missed periods are skipped
+  fixed_delay // fire `period` after the previous run completes
+};
+
+// Temporal behavior of a timer
+struct TimerStats {
+  size_t fired{0};    // Number of times the task was scheduled
+  // Fixed-rate periods skipped because the timer fell behind, or fixed-delay
+  // runs discarded by a bounded queue
+  size_t overruns{0};
+  // Lateness of an expiration: when the task was handed to the priority queue
+  // minus when it was due
+  std::chrono::nanoseconds last_jitter{0};
+  std::chrono::nanoseconds max_jitter{0};
+};
+
+namespace detail {
+
+struct TimerState {
+  Task task;
+  size_t level;                  // Priority level the task is scheduled at
+  uint64_t due;                  // Tick at which the timer expires next
+  uint64_t period;               // In ticks; 0 for one-shot timers
+  timer_mode mode;
+  std::atomic_bool cancelled{false};
+  std::atomic<size_t> fired{0};
+  std::atomic<size_t> overruns{0};
+  std::atomic<int64_t> last_jitter{0};
+  std::atomic<int64_t> max_jitter{0};
+
+  TimerState(Task t, size_t l, uint64_t d, uint64_t p, timer_mode m)
+      : task(std::move(t)), level(l), due(d), period(p), mode(m) {}
+};
+
+} // namespace detail
+
+// Handle to a timer created by `schedule_after`/`schedule_every`
+class Timer {
+  std::shared_ptr<detail::TimerState> state_;
+
+public:
+  Timer() = default;
+  explicit Timer(std::shared_ptr<detail::TimerState> state) : state_(std::move(state)) {}
+
+  // Stops future expirations; a task already handed to a queue still runs
+  void cancel() {
+    if (state_)
+      state_->cancelled = true;
+  }
+
+  TimerStats stats() const {
+    TimerStats stats;
+    if (state_) {
+      stats.fired = state_->fired;
+      stats.overruns = state_->overruns;
+      stats.last_jitter = std::chrono::nanoseconds(state_->last_jitter.load());
+      stats.max_jitter = std::chrono::nanoseconds(state_->max_jitter.load());
+    }
+    return stats;
+  }
+};
+
+// Hierarchical timing wheel driven by a single thread
+//
+// Four wheels of 256 slots each cover 2^32 ticks; a timer is placed in the
+// coarsest wheel that matches its distance from now and cascades down to
+// finer wheels as time advances. Inserting a timer is O(1): producers append
+// it to an incoming list which the timer thread files into the wheel.
+//
+// Expired timers are grouped by priority level and handed to `dispatch` in
+// one batch per level and tick.
+template <class Resolution, class Dispatch> class TimerWheel {
+  typedef std::chrono::steady_clock clock;
+  typedef std::shared_ptr<detail::TimerState> Entry;
+
+  constexpr static size_t wheels = 4;
+  constexpr static size_t slot_bits = 8;
+  constexpr static size_t slots = size_t(1) << slot_bits;
+  constexpr static uint64_t slot_mask = slots - 1;
+  constexpr static uint64_t max_delta = (uint64_t(1) << (wheels * slot_bits)) - 1;
+
+  Dispatch dispatch_;                           // Called with (level, first, last) batches
+  const size_t levels_;                         // Number of priority levels
+  std::vector<Entry> wheel_[wheels][slots];     // Timer thread only
+  std::vector<std::vector<Task>> expired_;      // Per-level batch of expired tasks
+  uint64_t tick_{0};                            // Current tick; timer thread only
+  size_t size_{0};                              // Timers in the wheel; timer thread only
+  const clock::time_point start_;               // Time point of tick 0
+  std::vector<Entry> incoming_;                 // Timers waiting to be filed
+  std::mutex mutex_;                            // Protects `incoming_` and `running_`
+  std::condition_variable wakeup_;              // Signals new timers and shutdown
+  bool running_{true};
+  std::thread thread_;
+
+  static uint64_t ticks(clock::duration d) {
+    const auto count = std::chrono::duration_cast<clock::duration>(Resolution::value).count();
+    return d.count() <= 0 ? 0 : static_cast<uint64_t>((d.count() + count - 1) / count);
+  }
+
+  clock::time_point time_of(uint64_t tick) const {
+    return start_ + std::chrono::duration_cast<clock::duration>(Resolution::value) * tick;
+  }
+
+  void file(Entry entry) {
+    const uint64_t due = entry->due;
+    if (due <= tick_) {
+      expire(std::move(entry));
+      return;
+    }
+    const uint64_t delta = std::min(due - tick_, max_delta);
+    size_t wheel = 0;
+    while (delta >> (slot_bits * (wheel + 1)))
+      wheel += 1;
+    // Timers beyond the last wheel are filed at its far end and re-filed later
+    const uint64_t slot_tick = (delta == max_delta) ? tick_ + max_delta : due;
+    wheel_[wheel][(slot_tick >> (slot_bits * wheel)) & slot_mask].push_back(std::move(entry));
+    size_ += 1;
+  }
+
+  void expire(Entry entry) {
+    if (entry->cancelled)
+      return;
+
+    const auto jitter =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - time_of(entry->due))
+            .count();
+    entry->last_jitter = jitter;
+    if (jitter > entry->max_jitter)
+      entry->max_jitter = jitter;
+    entry->fired += 1;
+
+    if (entry->period == 0) {
+      // Fires once, so the task can be moved out; it may be move-only
+      expired_[entry->level].push_back(std::move(entry->task));
+    } else if (entry->mode == timer_mode::fixed_rate) {
+      expired_[entry->level].push_back(entry->task);
+      entry->due += entry->period;
+      while (entry->due <= tick_) {
+        entry->due += entry->period;
+        entry->overruns += 1;
+      }
+      file(std::move(entry));
+    } else {
+      // Re-armed by the task itself once it completes, or when a bounded
+      // queue discards it
+      Entry self = entry;
+      Task task([this, self] {
+        Task task(self->task);
+        task();
+        rearm(self);
+      });
+      task.on_dropped([this, self](const TaskStats &) {
+        self->overruns += 1;
+        rearm(self);
+      });
+      expired_[entry->level].push_back(std::move(task));
+    }
+  }
+
+  void rearm(const Entry &entry) {
+    if (entry->cancelled)
+      return;
+    entry->due = ticks(clock::now() - start_) + entry->period;
+    add(entry);
+  }
+
+  void advance() {
+    tick_ += 1;
+    // Cascade coarser wheels whose slot comes due
+    for (size_t wheel = 1; wheel < wheels; ++wheel) {
+      if ((tick_ >> (slot_bits * (wheel - 1))) & slot_mask)
+        break;
+      auto &slot = wheel_[wheel][(tick_ >> (slot_bits * wheel)) & slot_mask];
+      std::vector<Entry> entries;
+      entries.swap(slot);
+      size_ -= entries.size();
+      for (auto &entry : entries)
+        file(std::move(entry));
+    }
+    auto &slot = wheel_[0][tick_ & slot_mask];
+    std::vector<Entry> entries;
+    entries.swap(slot);
+    size_ -= entries.size();
+    for (auto &entry : entries)
+      expire(std::move(entry));
+  }
+
+  void flush() {
+    for (size_t level = 0; level < levels_; ++level) {
+      auto &batch = expired_[level];
+      if (!batch.empty()) {
+        dispatch_(level, std::make_move_iterator(batch.begin()),
+                  std::make_move_iterator(batch.end()));
+        batch.clear();
+      }
+    }
+  }
+
+  void run() {
+    const auto resolution = std::chrono::duration_cast<clock::duration>(Resolution::value);
+    std::vector<Entry> incoming;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock{mutex_};
+        if (size_ == 0) {
+          // Nothing to time: sleep until a timer is added
+          wakeup_.wait(lock, [this] { return !incoming_.empty() || !running_; });
+          // Round down: a tick is only reached once it has fully elapsed, so
+          // filing a timer due at the current tick never fires it early
+          tick_ = static_cast<uint64_t>((clock::now() - start_) / resolution);
+        } else {
+          wakeup_.wait_until(lock, time_of(tick_ + 1), [this] { return !running_; });
+        }
+        if (!running_)
+          return;
+        incoming.swap(incoming_);
+      }
+
+      for (auto &entry : incoming)
+        file(std::move(entry));
+      incoming.clear();
+
+      const uint64_t now = (clock::now() - start_) / resolution;
+      while (tick_ < now)
+        advance();
+      flush();
+    }
+  }
+
+public:
+  TimerWheel(Dispatch dispatch, size_t levels)
+      : dispatch_(std::move(dispatch)), levels_(levels), expired_(levels), start_(clock::now()),
+        thread_([this] { run(); }) {}
+
+  ~TimerWheel() { stop(); }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      running_ = false;
+    }
+    wakeup_.notify_one();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  Timer add(Task task, size_t level, clock::duration delay, clock::duration period,
+            timer_mode mode) {
+    auto entry = std::make_shared<detail::TimerState>(
+        std::move(task), level, ticks(clock::now() + delay - start_), ticks(period), mode);
+    // A period shorter than one tick fires every tick
+    if (period > clock::duration::zero() && entry->period == 0)
+      entry->period = 1;
+    add(entry);
+    return Timer(std::move(entry));
+  }
+
+  void add(const Entry &entry) {
+    bool first;
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      first = incoming_.empty();
+      incoming_.push_back(entry);
+    }
+    if (first)
+      wakeup_.notify_one();
+  }
+};
+
+} // namespace psched
@@ -0,0 +1,339 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <psched/clock.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace psched {
+
+struct tracing_tag {};
+
+// Record scheduler events for `PriorityScheduler::write_trace`
+//
+// Every thread that schedules or runs tasks records into its own ring of
+// `events_per_thread` events, overwriting the oldest ones, so recording
+// never blocks and never contends with other threads. Recorded events are
+// enqueue, dequeue, start and end of each task, aging promotions, tasks
+// discarded by `maintain_size`, cancelled tasks skipped, and workers parking
+// and waking up.
+template <bool enabled = true, size_t events_per_thread = 16384> struct trace_events {
+  typedef tracing_tag option_tag;
+  constexpr static bool value = enabled;
+  constexpr static size_t capacity = events_per_thread;
+  static_assert(capacity >= 2 && (capacity & (capacity - 1)) == 0,
+                "events_per_thread must be a power of two");
+};
+
+enum class trace_event : uint8_t {
+  enqueue, // `arg` tasks pushed at `level`; the id is 0 for a batch
+  dequeue, // Task taken by a worker
+  start,   // Task started running
+  end,     // Task completed
+  promote, // Task moved up to `level` by aging, from level `arg`
+  drop,    // `arg` tasks discarded at `level` to keep a bounded queue's size
+  cancel,  // Cancelled task skipped by a worker
+  park,    // Worker went to sleep
+  unpark   // Worker woke up
+};
+
+namespace detail {
+
+// Number of the calling thread, unique for the life of the process, unlike a
+// std::thread::id, which may be given to a new thread once one has exited
+inline uint64_t thread_serial() {
+  static std::atomic<uint64_t> threads{0};
+  static thread_local const uint64_t serial = threads.fetch_add(1, std::memory_order_relaxed) + 1;
+  return serial;
+}
+
+// Events recorded by one thread
+//
+// Only the owning thread writes; readers copy the ring and keep the events
+// that cannot have been overwritten while they were copying. Fields are
+// relaxed atomics, which compile to plain stores. Once its thread has
+// exited, the ring can be handed over to a new thread with `reuse`.
+class TraceBuffer {
+  struct Slot {
+    std::atomic<int64_t> time{0};  // Nanoseconds since the tracer was created
+    std::atomic<uint64_t> id{0};   // Task id, 0 if not about a single task
+    std::atomic<uint64_t> data{0}; // Event type, level and argument, see `pack`
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  const uint64_t mask_;
+  std::atomic<uint64_t> head_{0}; // Events recorded so far
+  uint64_t next_id_;              // Last id handed out by this thread
+
+  static uint64_t pack(trace_event type, size_t level, uint64_t arg) {
+    return static_cast<uint64_t>(type) | (static_cast<uint64_t>(level) & 0xffffff) << 8 |
+           arg << 32;
+  }
+
+public:
+  struct Event {
+    int64_t time;
+    uint64_t id;
+    trace_event type;
+    size_t level;
+    uint64_t arg;
+  };
+
+  // `thread_serial` of the owner, 0 once it has given up the ring, and track
+  // name; protected by the tracer's mutex
+  uint64_t owner;
+  std::string name;
+
+  TraceBuffer(size_t capacity, size_t index, std::string name)
+      : slots_(new Slot[capacity]), mask_(capacity - 1), next_id_(uint64_t(index + 1) << 40),
+        owner(thread_serial()), name(std::move(name)) {}
+
+  // Hands the ring over to the calling thread, discarding the events of its
+  // previous owner; ids keep counting, so they stay unique
+  void reuse(std::string new_name) {
+    head_.store(0, std::memory_order_relaxed);
+    owner = thread_serial();
+    name = std::move(new_name);
+  }
+
+  // Unique across threads: the thread's index in the high bits
+  uint64_t next_id() { return ++next_id_; }
+
+  void record(int64_t time, trace_event type, uint64_t id, size_t level, uint64_t arg) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    Slot &slot = slots_[head & mask_];
+    slot.time.store(time, std::memory_order_relaxed);
+    slot.id.store(id, std::memory_order_relaxed);
+    slot.data.store(pack(type, level, arg), std::memory_order_relaxed);
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Events still in the ring, oldest first
+  std::vector<Event> events() const {
+    const uint64_t capacity = mask_ + 1;
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t first = head > capacity ? head - capacity : 0;
+    std::vector<Event> events;
+    events.reserve(head - first);
+    for (uint64_t i = first; i != head; ++i) {
+      const Slot &slot = slots_[i & mask_];
+      const uint64_t data = slot.data.load(std::memory_order_relaxed);
+      events.push_back(Event{slot.time.load(std::memory_order_relaxed),
+                             slot.id.load(std::memory_order_relaxed),
+                             static_cast<trace_event>(data & 0xff), (data >> 8) & 0xffffff,
+                             data >> 32});
+    }
+    // Slots the writer may have reused meanwhile, including the one it may
+    // be writing now, are not trusted
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t now = head_.load(std::memory_order_relaxed);
+    const uint64_t safe = now + 1 > capacity ? now + 1 - capacity : 0;
+    if (safe > first)
+      events.erase(events.begin(),
+                   events.begin() + static_cast<ptrdiff_t>(std::min(safe, head) - first));
+    return events;
+  }
+};
+
+} // namespace detail
+
+// Per-thread event rings and their export as Chrome trace-event JSON
+//
+// The JSON can be opened in Perfetto (ui.perfetto.dev) or chrome://tracing.
+// Each thread is a track; tasks are slices named after their priority level,
+// workers' sleeps are "parked" slices, and the other events are instants.
+// Every event about a task carries its id.
+//
+// A ring lives as long as the tracer. The ring of a thread that calls
+// `unregister_thread` before exiting, such as a retired worker of an elastic
+// pool, goes to the next new thread; the rings of other threads, e.g.,
+// short-lived producers, are kept with their events, so a program that keeps
+// starting new threads that record should unregister them.
+template <class Clock = TaskClock::source> class Tracer {
+  const size_t capacity_;
+  const uint64_t instance_;
+  const TaskStats::TimePoint origin_{Clock::now()};
+  mutable std::mutex mutex_; // Protects `buffers_`
+  std::vector<std::unique_ptr<detail::TraceBuffer>> buffers_;
+
+  static uint64_t next_instance() {
+    static std::atomic<uint64_t> instances{0};
+    return instances.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  struct Cache {
+    uint64_t instance;
+    detail::TraceBuffer *buffer;
+  };
+
+  // Ring of the calling thread for the last tracer it used
+  static Cache &cache() {
+    static thread_local Cache cache{0, nullptr};
+    return cache;
+  }
+
+  // Ring of the calling thread; takes over the ring of an exited thread, if
+  // any, before adding one
+  detail::TraceBuffer &local(const char *name = nullptr) {
+    Cache &cached = cache();
+    if (cached.instance == instance_)
+      return *cached.buffer;
+    std::lock_guard<std::mutex> lock{mutex_};
+    detail::TraceBuffer *buffer = nullptr;
+    size_t index = buffers_.size(); // First ring without an owner, if any
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      if (buffers_[i]->owner == detail::thread_serial())
+        buffer = buffers_[i].get();
+      else if (index == buffers_.size() && buffers_[i]->owner == 0)
+        index = i;
+    }
+    if (!buffer) {
+      std::string track = name ? name : "thread " + std::to_string(index);
+      if (index < buffers_.size())
+        buffers_[index]->reuse(std::move(track));
+      else
+        buffers_.emplace_back(new detail::TraceBuffer(capacity_, index, std::move(track)));
+      buffer = buffers_[index].get();
+    }
+    cached = Cache{instance_, buffer};
+    return *buffer;
+  }
+
+  // Writes `text` as the contents of a JSON string
+  static void write_escaped(std::ostream &out, const std::string &text) {
+    for (const char c : text) {
+      if (c == '"' || c == '\\') {
+        out << '\\' << c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+        out << escaped;
+      } else {
+        out << c;
+      }
+    }
+  }
+
+public:
+  explicit Tracer(size_t events_per_thread)
+      : capacity_(events_per_thread), instance_(next_instance()) {}
+
+  // Names the calling thread's track; call before it records anything
+  void register_thread(const std::string &name) { local(name.c_str()); }
+
+  // Gives the calling thread's ring up to a thread registered later; call
+  // right before the thread exits. Its events are written until then.
+  void unregister_thread() {
+    Cache &cached = cache();
+    if (cached.instance != instance_)
+      return;
+    std::lock_guard<std::mutex> lock{mutex_};
+    cached.buffer->owner = 0;
+    cached = Cache{0, nullptr};
+  }
+
+  // New task id, unique within this tracer
+  uint64_t next_id() { return local().next_id(); }
+
+  void record(trace_event type, uint64_t id, size_t level, uint64_t arg = 0) {
+    const auto time =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - origin_).count();
+    local().record(static_cast<int64_t>(time), type, id, level, arg);
+  }
+
+  // Writes the recorded events as Chrome trace-event JSON
+  //
+  // Threads keep recording while the trace is written; events they record
+  // meanwhile may or may not be included.
+  void write(std::ostream &out) const {
+    static const char *const instants[] = {"enqueue", "dequeue", "start", "end", "promote",
+                                           "drop",    "cancel",  "park",  "unpark"};
+    std::vector<std::pair<std::string, std::vector<detail::TraceBuffer::Event>>> threads;
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      for (auto &buffer : buffers_)
+        threads.emplace_back(buffer->name, buffer->events());
+    }
+
+    char line[256];
+    bool first = true;
+    const auto separate = [&out, &first] {
+      out << (first ? "\n" : ",\n");
+      first = false;
+    };
+    const auto emit = [&out, &separate, &line](int length) {
+      separate();
+      out.write(line, length);
+    };
+    const auto us = [](int64_t ns) { return static_cast<double>(ns) / 1000.0; };
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    for (size_t tid = 0; tid < threads.size(); ++tid) {
+      // Names are user-supplied, so they are escaped and may be of any length
+      separate();
+      out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << tid + 1
+          << ",\"args\":{\"name\":\"";
+      write_escaped(out, threads[tid].first);
+      out << "\"}}";
+      // Pair up starts with ends, and parks with unparks, into complete slices
+      const detail::TraceBuffer::Event *running = nullptr;
+      const detail::TraceBuffer::Event *parked = nullptr;
+      for (const auto &e : threads[tid].second) {
+        switch (e.type) {
+        case trace_event::start:
+          running = &e;
+          break;
+        case trace_event::end:
+          if (running && running->id == e.id) {
+            emit(snprintf(line, sizeof(line),
+                          "{\"ph\":\"X\",\"name\":\"priority %zu\",\"cat\":\"task\",\"pid\":1,"
+                          "\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%llu}}",
+                          e.level, tid + 1, us(running->time), us(e.time - running->time),
+                          static_cast<unsigned long long>(e.id)));
+          }
+          running = nullptr;
+          break;
+        case trace_event::park:
+          parked = &e;
+          break;
+        case trace_event::unpark:
+          if (parked) {
+            emit(snprintf(line, sizeof(line),
+                          "{\"ph\":\"X\",\"name\":\"parked\",\"cat\":\"worker\",\"pid\":1,"
+                          "\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                          tid + 1, us(parked->time), us(e.time - parked->time)));
+          }
+          parked = nullptr;
+          break;
+        default:
+          emit(snprintf(line, sizeof(line),
+                        "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"cat\":\"task\",\"pid\":1,"
+                        "\"tid\":%zu,\"ts\":%.3f,\"args\":{\"id\":%llu,\"level\":%zu,"
+                        "\"arg\":%llu}}",
+                        instants[static_cast<size_t>(e.type)], tid + 1, us(e.time),
+                        static_cast<unsigned long long>(e.id), e.level,
+                        static_cast<unsigned long long>(e.arg)));
+        }
+      }
+      // A task still running when the trace was taken
+      if (running) {
+        emit(snprintf(line, sizeof(line),
+                      "{\"ph\":\"B\",\"name\":\"priority %zu\",\"cat\":\"task\",\"pid\":1,"
+                      "\"tid\":%zu,\"ts\":%.3f,\"args\":{\"id\":%llu}}",
+                      running->level, tid + 1, us(running->time),
+                      static_cast<unsigned long long>(running->id)));
+      }
+    }
+    out << "\n]}\n";
+  }
+};
+
+} // namespace psched
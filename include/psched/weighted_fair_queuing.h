@@ -0,0 +1,50 @@
+#pragma once
+#include <stddef.h>
+
+namespace psched {
+
+struct service_order_tag {};
+
+// Serve the highest non-empty priority level first (the default)
+struct strict_priority {
+  typedef service_order_tag option_tag;
+  constexpr static bool value = false;
+  constexpr static size_t number_of_weights = 0;
+  static size_t weight_of(size_t) { return 1; }
+};
+
+// Share the workers between priority levels in proportion to `weights`
+//
+// Instead of always serving the highest non-empty level, a worker serves the
+// non-empty level with the lowest virtual time (stride scheduling). Each task
+// run at a level advances that level's virtual time by `cost / weight`, where
+// the cost is `Task::set_cost` (1 by default). Over any busy period, levels
+// with waiting tasks get worker time in proportion to their weights,
+// measured in tasks or in cost units. A level that was empty does not bank
+// credit for the time it was idle. Ties go to the higher level.
+//
+// `weights...` lists the weight of each level, lowest level first; with no
+// weights, level `i` has weight `i + 1`, and levels past the end of the list
+// use its last weight. Weights can be changed at runtime with
+// `PriorityScheduler::set_weight`.
+//
+// No level can starve, so the aging policy is not used. With work stealing,
+// a worker compares levels across its own deques, the shared queues, its
+// peers' deques and the producer lanes, and takes the task that starts first;
+// only within a level does its own deque come first.
+template <size_t... weights> struct weighted_fair_queuing {
+  typedef service_order_tag option_tag;
+  constexpr static bool value = true;
+  constexpr static size_t number_of_weights = sizeof...(weights);
+  static_assert(((weights > 0 && weights <= (size_t(1) << 20)) && ... && true),
+                "weights must be between 1 and 2^20");
+
+  static size_t weight_of(size_t level) {
+    if (number_of_weights == 0)
+      return level + 1;
+    const size_t list[] = {weights..., 0};
+    return list[level < number_of_weights ? level : number_of_weights - 1];
+  }
+};
+
+} // namespace psched
@@ -0,0 +1,24 @@
+#pragma once
+#include <psched/work_stealing_deque.h>
+
+namespace psched {
+
+struct work_stealing_tag {};
+
+// Per-worker task deques
+//
+// When enabled, every worker owns one Chase-Lev deque per priority level.
+// Tasks scheduled from inside a running task are pushed onto the current
+// worker's deque instead of the shared priority queues, and idle workers steal
+// from the highest priority level available across their peers.
+//
+// Priority order across workers is best effort within one stealing round, and
+// tasks in worker deques are not subject to the aging policy. With bounded
+// queues (`maintain_size`), tasks always go to the shared queues so that the
+// bound and its discard policy apply to every task.
+template <bool enabled = true> struct work_stealing {
+  typedef work_stealing_tag option_tag;
+  constexpr static bool value = enabled;
+};
+
+} // namespace psched
@@ -0,0 +1,116 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <psched/ring_buffer.h>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+namespace psched {
+
+// Chase-Lev work-stealing deque
+//
+// The owning thread pushes and pops at the bottom (LIFO, good locality) while
+// other threads steal from the top (FIFO). Elements must be trivially copyable
+// (e.g., pointers) since a thief may read a slot that the owner is racing for.
+//
+// Implements the C11 formulation from "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (Le, Pop, Cohen, Zappa Nardelli, 2013).
+template <class T> class WorkStealingDeque {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "WorkStealingDeque elements must be trivially copyable");
+
+  struct Array {
+    int64_t capacity;
+    std::unique_ptr<std::atomic<T>[]> slots;
+
+    explicit Array(int64_t c) : capacity(c), slots(new std::atomic<T>[static_cast<size_t>(c)]) {}
+
+    T get(int64_t i) const { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+    void put(int64_t i, T value) {
+      slots[i & (capacity - 1)].store(value, std::memory_order_relaxed);
+    }
+  };
+
+  alignas(cache_line_size) std::atomic<int64_t> top_{0};    // Thieves steal from here
+  alignas(cache_line_size) std::atomic<int64_t> bottom_{0}; // Owner pushes and pops here
+  std::atomic<Array *> array_;
+  // Arrays replaced by `grow`; a thief may still be reading them, so they are
+  // only freed when the deque is destroyed
+  std::vector<std::unique_ptr<Array>> retired_;
+
+  Array *grow(Array *array, int64_t top, int64_t bottom) {
+    std::unique_ptr<Array> bigger(new Array(array->capacity * 2));
+    for (int64_t i = top; i != bottom; ++i)
+      bigger->put(i, array->get(i));
+    retired_.emplace_back(array);
+    array = bigger.release();
+    array_.store(array, std::memory_order_release);
+    return array;
+  }
+
+public:
+  // `capacity` must be a power of two
+  explicit WorkStealingDeque(int64_t capacity = 64) : array_(new Array(capacity)) {}
+
+  ~WorkStealingDeque() { delete array_.load(std::memory_order_relaxed); }
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  // Owner only
+  void push(T value) {
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    const int64_t top = top_.load(std::memory_order_acquire);
+    Array *array = array_.load(std::memory_order_relaxed);
+    if (bottom - top > array->capacity - 1)
+      array = grow(array, top, bottom);
+    array->put(bottom, value);
+    // Release store (rather than a release fence) so that thieves acquiring
+    // `bottom_` also see the element
+    bottom_.store(bottom + 1, std::memory_order_release);
+  }
+
+  // Owner only
+  bool pop(T &value) {
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Array *array = array_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      // Deque was empty
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return false;
+    }
+    value = array->get(bottom);
+    if (top == bottom) {
+      // Last element: race against thieves for it
+      const bool won = top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                                    std::memory_order_relaxed);
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  // Any thread
+  bool steal(T &value) {
+    int64_t top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom)
+      return false;
+    Array *array = array_.load(std::memory_order_acquire);
+    value = array->get(top);
+    return top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed);
+  }
+
+  // Approximate; may be stale by the time the caller acts on it
+  bool empty() const {
+    return top_.load(std::memory_order_acquire) >= bottom_.load(std::memory_order_acquire);
+  }
+};
+
+} // namespace psched
@@ -0,0 +1,100 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace psched {
+
+struct worker_groups_tag {};
+
+// CPUs a worker group is pinned to; `cpus<>` leaves the workers unpinned
+template <size_t... ids> struct cpus {
+  static std::vector<size_t> list() { return {ids...}; }
+};
+
+// `count` workers that only serve priority levels >= `min_level`, pinned to `cpu_set`
+//
+// Reserving workers for the top levels bounds the head-of-line blocking that a
+// high priority task suffers behind long low priority tasks: the reserved
+// workers never pick up lower priority work, so one of them is free as soon as
+// the tasks at or above `min_level` they are running complete.
+template <size_t count, size_t min_level = 0, class cpu_set = cpus<>> struct worker_group {
+  constexpr static size_t workers = count;
+  constexpr static size_t lowest_level = min_level;
+  typedef cpu_set cpu_list;
+};
+
+// Where a worker runs and which levels it serves
+struct WorkerPlacement {
+  size_t group{0};          // Index of the worker's group
+  size_t min_level{0};      // Lowest priority level the worker serves
+  std::vector<size_t> cpus; // CPUs the worker is pinned to; empty if unpinned
+};
+
+// Partition the scheduler's workers into groups
+//
+// Workers are assigned to the groups in order; the workers left over (if
+// `threads<N>` has more than the groups need) form one more, unpinned group
+// that serves every level. For example, with `threads<8>`,
+//
+//   worker_groups<worker_group<2, 5, cpus<6, 7>>, worker_group<6, 0, cpus<0, 1, 2, 3, 4, 5>>>
+//
+// reserves two workers on CPUs 6 and 7 for levels 5 and above, and runs the
+// other six on CPUs 0-5 for every level.
+//
+// Pinning uses `pthread_setaffinity_np` and is ignored on other platforms.
+// Each worker, extra workers of an `elastic_pool` included, allocates its own
+// state (work-stealing deques and nodes, metrics) after it has been pinned, so
+// that on NUMA systems the memory is first touched by, and placed on the node
+// of, the CPU that uses it.
+template <class... groups> struct worker_groups {
+  typedef worker_groups_tag option_tag;
+
+  constexpr static size_t number_of_groups = sizeof...(groups);
+  constexpr static size_t reserved_workers = (size_t(0) + ... + groups::workers);
+  // At least one worker must serve the lowest level, or its tasks never run
+  constexpr static bool serves_every_level = ((groups::lowest_level == 0) || ... || false);
+
+  static WorkerPlacement placement(size_t worker) {
+    const size_t counts[] = {groups::workers..., 0};
+    const size_t min_levels[] = {groups::lowest_level..., 0};
+    const std::vector<size_t> cpu_lists[] = {groups::cpu_list::list()..., {}};
+    WorkerPlacement result;
+    size_t first = 0;
+    for (result.group = 0; result.group < number_of_groups; ++result.group) {
+      first += counts[result.group];
+      if (worker < first)
+        break;
+    }
+    result.min_level = min_levels[result.group];
+    result.cpus = cpu_lists[result.group];
+    return result;
+  }
+
+  // Lowest priority level served by `group`; the last group serves every level
+  static size_t min_level_of(size_t group) {
+    const size_t min_levels[] = {groups::lowest_level..., 0};
+    return min_levels[group];
+  }
+};
+
+// Pin the calling thread to `cpus`; returns false if pinning is not supported or failed
+inline bool pin_current_thread(const std::vector<size_t> &cpus) {
+  if (cpus.empty())
+    return true;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t cpu : cpus)
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+} // namespace psched
@@ -27,12 +27,7 @@ int main() {
         std::cout << "Turnaround time = " << stats.turnaround_time() << "ms\n";
       });
 
-  auto timer_a = std::thread([&scheduler, &a]() {
-    while (true) {
-      scheduler.schedule<priority<0>>(a);
-      std::this_thread::sleep_for(std::chrono::milliseconds(250));
-    }
-  });
+  auto timer_a = scheduler.schedule_every<priority<0>>(std::chrono::milliseconds(250), a);
 
   Task b(
       // Task action
@@ -45,12 +40,7 @@ int main() {
         std::cout << "Turnaround time = " << stats.turnaround_time() << "ms\n";
       });
 
-  auto timer_b = std::thread([&scheduler, &b]() {
-    while (true) {
-      scheduler.schedule<priority<1>>(b);
-      std::this_thread::sleep_for(std::chrono::milliseconds(500));
-    }
-  });
+  auto timer_b = scheduler.schedule_every<priority<1>>(std::chrono::milliseconds(500), b);
 
   Task c(
       // Task action
@@ -63,14 +53,10 @@ int main() {
         std::cout << "Turnaround time = " << stats.turnaround_time() << "ms\n";
       });
 
-  auto timer_c = std::thread([&scheduler, &c]() {
-    while (true) {
-      scheduler.schedule<priority<2>>(c);
-      std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-    }
-  });
+  auto timer_c = scheduler.schedule_every<priority<2>>(std::chrono::milliseconds(1000), c);
 
-  timer_a.join();
-  timer_b.join();
-  timer_c.join();
+  // Timers run on the scheduler's timer thread; keep the process alive
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
 }
\ No newline at end of file
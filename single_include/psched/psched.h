@@ -9,6 +9,11 @@ struct TaskStats {
   TimePoint arrival_time; // time point when the task is marked as 'ready' (queued)
   TimePoint start_time;   // time point when the task is about to execute (dequeued)
   TimePoint end_time;     // time point when the task completes execution
+  // time point by which the task should complete; max() if it has no deadline
+  TimePoint deadline{TimePoint::max()};
+
+  // Did the task complete after its deadline?
+  bool missed_deadline() const { return end_time > deadline; }
 
   // Waiting time is the amount of time spent by a task waiting
   // in the ready queue for getting the CPU.
@@ -33,330 +38,5347 @@ struct TaskStats {
   }
 };
 
+} // namespace psched#pragma once
+#include <atomic>
+#include <memory>
+
+namespace psched {
+
+namespace detail {
+struct CancellationState {
+  std::atomic_bool cancelled{false};
+};
+} // namespace detail
+
+// Shared flag used to withdraw scheduled tasks and to stop running ones
+//
+// A task with a token (see `Task::set_cancellation`) that is cancelled while
+// it waits in a queue is skipped by the worker that dequeues it, which calls
+// the task's `on_dropped` callback: cancelling is O(1) and never touches the
+// queue. A task that is already running keeps running, but can poll
+// `is_cancelled()` on a copy of the token and return early. Copies share the
+// same flag, so one token can cancel every task spawned for a request.
+class CancellationToken {
+  std::shared_ptr<detail::CancellationState> state_{
+      std::make_shared<detail::CancellationState>()};
+
+  friend class Task;
+
+public:
+  void cancel() { state_->cancelled.store(true, std::memory_order_release); }
+
+  bool is_cancelled() const { return state_->cancelled.load(std::memory_order_acquire); }
+};
+
+} // namespace psched
+#pragma once
+#include <atomic>
+#include <chrono>
+// #include <psched/task_stats.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PSCHED_HAS_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define PSCHED_HAS_TSC 1
+#endif
+
+namespace psched {
+
+// Reads std::chrono::steady_clock
+struct steady_clock_source {
+  static TaskStats::TimePoint now() { return std::chrono::steady_clock::now(); }
+};
+
+// Reads the CPU's time stamp counter, calibrated against steady_clock
+//
+// A `rdtsc` costs a fraction of a `clock_gettime` call. The counter is
+// calibrated once, on first use, and converted to steady_clock time points,
+// so timestamps from both clocks can be compared. Requires an invariant TSC
+// (any x86 CPU from the last decade); falls back to steady_clock on other
+// architectures.
+struct tsc_clock_source {
+#if defined(PSCHED_HAS_TSC)
+private:
+  struct Calibration {
+    TaskStats::TimePoint base;
+    uint64_t base_ticks;
+    double nanoseconds_per_tick;
+
+    Calibration() {
+      // Measure the tick rate over ~2ms of steady_clock time
+      const auto start = std::chrono::steady_clock::now();
+      const uint64_t start_ticks = __rdtsc();
+      auto end = start;
+      while (end - start < std::chrono::milliseconds(2))
+        end = std::chrono::steady_clock::now();
+      const uint64_t end_ticks = __rdtsc();
+      nanoseconds_per_tick =
+          static_cast<double>(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) /
+          static_cast<double>(end_ticks - start_ticks);
+      base = end;
+      base_ticks = end_ticks;
+    }
+  };
+
+public:
+  static TaskStats::TimePoint now() {
+    static const Calibration calibration;
+    const auto ticks = static_cast<int64_t>(__rdtsc() - calibration.base_ticks);
+    const auto ns = static_cast<int64_t>(static_cast<double>(ticks) *
+                                         calibration.nanoseconds_per_tick);
+    return calibration.base + std::chrono::duration_cast<TaskStats::TimePoint::duration>(
+                                  std::chrono::nanoseconds(ns));
+  }
+#else
+  static TaskStats::TimePoint now() { return std::chrono::steady_clock::now(); }
+#endif
+};
+
+// Reads a time point published every `N` `D`s by a ticker thread
+//
+// Reading the clock is a single relaxed load, at the cost of timestamps that
+// lag by about one period (more if the OS sleeps coarsely). The ticker
+// thread is started on first use and runs until the program exits.
+template <class D = std::chrono::microseconds, size_t N = 100> struct coarse_clock_source {
+private:
+  struct Ticker {
+    std::atomic<TaskStats::TimePoint::rep> now{
+        std::chrono::steady_clock::now().time_since_epoch().count()};
+    std::atomic_bool running{true};
+    std::thread thread{[this] {
+      while (running.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(D(N));
+        now.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                  std::memory_order_relaxed);
+      }
+    }};
+
+    ~Ticker() {
+      running = false;
+      thread.join();
+    }
+  };
+
+public:
+  static TaskStats::TimePoint now() {
+    static Ticker ticker;
+    return TaskStats::TimePoint(
+        TaskStats::TimePoint::duration(ticker.now.load(std::memory_order_relaxed)));
+  }
+};
+
+} // namespace psched
+
+// Clock used to timestamp tasks: `psched::steady_clock_source` (default),
+// `psched::tsc_clock_source` or `psched::coarse_clock_source<D, N>`
+// Define before including psched to change the clock
+#ifndef PSCHED_CLOCK
+#define PSCHED_CLOCK psched::steady_clock_source
+#endif
+
+// Define as 0 before including psched to compile out task timestamps
+#ifndef PSCHED_TASK_TIMESTAMPS
+#define PSCHED_TASK_TIMESTAMPS 1
+#endif
+
+namespace psched {
+
+// Clock read by tasks and queues for TaskStats timestamps
+//
+// With PSCHED_TASK_TIMESTAMPS set to 0, `now()` returns the epoch without
+// reading any clock: arrival, start and end times are left unset, aging is
+// disabled and deadline misses are not detected. Deadlines set relative to
+// now still read `source`.
+struct TaskClock {
+  typedef PSCHED_CLOCK source;
+  constexpr static bool enabled = PSCHED_TASK_TIMESTAMPS != 0;
+
+  static TaskStats::TimePoint now() {
+    if (enabled)
+      return source::now();
+    return TaskStats::TimePoint();
+  }
+};
+
 } // namespace psched
+
 #pragma once
 #include <stddef.h>
 
 namespace psched {
 
-enum class discard { oldest_task, newest_task };
+// What a bounded queue does when a task is scheduled while it is full
+//
+// `oldest_task` and `newest_task` discard a task (see `Task::on_dropped`);
+// `block` makes `schedule` wait until a worker has made room.
+enum class discard { oldest_task, newest_task, block };
 
 template <size_t queue_size, discard policy> struct maintain_size {
   constexpr static size_t bounded_queue_size = queue_size;
   constexpr static discard discard_policy = policy;
 };
 
+// Use as `queues<dynamic_queues>` to choose the number of priority levels
+// when the scheduler is constructed
+constexpr size_t dynamic_queues = 0;
+
 template <size_t count, class M = maintain_size<0, discard::oldest_task>> struct queues {
   constexpr static bool bounded_or_not = (M::bounded_queue_size > 0);
   constexpr static size_t number_of_queues = count;
   typedef M maintain_size;
 };
 
+} // namespace psched#pragma once
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// Inline storage (in bytes) for each callable held by a psched::Task
+// Define before including psched to fit larger lambda captures
+#ifndef PSCHED_TASK_INLINE_SIZE
+#define PSCHED_TASK_INLINE_SIZE 64
+#endif
+
+namespace psched {
+
+template <class Signature, size_t capacity = PSCHED_TASK_INLINE_SIZE,
+          size_t alignment = alignof(std::max_align_t)>
+class InplaceFunction;
+
+// Type-erased callable with fixed-size inline storage
+//
+// Like std::function, but a callable that fits in `capacity` bytes (and can
+// be moved without throwing) is stored inside the object, so constructing,
+// copying and moving it never allocate. Larger callables are stored on the
+// heap; moving them only moves a pointer.
+//
+// Move-only callables are accepted too; copying an InplaceFunction that holds
+// one throws std::logic_error.
+template <class R, class... Args, size_t capacity, size_t alignment>
+class InplaceFunction<R(Args...), capacity, alignment> {
+  static_assert(capacity >= sizeof(void *), "capacity must fit a pointer");
+
+  struct VTable {
+    R (*invoke)(void *, Args &&...);
+    void (*copy)(void *, const void *); // Null if the callable is move-only
+    void (*move)(void *, void *) noexcept;
+    void (*destroy)(void *) noexcept;
+  };
+
+  // Move-only callables get no `copy` in their vtable
+  template <class F> using copyable = std::is_copy_constructible<F>;
+
+  template <class F> struct Operations {
+    static R invoke(void *f, Args &&... args) {
+      return (*static_cast<F *>(f))(std::forward<Args>(args)...);
+    }
+    static void copy(void *dst, const void *src) {
+      if constexpr (copyable<F>::value)
+        new (dst) F(*static_cast<const F *>(src));
+    }
+    static void move(void *dst, void *src) noexcept {
+      new (dst) F(std::move(*static_cast<F *>(src)));
+      static_cast<F *>(src)->~F();
+    }
+    static void destroy(void *f) noexcept { static_cast<F *>(f)->~F(); }
+
+    constexpr static VTable vtable{&invoke, copyable<F>::value ? &copy : nullptr, &move,
+                                   &destroy};
+  };
+
+  // Operations on a callable stored on the heap; the storage holds a `F *`
+  template <class F> struct HeapOperations {
+    static F *&get(void *f) { return *static_cast<F **>(f); }
+    static R invoke(void *f, Args &&... args) { return (*get(f))(std::forward<Args>(args)...); }
+    static void copy(void *dst, const void *src) {
+      if constexpr (copyable<F>::value)
+        new (dst) F *(new F(**static_cast<F *const *>(src)));
+    }
+    static void move(void *dst, void *src) noexcept { new (dst) F *(get(src)); }
+    static void destroy(void *f) noexcept { delete get(f); }
+
+    constexpr static VTable vtable{&invoke, copyable<F>::value ? &copy : nullptr, &move,
+                                   &destroy};
+  };
+
+  template <class F>
+  using fits_inline =
+      std::integral_constant<bool, sizeof(F) <= capacity && alignment % alignof(F) == 0 &&
+                                       std::is_nothrow_move_constructible<F>::value>;
+
+  // Empty function pointers, std::functions, etc. produce an empty InplaceFunction
+  template <class F> static auto is_null(const F &f, int) -> decltype(f == nullptr) {
+    return f == nullptr;
+  }
+  template <class F> static bool is_null(const F &, long) { return false; }
+
+  const VTable *vtable_{nullptr};
+  typename std::aligned_storage<capacity, alignment>::type storage_;
+
+  template <class D, class F> void store(F &&f, std::true_type) {
+    new (&storage_) D(std::forward<F>(f));
+    vtable_ = &Operations<D>::vtable;
+  }
+
+  template <class D, class F> void store(F &&f, std::false_type) {
+    new (&storage_) D *(new D(std::forward<F>(f)));
+    vtable_ = &HeapOperations<D>::vtable;
+  }
+
+  void reset() noexcept {
+    if (vtable_) {
+      vtable_->destroy(&storage_);
+      vtable_ = nullptr;
+    }
+  }
+
+public:
+  InplaceFunction() noexcept {}
+
+  InplaceFunction(std::nullptr_t) noexcept {}
+
+  template <class F, class D = typename std::decay<F>::type,
+            class = typename std::enable_if<!std::is_same<D, InplaceFunction>::value>::type>
+  InplaceFunction(F &&f) {
+    if (is_null(f, 0))
+      return;
+    store<D>(std::forward<F>(f), fits_inline<D>());
+  }
+
+  InplaceFunction(const InplaceFunction &other) {
+    if (other.vtable_) {
+      if (!other.vtable_->copy)
+        throw std::logic_error("psched: cannot copy a move-only callable");
+      other.vtable_->copy(&storage_, &other.storage_);
+      vtable_ = other.vtable_;
+    }
+  }
+
+  InplaceFunction(InplaceFunction &&other) noexcept {
+    if (other.vtable_) {
+      other.vtable_->move(&storage_, &other.storage_);
+      vtable_ = other.vtable_;
+      other.vtable_ = nullptr;
+    }
+  }
+
+  InplaceFunction &operator=(const InplaceFunction &other) {
+    if (this != &other)
+      *this = InplaceFunction(other);
+    return *this;
+  }
+
+  InplaceFunction &operator=(InplaceFunction &&other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.vtable_) {
+        other.vtable_->move(&storage_, &other.storage_);
+        vtable_ = other.vtable_;
+        other.vtable_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  ~InplaceFunction() { reset(); }
+
+  explicit operator bool() const noexcept { return vtable_ != nullptr; }
+
+  // False if the callable is move-only
+  bool can_copy() const noexcept { return !vtable_ || vtable_->copy; }
+
+  R operator()(Args... args) const {
+    if (!vtable_)
+      throw std::bad_function_call();
+    return vtable_->invoke(const_cast<void *>(static_cast<const void *>(&storage_)),
+                           std::forward<Args>(args)...);
+  }
+};
+
 } // namespace psched
+
 #pragma once
-#include <atomic>
-#include <functional>
+#include <exception>
+#include <memory>
+// #include <psched/cancellation.h>
+// #include <psched/clock.h>
+// #include <psched/inplace_function.h>
 // #include <psched/task_stats.h>
+#include <stdint.h>
+#include <utility>
 
 namespace psched {
 
+namespace detail {
+template <class Scheduler> class GraphRun;
+class StrandTable;
+} // namespace detail
+
 class Task {
+public:
+  typedef InplaceFunction<void()> Function;
+  typedef InplaceFunction<void(const TaskStats &)> CompletionFunction;
+  typedef InplaceFunction<void(const char *)> ErrorFunction;
+
+private:
   // Called when the task is (finally) executed by an executor thread
-  std::function<void()> task_main_;
+  Function task_main_;
 
   // Called after the task has completed executing.
   // In case of exception, `task_error` is called first
   //
   // TaskStats argument can be used to get task computation_time
   // and task response_time.
-  std::function<void(const TaskStats &)> task_end_;
+  CompletionFunction task_end_;
 
   // Called if `task_main()` throws an exception
-  std::function<void(const char *)> task_error_;
+  ErrorFunction task_error_;
+
+  // Called after the task has completed executing past its deadline,
+  // before `task_end`
+  CompletionFunction task_deadline_miss_;
+
+  // Called instead of `task_main` if the task is discarded to maintain the
+  // size of a bounded queue, or skipped because it was cancelled
+  CompletionFunction task_dropped_;
 
   // Temporal behavior of Task
   // Stats includes arrival_time, start_time, end_time
   // Stats can be used to calculate waiting_time, burst_time, turnaround_time
   TaskStats stats_;
 
-  template <class enforce_queue_size> friend class TaskQueue;
+  // Set by `CancellationToken::cancel()`; null if the task cannot be cancelled
+  std::shared_ptr<detail::CancellationState> cancellation_;
+
+  // Share of its level's weight used by the task (weighted fair queuing only)
+  uint32_t cost_{1};
+
+  // Identifies the task in traces (trace_events only), 0 until it is scheduled
+  uint64_t trace_id_{0};
+
+  template <class queue_policy, bool bounded> friend class TaskQueue;
+  template <class queue_policy> friend class DeadlineQueue;
+  template <class Scheduler> friend class detail::GraphRun;
+  friend class detail::StrandTable;
+  template <class threads, class queues, class aging_policy, class... options>
+  friend class PriorityScheduler;
 
 protected:
-  void save_arrival_time() { stats_.arrival_time = std::chrono::steady_clock::now(); }
+  void save_arrival_time() { stats_.arrival_time = TaskClock::now(); }
 
-public:
-  Task(const std::function<void()> &task_main = {},
-       const std::function<void(const TaskStats &)> &task_end = {},
-       const std::function<void(const char *)> &task_error = {})
-      : task_main_(task_main), task_end_(task_end), task_error_(task_error) {}
+  void drop() {
+    if (task_dropped_)
+      task_dropped_(stats_);
+  }
 
-  Task(const Task &other) {
-    task_main_ = other.task_main_;
-    task_end_ = other.task_end_;
-    task_error_ = other.task_error_;
-    stats_ = other.stats_;
+  // False if one of the callables is move-only, so copying the task throws
+  bool can_copy() const {
+    return task_main_.can_copy() && task_end_.can_copy() && task_error_.can_copy() &&
+           task_deadline_miss_.can_copy() && task_dropped_.can_copy();
   }
 
-  Task &operator=(Task other) {
-    std::swap(task_main_, other.task_main_);
-    std::swap(task_end_, other.task_end_);
-    std::swap(task_error_, other.task_error_);
-    std::swap(stats_, other.stats_);
-    return *this;
+public:
+  // Callables of up to PSCHED_TASK_INLINE_SIZE bytes are stored inline, so
+  // creating, moving and copying a Task with them never allocates. Callables
+  // may be move-only, e.g., capture a std::unique_ptr; copying a Task that
+  // holds one throws std::logic_error.
+  Task(Function task_main = {}, CompletionFunction task_end = {}, ErrorFunction task_error = {})
+      : task_main_(std::move(task_main)), task_end_(std::move(task_end)),
+        task_error_(std::move(task_error)) {}
+
+  void on_execute(Function fn) { task_main_ = std::move(fn); }
+
+  void on_complete(CompletionFunction fn) { task_end_ = std::move(fn); }
+
+  void on_error(ErrorFunction fn) { task_error_ = std::move(fn); }
+
+  void on_deadline_miss(CompletionFunction fn) { task_deadline_miss_ = std::move(fn); }
+
+  void on_dropped(CompletionFunction fn) { task_dropped_ = std::move(fn); }
+
+  // Absolute time point by which the task should complete
+  //
+  // With the `earliest_deadline_first` option, tasks at the same priority
+  // level run in order of their deadlines.
+  void set_deadline(TaskStats::TimePoint deadline) { stats_.deadline = deadline; }
+
+  // Deadline relative to now
+  template <class Rep, class Period> void set_deadline(std::chrono::duration<Rep, Period> d) {
+    stats_.deadline = TaskClock::source::now() +
+                      std::chrono::duration_cast<std::chrono::steady_clock::duration>(d);
   }
 
-  void on_execute(const std::function<void()> &fn) { task_main_ = fn; }
+  TaskStats::TimePoint deadline() const { return stats_.deadline; }
 
-  void on_complete(const std::function<void(const TaskStats &)> &fn) { task_end_ = fn; }
+  // Skip the task if `token` is cancelled before it starts; a skipped task
+  // calls its `on_dropped` callback instead
+  void set_cancellation(const CancellationToken &token) { cancellation_ = token.state_; }
 
-  void on_error(const std::function<void(const char *)> &fn) { task_error_ = fn; }
+  bool is_cancelled() const {
+    return cancellation_ && cancellation_->cancelled.load(std::memory_order_acquire);
+  }
+
+  // Estimated cost of the task, e.g., in microseconds; with the
+  // `weighted_fair_queuing` option, a task of cost 2 uses as much of its
+  // level's share as two tasks of cost 1. A cost of 0 counts as 1, so that
+  // every task uses up some of its level's share.
+  void set_cost(uint32_t cost) { cost_ = cost > 0 ? cost : 1; }
+
+  uint32_t cost() const { return cost_; }
 
   void operator()() {
-    stats_.start_time = std::chrono::steady_clock::now();
+    if (is_cancelled()) {
+      drop();
+      return;
+    }
+    stats_.start_time = TaskClock::now();
     try {
       if (task_main_) {
         task_main_();
       }
-      stats_.end_time = std::chrono::steady_clock::now();
+      stats_.end_time = TaskClock::now();
     } catch (std::exception &e) {
-      stats_.end_time = std::chrono::steady_clock::now();
+      stats_.end_time = TaskClock::now();
       if (task_error_) {
         task_error_(e.what());
       }
     } catch (...) {
-      stats_.end_time = std::chrono::steady_clock::now();
+      stats_.end_time = TaskClock::now();
       if (task_error_) {
         task_error_("Unknown exception");
       }
     }
+    if (task_deadline_miss_ && stats_.missed_deadline()) {
+      task_deadline_miss_(stats_);
+    }
     if (task_end_) {
       task_end_(stats_);
     }
   }
 };
 
-} // namespace psched
-#pragma once
-#include <condition_variable>
-#include <deque>
-#include <functional>
-#include <mutex>
-// #include <psched/queue_size.h>
+} // namespace psched#pragma once
+#include <atomic>
+#include <memory>
 // #include <psched/task.h>
+#include <stddef.h>
+#include <utility>
+#include <vector>
 
 namespace psched {
 
-template <class queue_policy> class TaskQueue {
-  std::deque<Task> queue_;        // Internal queue data structure
-  bool done_{false};              // Set to true when no more tasks are expected
-  std::mutex mutex_;              // Mutex for the internal queue
-  std::condition_variable ready_; // Signal for when a task is enqueued
+namespace detail {
+
+class TaskPool;
+
+// A task in a pool's slab, linked into a queue or a free list
+struct TaskNode {
+  Task task;
+  TaskNode *next{nullptr};
+  TaskPool *owner{nullptr}; // Pool whose slab the node lives in
+};
+
+// Slab allocator of TaskNodes
+//
+// Nodes are allocated `slab_size` at a time and are only returned to the
+// system when the pool is destroyed, so a scheduler in a steady state never
+// calls malloc to enqueue a task. One thread at a time allocates and
+// releases (the owner, or whoever holds the lock protecting the pool); any
+// other thread hands nodes back through a lock-free stack, which the owner
+// takes over with a single exchange once its own free list runs out.
+class TaskPool {
+  std::vector<std::unique_ptr<TaskNode[]>> slabs_;
+  TaskNode *free_{nullptr};                      // Owner only
+  std::atomic<TaskNode *> remote_free_{nullptr}; // Nodes released by other threads
+
+  void add_slab() {
+    std::unique_ptr<TaskNode[]> slab(new TaskNode[slab_size]);
+    for (size_t i = 0; i < slab_size; ++i) {
+      slab[i].owner = this;
+      slab[i].next = free_;
+      free_ = &slab[i];
+    }
+    slabs_.emplace_back(std::move(slab));
+  }
 
 public:
-  bool try_pop(Task &task) {
-    std::unique_lock<std::mutex> lock{mutex_, std::try_to_lock};
-    if (!lock || queue_.empty())
-      return false;
-    task = std::move(queue_.front());
-    queue_.pop_front();
-    return true;
+  constexpr static size_t slab_size = 64;
+
+  // Preallocates room for at least `tasks` tasks
+  explicit TaskPool(size_t tasks = slab_size) { reserve(tasks); }
+
+  // Adds room for at least `tasks` more tasks; owner only
+  void reserve(size_t tasks) {
+    for (size_t n = 0; n < tasks; n += slab_size)
+      add_slab();
   }
 
-  bool try_push(Task &task) {
-    {
-      std::unique_lock<std::mutex> lock{mutex_, std::try_to_lock};
-      if (!lock)
-        return false;
-      task.save_arrival_time();
-      queue_.emplace_back(task);
-
-      // Is the queue bounded?
-      if (queue_policy::bounded_or_not) {
-        while (queue_.size() > queue_policy::maintain_size::bounded_queue_size) {
-          // Queue size greater than bound
-          if (queue_policy::maintain_size::discard_policy == discard::newest_task) {
-            queue_.pop_back(); // newest task is in the back of the queue
-          } else if (queue_policy::maintain_size::discard_policy == discard::oldest_task) {
-            queue_.pop_front(); // oldest task is in the front of the queue
-          }
-        }
-      }
-    }
-    ready_.notify_one();
-    return true;
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  TaskNode *allocate(Task &&task) {
+    if (!free_)
+      free_ = remote_free_.exchange(nullptr, std::memory_order_acquire);
+    if (!free_)
+      add_slab();
+    TaskNode *node = free_;
+    free_ = node->next;
+    node->next = nullptr;
+    node->task = std::move(task);
+    return node;
   }
 
-  void done() {
-    {
-      std::unique_lock<std::mutex> lock{mutex_};
-      done_ = true;
-    }
-    ready_.notify_all();
+  // Returns `node`, which may come from any pool, to the pool it came from
+  void release(TaskNode *node) {
+    if (node->owner != this)
+      return give_back(node);
+    // Destroy the callables now rather than when the node is reused
+    node->task = Task();
+    node->next = free_;
+    free_ = node;
   }
 
-  template <class A> bool try_pop_if_starved(Task &task) {
-    std::unique_lock<std::mutex> lock{mutex_, std::try_to_lock};
-    if (!lock || queue_.empty())
-      return false;
-    task = queue_.front();
-    const auto now = std::chrono::steady_clock::now();
-    const auto diff = std::chrono::duration_cast<typename A::type>(now - task.stats_.arrival_time);
-    if (diff > A::value) {
-      // pop the task so it can be enqueued at a higher priority
-      task = std::move(queue_.front());
-      queue_.pop_front();
-      return true;
+  // Returns `node` to its pool from a thread that does not own that pool
+  static void give_back(TaskNode *node) {
+    node->task = Task();
+    TaskPool *owner = node->owner;
+    node->next = owner->remote_free_.load(std::memory_order_relaxed);
+    while (!owner->remote_free_.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                                      std::memory_order_relaxed)) {
     }
-    return false;
   }
 };
 
-} // namespace psched
-#pragma once
-#include <chrono>
+// FIFO list of TaskNodes, linked through `TaskNode::next`
+//
+// Used to move tasks between queues (e.g., on aging promotion) by relinking
+// nodes instead of moving the tasks themselves.
+struct TaskList {
+  TaskNode *head{nullptr};
+  TaskNode *tail{nullptr};
+  size_t count{0};
 
-namespace psched {
+  struct iterator {
+    TaskNode *node;
+    Task &operator*() const { return node->task; }
+    iterator &operator++() {
+      node = node->next;
+      return *this;
+    }
+    bool operator!=(const iterator &other) const { return node != other.node; }
+  };
 
-template <typename T> struct is_chrono_duration { static constexpr bool value = false; };
+  iterator begin() const { return iterator{head}; }
+  iterator end() const { return iterator{nullptr}; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
 
-template <typename Rep, typename Period>
-struct is_chrono_duration<std::chrono::duration<Rep, Period>> {
-  static constexpr bool value = true;
-};
+  void push_back(TaskNode *node) {
+    node->next = nullptr;
+    if (tail)
+      tail->next = node;
+    else
+      head = node;
+    tail = node;
+    count += 1;
+  }
 
-template <class D = std::chrono::milliseconds, size_t P = 0> struct task_starvation_after {
-  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
-  typedef D type;
-  constexpr static D value = D(P);
-};
+  TaskNode *pop_front() {
+    TaskNode *node = head;
+    head = node->next;
+    if (!head)
+      tail = nullptr;
+    count -= 1;
+    node->next = nullptr;
+    return node;
+  }
 
-template <size_t P> struct increment_priority_by { constexpr static size_t value = P; };
+  // Moves every node of `other` to the back of this list
+  void splice(TaskList &other) {
+    if (other.empty())
+      return;
+    if (tail)
+      tail->next = other.head;
+    else
+      head = other.head;
+    tail = other.tail;
+    count += other.count;
+    other = TaskList();
+  }
 
-template <class T = task_starvation_after<>, class I = increment_priority_by<1>>
-struct aging_policy {
-  typedef T task_starvation_after;
-  typedef I increment_priority_by;
+  // Returns the nodes for which `predicate(task)` holds to their pools;
+  // returns how many there were
+  template <class Predicate> size_t release_if(Predicate predicate) {
+    TaskList kept;
+    size_t released = 0;
+    while (!empty()) {
+      TaskNode *node = pop_front();
+      if (predicate(node->task)) {
+        TaskPool::give_back(node);
+        released += 1;
+      } else {
+        kept.push_back(node);
+      }
+    }
+    *this = kept;
+    return released;
+  }
+
+  // Returns every node to its pool
+  void clear() {
+    while (!empty())
+      TaskPool::give_back(pop_front());
+  }
 };
 
+} // namespace detail
+
 } // namespace psched
 #pragma once
-#include <array>
 #include <atomic>
-#include <condition_variable>
-#include <mutex>
-// #include <psched/aging_policy.h>
-// #include <psched/task.h>
-// #include <psched/task_queue.h>
-#include <thread>
-#include <vector>
+#include <memory>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
 
 namespace psched {
 
-template <size_t T> struct threads { constexpr static size_t value = T; };
+// Size of a cache line, used to pad shared atomics and avoid false sharing
+constexpr size_t cache_line_size = 64;
 
-template <size_t P> struct priority { constexpr static size_t value = P; };
+// Bounded, lock-free, multi-producer multi-consumer ring buffer
+//
+// Based on Dmitry Vyukov's sequence-slot algorithm: every cell carries a
+// sequence number that tells producers and consumers whether the cell is
+// ready to be written or read for the current lap around the ring.
+//
+// Every cell also carries an atomic `key` (e.g., an arrival timestamp) that
+// consumers can inspect without taking ownership of the element.
+template <class T, size_t capacity> class RingBuffer {
+  // With a single cell, a full cell and a cell free for the next lap would
+  // carry the same sequence number
+  static_assert(capacity > 1, "RingBuffer capacity must be at least 2");
 
-template <class threads, class queues, class aging_policy> class PriorityScheduler {
-  constexpr static size_t priority_levels = queues::number_of_queues;
+  struct alignas(cache_line_size) Cell {
+    std::atomic_size_t sequence{0};
+    std::atomic<int64_t> key{0};
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
 
-  std::vector<std::thread> threads_{};                               // Scheduler thread pool
-  std::array<TaskQueue<queues>, priority_levels> priority_queues_{}; // Array of task queues
-  std::atomic_bool running_{false};                                  // Is the scheduler running?
-  std::mutex mutex_{};                                               // Mutex to protect `enqueued_`
-  std::condition_variable ready_{}; // Signal to notify task enqueued
-  std::atomic_size_t enqueued_{0};  // Incremented when a task is scheduled
+    T *get() { return reinterpret_cast<T *>(&storage); }
+  };
 
-  void run() {
-    while (running_ || enqueued_ > 0) {
-      // Wait for the `enqueued` signal
-      {
-        std::unique_lock<std::mutex> lock{mutex_};
-        ready_.wait(lock, [this] { return enqueued_ > 0 || !running_; });
-      }
-
-      Task t;
-
-      // Handle task starvation at lower priorities
-      // Modulate priorities based on age
-      // Start from the lowest priority till (highest_priority - 1)
-      for (size_t i = 0; i < priority_levels - 1; i++) {
-        // Check if the front of the queue has a starving task
-        if (priority_queues_[i]
-                .template try_pop_if_starved<typename aging_policy::task_starvation_after>(t)) {
-          // task has been starved, reschedule at a higher priority
-          while (running_) {
-            const auto new_priority =
-                std::min(i + aging_policy::increment_priority_by::value, priority_levels - 1);
-            if (priority_queues_[new_priority].try_push(t)) {
-              break;
-            }
-          }
-        }
-      }
+  std::unique_ptr<Cell[]> cells_;                             // Preallocated storage
+  alignas(cache_line_size) std::atomic_size_t enqueue_pos_{0}; // Next cell to write
+  alignas(cache_line_size) std::atomic_size_t dequeue_pos_{0}; // Next cell to read
 
-      // Run the highest priority ready task
-      bool dequeued = false;
-
-      while (!dequeued) {
-        for (size_t i = priority_levels; i > 0; --i) {
-          // Try to pop an item
-          if (priority_queues_[i - 1].try_pop(t)) {
-            dequeued = true;
-            if (enqueued_ > 0) {
-              enqueued_ -= 1;
-            }
-            // execute task
-            t();
-            break;
-          }
-        }
-        if (!(running_ || enqueued_ > 0))
-          break;
+  static intptr_t difference(size_t a, size_t b) {
+    return static_cast<intptr_t>(a) - static_cast<intptr_t>(b);
+  }
+
+  // Claim the cell at the head of the ring if `predicate(key)` holds
+  // Returns nullptr if the ring is empty or the predicate fails
+  template <class Predicate> Cell *claim_head(Predicate &&predicate, size_t &pos) {
+    pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell *cell = &cells_[pos % capacity];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const intptr_t diff = difference(sequence, pos + 1);
+      if (diff == 0) {
+        if (!predicate(cell->key.load(std::memory_order_relaxed)))
+          return nullptr;
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          return cell;
+      } else if (diff < 0) {
+        return nullptr; // empty
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
       }
     }
   }
 
 public:
-  PriorityScheduler() {
-    running_ = true;
-    for (unsigned n = 0; n != threads::value; ++n) {
-      threads_.emplace_back([&, n] { run(); });
-    }
+  RingBuffer() : cells_(new Cell[capacity]) {
+    for (size_t i = 0; i < capacity; ++i)
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
   }
 
-  ~PriorityScheduler() {
-    running_ = false;
-    ready_.notify_all();
-    for (auto &q : priority_queues_)
-      q.done();
-    for (auto &t : threads_)
-      if (t.joinable())
-        t.join();
+  ~RingBuffer() {
+    size_t pos;
+    while (Cell *cell = claim_head([](int64_t) { return true; }, pos)) {
+      cell->get()->~T();
+      cell->sequence.store(pos + capacity, std::memory_order_release);
+    }
   }
 
-  template <class priority> void schedule(Task &task) {
-    static_assert(priority::value <= priority_levels, "priority out of range");
+  RingBuffer(const RingBuffer &) = delete;
+  RingBuffer &operator=(const RingBuffer &) = delete;
 
-    // Enqueue task
-    while (running_) {
-      if (priority_queues_[priority::value].try_push(task)) {
-        break;
+  template <class U> bool try_push(U &&value, int64_t key = 0) {
+    Cell *cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos % capacity];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const intptr_t diff = difference(sequence, pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false; // full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
       }
     }
+    new (&cell->storage) T(std::forward<U>(value));
+    cell->key.store(key, std::memory_order_relaxed);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
 
-    // Send `enqueued` signal to worker threads
-    {
-      std::unique_lock<std::mutex> lock{mutex_};
-      enqueued_ += 1;
-      ready_.notify_one();
+  // Push up to `count` elements, produced in order by `make()`, claiming all
+  // of their cells with a single CAS. Returns the number of elements pushed.
+  template <class Make> size_t try_push_n(size_t count, int64_t key, Make &&make) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    size_t claimed = 0;
+    while (count > 0) {
+      // Count the consecutive free cells starting at `pos`
+      bool stale = false;
+      for (claimed = 0; claimed < count; ++claimed) {
+        const Cell &cell = cells_[(pos + claimed) % capacity];
+        const intptr_t diff =
+            difference(cell.sequence.load(std::memory_order_acquire), pos + claimed);
+        if (diff < 0)
+          break; // full from here on
+        if (diff > 0) {
+          stale = true; // another producer got there first
+          break;
+        }
+      }
+      if (stale) {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (claimed == 0)
+        return 0;
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + claimed, std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < claimed; ++i) {
+      Cell &cell = cells_[(pos + i) % capacity];
+      new (&cell.storage) T(make());
+      cell.key.store(key, std::memory_order_relaxed);
+      cell.sequence.store(pos + i + 1, std::memory_order_release);
     }
+    return claimed;
   }
 
-  void stop() {
+  bool try_pop(T &value) {
+    return try_pop_if(value, [](int64_t) { return true; });
+  }
+
+  // Pop the element at the head of the ring only if `predicate(key)` is true
+  template <class Predicate> bool try_pop_if(T &value, Predicate &&predicate) {
+    size_t pos;
+    Cell *cell = claim_head(predicate, pos);
+    if (!cell)
+      return false;
+    T *element = cell->get();
+    value = std::move(*element);
+    element->~T();
+    cell->sequence.store(pos + capacity, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate; may be stale by the time the caller acts on it
+  bool empty() const {
+    return dequeue_pos_.load(std::memory_order_relaxed) >=
+           enqueue_pos_.load(std::memory_order_relaxed);
+  }
+};
+
+} // namespace psched
+
+#pragma once
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <mutex>
+// #include <psched/queue_size.h>
+// #include <psched/ring_buffer.h>
+// #include <psched/task.h>
+// #include <psched/task_pool.h>
+#include <vector>
+
+namespace psched {
+
+// Unbounded task queue: an intrusive list of pooled nodes protected by a mutex
+//
+// Nodes come from the queue's own pool and go back to it when their task is
+// popped, so pushes stop allocating once the queue has reached its largest
+// size. Aging moves starved tasks to another queue by relinking their nodes.
+template <class queue_policy, bool bounded = queue_policy::bounded_or_not> class TaskQueue {
+  detail::TaskPool pool_;  // Nodes of the queued tasks
+  detail::TaskList queue_; // Internal queue data structure
+  bool done_{false};       // Set to true when no more tasks are expected
+  std::mutex mutex_;       // Mutex for the internal queue
+
+public:
+  // Tasks taken off the queue together, e.g., by `pop_arrived_before`
+  typedef detail::TaskList Batch;
+
+  // Blocks on the queue mutex; only fails if the queue is empty
+  bool try_pop(Task &task) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (queue_.empty())
+      return false;
+    detail::TaskNode *node = queue_.pop_front();
+    task = std::move(node->task);
+    pool_.release(node);
+    return true;
+  }
+
+  bool empty() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    return queue_.empty();
+  }
+
+  // Blocks on the queue mutex; never fails
+  bool try_push(Task &&task, size_t &discarded) {
+    discarded = 0;
+    return try_push_if_not_full(std::move(task));
+  }
+
+  // The queue is never full
+  bool try_push_if_not_full(Task &&task) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    task.save_arrival_time();
+    queue_.push_back(pool_.allocate(std::move(task)));
+    return true;
+  }
+
+  // Pushes every task in [first, last) under a single lock with one arrival time
+  template <class Iterator>
+  size_t try_push_bulk(Iterator first, Iterator last, size_t &discarded) {
+    discarded = 0;
+    size_t pushed = 0;
+    std::unique_lock<std::mutex> lock{mutex_};
+    const auto now = TaskClock::now();
+    for (; first != last; ++first, ++pushed) {
+      queue_.push_back(pool_.allocate(Task(*first)));
+      queue_.tail->task.stats_.arrival_time = now;
+    }
+    return pushed;
+  }
+
+  // Links every task of `batch` at the back of the queue with one arrival
+  // time, leaving `batch` empty; never discards a task
+  size_t push_batch(Batch &batch, size_t &discarded) {
+    discarded = 0;
+    const size_t pushed = batch.size();
+    const auto now = TaskClock::now();
+    for (auto &task : batch)
+      task.stats_.arrival_time = now;
+    std::unique_lock<std::mutex> lock{mutex_};
+    queue_.splice(batch);
+    return pushed;
+  }
+
+  // Pushes every task of `batch` like `try_push_bulk`, leaving `batch` empty
+  size_t push_batch(std::vector<Task> &batch, size_t &discarded) {
+    const size_t pushed = try_push_bulk(std::make_move_iterator(batch.begin()),
+                                        std::make_move_iterator(batch.end()), discarded);
+    batch.clear();
+    return pushed;
+  }
+
+  void done() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    done_ = true;
+  }
+
+  // Moves every task that arrived before `cutoff` to the back of `starved`,
+  // oldest first; returns the number of tasks moved
+  //
+  // Tasks are pushed in arrival order, so the starved tasks are a prefix of the queue.
+  size_t pop_arrived_before(TaskStats::TimePoint cutoff, Batch &starved) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    size_t count = 0;
+    while (!queue_.empty() && queue_.head->task.stats_.arrival_time < cutoff) {
+      starved.push_back(queue_.pop_front());
+      count += 1;
+    }
+    return count;
+  }
+};
+
+// Bounded task queue: a preallocated, lock-free MPMC ring buffer
+//
+// The arrival time of every task is stored alongside it in the ring so that
+// starvation can be checked without taking the task off the queue.
+template <class queue_policy> class TaskQueue<queue_policy, true> {
+  // The ring needs at least two cells; a queue of size 1 gets two cells and
+  // holds a single task by claiming `occupied_` before every push
+  constexpr static bool single = queue_policy::maintain_size::bounded_queue_size < 2;
+  constexpr static size_t capacity = single ? 2 : queue_policy::maintain_size::bounded_queue_size;
+  constexpr static discard discard_policy = queue_policy::maintain_size::discard_policy;
+
+  RingBuffer<Task, capacity> queue_;  // Internal queue data structure
+  std::atomic_bool occupied_{false}; // Size 1 only: a task is queued or being pushed
+
+  // Pushes onto the ring unless it already holds as many tasks as allowed
+  bool push(Task &&task, int64_t arrival) {
+    if (!single)
+      return queue_.try_push(std::move(task), arrival);
+    if (occupied_.exchange(true, std::memory_order_acquire))
+      return false;
+    // The last task was popped before `occupied_` was cleared, so both cells are free
+    queue_.try_push(std::move(task), arrival);
+    return true;
+  }
+
+  void popped() {
+    if (single)
+      occupied_.store(false, std::memory_order_release);
+  }
+
+public:
+  // Tasks taken off the queue together, e.g., by `pop_arrived_before`
+  typedef std::vector<Task> Batch;
+
+  bool try_pop(Task &task) {
+    if (!queue_.try_pop(task))
+      return false;
+    popped();
+    return true;
+  }
+
+  // `discarded` is set to the number of tasks dropped to maintain the queue
+  // size; returns false if `task` itself was dropped
+  bool try_push(Task &&task, size_t &discarded) {
+    discarded = 0;
+    task.save_arrival_time();
+    const auto arrival = task.stats_.arrival_time.time_since_epoch().count();
+    if (discard_policy != discard::oldest_task) {
+      // If the queue is full, the incoming task is the newest task and is dropped
+      if (push(std::move(task), arrival))
+        return true;
+      discarded = 1;
+      task.drop();
+      return false;
+    }
+    // Make room by discarding the oldest task(s) at the front of the queue
+    // (the incoming task is only moved from once the push succeeds)
+    Task oldest;
+    while (!push(std::move(task), arrival)) {
+      if (try_pop(oldest)) {
+        discarded += 1;
+        oldest.drop();
+      }
+    }
+    return true;
+  }
+
+  // Never discards a task; `task` is left untouched if the queue is full
+  bool try_push_if_not_full(Task &&task) {
+    task.save_arrival_time();
+    const auto arrival = task.stats_.arrival_time.time_since_epoch().count();
+    return push(std::move(task), arrival);
+  }
+
+  // Pushes every task in [first, last) with one arrival time, claiming as many
+  // ring cells as possible at once; the overflow, if any, follows the discard policy
+  template <class Iterator>
+  size_t try_push_bulk(Iterator first, Iterator last, size_t &discarded) {
+    discarded = 0;
+    const auto now = TaskClock::now();
+    const auto arrival = now.time_since_epoch().count();
+    size_t remaining = static_cast<size_t>(std::distance(first, last));
+    const size_t pushed = remaining;
+    while (!single && remaining > 0) {
+      const size_t n = queue_.try_push_n(remaining, arrival, [&] {
+        Task task(*first);
+        ++first;
+        task.stats_.arrival_time = now;
+        return task;
+      });
+      if (n == 0)
+        break;
+      remaining -= n;
+    }
+    // Queue is full (or holds a single task)
+    for (; first != last; ++first) {
+      size_t dropped = 0;
+      try_push(Task(*first), dropped);
+      discarded += dropped;
+    }
+    return pushed;
+  }
+
+  // Pushes every task of `batch` like `try_push_bulk`, leaving `batch` empty
+  size_t push_batch(Batch &batch, size_t &discarded) {
+    const size_t pushed = try_push_bulk(std::make_move_iterator(batch.begin()),
+                                        std::make_move_iterator(batch.end()), discarded);
+    batch.clear();
+    return pushed;
+  }
+
+  void done() {}
+
+  bool empty() const { return queue_.empty(); }
+
+  // Moves every task that arrived before `cutoff` to the back of `starved`,
+  // oldest first; returns the number of tasks moved
+  //
+  // Only the arrival time stored alongside each task in the ring is inspected.
+  size_t pop_arrived_before(TaskStats::TimePoint cutoff, std::vector<Task> &starved) {
+    const auto limit = cutoff.time_since_epoch().count();
+    const auto starving = [limit](int64_t arrival) { return arrival < limit; };
+    size_t count = 0;
+    Task task;
+    while (queue_.try_pop_if(task, starving)) {
+      popped();
+      starved.emplace_back(std::move(task));
+      count += 1;
+    }
+    return count;
+  }
+};
+
+} // namespace psched#pragma once
+#include <chrono>
+#include <iterator>
+#include <mutex>
+// #include <psched/queue_size.h>
+// #include <psched/task.h>
+#include <stdint.h>
+#include <vector>
+
+namespace psched {
+
+// Task queue ordered by deadline: a binary min-heap protected by a mutex
+//
+// Tasks are popped in order of their absolute deadline (`Task::set_deadline`);
+// tasks without a deadline come after every task that has one. Ties are broken
+// by arrival order, so a queue of tasks without deadlines behaves like a FIFO.
+//
+// Tasks live in a slab of slots that is recycled through a free list, and the
+// heap only moves small (deadline, sequence, slot) keys around. Queued slots
+// are also linked in arrival order, and every slot knows where its key is in
+// the heap, so the oldest task can be removed in O(log n).
+//
+// If the queue policy bounds the queue, `discard::newest_task` (and
+// `discard::block`, when the scheduler cannot wait) drops the incoming task
+// and `discard::oldest_task` drops the task that arrived first.
+template <class queue_policy> class DeadlineQueue {
+  constexpr static size_t none = static_cast<size_t>(-1);
+
+  struct Key {
+    int64_t deadline;  // Absolute deadline, steady_clock ticks
+    uint64_t sequence; // Arrival order, breaks deadline ties
+    size_t slot;       // Index of the task in `tasks_`
+
+    // Is this key popped before `other`?
+    bool before(const Key &other) const {
+      return deadline != other.deadline ? deadline < other.deadline : sequence < other.sequence;
+    }
+  };
+
+  // Per-slot bookkeeping, next to the slab of tasks
+  struct Link {
+    size_t position; // Index of the slot's key in `heap_`
+    size_t older;    // Previous slot in arrival order, or `none`
+    size_t newer;    // Next slot in arrival order, or `none`
+  };
+
+  std::vector<Key> heap_;    // Min-heap of the keys of the queued tasks
+  std::vector<Task> tasks_;  // Slab of task slots
+  std::vector<Link> links_;  // Indexed like `tasks_`
+  std::vector<size_t> free_; // Unused slots in `tasks_`
+  size_t oldest_{none};      // Queued slots in arrival order, oldest first
+  size_t newest_{none};
+  uint64_t sequence_{0}; // Next arrival sequence number
+  std::mutex mutex_;     // Protects everything above
+
+  void place(size_t i, const Key &key) {
+    heap_[i] = key;
+    links_[key.slot].position = i;
+  }
+
+  void sift_up(size_t i) {
+    const Key key = heap_[i];
+    while (i > 0 && key.before(heap_[(i - 1) / 2])) {
+      place(i, heap_[(i - 1) / 2]);
+      i = (i - 1) / 2;
+    }
+    place(i, key);
+  }
+
+  void sift_down(size_t i) {
+    const Key key = heap_[i];
+    const size_t size = heap_.size();
+    while (true) {
+      size_t child = 2 * i + 1;
+      if (child >= size)
+        break;
+      if (child + 1 < size && heap_[child + 1].before(heap_[child]))
+        child += 1;
+      if (!heap_[child].before(key))
+        break;
+      place(i, heap_[child]);
+      i = child;
+    }
+    place(i, key);
+  }
+
+  // Unlinks the task in `slot` from the heap and the arrival list and moves it out
+  Task remove(size_t slot) {
+    const size_t i = links_[slot].position;
+    const Key last = heap_.back();
+    heap_.pop_back();
+    if (i < heap_.size()) {
+      place(i, last);
+      sift_up(i);
+      sift_down(links_[last.slot].position);
+    }
+    Link &link = links_[slot];
+    (link.older == none ? oldest_ : links_[link.older].newer) = link.newer;
+    (link.newer == none ? newest_ : links_[link.newer].older) = link.older;
+    Task task = std::move(tasks_[slot]);
+    release(slot);
+    return task;
+  }
+
+  bool full() const {
+    return queue_policy::bounded_or_not &&
+           heap_.size() >= queue_policy::maintain_size::bounded_queue_size;
+  }
+
+  // Called with the lock held; discarded tasks are moved to `dropped` so that
+  // their callbacks can run once the lock is released
+  bool push_locked(Task &&task, size_t &discarded, std::vector<Task> &dropped) {
+    if (full()) {
+      if (queue_policy::maintain_size::discard_policy != discard::oldest_task) {
+        discarded += 1;
+        dropped.emplace_back(std::move(task));
+        return false;
+      }
+      dropped.emplace_back(remove(oldest_));
+      discarded += 1;
+    }
+
+    size_t slot;
+    if (free_.empty()) {
+      slot = tasks_.size();
+      tasks_.emplace_back(std::move(task));
+      links_.emplace_back();
+    } else {
+      slot = free_.back();
+      free_.pop_back();
+      tasks_[slot] = std::move(task);
+    }
+    links_[slot].older = newest_;
+    links_[slot].newer = none;
+    (newest_ == none ? oldest_ : links_[newest_].newer) = slot;
+    newest_ = slot;
+    heap_.push_back(
+        Key{tasks_[slot].stats_.deadline.time_since_epoch().count(), sequence_++, slot});
+    sift_up(heap_.size() - 1);
+    return true;
+  }
+
+  static void drop_all(std::vector<Task> &dropped) {
+    for (auto &task : dropped)
+      task.drop();
+  }
+
+  // Called with the lock held
+  void pop_locked(Task &task) { task = remove(heap_.front().slot); }
+
+  void release(size_t slot) {
+    tasks_[slot] = Task();
+    free_.push_back(slot);
+  }
+
+public:
+  // Tasks taken off the queue together, e.g., by `pop_arrived_before`
+  typedef std::vector<Task> Batch;
+
+  // A bounded queue allocates all of its slots up front
+  DeadlineQueue() {
+    const size_t size = queue_policy::maintain_size::bounded_queue_size;
+    heap_.reserve(size);
+    tasks_.reserve(size);
+    links_.reserve(size);
+    free_.reserve(size);
+  }
+
+  // Blocks on the queue mutex; only fails if the queue is empty
+  bool try_pop(Task &task) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (heap_.empty())
+      return false;
+    pop_locked(task);
+    return true;
+  }
+
+  bool empty() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    return heap_.empty();
+  }
+
+  // `discarded` is set to the number of tasks dropped to maintain the queue
+  // size; returns false if `task` itself was dropped
+  bool try_push(Task &&task, size_t &discarded) {
+    discarded = 0;
+    std::vector<Task> dropped;
+    bool pushed;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      task.save_arrival_time();
+      pushed = push_locked(std::move(task), discarded, dropped);
+    }
+    drop_all(dropped);
+    return pushed;
+  }
+
+  // Never discards a task; `task` is left untouched if the queue is full
+  bool try_push_if_not_full(Task &&task) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (full())
+      return false;
+    task.save_arrival_time();
+    size_t discarded = 0;
+    std::vector<Task> dropped;
+    return push_locked(std::move(task), discarded, dropped);
+  }
+
+  // Pushes every task in [first, last) under a single lock with one arrival time
+  template <class Iterator>
+  size_t try_push_bulk(Iterator first, Iterator last, size_t &discarded) {
+    discarded = 0;
+    size_t pushed = 0;
+    std::vector<Task> dropped;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      const auto now = TaskClock::now();
+      for (; first != last; ++first, ++pushed) {
+        Task task(*first);
+        task.stats_.arrival_time = now;
+        push_locked(std::move(task), discarded, dropped);
+      }
+    }
+    drop_all(dropped);
+    return pushed;
+  }
+
+  // Pushes every task of `batch` like `try_push_bulk`, leaving `batch` empty
+  size_t push_batch(Batch &batch, size_t &discarded) {
+    const size_t pushed = try_push_bulk(std::make_move_iterator(batch.begin()),
+                                        std::make_move_iterator(batch.end()), discarded);
+    batch.clear();
+    return pushed;
+  }
+
+  void done() {}
+
+  // Moves every task that arrived before `cutoff` to the back of `starved`,
+  // oldest first; returns the number of tasks moved
+  size_t pop_arrived_before(TaskStats::TimePoint cutoff, std::vector<Task> &starved) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    // Tasks are linked in arrival order, so the starved tasks come first
+    size_t count = 0;
+    while (oldest_ != none && tasks_[oldest_].stats_.arrival_time < cutoff) {
+      starved.emplace_back(remove(oldest_));
+      count += 1;
+    }
+    return count;
+  }
+};
+
+} // namespace psched
+#pragma once
+// #include <psched/deadline_queue.h>
+
+namespace psched {
+
+struct task_order_tag {};
+
+// Order tasks within each priority level by deadline
+//
+// When enabled, every priority queue is a DeadlineQueue: a worker still serves
+// the highest non-empty priority level first, but within that level it runs the
+// task with the earliest deadline (`Task::set_deadline`) instead of the oldest
+// one. Use a single priority level (`queues<1>`) for global EDF scheduling.
+//
+// Tasks in work-stealing deques keep their LIFO/FIFO order.
+template <bool enabled = true> struct earliest_deadline_first {
+  typedef task_order_tag option_tag;
+  constexpr static bool value = enabled;
+};
+
+} // namespace psched
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace psched {
+
+namespace detail {
+
+// Token bucket limiting the rate at which tasks are admitted to one level
+//
+// Implemented as a generic cell rate algorithm: instead of a token count,
+// a single atomic holds the time at which the bucket will be full again
+// (`next_`). Admitting `n` tasks pushes it `n` intervals into the future,
+// and is refused if that would put it more than `burst` intervals ahead of
+// now. An interval of zero means the level is not limited.
+class AdmissionLimit {
+  std::atomic<int64_t> interval_{0};  // Nanoseconds per token, 0 if unlimited
+  std::atomic<int64_t> tolerance_{0}; // `burst` intervals, in nanoseconds
+  std::atomic<int64_t> next_{0};      // Theoretical arrival time, steady_clock nanoseconds
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+public:
+  // `tasks_per_second` of zero removes the limit
+  void set(double tasks_per_second, size_t burst) {
+    const int64_t interval =
+        tasks_per_second > 0 ? std::max<int64_t>(1, static_cast<int64_t>(1e9 / tasks_per_second))
+                             : 0;
+    tolerance_.store(interval * static_cast<int64_t>(std::max<size_t>(burst, 1)),
+                     std::memory_order_relaxed);
+    next_.store(0, std::memory_order_relaxed);
+    interval_.store(interval, std::memory_order_release);
+  }
+
+  bool try_acquire(size_t count = 1) {
+    const int64_t interval = interval_.load(std::memory_order_acquire);
+    if (interval == 0)
+      return true;
+    const int64_t tolerance = tolerance_.load(std::memory_order_relaxed);
+    const int64_t t = now();
+    int64_t next = next_.load(std::memory_order_relaxed);
+    while (true) {
+      const int64_t updated = std::max(next, t) + interval * static_cast<int64_t>(count);
+      if (updated - t > tolerance)
+        return false;
+      if (next_.compare_exchange_weak(next, updated, std::memory_order_relaxed))
+        return true;
+    }
+  }
+};
+
+} // namespace detail
+
+} // namespace psched
+
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <stddef.h>
+
+namespace psched {
+
+template <typename T> struct is_chrono_duration { static constexpr bool value = false; };
+
+template <typename Rep, typename Period>
+struct is_chrono_duration<std::chrono::duration<Rep, Period>> {
+  static constexpr bool value = true;
+};
+
+template <class D = std::chrono::milliseconds, size_t P = 0> struct task_starvation_after {
+  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
+  typedef D type;
+  constexpr static D value = D(P);
+};
+
+template <size_t P> struct increment_priority_by { constexpr static size_t value = P; };
+
+// How often the aging thread looks for starved tasks
+//
+// The default (zero) checks twice per `task_starvation_after` period, and at
+// most once per millisecond.
+template <class D = std::chrono::milliseconds, size_t P = 0> struct aging_interval {
+  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
+  typedef D type;
+  constexpr static D value = D(P);
+};
+
+template <class T = task_starvation_after<>, class I = increment_priority_by<1>,
+          class A = aging_interval<>>
+struct aging_policy {
+  typedef T task_starvation_after;
+  typedef I increment_priority_by;
+  typedef A aging_interval;
+
+  // Period of the aging thread
+  static std::chrono::steady_clock::duration interval() {
+    typedef std::chrono::steady_clock::duration duration;
+    const auto configured = std::chrono::duration_cast<duration>(A::value);
+    if (configured > duration::zero())
+      return configured;
+    return std::max<duration>(std::chrono::duration_cast<duration>(T::value) / 2,
+                              std::chrono::milliseconds(1));
+  }
+};
+
+} // namespace psched#pragma once
+#include <algorithm>
+#include <chrono>
+// #include <psched/aging_policy.h>
+#include <stddef.h>
+
+namespace psched {
+
+struct elastic_pool_tag {};
+
+// How long an extra worker may stay idle before it exits
+template <class D = std::chrono::seconds, size_t N = 30> struct retire_after {
+  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
+  typedef D type;
+  constexpr static D value = D(N);
+};
+
+// How long a worker may run a single task before it counts as blocked
+template <class D = std::chrono::milliseconds, size_t N = 100> struct blocked_after {
+  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
+  typedef D type;
+  constexpr static D value = D(N);
+};
+
+// Grow the worker pool from `threads<N>` up to `max_workers` under load
+//
+// A pool manager thread checks the scheduler a few times per `blocked_after`
+// period and starts one extra worker per check while
+//   * more than `grow_when_queued` tasks are waiting, or
+//   * some task is waiting and a worker has been running the same task for
+//     longer than `blocked_after` (e.g., blocked on I/O).
+// An extra worker that finds nothing to do for `retire_after` exits. The
+// `threads<N>` workers always stay.
+//
+// Only the extra workers are affected by the option; `elastic_pool<0>` (the
+// default) keeps the pool fixed.
+template <size_t max_workers, size_t grow_when_queued = 64, class R = retire_after<>,
+          class B = blocked_after<>>
+struct elastic_pool {
+  typedef elastic_pool_tag option_tag;
+  typedef R retire_after;
+  typedef B blocked_after;
+  constexpr static size_t value = max_workers;
+  constexpr static size_t queued_threshold = grow_when_queued;
+
+  // Period of the pool manager
+  static std::chrono::steady_clock::duration interval() {
+    typedef std::chrono::steady_clock::duration duration;
+    return std::max<duration>(std::chrono::duration_cast<duration>(B::value) / 4,
+                              std::chrono::milliseconds(1));
+  }
+};
+
+} // namespace psched
+#pragma once
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace psched {
+
+// Index of the most significant set bit in a non-zero word
+inline size_t most_significant_bit(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - static_cast<size_t>(__builtin_clzll(word));
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanReverse64(&index, word);
+  return static_cast<size_t>(index);
+#else
+  size_t index = 0;
+  while (word >>= 1)
+    index += 1;
+  return index;
+#endif
+}
+
+// Atomic bitmap of non-empty priority levels
+//
+// Producers set the bit for a level after enqueuing a task; consumers clear
+// it when they find the level empty. A worker can then jump straight to the
+// highest occupied level instead of probing every queue.
+class OccupancyBitmap {
+  constexpr static size_t bits_per_word = 64;
+
+  size_t number_of_words_;
+  std::unique_ptr<std::atomic<uint64_t>[]> words_;
+
+  static uint64_t mask(size_t level) { return uint64_t(1) << (level % bits_per_word); }
+
+public:
+  constexpr static size_t npos = static_cast<size_t>(-1);
+
+  explicit OccupancyBitmap(size_t levels)
+      : number_of_words_((levels + bits_per_word - 1) / bits_per_word),
+        words_(new std::atomic<uint64_t>[number_of_words_]) {
+    for (size_t i = 0; i < number_of_words_; ++i)
+      words_[i].store(0, std::memory_order_relaxed);
+  }
+
+  // The fences order the caller's preceding push/pop against the bit so that a
+  // concurrent `clear` followed by an emptiness re-check cannot lose a `set`
+  void set(size_t level) {
+    auto &word = words_[level / bits_per_word];
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // Avoid the read-modify-write (and the cache line transfer) if already set
+    if (!(word.load(std::memory_order_relaxed) & mask(level)))
+      word.fetch_or(mask(level), std::memory_order_acq_rel);
+  }
+
+  void clear(size_t level) {
+    words_[level / bits_per_word].fetch_and(~mask(level), std::memory_order_acq_rel);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  bool test(size_t level) const {
+    return words_[level / bits_per_word].load(std::memory_order_acquire) & mask(level);
+  }
+
+  // Highest occupied level, or `npos` if every level is empty
+  size_t highest() const {
+    for (size_t i = number_of_words_; i > 0; --i) {
+      const uint64_t word = words_[i - 1].load(std::memory_order_acquire);
+      if (word)
+        return (i - 1) * bits_per_word + most_significant_bit(word);
+    }
+    return npos;
+  }
+
+  // Highest occupied level below `level`, or `npos` if there is none
+  size_t highest_below(size_t level) const {
+    if (level == 0)
+      return npos;
+    size_t i = (level - 1) / bits_per_word;
+    const size_t bit = (level - 1) % bits_per_word;
+    uint64_t word = words_[i].load(std::memory_order_acquire);
+    if (bit + 1 < bits_per_word)
+      word &= (uint64_t(1) << (bit + 1)) - 1;
+    while (true) {
+      if (word)
+        return i * bits_per_word + most_significant_bit(word);
+      if (i == 0)
+        return npos;
+      word = words_[--i].load(std::memory_order_acquire);
+    }
+  }
+
+  bool empty() const { return highest() == npos; }
+};
+
+} // namespace psched
+#pragma once
+#include <type_traits>
+
+namespace psched {
+
+// Find the scheduler option tagged `Tag` in `Options...`, or `Default`
+//
+// Optional scheduler policies (e.g., `idle_policy<...>`) are passed as trailing
+// template arguments to PriorityScheduler, in any order. Each one declares an
+// `option_tag` typedef that identifies which policy it configures.
+template <class Tag, class Default, class... Options> struct find_option { typedef Default type; };
+
+template <class Tag, class Default, class Option, class... Options>
+struct find_option<Tag, Default, Option, Options...> {
+  typedef typename std::conditional<
+      std::is_same<typename Option::option_tag, Tag>::value, Option,
+      typename find_option<Tag, Default, Options...>::type>::type type;
+};
+
+} // namespace psched
+#pragma once
+#include <atomic>
+#include <memory>
+// #include <psched/ring_buffer.h>
+// #include <psched/task.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
+namespace psched {
+
+struct producer_lanes_tag {};
+
+// Give up to `max_producers` registered producer threads a private lane per
+// priority level (see `PriorityScheduler::register_producer`)
+//
+// A lane is a single-producer ring of `lane_capacity` tasks, so a registered
+// producer enqueues without a lock or a read-modify-write on memory that
+// other producers write. Workers drain the lanes in priority order, along
+// with the shared queues.
+template <size_t max_producers = 0, size_t lane_capacity = 256> struct producer_lanes {
+  typedef producer_lanes_tag option_tag;
+  constexpr static size_t value = max_producers;
+  constexpr static size_t capacity = lane_capacity;
+  static_assert(lane_capacity >= 2 && (lane_capacity & (lane_capacity - 1)) == 0,
+                "lane_capacity must be a power of two");
+};
+
+namespace detail {
+
+// Single-producer ring of tasks with a try-lock for its consumers
+//
+// The producer never waits: it writes a slot and publishes the new tail.
+// Any worker may consume, one at a time, by taking the lane's lock with
+// `try_lock`; a worker that finds the lane locked moves on to another one.
+// Each side caches the other's index, so the shared indices are only read
+// when the ring looks full (producer) or empty (consumer).
+template <size_t capacity> class LaneRing {
+  constexpr static uint64_t mask = capacity - 1;
+
+  alignas(cache_line_size) std::atomic<uint64_t> tail_{0}; // Next slot to write
+  uint64_t cached_head_{0};                                // Producer's copy of `head_`
+  alignas(cache_line_size) std::atomic<uint64_t> head_{0}; // Next slot to read
+  uint64_t cached_tail_{0};                                // Consumers' copy of `tail_`
+  std::atomic_bool locked_{false};                         // Held by the consuming worker
+  std::unique_ptr<Task[]> slots_{new Task[capacity]};
+
+public:
+  // Producer only; leaves `task` untouched if the ring is full
+  bool try_push(Task &&task) {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == capacity) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ == capacity)
+        return false;
+    }
+    slots_[tail & mask] = std::move(task);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_lock() {
+    return !locked_.load(std::memory_order_relaxed) &&
+           !locked_.exchange(true, std::memory_order_acquire);
+  }
+
+  void unlock() { locked_.store(false, std::memory_order_release); }
+
+  // Lock holder only
+  bool try_pop(Task &task) {
+    return try_pop_if(task, [](const Task &) { return true; });
+  }
+
+  // Lock holder only; pops the front task if `predicate(task)` holds
+  template <class Predicate> bool try_pop_if(Task &task, Predicate predicate) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_)
+        return false;
+    }
+    Task &front = slots_[head & mask];
+    if (!predicate(front))
+      return false;
+    task = std::move(front);
+    // Destroy the callables before handing the slot back to the producer
+    front = Task();
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+  }
+};
+
+} // namespace detail
+
+} // namespace psched
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace psched {
+
+// Eventcount: lets idle threads park without a lost-wakeup race
+//
+// A waiter announces itself with `prepare_wait()`, re-checks its wait
+// condition, and then either `cancel_wait()`s or `commit_wait()`s. Notifiers
+// bump the epoch, which releases every waiter that prepared before the bump.
+// The mutex is only touched when at least one thread is actually parked, so
+// notifying with no waiters costs a fence and a load.
+class EventCount {
+  constexpr static uint64_t waiter_mask = 0xFFFFFFFF;
+  constexpr static uint64_t epoch_increment = uint64_t(1) << 32;
+
+  std::atomic<uint64_t> state_{0}; // epoch (high 32 bits) | number of waiters (low 32 bits)
+  std::mutex mutex_;
+  std::condition_variable parked_;
+
+  static uint32_t epoch(uint64_t state) { return static_cast<uint32_t>(state >> 32); }
+
+public:
+  using Key = uint32_t;
+
+  Key prepare_wait() {
+    const auto previous = state_.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return epoch(previous);
+  }
+
+  void cancel_wait() { state_.fetch_sub(1, std::memory_order_seq_cst); }
+
+  void commit_wait(Key key) {
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      parked_.wait(lock, [&] { return epoch(state_.load(std::memory_order_seq_cst)) != key; });
+    }
+    state_.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+  // Like `commit_wait`, but gives up after `timeout`; returns false if it timed out
+  template <class Rep, class Period>
+  bool commit_wait_for(Key key, std::chrono::duration<Rep, Period> timeout) {
+    bool notified;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      notified = parked_.wait_for(
+          lock, timeout, [&] { return epoch(state_.load(std::memory_order_seq_cst)) != key; });
+    }
+    state_.fetch_sub(1, std::memory_order_seq_cst);
+    return notified;
+  }
+
+  // Wake up to `count` parked threads; returns false if no thread was waiting
+  bool notify(size_t count) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const uint64_t waiters = state_.load(std::memory_order_relaxed) & waiter_mask;
+    if (waiters == 0 || count == 0)
+      return false; // fast path: nobody to wake up
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      state_.fetch_add(epoch_increment, std::memory_order_seq_cst);
+    }
+    if (count >= waiters) {
+      parked_.notify_all();
+    } else {
+      for (size_t i = 0; i < count; ++i)
+        parked_.notify_one();
+    }
+    return true;
+  }
+
+  bool notify_one() { return notify(1); }
+
+  bool notify_all() { return notify(waiter_mask); }
+};
+
+} // namespace psched
+#pragma once
+#include <stddef.h>
+#include <thread>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace psched {
+
+// Hint to the CPU that the calling thread is busy-waiting
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield");
+#endif
+}
+
+struct idle_policy_tag {};
+
+template <size_t S> struct spin { constexpr static size_t value = S; };
+
+template <size_t Y> struct yield { constexpr static size_t value = Y; };
+
+// What an idle worker does before parking
+//
+// A worker that finds no ready task first spins `spin` times (cheapest wake-up,
+// burns the core), then calls std::this_thread::yield `yield` times, and then
+// parks until a task is scheduled.
+template <class S = spin<64>, class Y = yield<8>> struct idle_policy {
+  typedef idle_policy_tag option_tag;
+  typedef S spin;
+  typedef Y yield;
+
+  static void wait(size_t round) {
+    if (round < S::value)
+      cpu_relax();
+    else
+      std::this_thread::yield();
+  }
+
+  // Number of rounds after which the worker parks
+  constexpr static size_t park_after = S::value + Y::value;
+};
+
+} // namespace psched
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+// #include <psched/occupancy_bitmap.h>
+// #include <psched/ring_buffer.h>
+// #include <psched/task_stats.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace psched {
+
+struct metrics_tag {};
+
+// Per-priority latency histograms and counters
+//
+// When enabled, every worker records the wait, burst and turnaround time of
+// each task it runs into its own histograms, one set per priority level, so
+// recording never contends with other workers. `metrics_snapshot()` merges
+// them while the workers keep running.
+template <bool enabled = true> struct collect_metrics {
+  typedef metrics_tag option_tag;
+  constexpr static bool value = enabled;
+};
+
+// Merged latency distribution
+//
+// Values are bucketed logarithmically: each power of two is split into 8
+// linear sub-buckets, so a reported value is within 12.5% of the true one.
+struct HistogramSnapshot {
+  constexpr static size_t sub_bucket_bits = 3;
+  constexpr static size_t sub_buckets = size_t(1) << sub_bucket_bits;
+  constexpr static size_t max_bit = 47; // Longer durations (~39h) land in the last bucket
+  constexpr static size_t buckets = (max_bit - sub_bucket_bits + 2) * sub_buckets;
+
+  uint64_t count{0}; // Number of recorded values
+  uint64_t total{0}; // Sum of recorded values, in nanoseconds
+  std::vector<uint64_t> counts = std::vector<uint64_t>(buckets); // Per-bucket counts
+
+  static size_t bucket_of(uint64_t ns) {
+    if (ns < sub_buckets)
+      return static_cast<size_t>(ns);
+    const size_t msb = most_significant_bit(ns);
+    if (msb > max_bit)
+      return buckets - 1;
+    const size_t shift = msb - sub_bucket_bits;
+    const size_t sub = static_cast<size_t>((ns >> shift) & (sub_buckets - 1));
+    return (shift + 1) * sub_buckets + sub;
+  }
+
+  // Largest value that falls into `bucket`
+  static uint64_t upper_bound(size_t bucket) {
+    if (bucket < sub_buckets)
+      return bucket;
+    const size_t shift = bucket / sub_buckets - 1;
+    const uint64_t sub = sub_buckets + bucket % sub_buckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  // Value below which a fraction `q` (e.g., 0.99) of the recorded values fall
+  std::chrono::nanoseconds percentile(double q) const {
+    if (count == 0)
+      return std::chrono::nanoseconds(0);
+    const uint64_t rank =
+        std::max<uint64_t>(1, static_cast<uint64_t>(q * static_cast<double>(count) + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets; ++i) {
+      seen += counts[i];
+      if (seen >= rank)
+        return std::chrono::nanoseconds(upper_bound(i));
+    }
+    return std::chrono::nanoseconds(upper_bound(buckets - 1));
+  }
+
+  std::chrono::nanoseconds mean() const {
+    return std::chrono::nanoseconds(count ? total / count : 0);
+  }
+};
+
+// Scheduler activity at one priority level
+struct LevelMetrics {
+  uint64_t enqueued{0};  // Tasks scheduled at this level
+  uint64_t dropped{0};   // Tasks discarded to maintain the queue size
+  uint64_t promoted{0};  // Tasks moved up from this level by aging
+  uint64_t cancelled{0}; // Tasks skipped because they were cancelled while queued
+  uint64_t rejected{0};  // Tasks refused by `try_schedule`
+  uint64_t stolen{0};    // Tasks at this level stolen from another worker's deque
+  uint64_t executed{0};  // Tasks run at this level
+  HistogramSnapshot waiting_time;
+  HistogramSnapshot burst_time;
+  HistogramSnapshot turnaround_time;
+};
+
+// Size of the worker pool (see `elastic_pool`)
+struct PoolMetrics {
+  size_t workers{0};   // Workers currently running
+  uint64_t started{0}; // Extra workers started under load
+  uint64_t retired{0}; // Extra workers that exited after idling
+};
+
+struct MetricsSnapshot {
+  std::vector<LevelMetrics> levels; // Indexed by priority level
+  PoolMetrics pool;
+};
+
+namespace detail {
+
+// Counter with a single writer; increments are plain loads and stores
+class LocalCounter {
+  std::atomic<uint64_t> value_{0};
+
+public:
+  void add(uint64_t n) {
+    value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+  uint64_t load() const { return value_.load(std::memory_order_relaxed); }
+};
+
+// Histogram with a single writer, readable while it is being written
+class LatencyHistogram {
+  LocalCounter total_;
+  std::unique_ptr<LocalCounter[]> counts_{new LocalCounter[HistogramSnapshot::buckets]};
+
+public:
+  void record(std::chrono::steady_clock::duration d) {
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    const uint64_t value = ns < 0 ? 0 : static_cast<uint64_t>(ns);
+    total_.add(value);
+    counts_[HistogramSnapshot::bucket_of(value)].add(1);
+  }
+
+  void merge_into(HistogramSnapshot &snapshot) const {
+    snapshot.total += total_.load();
+    for (size_t i = 0; i < HistogramSnapshot::buckets; ++i) {
+      const uint64_t n = counts_[i].load();
+      snapshot.counts[i] += n;
+      snapshot.count += n;
+    }
+  }
+};
+
+// Metrics recorded by one worker at one priority level
+struct WorkerLevelMetrics {
+  LatencyHistogram waiting_time;
+  LatencyHistogram burst_time;
+  LatencyHistogram turnaround_time;
+  LocalCounter stolen;
+  LocalCounter cancelled;
+
+  void record(const TaskStats &stats) {
+    waiting_time.record(stats.start_time - stats.arrival_time);
+    burst_time.record(stats.end_time - stats.start_time);
+    turnaround_time.record(stats.end_time - stats.arrival_time);
+  }
+
+  void merge_into(LevelMetrics &level) const {
+    waiting_time.merge_into(level.waiting_time);
+    burst_time.merge_into(level.burst_time);
+    turnaround_time.merge_into(level.turnaround_time);
+    level.stolen += stolen.load();
+    level.cancelled += cancelled.load();
+  }
+};
+
+// Counters updated by producers and the aging thread at one priority level
+struct alignas(cache_line_size) SharedLevelMetrics {
+  std::atomic<uint64_t> enqueued{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> promoted{0};
+  std::atomic<uint64_t> cancelled{0};
+  std::atomic<uint64_t> rejected{0};
+
+  void merge_into(LevelMetrics &level) const {
+    level.enqueued += enqueued.load(std::memory_order_relaxed);
+    level.dropped += dropped.load(std::memory_order_relaxed);
+    level.promoted += promoted.load(std::memory_order_relaxed);
+    level.cancelled += cancelled.load(std::memory_order_relaxed);
+    level.rejected += rejected.load(std::memory_order_relaxed);
+  }
+};
+
+} // namespace detail
+
+} // namespace psched
+#pragma once
+#include <atomic>
+#include <memory>
+// #include <psched/ring_buffer.h>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+namespace psched {
+
+// Chase-Lev work-stealing deque
+//
+// The owning thread pushes and pops at the bottom (LIFO, good locality) while
+// other threads steal from the top (FIFO). Elements must be trivially copyable
+// (e.g., pointers) since a thief may read a slot that the owner is racing for.
+//
+// Implements the C11 formulation from "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (Le, Pop, Cohen, Zappa Nardelli, 2013).
+template <class T> class WorkStealingDeque {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "WorkStealingDeque elements must be trivially copyable");
+
+  struct Array {
+    int64_t capacity;
+    std::unique_ptr<std::atomic<T>[]> slots;
+
+    explicit Array(int64_t c) : capacity(c), slots(new std::atomic<T>[static_cast<size_t>(c)]) {}
+
+    T get(int64_t i) const { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+    void put(int64_t i, T value) {
+      slots[i & (capacity - 1)].store(value, std::memory_order_relaxed);
+    }
+  };
+
+  alignas(cache_line_size) std::atomic<int64_t> top_{0};    // Thieves steal from here
+  alignas(cache_line_size) std::atomic<int64_t> bottom_{0}; // Owner pushes and pops here
+  std::atomic<Array *> array_;
+  // Arrays replaced by `grow`; a thief may still be reading them, so they are
+  // only freed when the deque is destroyed
+  std::vector<std::unique_ptr<Array>> retired_;
+
+  Array *grow(Array *array, int64_t top, int64_t bottom) {
+    std::unique_ptr<Array> bigger(new Array(array->capacity * 2));
+    for (int64_t i = top; i != bottom; ++i)
+      bigger->put(i, array->get(i));
+    retired_.emplace_back(array);
+    array = bigger.release();
+    array_.store(array, std::memory_order_release);
+    return array;
+  }
+
+public:
+  // `capacity` must be a power of two
+  explicit WorkStealingDeque(int64_t capacity = 64) : array_(new Array(capacity)) {}
+
+  ~WorkStealingDeque() { delete array_.load(std::memory_order_relaxed); }
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  // Owner only
+  void push(T value) {
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    const int64_t top = top_.load(std::memory_order_acquire);
+    Array *array = array_.load(std::memory_order_relaxed);
+    if (bottom - top > array->capacity - 1)
+      array = grow(array, top, bottom);
+    array->put(bottom, value);
+    // Release store (rather than a release fence) so that thieves acquiring
+    // `bottom_` also see the element
+    bottom_.store(bottom + 1, std::memory_order_release);
+  }
+
+  // Owner only
+  bool pop(T &value) {
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Array *array = array_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      // Deque was empty
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return false;
+    }
+    value = array->get(bottom);
+    if (top == bottom) {
+      // Last element: race against thieves for it
+      const bool won = top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                                    std::memory_order_relaxed);
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  // Any thread
+  bool steal(T &value) {
+    int64_t top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom)
+      return false;
+    Array *array = array_.load(std::memory_order_acquire);
+    value = array->get(top);
+    return top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed);
+  }
+
+  // Approximate; may be stale by the time the caller acts on it
+  bool empty() const {
+    return top_.load(std::memory_order_acquire) >= bottom_.load(std::memory_order_acquire);
+  }
+};
+
+} // namespace psched
+#pragma once
+// #include <psched/work_stealing_deque.h>
+
+namespace psched {
+
+struct work_stealing_tag {};
+
+// Per-worker task deques
+//
+// When enabled, every worker owns one Chase-Lev deque per priority level.
+// Tasks scheduled from inside a running task are pushed onto the current
+// worker's deque instead of the shared priority queues, and idle workers steal
+// from the highest priority level available across their peers.
+//
+// Priority order across workers is best effort within one stealing round, and
+// tasks in worker deques are not subject to the aging policy. With bounded
+// queues (`maintain_size`), tasks always go to the shared queues so that the
+// bound and its discard policy apply to every task.
+template <bool enabled = true> struct work_stealing {
+  typedef work_stealing_tag option_tag;
+  constexpr static bool value = enabled;
+};
+
+} // namespace psched
+#pragma once
+#include <stddef.h>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace psched {
+
+struct worker_groups_tag {};
+
+// CPUs a worker group is pinned to; `cpus<>` leaves the workers unpinned
+template <size_t... ids> struct cpus {
+  static std::vector<size_t> list() { return {ids...}; }
+};
+
+// `count` workers that only serve priority levels >= `min_level`, pinned to `cpu_set`
+//
+// Reserving workers for the top levels bounds the head-of-line blocking that a
+// high priority task suffers behind long low priority tasks: the reserved
+// workers never pick up lower priority work, so one of them is free as soon as
+// the tasks at or above `min_level` they are running complete.
+template <size_t count, size_t min_level = 0, class cpu_set = cpus<>> struct worker_group {
+  constexpr static size_t workers = count;
+  constexpr static size_t lowest_level = min_level;
+  typedef cpu_set cpu_list;
+};
+
+// Where a worker runs and which levels it serves
+struct WorkerPlacement {
+  size_t group{0};          // Index of the worker's group
+  size_t min_level{0};      // Lowest priority level the worker serves
+  std::vector<size_t> cpus; // CPUs the worker is pinned to; empty if unpinned
+};
+
+// Partition the scheduler's workers into groups
+//
+// Workers are assigned to the groups in order; the workers left over (if
+// `threads<N>` has more than the groups need) form one more, unpinned group
+// that serves every level. For example, with `threads<8>`,
+//
+//   worker_groups<worker_group<2, 5, cpus<6, 7>>, worker_group<6, 0, cpus<0, 1, 2, 3, 4, 5>>>
+//
+// reserves two workers on CPUs 6 and 7 for levels 5 and above, and runs the
+// other six on CPUs 0-5 for every level.
+//
+// Pinning uses `pthread_setaffinity_np` and is ignored on other platforms.
+// Each worker, extra workers of an `elastic_pool` included, allocates its own
+// state (work-stealing deques and nodes, metrics) after it has been pinned, so
+// that on NUMA systems the memory is first touched by, and placed on the node
+// of, the CPU that uses it.
+template <class... groups> struct worker_groups {
+  typedef worker_groups_tag option_tag;
+
+  constexpr static size_t number_of_groups = sizeof...(groups);
+  constexpr static size_t reserved_workers = (size_t(0) + ... + groups::workers);
+  // At least one worker must serve the lowest level, or its tasks never run
+  constexpr static bool serves_every_level = ((groups::lowest_level == 0) || ... || false);
+
+  static WorkerPlacement placement(size_t worker) {
+    const size_t counts[] = {groups::workers..., 0};
+    const size_t min_levels[] = {groups::lowest_level..., 0};
+    const std::vector<size_t> cpu_lists[] = {groups::cpu_list::list()..., {}};
+    WorkerPlacement result;
+    size_t first = 0;
+    for (result.group = 0; result.group < number_of_groups; ++result.group) {
+      first += counts[result.group];
+      if (worker < first)
+        break;
+    }
+    result.min_level = min_levels[result.group];
+    result.cpus = cpu_lists[result.group];
+    return result;
+  }
+
+  // Lowest priority level served by `group`; the last group serves every level
+  static size_t min_level_of(size_t group) {
+    const size_t min_levels[] = {groups::lowest_level..., 0};
+    return min_levels[group];
+  }
+};
+
+// Pin the calling thread to `cpus`; returns false if pinning is not supported or failed
+inline bool pin_current_thread(const std::vector<size_t> &cpus) {
+  if (cpus.empty())
+    return true;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t cpu : cpus)
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+} // namespace psched
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <mutex>
+// #include <psched/idle_policy.h>
+// #include <psched/inplace_function.h>
+// #include <psched/task.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+
+namespace psched {
+
+template <class T> class Future;
+class TaskGraph;
+
+namespace detail {
+
+// Shared state between a Future and the task that fulfills it
+//
+// One allocation holds the result, the callable that produces it, and an
+// optional continuation. The fast path (result set before anyone waits) is
+// lock-free; the mutex and condition variable are only used when a thread
+// actually blocks in `Future::get()`.
+template <class T> class FutureState {
+  enum : uint8_t { pending, has_continuation, ready };
+
+  std::atomic<uint32_t> references_{1};
+  std::atomic<uint8_t> status_{pending};
+  std::atomic_bool waiting_{false}; // Is a thread blocked in `wait()`?
+  std::exception_ptr error_{};
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type value_;
+  InplaceFunction<void()> continuation_{};
+  std::mutex mutex_{};
+  std::condition_variable ready_{};
+
+  void run_continuation() {
+    // Drop the continuation (and the references it holds) once it has run
+    auto continuation = std::move(continuation_);
+    continuation();
+  }
+
+  void publish() {
+    const auto previous = status_.exchange(ready, std::memory_order_seq_cst);
+    if (previous == has_continuation)
+      run_continuation();
+    if (waiting_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      ready_.notify_all();
+    }
+  }
+
+public:
+  virtual ~FutureState() {
+    if (status_.load(std::memory_order_relaxed) == ready && !error_)
+      reinterpret_cast<T *>(&value_)->~T();
+  }
+
+  // Runs the callable and fulfills the state (see TaskFutureState)
+  virtual void run() {}
+
+  void retain() { references_.fetch_add(1, std::memory_order_relaxed); }
+
+  void release() {
+    if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete this;
+  }
+
+  template <class... U> void set_value(U &&... value) {
+    new (&value_) T(std::forward<U>(value)...);
+    publish();
+  }
+
+  void set_exception(std::exception_ptr error) {
+    error_ = std::move(error);
+    publish();
+  }
+
+  // Fails the state with std::future_errc::broken_promise, e.g., because the
+  // task that would have fulfilled it was discarded
+  void break_promise() {
+    set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+  }
+
+  bool is_ready() const { return status_.load(std::memory_order_acquire) == ready; }
+
+  void wait() {
+    for (size_t i = 0; i < 64; ++i) {
+      if (is_ready())
+        return;
+      cpu_relax();
+    }
+    waiting_.store(true, std::memory_order_seq_cst);
+    std::unique_lock<std::mutex> lock{mutex_};
+    ready_.wait(lock, [this] { return status_.load(std::memory_order_seq_cst) == ready; });
+  }
+
+  std::exception_ptr error() const { return error_; }
+
+  T &value() {
+    if (error_)
+      std::rethrow_exception(error_);
+    return *reinterpret_cast<T *>(&value_);
+  }
+
+  // Calls `fn` once the state is ready: right away if it already is,
+  // otherwise on the thread that fulfills it
+  void on_ready(InplaceFunction<void()> fn) {
+    continuation_ = std::move(fn);
+    uint8_t expected = pending;
+    if (!status_.compare_exchange_strong(expected, has_continuation, std::memory_order_seq_cst))
+      run_continuation(); // already ready
+  }
+};
+
+// `void` results are stored as an empty struct
+struct Unit {};
+
+template <class T> struct state_type { typedef T type; };
+template <> struct state_type<void> { typedef Unit type; };
+
+template <class T, class F> class TaskFutureState : public FutureState<T> {
+  F fn_;
+
+public:
+  explicit TaskFutureState(F fn) : fn_(std::move(fn)) {}
+
+  void run() override {
+    try {
+      if constexpr (std::is_same<T, Unit>::value) {
+        fn_();
+        this->set_value();
+      } else {
+        this->set_value(fn_());
+      }
+    } catch (...) {
+      this->set_exception(std::current_exception());
+    }
+  }
+};
+
+// Counted reference to a FutureState
+template <class T> class StateRef;
+
+// Task that runs `state`, or breaks its promise if a bounded queue discards it
+template <class T> Task fulfilling_task(const StateRef<T> &state) {
+  Task task([state] { state->run(); });
+  task.on_dropped([state](const TaskStats &) { state->break_promise(); });
+  return task;
+}
+
+template <class T> class StateRef {
+  FutureState<T> *state_{nullptr};
+
+public:
+  StateRef() = default;
+  explicit StateRef(FutureState<T> *state) : state_(state) {}
+  StateRef(const StateRef &other) : state_(other.state_) {
+    if (state_)
+      state_->retain();
+  }
+  StateRef(StateRef &&other) noexcept : state_(other.state_) { other.state_ = nullptr; }
+  StateRef &operator=(StateRef other) {
+    std::swap(state_, other.state_);
+    return *this;
+  }
+  ~StateRef() {
+    if (state_)
+      state_->release();
+  }
+
+  FutureState<T> *operator->() const { return state_; }
+  explicit operator bool() const { return state_ != nullptr; }
+};
+
+} // namespace detail
+
+// Result of `PriorityScheduler::submit`
+//
+// A lightweight, single-consumer future: `get()` blocks until the task has
+// run and returns its result, or rethrows the exception the task threw. If
+// the task is discarded to maintain the size of a bounded queue, `get()`
+// throws std::future_error with std::future_errc::broken_promise.
+template <class T> class Future {
+  typedef typename detail::state_type<T>::type stored_type;
+
+  detail::StateRef<stored_type> state_;
+
+  template <class U> friend class Future;
+  template <class threads, class queues, class aging_policy, class... options>
+  friend class PriorityScheduler;
+  friend class TaskGraph;
+
+  explicit Future(detail::StateRef<stored_type> state) : state_(std::move(state)) {}
+
+  // Allocates the shared state for a result computed by `fn`
+  template <class F> static detail::StateRef<stored_type> make_state(F fn) {
+    return detail::StateRef<stored_type>(
+        new detail::TaskFutureState<stored_type, F>(std::move(fn)));
+  }
+
+public:
+  Future() = default;
+
+  bool valid() const { return static_cast<bool>(state_); }
+
+  bool is_ready() const { return state_->is_ready(); }
+
+  void wait() const { state_->wait(); }
+
+  // Waits for the result and moves it out of the future
+  T get() {
+    if (!state_)
+      throw std::logic_error("psched::Future has no state");
+    auto state = std::move(state_);
+    state->wait();
+    if constexpr (std::is_void<T>::value) {
+      state->value();
+    } else {
+      return std::move(state->value());
+    }
+  }
+
+  // Schedules `fn(result)` at `level` once this future is ready and returns
+  // a future for its result. If this future holds an exception, `fn` is not
+  // called and the exception is forwarded.
+  template <class Scheduler, class F> auto then(Scheduler &scheduler, size_t level, F &&fn) {
+    if (!state_)
+      throw std::logic_error("psched::Future has no state");
+    auto antecedent = std::move(state_);
+
+    auto body = [fn = typename std::decay<F>::type(std::forward<F>(fn)), antecedent]() mutable {
+      if constexpr (std::is_void<T>::value) {
+        antecedent->value();
+        return fn();
+      } else {
+        return fn(std::move(antecedent->value()));
+      }
+    };
+    typedef decltype(body()) R;
+    auto next = Future<R>::make_state(std::move(body));
+
+    auto *raw = antecedent.operator->();
+    raw->on_ready([&scheduler, level, next] {
+      scheduler.schedule(level, detail::fulfilling_task(next));
+    });
+    return Future<R>(std::move(next));
+  }
+
+  template <class priority, class Scheduler, class F> auto then(Scheduler &scheduler, F &&fn) {
+    return then(scheduler, priority::value, std::forward<F>(fn));
+  }
+};
+
+} // namespace psched
+#pragma once
+// Coroutine support is only available when compiling as C++20 (or later)
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define PSCHED_HAS_COROUTINES 1
+#endif
+#endif
+
+#if defined(PSCHED_HAS_COROUTINES)
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <optional>
+// #include <psched/future.h>
+#include <stddef.h>
+#include <utility>
+
+namespace psched {
+
+template <class T = void> class CoTask;
+
+namespace detail {
+
+// Promise state shared by every CoTask<T>
+struct CoTaskPromiseBase {
+  std::coroutine_handle<> continuation{}; // Coroutine awaiting this one, if any
+  std::exception_ptr error{};
+
+  // Transfers control to the awaiting coroutine, if any, when the body finishes
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    template <class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      const auto continuation = h.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+  };
+
+  // A CoTask does not run until it is awaited
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <class T> struct CoTaskPromise : CoTaskPromiseBase {
+  std::optional<T> value{};
+
+  CoTask<T> get_return_object();
+  template <class U> void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+
+  T result() {
+    if (error)
+      std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+template <> struct CoTaskPromise<void> : CoTaskPromiseBase {
+  CoTask<void> get_return_object();
+  void return_void() {}
+
+  void result() {
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+// Coroutine that owns its own frame and runs to completion unobserved
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() const noexcept { return {}; }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+};
+
+} // namespace detail
+
+// Lazily started coroutine returning T
+//
+// A CoTask starts when it is `co_await`ed, on the awaiting thread, and
+// resumes its awaiter when it completes. To run one on a scheduler, pass it
+// to `PriorityScheduler::spawn`, which returns a Future for its result.
+template <class T> class CoTask {
+public:
+  typedef detail::CoTaskPromise<T> promise_type;
+
+private:
+  std::coroutine_handle<promise_type> handle_{};
+
+public:
+  CoTask() = default;
+  explicit CoTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+  CoTask(CoTask &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  CoTask &operator=(CoTask other) noexcept {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+  CoTask(const CoTask &) = delete;
+  ~CoTask() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  bool done() const { return !handle_ || handle_.done(); }
+
+  auto operator co_await() && noexcept {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> handle;
+      bool await_ready() const noexcept { return !handle || handle.done(); }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+      }
+      T await_resume() { return handle.promise().result(); }
+    };
+    return Awaiter{handle_};
+  }
+};
+
+namespace detail {
+
+template <class T> CoTask<T> CoTaskPromise<T>::get_return_object() {
+  return CoTask<T>(std::coroutine_handle<CoTaskPromise<T>>::from_promise(*this));
+}
+
+inline CoTask<void> CoTaskPromise<void>::get_return_object() {
+  return CoTask<void>(std::coroutine_handle<CoTaskPromise<void>>::from_promise(*this));
+}
+
+// Awaitable that suspends the coroutine and queues its resumption at a level
+//
+// The task that resumes the coroutine only captures the coroutine handle and
+// the awaiter, so it is stored inline in the queue node and needs no
+// allocation of its own. If a bounded queue discards the task, the coroutine
+// is resumed right away, on the discarding thread, and `co_await` throws
+// std::future_error (std::future_errc::broken_promise), so that the frames
+// awaiting it unwind and are destroyed instead of staying suspended forever.
+template <class Scheduler> struct ResumeOn {
+  Scheduler &scheduler;
+  size_t level;
+  bool dropped{false};
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle) {
+    Task task([handle] { handle.resume(); });
+    task.on_dropped([this, handle](const TaskStats &) {
+      dropped = true;
+      handle.resume();
+    });
+    scheduler.schedule(level, std::move(task));
+  }
+  void await_resume() const {
+    if (dropped)
+      throw std::future_error(std::future_errc::broken_promise);
+  }
+};
+
+// Hops onto `level`, runs `task` there and fulfills `state` with its result
+template <class Scheduler, class T, class S>
+Detached drive(Scheduler &scheduler, size_t level, CoTask<T> task, StateRef<S> state) {
+  try {
+    co_await ResumeOn<Scheduler>{scheduler, level};
+    if constexpr (std::is_void<T>::value) {
+      co_await std::move(task);
+      state->set_value();
+    } else {
+      state->set_value(co_await std::move(task));
+    }
+  } catch (...) {
+    state->set_exception(std::current_exception());
+  }
+}
+
+} // namespace detail
+
+} // namespace psched
+#endif
+#pragma once
+#include <deque>
+#include <memory>
+#include <mutex>
+// #include <psched/task.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+
+namespace psched {
+
+namespace detail {
+
+// Serial queues of tasks, one per key (see `PriorityScheduler::schedule(key, task)`)
+//
+// A key with waiting tasks has a strand: a FIFO queue of tasks and a single
+// turn task in the scheduler's queues. A turn runs up to `batch_size` of the
+// strand's tasks back to back on one worker, then schedules the next turn if
+// tasks are left. Tasks of one key never overlap and start in order, while
+// different keys run in parallel. Keys are spread over independently locked
+// shards, so producers of different keys rarely contend.
+class StrandTable {
+public:
+  constexpr static size_t batch_size = 16; // Tasks run per turn
+
+private:
+  constexpr static size_t number_of_shards = 64;
+
+  struct Entry {
+    Task task;
+    size_t level;
+  };
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::deque<Entry>> strands;
+  };
+
+  std::unique_ptr<Shard[]> shards_{new Shard[number_of_shards]};
+
+  Shard &shard_of(uint64_t key) {
+    // Fibonacci hashing, so that sequential keys land on different shards
+    return shards_[(key * 0x9E3779B97F4A7C15ull) >> 58];
+  }
+
+public:
+  // Queues `task` at the back of the strand of `key`; returns true if the
+  // strand was idle, in which case the caller schedules its first turn
+  bool push(uint64_t key, Task &&task, size_t level) {
+    task.save_arrival_time();
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    auto &strand = shard.strands[key];
+    strand.push_back(Entry{std::move(task), level});
+    return strand.size() == 1;
+  }
+
+  // Takes the task at the front of the strand of `key`, leaving its entry in
+  // place so that tasks pushed while it runs wait for this turn
+  void take_front(uint64_t key, Task &task) {
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    task = std::move(shard.strands.find(key)->second.front().task);
+  }
+
+  // Removes the entry of the task that has just run. Returns false, removing
+  // the strand, if it was the last one; else sets `level` to that of the next
+  // task and, if `next` is not null, takes it like `take_front`
+  bool advance(uint64_t key, size_t &level, Task *next) {
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    auto it = shard.strands.find(key);
+    auto &strand = it->second;
+    strand.pop_front();
+    if (strand.empty()) {
+      shard.strands.erase(it);
+      return false;
+    }
+    level = strand.front().level;
+    if (next)
+      *next = std::move(strand.front().task);
+    return true;
+  }
+
+  // Discards every task of the strand of `key`, whose turn was discarded
+  void drop(uint64_t key) {
+    std::deque<Entry> dropped;
+    {
+      auto &shard = shard_of(key);
+      std::lock_guard<std::mutex> lock{shard.mutex};
+      auto it = shard.strands.find(key);
+      dropped.swap(it->second);
+      shard.strands.erase(it);
+    }
+    for (auto &entry : dropped)
+      entry.task.drop();
+  }
+};
+
+} // namespace detail
+
+} // namespace psched
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+// #include <psched/future.h>
+// #include <psched/task.h>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace psched {
+
+class TaskGraph;
+
+namespace detail {
+
+// State of one execution of a TaskGraph
+//
+// Every node has an atomic count of unfinished predecessors. The worker that
+// brings counts to zero keeps the most urgent ready successor and runs it
+// right away, without a trip through the queues, unless a more urgent task is
+// waiting or the worker does not serve its level; it schedules the others
+// like any other task. Either way nodes get the scheduler's worker groups,
+// metrics, tracing and cancellation checks.
+//
+// If a bounded queue discards a node, no further node is scheduled and the
+// run fails with std::future_errc::broken_promise once the nodes already
+// scheduled have finished.
+template <class Scheduler> class GraphRun {
+  TaskGraph &graph_;
+  Scheduler &scheduler_;
+  std::unique_ptr<std::atomic<size_t>[]> pending_; // Unfinished predecessors per node
+  std::vector<size_t> levels_;                     // Priority level per node
+  std::atomic<size_t> active_{0};                  // Nodes scheduled but not finished
+  std::atomic_bool failed_{false};                 // Has a node been discarded?
+  StateRef<Unit> done_;                            // Fulfilled when every node has run
+
+  constexpr static size_t none = static_cast<size_t>(-1);
+
+  // Called once per scheduled node, after it has run or been discarded
+  void finish() {
+    if (active_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+      return;
+    if (failed_.load(std::memory_order_acquire))
+      done_->break_promise();
+    else
+      done_->run();
+  }
+
+public:
+  GraphRun(TaskGraph &graph, Scheduler &scheduler, std::vector<size_t> levels,
+           StateRef<Unit> done);
+
+  // Task running `node` with its deadline and cost
+  template <class F> Task node_task(size_t node, F &&run) const;
+
+  // The caller has already counted the node in `active_`
+  void schedule(const std::shared_ptr<GraphRun> &self, size_t node);
+
+  // Counts and schedules the successors of `node` that became ready, except
+  // the most urgent one, which is returned (or `none`)
+  size_t release(const std::shared_ptr<GraphRun> &self, size_t node);
+
+  void start(const std::shared_ptr<GraphRun> &self);
+
+  void execute(const std::shared_ptr<GraphRun> &self, size_t node);
+};
+
+} // namespace detail
+
+// Directed acyclic graph of tasks
+//
+// Nodes are tasks with a priority level; an edge `precede(a, b)` makes `b`
+// wait until `a` has completed. `run` schedules every node whose
+// predecessors have all completed, and returns a Future that becomes ready
+// once the whole graph has run:
+//
+//   TaskGraph graph;
+//   auto a = graph.add<priority<1>>([] { /* ... */ });
+//   auto b = graph.add<priority<1>>([] { /* ... */ });
+//   auto c = graph.add<priority<2>>([] { /* ... */ });
+//   graph.precede(a, c);
+//   graph.precede(b, c);
+//   graph.run(scheduler).wait();
+//
+// With `inherit_priority`, a node runs at the highest level of any node that
+// (transitively) depends on it, so the path leading to an urgent node is not
+// held back by its lower priority predecessors.
+//
+// A graph can be run again once a run has completed, but must not be modified
+// or destroyed while it runs. If a bounded queue discards one of its nodes,
+// the nodes that depend on it do not run, and the Future throws
+// std::future_error (std::future_errc::broken_promise) once the nodes already
+// scheduled have finished.
+class TaskGraph {
+  struct Node {
+    Task task;
+    size_t level;
+    std::vector<size_t> successors{};
+    size_t predecessors{0};
+  };
+
+  std::vector<Node> nodes_;
+
+  template <class Scheduler> friend class detail::GraphRun;
+
+  // Nodes in dependency order; throws if the graph has a cycle
+  std::vector<size_t> topological_order() const {
+    std::vector<size_t> pending(nodes_.size());
+    std::vector<size_t> order;
+    order.reserve(nodes_.size());
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      pending[i] = nodes_[i].predecessors;
+      if (pending[i] == 0)
+        order.push_back(i);
+    }
+    for (size_t k = 0; k < order.size(); ++k) {
+      for (size_t successor : nodes_[order[k]].successors) {
+        if (--pending[successor] == 0)
+          order.push_back(successor);
+      }
+    }
+    if (order.size() != nodes_.size())
+      throw std::invalid_argument("psched: task graph has a cycle");
+    return order;
+  }
+
+  void check(size_t node) const {
+    if (node >= nodes_.size())
+      throw std::out_of_range("psched: no such task graph node");
+  }
+
+public:
+  typedef size_t NodeId;
+
+  size_t size() const { return nodes_.size(); }
+
+  // Adds a task run at priority `level`
+  template <class F> NodeId add(size_t level, F &&task) {
+    nodes_.push_back(Node{Task(std::forward<F>(task)), level});
+    return nodes_.size() - 1;
+  }
+
+  template <class priority, class F> NodeId add(F &&task) {
+    return add(priority::value, std::forward<F>(task));
+  }
+
+  // `after` runs once `before` has completed
+  void precede(NodeId before, NodeId after) {
+    check(before);
+    check(after);
+    if (before == after)
+      throw std::invalid_argument("psched: a task graph node cannot precede itself");
+    nodes_[before].successors.push_back(after);
+    nodes_[after].predecessors += 1;
+  }
+
+  template <class Scheduler>
+  Future<void> run(Scheduler &scheduler, bool inherit_priority = false) {
+    const auto order = topological_order();
+    std::vector<size_t> levels(nodes_.size());
+    for (size_t i = 0; i < nodes_.size(); ++i)
+      levels[i] = nodes_[i].level;
+    if (inherit_priority) {
+      // Walk the graph backwards so every successor is final before its predecessors
+      for (auto i = order.rbegin(); i != order.rend(); ++i) {
+        for (size_t successor : nodes_[*i].successors)
+          levels[*i] = std::max(levels[*i], levels[successor]);
+      }
+    }
+
+    auto done = Future<void>::make_state([] {});
+    auto run = std::make_shared<detail::GraphRun<Scheduler>>(*this, scheduler, std::move(levels),
+                                                             done);
+    run->start(run);
+    return Future<void>(std::move(done));
+  }
+};
+
+namespace detail {
+
+template <class Scheduler>
+GraphRun<Scheduler>::GraphRun(TaskGraph &graph, Scheduler &scheduler, std::vector<size_t> levels,
+                              StateRef<Unit> done)
+    : graph_(graph), scheduler_(scheduler), pending_(new std::atomic<size_t>[graph.size()]),
+      levels_(std::move(levels)), done_(std::move(done)) {
+  for (size_t i = 0; i < graph.size(); ++i)
+    pending_[i].store(graph.nodes_[i].predecessors, std::memory_order_relaxed);
+}
+
+template <class Scheduler>
+template <class F>
+Task GraphRun<Scheduler>::node_task(size_t node, F &&run) const {
+  const Task &original = graph_.nodes_[node].task;
+  Task task(std::forward<F>(run));
+  task.set_deadline(original.deadline());
+  task.set_cost(original.cost());
+  return task;
+}
+
+template <class Scheduler>
+void GraphRun<Scheduler>::schedule(const std::shared_ptr<GraphRun> &self, size_t node) {
+  Task task = node_task(node, [self, node] { self->execute(self, node); });
+  task.on_dropped([self](const TaskStats &) {
+    self->failed_.store(true, std::memory_order_release);
+    self->finish();
+  });
+  scheduler_.schedule(levels_[node], std::move(task));
+}
+
+template <class Scheduler> void GraphRun<Scheduler>::start(const std::shared_ptr<GraphRun> &self) {
+  if (graph_.size() == 0) {
+    done_->run();
+    return;
+  }
+  // Count every source first, so the run cannot complete before all are scheduled
+  size_t sources = 0;
+  for (size_t i = 0; i < graph_.size(); ++i)
+    sources += graph_.nodes_[i].predecessors == 0;
+  active_.store(sources, std::memory_order_relaxed);
+  for (size_t i = 0; i < graph_.size(); ++i) {
+    if (graph_.nodes_[i].predecessors == 0) {
+      graph_.nodes_[i].task.save_arrival_time();
+      schedule(self, i);
+    }
+  }
+}
+
+template <class Scheduler>
+size_t GraphRun<Scheduler>::release(const std::shared_ptr<GraphRun> &self, size_t node) {
+  size_t next = none;
+  for (size_t successor : graph_.nodes_[node].successors) {
+    if (pending_[successor].fetch_sub(1, std::memory_order_acq_rel) != 1 ||
+        failed_.load(std::memory_order_acquire))
+      continue;
+    graph_.nodes_[successor].task.save_arrival_time();
+    active_.fetch_add(1, std::memory_order_relaxed);
+    if (next == none) {
+      next = successor;
+    } else if (levels_[successor] > levels_[next]) {
+      schedule(self, next);
+      next = successor;
+    } else {
+      schedule(self, successor);
+    }
+  }
+  return next;
+}
+
+template <class Scheduler>
+void GraphRun<Scheduler>::execute(const std::shared_ptr<GraphRun> &self, size_t node) {
+  graph_.nodes_[node].task();
+  // Run the most urgent ready successor on this worker, in a loop rather than
+  // nested, so long chains do not grow the stack
+  for (size_t next; (next = release(self, node)) != none; node = next) {
+    finish();
+    Task task = node_task(next, [this, next] { graph_.nodes_[next].task(); });
+    if (!scheduler_.run_here(levels_[next], task)) {
+      schedule(self, next);
+      return;
+    }
+  }
+  finish();
+}
+
+} // namespace detail
+
+} // namespace psched
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+// #include <psched/aging_policy.h>
+// #include <psched/task.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace psched {
+
+struct timer_resolution_tag {};
+
+// Tick length of the timer wheel behind `schedule_after`/`schedule_every`
+template <class D = std::chrono::milliseconds, size_t N = 1> struct timer_resolution {
+  static_assert(is_chrono_duration<D>::value, "Duration must be a std::chrono::duration");
+  static_assert(N > 0, "Timer resolution must be greater than zero");
+  typedef timer_resolution_tag option_tag;
+  typedef D type;
+  constexpr static D value = D(N);
+};
+
+// What a periodic timer does when a period elapses
+enum class timer_mode {
+  fixed_rate, // fire every `period` after the first expiration; missed periods are skipped
+  fixed_delay // fire `period` after the previous run completes
+};
+
+// Temporal behavior of a timer
+struct TimerStats {
+  size_t fired{0};    // Number of times the task was scheduled
+  // Fixed-rate periods skipped because the timer fell behind, or fixed-delay
+  // runs discarded by a bounded queue
+  size_t overruns{0};
+  // Lateness of an expiration: when the task was handed to the priority queue
+  // minus when it was due
+  std::chrono::nanoseconds last_jitter{0};
+  std::chrono::nanoseconds max_jitter{0};
+};
+
+namespace detail {
+
+struct TimerState {
+  Task task;
+  size_t level;                  // Priority level the task is scheduled at
+  uint64_t due;                  // Tick at which the timer expires next
+  uint64_t period;               // In ticks; 0 for one-shot timers
+  timer_mode mode;
+  std::atomic_bool cancelled{false};
+  std::atomic<size_t> fired{0};
+  std::atomic<size_t> overruns{0};
+  std::atomic<int64_t> last_jitter{0};
+  std::atomic<int64_t> max_jitter{0};
+
+  TimerState(Task t, size_t l, uint64_t d, uint64_t p, timer_mode m)
+      : task(std::move(t)), level(l), due(d), period(p), mode(m) {}
+};
+
+} // namespace detail
+
+// Handle to a timer created by `schedule_after`/`schedule_every`
+class Timer {
+  std::shared_ptr<detail::TimerState> state_;
+
+public:
+  Timer() = default;
+  explicit Timer(std::shared_ptr<detail::TimerState> state) : state_(std::move(state)) {}
+
+  // Stops future expirations; a task already handed to a queue still runs
+  void cancel() {
+    if (state_)
+      state_->cancelled = true;
+  }
+
+  TimerStats stats() const {
+    TimerStats stats;
+    if (state_) {
+      stats.fired = state_->fired;
+      stats.overruns = state_->overruns;
+      stats.last_jitter = std::chrono::nanoseconds(state_->last_jitter.load());
+      stats.max_jitter = std::chrono::nanoseconds(state_->max_jitter.load());
+    }
+    return stats;
+  }
+};
+
+// Hierarchical timing wheel driven by a single thread
+//
+// Four wheels of 256 slots each cover 2^32 ticks; a timer is placed in the
+// coarsest wheel that matches its distance from now and cascades down to
+// finer wheels as time advances. Inserting a timer is O(1): producers append
+// it to an incoming list which the timer thread files into the wheel.
+//
+// Expired timers are grouped by priority level and handed to `dispatch` in
+// one batch per level and tick.
+template <class Resolution, class Dispatch> class TimerWheel {
+  typedef std::chrono::steady_clock clock;
+  typedef std::shared_ptr<detail::TimerState> Entry;
+
+  constexpr static size_t wheels = 4;
+  constexpr static size_t slot_bits = 8;
+  constexpr static size_t slots = size_t(1) << slot_bits;
+  constexpr static uint64_t slot_mask = slots - 1;
+  constexpr static uint64_t max_delta = (uint64_t(1) << (wheels * slot_bits)) - 1;
+
+  Dispatch dispatch_;                           // Called with (level, first, last) batches
+  const size_t levels_;                         // Number of priority levels
+  std::vector<Entry> wheel_[wheels][slots];     // Timer thread only
+  std::vector<std::vector<Task>> expired_;      // Per-level batch of expired tasks
+  uint64_t tick_{0};                            // Current tick; timer thread only
+  size_t size_{0};                              // Timers in the wheel; timer thread only
+  const clock::time_point start_;               // Time point of tick 0
+  std::vector<Entry> incoming_;                 // Timers waiting to be filed
+  std::mutex mutex_;                            // Protects `incoming_` and `running_`
+  std::condition_variable wakeup_;              // Signals new timers and shutdown
+  bool running_{true};
+  std::thread thread_;
+
+  static uint64_t ticks(clock::duration d) {
+    const auto count = std::chrono::duration_cast<clock::duration>(Resolution::value).count();
+    return d.count() <= 0 ? 0 : static_cast<uint64_t>((d.count() + count - 1) / count);
+  }
+
+  clock::time_point time_of(uint64_t tick) const {
+    return start_ + std::chrono::duration_cast<clock::duration>(Resolution::value) * tick;
+  }
+
+  void file(Entry entry) {
+    const uint64_t due = entry->due;
+    if (due <= tick_) {
+      expire(std::move(entry));
+      return;
+    }
+    const uint64_t delta = std::min(due - tick_, max_delta);
+    size_t wheel = 0;
+    while (delta >> (slot_bits * (wheel + 1)))
+      wheel += 1;
+    // Timers beyond the last wheel are filed at its far end and re-filed later
+    const uint64_t slot_tick = (delta == max_delta) ? tick_ + max_delta : due;
+    wheel_[wheel][(slot_tick >> (slot_bits * wheel)) & slot_mask].push_back(std::move(entry));
+    size_ += 1;
+  }
+
+  void expire(Entry entry) {
+    if (entry->cancelled)
+      return;
+
+    const auto jitter =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - time_of(entry->due))
+            .count();
+    entry->last_jitter = jitter;
+    if (jitter > entry->max_jitter)
+      entry->max_jitter = jitter;
+    entry->fired += 1;
+
+    if (entry->period == 0) {
+      // Fires once, so the task can be moved out; it may be move-only
+      expired_[entry->level].push_back(std::move(entry->task));
+    } else if (entry->mode == timer_mode::fixed_rate) {
+      expired_[entry->level].push_back(entry->task);
+      entry->due += entry->period;
+      while (entry->due <= tick_) {
+        entry->due += entry->period;
+        entry->overruns += 1;
+      }
+      file(std::move(entry));
+    } else {
+      // Re-armed by the task itself once it completes, or when a bounded
+      // queue discards it
+      Entry self = entry;
+      Task task([this, self] {
+        Task task(self->task);
+        task();
+        rearm(self);
+      });
+      task.on_dropped([this, self](const TaskStats &) {
+        self->overruns += 1;
+        rearm(self);
+      });
+      expired_[entry->level].push_back(std::move(task));
+    }
+  }
+
+  void rearm(const Entry &entry) {
+    if (entry->cancelled)
+      return;
+    entry->due = ticks(clock::now() - start_) + entry->period;
+    add(entry);
+  }
+
+  void advance() {
+    tick_ += 1;
+    // Cascade coarser wheels whose slot comes due
+    for (size_t wheel = 1; wheel < wheels; ++wheel) {
+      if ((tick_ >> (slot_bits * (wheel - 1))) & slot_mask)
+        break;
+      auto &slot = wheel_[wheel][(tick_ >> (slot_bits * wheel)) & slot_mask];
+      std::vector<Entry> entries;
+      entries.swap(slot);
+      size_ -= entries.size();
+      for (auto &entry : entries)
+        file(std::move(entry));
+    }
+    auto &slot = wheel_[0][tick_ & slot_mask];
+    std::vector<Entry> entries;
+    entries.swap(slot);
+    size_ -= entries.size();
+    for (auto &entry : entries)
+      expire(std::move(entry));
+  }
+
+  void flush() {
+    for (size_t level = 0; level < levels_; ++level) {
+      auto &batch = expired_[level];
+      if (!batch.empty()) {
+        dispatch_(level, std::make_move_iterator(batch.begin()),
+                  std::make_move_iterator(batch.end()));
+        batch.clear();
+      }
+    }
+  }
+
+  void run() {
+    const auto resolution = std::chrono::duration_cast<clock::duration>(Resolution::value);
+    std::vector<Entry> incoming;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock{mutex_};
+        if (size_ == 0) {
+          // Nothing to time: sleep until a timer is added
+          wakeup_.wait(lock, [this] { return !incoming_.empty() || !running_; });
+          // Round down: a tick is only reached once it has fully elapsed, so
+          // filing a timer due at the current tick never fires it early
+          tick_ = static_cast<uint64_t>((clock::now() - start_) / resolution);
+        } else {
+          wakeup_.wait_until(lock, time_of(tick_ + 1), [this] { return !running_; });
+        }
+        if (!running_)
+          return;
+        incoming.swap(incoming_);
+      }
+
+      for (auto &entry : incoming)
+        file(std::move(entry));
+      incoming.clear();
+
+      const uint64_t now = (clock::now() - start_) / resolution;
+      while (tick_ < now)
+        advance();
+      flush();
+    }
+  }
+
+public:
+  TimerWheel(Dispatch dispatch, size_t levels)
+      : dispatch_(std::move(dispatch)), levels_(levels), expired_(levels), start_(clock::now()),
+        thread_([this] { run(); }) {}
+
+  ~TimerWheel() { stop(); }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      running_ = false;
+    }
+    wakeup_.notify_one();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  Timer add(Task task, size_t level, clock::duration delay, clock::duration period,
+            timer_mode mode) {
+    auto entry = std::make_shared<detail::TimerState>(
+        std::move(task), level, ticks(clock::now() + delay - start_), ticks(period), mode);
+    // A period shorter than one tick fires every tick
+    if (period > clock::duration::zero() && entry->period == 0)
+      entry->period = 1;
+    add(entry);
+    return Timer(std::move(entry));
+  }
+
+  void add(const Entry &entry) {
+    bool first;
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      first = incoming_.empty();
+      incoming_.push_back(entry);
+    }
+    if (first)
+      wakeup_.notify_one();
+  }
+};
+
+} // namespace psched
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+// #include <psched/clock.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace psched {
+
+struct tracing_tag {};
+
+// Record scheduler events for `PriorityScheduler::write_trace`
+//
+// Every thread that schedules or runs tasks records into its own ring of
+// `events_per_thread` events, overwriting the oldest ones, so recording
+// never blocks and never contends with other threads. Recorded events are
+// enqueue, dequeue, start and end of each task, aging promotions, tasks
+// discarded by `maintain_size`, cancelled tasks skipped, and workers parking
+// and waking up.
+template <bool enabled = true, size_t events_per_thread = 16384> struct trace_events {
+  typedef tracing_tag option_tag;
+  constexpr static bool value = enabled;
+  constexpr static size_t capacity = events_per_thread;
+  static_assert(capacity >= 2 && (capacity & (capacity - 1)) == 0,
+                "events_per_thread must be a power of two");
+};
+
+enum class trace_event : uint8_t {
+  enqueue, // `arg` tasks pushed at `level`; the id is 0 for a batch
+  dequeue, // Task taken by a worker
+  start,   // Task started running
+  end,     // Task completed
+  promote, // Task moved up to `level` by aging, from level `arg`
+  drop,    // `arg` tasks discarded at `level` to keep a bounded queue's size
+  cancel,  // Cancelled task skipped by a worker
+  park,    // Worker went to sleep
+  unpark   // Worker woke up
+};
+
+namespace detail {
+
+// Number of the calling thread, unique for the life of the process, unlike a
+// std::thread::id, which may be given to a new thread once one has exited
+inline uint64_t thread_serial() {
+  static std::atomic<uint64_t> threads{0};
+  static thread_local const uint64_t serial = threads.fetch_add(1, std::memory_order_relaxed) + 1;
+  return serial;
+}
+
+// Events recorded by one thread
+//
+// Only the owning thread writes; readers copy the ring and keep the events
+// that cannot have been overwritten while they were copying. Fields are
+// relaxed atomics, which compile to plain stores. Once its thread has
+// exited, the ring can be handed over to a new thread with `reuse`.
+class TraceBuffer {
+  struct Slot {
+    std::atomic<int64_t> time{0};  // Nanoseconds since the tracer was created
+    std::atomic<uint64_t> id{0};   // Task id, 0 if not about a single task
+    std::atomic<uint64_t> data{0}; // Event type, level and argument, see `pack`
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  const uint64_t mask_;
+  std::atomic<uint64_t> head_{0}; // Events recorded so far
+  uint64_t next_id_;              // Last id handed out by this thread
+
+  static uint64_t pack(trace_event type, size_t level, uint64_t arg) {
+    return static_cast<uint64_t>(type) | (static_cast<uint64_t>(level) & 0xffffff) << 8 |
+           arg << 32;
+  }
+
+public:
+  struct Event {
+    int64_t time;
+    uint64_t id;
+    trace_event type;
+    size_t level;
+    uint64_t arg;
+  };
+
+  // `thread_serial` of the owner, 0 once it has given up the ring, and track
+  // name; protected by the tracer's mutex
+  uint64_t owner;
+  std::string name;
+
+  TraceBuffer(size_t capacity, size_t index, std::string name)
+      : slots_(new Slot[capacity]), mask_(capacity - 1), next_id_(uint64_t(index + 1) << 40),
+        owner(thread_serial()), name(std::move(name)) {}
+
+  // Hands the ring over to the calling thread, discarding the events of its
+  // previous owner; ids keep counting, so they stay unique
+  void reuse(std::string new_name) {
+    head_.store(0, std::memory_order_relaxed);
+    owner = thread_serial();
+    name = std::move(new_name);
+  }
+
+  // Unique across threads: the thread's index in the high bits
+  uint64_t next_id() { return ++next_id_; }
+
+  void record(int64_t time, trace_event type, uint64_t id, size_t level, uint64_t arg) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    Slot &slot = slots_[head & mask_];
+    slot.time.store(time, std::memory_order_relaxed);
+    slot.id.store(id, std::memory_order_relaxed);
+    slot.data.store(pack(type, level, arg), std::memory_order_relaxed);
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Events still in the ring, oldest first
+  std::vector<Event> events() const {
+    const uint64_t capacity = mask_ + 1;
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t first = head > capacity ? head - capacity : 0;
+    std::vector<Event> events;
+    events.reserve(head - first);
+    for (uint64_t i = first; i != head; ++i) {
+      const Slot &slot = slots_[i & mask_];
+      const uint64_t data = slot.data.load(std::memory_order_relaxed);
+      events.push_back(Event{slot.time.load(std::memory_order_relaxed),
+                             slot.id.load(std::memory_order_relaxed),
+                             static_cast<trace_event>(data & 0xff), (data >> 8) & 0xffffff,
+                             data >> 32});
+    }
+    // Slots the writer may have reused meanwhile, including the one it may
+    // be writing now, are not trusted
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t now = head_.load(std::memory_order_relaxed);
+    const uint64_t safe = now + 1 > capacity ? now + 1 - capacity : 0;
+    if (safe > first)
+      events.erase(events.begin(),
+                   events.begin() + static_cast<ptrdiff_t>(std::min(safe, head) - first));
+    return events;
+  }
+};
+
+} // namespace detail
+
+// Per-thread event rings and their export as Chrome trace-event JSON
+//
+// The JSON can be opened in Perfetto (ui.perfetto.dev) or chrome://tracing.
+// Each thread is a track; tasks are slices named after their priority level,
+// workers' sleeps are "parked" slices, and the other events are instants.
+// Every event about a task carries its id.
+//
+// A ring lives as long as the tracer. The ring of a thread that calls
+// `unregister_thread` before exiting, such as a retired worker of an elastic
+// pool, goes to the next new thread; the rings of other threads, e.g.,
+// short-lived producers, are kept with their events, so a program that keeps
+// starting new threads that record should unregister them.
+template <class Clock = TaskClock::source> class Tracer {
+  const size_t capacity_;
+  const uint64_t instance_;
+  const TaskStats::TimePoint origin_{Clock::now()};
+  mutable std::mutex mutex_; // Protects `buffers_`
+  std::vector<std::unique_ptr<detail::TraceBuffer>> buffers_;
+
+  static uint64_t next_instance() {
+    static std::atomic<uint64_t> instances{0};
+    return instances.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  struct Cache {
+    uint64_t instance;
+    detail::TraceBuffer *buffer;
+  };
+
+  // Ring of the calling thread for the last tracer it used
+  static Cache &cache() {
+    static thread_local Cache cache{0, nullptr};
+    return cache;
+  }
+
+  // Ring of the calling thread; takes over the ring of an exited thread, if
+  // any, before adding one
+  detail::TraceBuffer &local(const char *name = nullptr) {
+    Cache &cached = cache();
+    if (cached.instance == instance_)
+      return *cached.buffer;
+    std::lock_guard<std::mutex> lock{mutex_};
+    detail::TraceBuffer *buffer = nullptr;
+    size_t index = buffers_.size(); // First ring without an owner, if any
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      if (buffers_[i]->owner == detail::thread_serial())
+        buffer = buffers_[i].get();
+      else if (index == buffers_.size() && buffers_[i]->owner == 0)
+        index = i;
+    }
+    if (!buffer) {
+      std::string track = name ? name : "thread " + std::to_string(index);
+      if (index < buffers_.size())
+        buffers_[index]->reuse(std::move(track));
+      else
+        buffers_.emplace_back(new detail::TraceBuffer(capacity_, index, std::move(track)));
+      buffer = buffers_[index].get();
+    }
+    cached = Cache{instance_, buffer};
+    return *buffer;
+  }
+
+  // Writes `text` as the contents of a JSON string
+  static void write_escaped(std::ostream &out, const std::string &text) {
+    for (const char c : text) {
+      if (c == '"' || c == '\\') {
+        out << '\\' << c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+        out << escaped;
+      } else {
+        out << c;
+      }
+    }
+  }
+
+public:
+  explicit Tracer(size_t events_per_thread)
+      : capacity_(events_per_thread), instance_(next_instance()) {}
+
+  // Names the calling thread's track; call before it records anything
+  void register_thread(const std::string &name) { local(name.c_str()); }
+
+  // Gives the calling thread's ring up to a thread registered later; call
+  // right before the thread exits. Its events are written until then.
+  void unregister_thread() {
+    Cache &cached = cache();
+    if (cached.instance != instance_)
+      return;
+    std::lock_guard<std::mutex> lock{mutex_};
+    cached.buffer->owner = 0;
+    cached = Cache{0, nullptr};
+  }
+
+  // New task id, unique within this tracer
+  uint64_t next_id() { return local().next_id(); }
+
+  void record(trace_event type, uint64_t id, size_t level, uint64_t arg = 0) {
+    const auto time =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - origin_).count();
+    local().record(static_cast<int64_t>(time), type, id, level, arg);
+  }
+
+  // Writes the recorded events as Chrome trace-event JSON
+  //
+  // Threads keep recording while the trace is written; events they record
+  // meanwhile may or may not be included.
+  void write(std::ostream &out) const {
+    static const char *const instants[] = {"enqueue", "dequeue", "start", "end", "promote",
+                                           "drop",    "cancel",  "park",  "unpark"};
+    std::vector<std::pair<std::string, std::vector<detail::TraceBuffer::Event>>> threads;
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      for (auto &buffer : buffers_)
+        threads.emplace_back(buffer->name, buffer->events());
+    }
+
+    char line[256];
+    bool first = true;
+    const auto separate = [&out, &first] {
+      out << (first ? "\n" : ",\n");
+      first = false;
+    };
+    const auto emit = [&out, &separate, &line](int length) {
+      separate();
+      out.write(line, length);
+    };
+    const auto us = [](int64_t ns) { return static_cast<double>(ns) / 1000.0; };
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    for (size_t tid = 0; tid < threads.size(); ++tid) {
+      // Names are user-supplied, so they are escaped and may be of any length
+      separate();
+      out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << tid + 1
+          << ",\"args\":{\"name\":\"";
+      write_escaped(out, threads[tid].first);
+      out << "\"}}";
+      // Pair up starts with ends, and parks with unparks, into complete slices
+      const detail::TraceBuffer::Event *running = nullptr;
+      const detail::TraceBuffer::Event *parked = nullptr;
+      for (const auto &e : threads[tid].second) {
+        switch (e.type) {
+        case trace_event::start:
+          running = &e;
+          break;
+        case trace_event::end:
+          if (running && running->id == e.id) {
+            emit(snprintf(line, sizeof(line),
+                          "{\"ph\":\"X\",\"name\":\"priority %zu\",\"cat\":\"task\",\"pid\":1,"
+                          "\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%llu}}",
+                          e.level, tid + 1, us(running->time), us(e.time - running->time),
+                          static_cast<unsigned long long>(e.id)));
+          }
+          running = nullptr;
+          break;
+        case trace_event::park:
+          parked = &e;
+          break;
+        case trace_event::unpark:
+          if (parked) {
+            emit(snprintf(line, sizeof(line),
+                          "{\"ph\":\"X\",\"name\":\"parked\",\"cat\":\"worker\",\"pid\":1,"
+                          "\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                          tid + 1, us(parked->time), us(e.time - parked->time)));
+          }
+          parked = nullptr;
+          break;
+        default:
+          emit(snprintf(line, sizeof(line),
+                        "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"cat\":\"task\",\"pid\":1,"
+                        "\"tid\":%zu,\"ts\":%.3f,\"args\":{\"id\":%llu,\"level\":%zu,"
+                        "\"arg\":%llu}}",
+                        instants[static_cast<size_t>(e.type)], tid + 1, us(e.time),
+                        static_cast<unsigned long long>(e.id), e.level,
+                        static_cast<unsigned long long>(e.arg)));
+        }
+      }
+      // A task still running when the trace was taken
+      if (running) {
+        emit(snprintf(line, sizeof(line),
+                      "{\"ph\":\"B\",\"name\":\"priority %zu\",\"cat\":\"task\",\"pid\":1,"
+                      "\"tid\":%zu,\"ts\":%.3f,\"args\":{\"id\":%llu}}",
+                      running->level, tid + 1, us(running->time),
+                      static_cast<unsigned long long>(running->id)));
+      }
+    }
+    out << "\n]}\n";
+  }
+};
+
+} // namespace psched
+#pragma once
+#include <stddef.h>
+
+namespace psched {
+
+struct service_order_tag {};
+
+// Serve the highest non-empty priority level first (the default)
+struct strict_priority {
+  typedef service_order_tag option_tag;
+  constexpr static bool value = false;
+  constexpr static size_t number_of_weights = 0;
+  static size_t weight_of(size_t) { return 1; }
+};
+
+// Share the workers between priority levels in proportion to `weights`
+//
+// Instead of always serving the highest non-empty level, a worker serves the
+// non-empty level with the lowest virtual time (stride scheduling). Each task
+// run at a level advances that level's virtual time by `cost / weight`, where
+// the cost is `Task::set_cost` (1 by default). Over any busy period, levels
+// with waiting tasks get worker time in proportion to their weights,
+// measured in tasks or in cost units. A level that was empty does not bank
+// credit for the time it was idle. Ties go to the higher level.
+//
+// `weights...` lists the weight of each level, lowest level first; with no
+// weights, level `i` has weight `i + 1`, and levels past the end of the list
+// use its last weight. Weights can be changed at runtime with
+// `PriorityScheduler::set_weight`.
+//
+// No level can starve, so the aging policy is not used. With work stealing,
+// a worker compares levels across its own deques, the shared queues, its
+// peers' deques and the producer lanes, and takes the task that starts first;
+// only within a level does its own deque come first.
+template <size_t... weights> struct weighted_fair_queuing {
+  typedef service_order_tag option_tag;
+  constexpr static bool value = true;
+  constexpr static size_t number_of_weights = sizeof...(weights);
+  static_assert(((weights > 0 && weights <= (size_t(1) << 20)) && ... && true),
+                "weights must be between 1 and 2^20");
+
+  static size_t weight_of(size_t level) {
+    if (number_of_weights == 0)
+      return level + 1;
+    const size_t list[] = {weights..., 0};
+    return list[level < number_of_weights ? level : number_of_weights - 1];
+  }
+};
+
+} // namespace psched
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ostream>
+// #include <psched/admission.h>
+// #include <psched/aging_policy.h>
+// #include <psched/cancellation.h>
+// #include <psched/clock.h>
+// #include <psched/coroutine.h>
+// #include <psched/earliest_deadline_first.h>
+// #include <psched/elastic_pool.h>
+// #include <psched/event_count.h>
+// #include <psched/future.h>
+// #include <psched/idle_policy.h>
+// #include <psched/metrics.h>
+// #include <psched/occupancy_bitmap.h>
+// #include <psched/options.h>
+// #include <psched/producer_lanes.h>
+// #include <psched/strand.h>
+// #include <psched/task.h>
+// #include <psched/task_graph.h>
+// #include <psched/task_pool.h>
+// #include <psched/task_queue.h>
+// #include <psched/timer_wheel.h>
+// #include <psched/tracing.h>
+// #include <psched/weighted_fair_queuing.h>
+// #include <psched/work_stealing.h>
+// #include <psched/worker_groups.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace psched {
+
+template <size_t T> struct threads { constexpr static size_t value = T; };
+
+template <size_t P> struct priority { constexpr static size_t value = P; };
+
+template <class threads, class queues, class aging_policy, class... options>
+class PriorityScheduler {
+  // Task graphs hand a ready node straight to the worker that readied it
+  template <class Scheduler> friend class detail::GraphRun;
+
+  // Number of priority levels if fixed at compile time, else `dynamic_queues`
+  constexpr static size_t static_levels = queues::number_of_queues;
+
+  typedef typename find_option<idle_policy_tag, idle_policy<>, options...>::type idle;
+  typedef typename find_option<work_stealing_tag, work_stealing<false>, options...>::type stealing;
+  typedef typename find_option<task_order_tag, earliest_deadline_first<false>, options...>::type
+      deadline_order;
+  typedef typename std::conditional<deadline_order::value, DeadlineQueue<queues>,
+                                    TaskQueue<queues>>::type Queue;
+
+  // Producers may wait for room in a bounded queue
+  constexpr static bool bounded = queues::bounded_or_not;
+  constexpr static bool blocking =
+      bounded && queues::maintain_size::discard_policy == discard::block;
+  typedef typename find_option<timer_resolution_tag, timer_resolution<>, options...>::type
+      resolution;
+  typedef typename find_option<metrics_tag, collect_metrics<false>, options...>::type metrics;
+  static_assert(!metrics::value || TaskClock::enabled,
+                "collect_metrics needs task timestamps (PSCHED_TASK_TIMESTAMPS)");
+  typedef typename find_option<worker_groups_tag, worker_groups<>, options...>::type groups;
+
+  static_assert(groups::reserved_workers <= threads::value,
+                "worker groups need more workers than threads<N> provides");
+  static_assert(groups::reserved_workers < threads::value || groups::serves_every_level,
+                "no worker group serves priority level 0");
+
+  typedef typename find_option<elastic_pool_tag, elastic_pool<0>, options...>::type pool;
+  typedef typename find_option<tracing_tag, trace_events<false>, options...>::type tracing;
+  typedef typename find_option<producer_lanes_tag, producer_lanes<0>, options...>::type lanes;
+  constexpr static bool has_lanes = lanes::value > 0;
+  typedef detail::LaneRing<lanes::capacity> LaneRing;
+
+  // Weighted fair queuing instead of strict priority
+  typedef typename find_option<service_order_tag, strict_priority, options...>::type service;
+  constexpr static bool fair = service::value;
+  static_assert(!fair || service::number_of_weights == 0 || static_levels == dynamic_queues ||
+                    service::number_of_weights == static_levels,
+                "weighted_fair_queuing needs one weight per priority level");
+
+  // Virtual time of a level advances by `stride_scale / weight` per unit of cost
+  constexpr static uint64_t stride_scale = uint64_t(1) << 20;
+
+  // Workers beyond `threads::value` are started and retired by the pool manager
+  constexpr static size_t max_workers = std::max(threads::value, pool::value);
+  constexpr static bool elastic = max_workers > threads::value;
+
+  // One parking lot per worker group, plus one for the workers left over
+  constexpr static size_t number_of_lots = groups::number_of_groups + 1;
+
+  // Hands batches of expired timers to the priority queues (one at a time,
+  // waiting for room, with `discard::block`)
+  struct TimerDispatch {
+    PriorityScheduler *scheduler;
+    template <class Iterator> void operator()(size_t level, Iterator first, Iterator last) {
+      scheduler->schedule_bulk(level, first, last);
+    }
+  };
+
+  // State owned by one worker thread
+  struct Worker {
+    PriorityScheduler *scheduler;
+    // One deque per priority level, and the nodes of the tasks pushed onto
+    // them (work stealing only)
+    std::unique_ptr<WorkStealingDeque<detail::TaskNode *>[]> deques;
+    detail::TaskPool pool;
+    OccupancyBitmap occupancy; // Non-empty deques, as seen by the owner
+    size_t next_victim{0};     // Where the next stealing round starts
+    size_t next_lane{0};       // Producer lane visited last (producer lanes only)
+    // One set of histograms per priority level (metrics only)
+    std::unique_ptr<detail::WorkerLevelMetrics[]> metrics;
+    const size_t min_level; // Lowest priority level this worker serves
+    const size_t lot;       // Parking lot of the worker's group
+    const size_t index;     // Position in `workers_`
+    // Elastic pool only: when the running task started, 0 if idle; and
+    // whether an extra worker's thread is running
+    std::atomic<int64_t> busy_since{0};
+    std::atomic_bool active{false};
+    // Set once `set_up` has allocated the state above; until then, other
+    // threads skip the worker's deques and metrics
+    std::atomic_bool ready{false};
+
+    Worker(PriorityScheduler *s, size_t index, const WorkerPlacement &placement)
+        : scheduler(s), pool(0), occupancy(0), next_victim(index),
+          min_level(std::min(placement.min_level, s->levels_ - 1)), lot(placement.group),
+          index(index) {}
+
+    // Allocates the deques, node pool, occupancy bitmap and histograms. Called
+    // on the worker's own thread once it has been pinned, so that the memory
+    // the worker writes most is first touched, and placed, on its own node;
+    // an extra worker keeps its state when it retires.
+    void set_up() {
+      if (ready.load(std::memory_order_relaxed))
+        return;
+      const size_t levels = scheduler->levels_;
+      if (stealing::value) {
+        deques.reset(new WorkStealingDeque<detail::TaskNode *>[levels]);
+        pool.reserve(detail::TaskPool::slab_size);
+      }
+      occupancy = OccupancyBitmap(levels);
+      if (metrics::value)
+        metrics.reset(new detail::WorkerLevelMetrics[levels]);
+      ready.store(true, std::memory_order_release);
+    }
+  };
+
+  const size_t levels_;                                  // Number of priority levels
+  std::vector<std::thread> threads_{};                   // Scheduler thread pool
+  std::vector<std::unique_ptr<Worker>> workers_{};       // Per-worker state
+  std::unique_ptr<Queue[]> priority_queues_;             // Array of task queues
+  OccupancyBitmap occupancy_;                            // Non-empty task queues
+  OccupancyBitmap stealable_;       // Levels with tasks in some worker deque
+  std::atomic_bool running_{false}; // Is the scheduler running?
+  std::atomic<size_t> started_{0};  // Workers that have set up their state
+  // Parking lots for idle workers, one per worker group
+  std::unique_ptr<EventCount[]> idle_workers_{new EventCount[number_of_lots]};
+  size_t lot_min_level_[number_of_lots]; // Lowest level served by each lot's workers
+  size_t wake_order_[number_of_lots];    // Lots by descending lowest level
+  // Counters shared by producers, one per level (metrics only)
+  std::unique_ptr<detail::SharedLevelMetrics[]> level_metrics_;
+  // Producers waiting for room, one per level (bounded queues only)
+  std::unique_ptr<EventCount[]> room_;
+  std::unique_ptr<detail::AdmissionLimit[]> admission_; // Per-level limits for `try_schedule`
+  // Weighted fair queuing only: per-level virtual time and its increment per
+  // unit of cost, and the virtual time of the last task started
+  std::unique_ptr<std::atomic<uint64_t>[]> pass_;
+  std::unique_ptr<std::atomic<uint64_t>[]> stride_;
+  std::atomic<uint64_t> virtual_time_{0};
+  detail::StrandTable strands_; // Tasks scheduled with a key
+  std::unique_ptr<Tracer<>> tracer_; // Per-thread event rings (trace_events only)
+
+  // Lanes of one registered producer, one per priority level (producer lanes only)
+  struct Lane {
+    std::unique_ptr<LaneRing[]> rings; // Allocated on first registration, then reused
+    bool registered{false};            // Protected by `lanes_mutex_`
+  };
+  std::unique_ptr<Lane[]> lanes_;
+  std::vector<OccupancyBitmap> lanes_with_work_; // Per level: producers with tasks in their lane
+  OccupancyBitmap lane_levels_;                  // Levels with tasks in some lane
+  std::mutex lanes_mutex_;                       // Serializes registration
+  std::unique_ptr<TimerWheel<resolution, TimerDispatch>> timers_; // Started on first use
+  std::thread aging_thread_{};                // Promotes starved tasks
+  EventCount aging_idle_;                     // Parks the aging thread while nothing can starve
+  std::thread pool_thread_{};                 // Grows the pool (elastic pool only)
+  std::mutex background_mutex_;               // Protects `background_running_`
+  std::condition_variable background_wakeup_; // Signals shutdown to the threads above
+  bool background_running_{true};
+  std::atomic<int64_t> queued_{0}; // Tasks waiting to run (elastic pool only)
+  std::atomic<size_t> active_workers_{threads::value};
+  std::atomic<uint64_t> workers_started_{0};
+  std::atomic<uint64_t> workers_retired_{0};
+  std::once_flag timers_started_;
+
+  inline static thread_local Worker *current_worker_{nullptr}; // Worker running on this thread
+
+  static bool serves(size_t highest, size_t min_level) {
+    return highest != OccupancyBitmap::npos && highest >= min_level;
+  }
+
+  // Highest level below `below` (or at all, if `below` is `npos`) with a task
+  // in a shared queue or a producer lane
+  size_t highest_shared(size_t below = OccupancyBitmap::npos) const {
+    const auto highest = [below](const OccupancyBitmap &bits) {
+      return below == OccupancyBitmap::npos ? bits.highest() : bits.highest_below(below);
+    };
+    const size_t queued = highest(occupancy_);
+    if (!has_lanes)
+      return queued;
+    const size_t laned = highest(lane_levels_);
+    if (queued == OccupancyBitmap::npos || laned == OccupancyBitmap::npos)
+      return queued == OccupancyBitmap::npos ? laned : queued;
+    return std::max(queued, laned);
+  }
+
+  // Is there a task that `self` may run anywhere in the scheduler?
+  bool has_work(const Worker &self) const {
+    return serves(highest_shared(), self.min_level) ||
+           serves(stealable_.highest(), self.min_level);
+  }
+
+  // Wake up to `count` parked workers that serve `level`, preferring the
+  // group reserved for the highest levels
+  void notify(size_t level, size_t count) {
+    for (size_t lot : wake_order_) {
+      if (lot_min_level_[lot] <= level && idle_workers_[lot].notify(count))
+        return;
+    }
+  }
+
+  void start(size_t index) {
+    const auto placement = groups::placement(index);
+    pin_current_thread(placement.cpus);
+    if (tracing::value)
+      tracer_->register_thread("worker " + std::to_string(index));
+    workers_[index]->set_up();
+    started_.fetch_add(1, std::memory_order_release);
+    // Peers are needed for stealing
+    while (started_.load(std::memory_order_acquire) != threads::value)
+      std::this_thread::yield();
+    workers_[index]->active.store(true, std::memory_order_relaxed);
+    run(*workers_[index]);
+  }
+
+  void run(Worker &self) {
+    current_worker_ = &self;
+    auto &lot = idle_workers_[self.lot];
+    Task t;
+    size_t idle_rounds = 0;
+
+    while (true) {
+      // Run the highest priority ready task
+      if (try_run_one(self, t)) {
+        idle_rounds = 0;
+        continue;
+      }
+
+      if (!running_ && !has_work(self))
+        break;
+
+      // Nothing to do: spin, then yield, then park
+      if (idle_rounds < idle::park_after) {
+        idle::wait(idle_rounds++);
+        continue;
+      }
+      idle_rounds = 0;
+      const auto key = lot.prepare_wait();
+      if (has_work(self) || !running_) {
+        lot.cancel_wait();
+        continue;
+      }
+      trace(trace_event::park, 0, self.min_level);
+      if (!elastic || self.index < threads::value) {
+        lot.commit_wait(key);
+        trace(trace_event::unpark, 0, self.min_level);
+        continue;
+      }
+      // Extra workers retire once they have been idle for long enough
+      const bool woken = lot.commit_wait_for(key, pool::retire_after::value);
+      trace(trace_event::unpark, 0, self.min_level);
+      if (!woken && !has_work(self) && running_)
+        break;
+    }
+
+    if (elastic && self.index >= threads::value && running_) {
+      active_workers_.fetch_sub(1, std::memory_order_relaxed);
+      workers_retired_.fetch_add(1, std::memory_order_relaxed);
+      self.active.store(false, std::memory_order_release);
+    }
+    current_worker_ = nullptr;
+  }
+
+  // Pool manager (elastic pool only)
+  //
+  // Starts one extra worker per round while tasks pile up or a worker is
+  // stuck on a long task and others are waiting.
+  void manage_pool() {
+    std::unique_lock<std::mutex> lock{background_mutex_};
+    while (!background_wakeup_.wait_for(lock, pool::interval(),
+                                        [this] { return !background_running_; })) {
+      const int64_t queued = queued_.load(std::memory_order_relaxed);
+      if (queued <= 0 || active_workers_.load(std::memory_order_relaxed) >= max_workers)
+        continue;
+      bool grow = queued > static_cast<int64_t>(pool::queued_threshold);
+      if (!grow) {
+        const int64_t blocked_since =
+            (std::chrono::steady_clock::now() -
+             std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                 pool::blocked_after::value))
+                .time_since_epoch()
+                .count();
+        for (auto &worker : workers_) {
+          const int64_t busy = worker->busy_since.load(std::memory_order_relaxed);
+          if (busy != 0 && busy < blocked_since) {
+            grow = true;
+            break;
+          }
+        }
+      }
+      if (grow)
+        start_extra_worker();
+    }
+  }
+
+  void start_extra_worker() {
+    for (size_t n = threads::value; n < max_workers; ++n) {
+      Worker &worker = *workers_[n];
+      if (worker.active.load(std::memory_order_acquire))
+        continue;
+      // Reap the thread of a worker that has retired
+      if (threads_[n].joinable())
+        threads_[n].join();
+      worker.active.store(true, std::memory_order_relaxed);
+      active_workers_.fetch_add(1, std::memory_order_relaxed);
+      workers_started_.fetch_add(1, std::memory_order_relaxed);
+      threads_[n] = std::thread([this, &worker] {
+        pin_current_thread(groups::placement(worker.index).cpus);
+        if (tracing::value)
+          tracer_->register_thread("worker " + std::to_string(worker.index));
+        worker.set_up();
+        run(worker);
+        // The next extra worker records into this thread's ring
+        if (tracing::value)
+          tracer_->unregister_thread();
+      });
+      return;
+    }
+  }
+
+  // Handle task starvation at lower priorities
+  //
+  // Runs on its own thread every `aging_policy::interval()`, off the workers'
+  // dequeue path. Every task that has waited longer than
+  // `task_starvation_after` at a level below the highest one is moved up by
+  // `increment_priority_by` levels; the promoted tasks keep their relative
+  // order and restart their wait at the new level. While no such task is
+  // queued, the thread parks until one is scheduled.
+  void age() {
+    typedef typename aging_policy::task_starvation_after starvation;
+    typename Queue::Batch starved;
+    std::vector<Task> starved_in_lanes;
+    std::unique_lock<std::mutex> lock{background_mutex_};
+    while (true) {
+      if (!may_starve()) {
+        lock.unlock();
+        const auto key = aging_idle_.prepare_wait();
+        // `stop` notifies after clearing `background_running_` under the lock
+        lock.lock();
+        const bool stopping = !background_running_;
+        lock.unlock();
+        if (stopping || may_starve())
+          aging_idle_.cancel_wait();
+        else
+          aging_idle_.commit_wait(key);
+        lock.lock();
+      }
+      if (background_wakeup_.wait_for(lock, aging_policy::interval(),
+                                      [this] { return !background_running_; }))
+        return;
+      // Promoting may wait for room in a bounded queue; `stop` and the pool
+      // manager must not wait with it
+      lock.unlock();
+      const auto cutoff =
+          TaskClock::now() -
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(starvation::value);
+      // Highest levels first, so a task is promoted at most once per round
+      for (size_t i = levels_ - 1; i-- > 0;) {
+        const auto new_priority =
+            std::min(i + aging_policy::increment_priority_by::value, levels_ - 1);
+        if (has_lanes && lane_levels_.test(i))
+          age_lanes(i, new_priority, cutoff, starved_in_lanes);
+        // Skip empty queues without touching them
+        if (!occupancy_.test(i))
+          continue;
+        if (priority_queues_[i].pop_arrived_before(cutoff, starved) == 0)
+          continue;
+        if (bounded)
+          room_[i].notify(starved.size());
+        promote(i, new_priority, starved);
+        mark_if_empty(i);
+      }
+      lock.lock();
+    }
+  }
+
+  // Is a task queued below the highest level, where it could starve?
+  bool may_starve() const {
+    return occupancy_.highest_below(levels_ - 1) != OccupancyBitmap::npos ||
+           (has_lanes && lane_levels_.highest_below(levels_ - 1) != OccupancyBitmap::npos);
+  }
+
+  // Wakes the aging thread, if it is parked, for a task queued at `level`
+  void wake_aging(size_t level) {
+    if (ages() && level + 1 < levels_)
+      aging_idle_.notify_one();
+  }
+
+  // Promotes the starved tasks of the producer lanes at level `i`
+  //
+  // A lane that a worker is draining is skipped until the next round.
+  void age_lanes(size_t i, size_t new_priority, TaskStats::TimePoint cutoff,
+                 std::vector<Task> &starved) {
+    const auto starving = [cutoff](const Task &t) { return t.stats_.arrival_time < cutoff; };
+    auto &producers = lanes_with_work_[i];
+    Task task;
+    for (size_t p = producers.highest(); p != OccupancyBitmap::npos;
+         p = producers.highest_below(p)) {
+      LaneRing &ring = lanes_[p].rings[i];
+      if (!ring.try_lock())
+        continue;
+      while (ring.try_pop_if(task, starving))
+        starved.emplace_back(std::move(task));
+      ring.unlock();
+    }
+    promote(i, new_priority, starved);
+    for (size_t p = producers.highest(); p != OccupancyBitmap::npos;
+         p = producers.highest_below(p))
+      mark_lane_if_empty(p, i);
+    lane_levels_.clear(i);
+    if (!producers.empty())
+      lane_levels_.set(i);
+  }
+
+  // Moves the starved tasks taken from level `from` to the back of the queue
+  // at `new_priority`, leaving `starved` empty; cancelled tasks are dropped
+  // instead
+  template <class Batch> void promote(size_t from, size_t new_priority, Batch &starved) {
+    count_cancelled(from, remove_cancelled(starved));
+    if (starved.empty())
+      return;
+    const size_t promoted = starved.size();
+    for (auto &task : starved)
+      trace(trace_event::promote, task.trace_id_, new_priority, from);
+    size_t discarded = 0;
+    if (blocking) {
+      // Wait for room like any other producer; workers drain the higher level first
+      for (auto &task : starved) {
+        if (!push_when_not_full(new_priority, task,
+                                std::chrono::steady_clock::time_point::max())) {
+          task.drop();
+          discarded += 1;
+        }
+      }
+    } else {
+      // Unbounded queues relink the tasks' nodes
+      priority_queues_[new_priority].push_batch(starved, discarded);
+    }
+    if (metrics::value)
+      level_metrics_[from].promoted.fetch_add(promoted, std::memory_order_relaxed);
+    count_dropped(new_priority, discarded);
+    // Set the new bit before the caller clears the old one so workers never
+    // see the scheduler empty and park in between
+    occupancy_.set(new_priority);
+    // Workers reserved for higher levels may be parked
+    notify(new_priority, promoted);
+    starved.clear();
+  }
+
+  bool try_run_one(Worker &self, Task &t) {
+    size_t level;
+    if (!stealing::value) {
+      if (!(fair ? try_pop_weighted(self, t, level) : try_pop_highest(self, t, level)))
+        return false;
+      return execute(self, t, level);
+    }
+
+    detail::TaskNode *node = nullptr;
+    if (fair) {
+      // Serve the level whose next task starts first in virtual time, from
+      // the local deque, the shared queue or a peer, in that order
+      const uint64_t now = virtual_time_.load(std::memory_order_relaxed);
+      uint64_t start = 0;
+      size_t i = earliest_level(self.occupancy, self.min_level, now, OccupancyBitmap::npos, start);
+      i = earliest_level(occupancy_, self.min_level, now, i, start);
+      i = earliest_level(stealable_, self.min_level, now, i, start);
+      if (has_lanes)
+        i = earliest_level(lane_levels_, self.min_level, now, i, start);
+      if (i == OccupancyBitmap::npos)
+        return false;
+      level = i;
+      if (self.occupancy.test(i) && self.deques[i].pop(node))
+        return run_node(self, node, level);
+      if (try_pop_level(self, t, i))
+        return execute(self, t, level);
+      if (stealable_.test(i) && try_steal_at(self, node, i)) {
+        if (metrics::value)
+          self.metrics[level].stolen.add(1);
+        return run_node(self, node, level);
+      }
+      // Raced with another worker; fall back to any level
+      if (try_pop_local(self, node, level))
+        return run_node(self, node, level);
+      if (try_pop_weighted(self, t, level))
+        return execute(self, t, level);
+      if (!try_steal(self, node, level))
+        return false;
+      if (metrics::value)
+        self.metrics[level].stolen.add(1);
+      return run_node(self, node, level);
+    }
+
+    // Serve whichever of the local deques, the shared queues (and producer
+    // lanes) and the peers' deques has the highest priority task, falling
+    // back to the others
+    const auto rank = [&self](size_t level) {
+      return serves(level, self.min_level) ? static_cast<long>(level) : -1;
+    };
+    const long local = rank(self.occupancy.highest());
+    const long shared = rank(highest_shared());
+    const long remote = rank(stealable_.highest());
+
+    if (local >= 0 && local >= shared && local >= remote && try_pop_local(self, node, level))
+      return run_node(self, node, level);
+    if (shared >= 0 && shared >= remote && try_pop_highest(self, t, level))
+      return execute(self, t, level);
+    if (try_steal(self, node, level)) {
+      if (metrics::value)
+        self.metrics[level].stolen.add(1);
+      return run_node(self, node, level);
+    }
+    if (try_pop_local(self, node, level))
+      return run_node(self, node, level);
+    if (try_pop_highest(self, t, level))
+      return execute(self, t, level);
+    return false;
+  }
+
+  // Runs a task taken from `level` and records its latencies
+  bool execute(Worker &self, Task &t, size_t level) {
+    if (elastic)
+      queued_.fetch_sub(1, std::memory_order_relaxed);
+    if (tracing::value) {
+      // Tasks scheduled in a batch get their id here
+      if (!t.trace_id_)
+        t.trace_id_ = tracer_->next_id();
+      trace(trace_event::dequeue, t.trace_id_, level);
+    }
+    if (t.is_cancelled()) {
+      trace(trace_event::cancel, t.trace_id_, level);
+      if (metrics::value)
+        self.metrics[level].cancelled.add(1);
+      t.drop();
+      return true;
+    }
+    if (fair)
+      charge(level, t.cost_);
+    // A task run while its worker waits for room in a full queue nests in
+    // another task; the outer task is busy again once it returns
+    const int64_t outer = elastic ? self.busy_since.load(std::memory_order_relaxed) : 0;
+    if (elastic) {
+      self.busy_since.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                            std::memory_order_relaxed);
+    }
+    trace(trace_event::start, t.trace_id_, level);
+    t();
+    trace(trace_event::end, t.trace_id_, level);
+    if (elastic)
+      self.busy_since.store(outer, std::memory_order_relaxed);
+    if (metrics::value)
+      self.metrics[level].record(t.stats_);
+    return true;
+  }
+
+  // Runs a task taken from a deque and returns its node to the pool it came from
+  bool run_node(Worker &self, detail::TaskNode *node, size_t level) {
+    execute(self, node->task, level);
+    self.pool.release(node);
+    return true;
+  }
+
+  // Drops the cancelled tasks, calling their `on_dropped` callbacks
+  static bool drop_if_cancelled(Task &t) {
+    if (!t.is_cancelled())
+      return false;
+    t.drop();
+    return true;
+  }
+
+  static size_t remove_cancelled(std::vector<Task> &tasks) {
+    const size_t count = tasks.size();
+    tasks.erase(std::remove_if(tasks.begin(), tasks.end(), drop_if_cancelled), tasks.end());
+    return count - tasks.size();
+  }
+
+  static size_t remove_cancelled(detail::TaskList &tasks) {
+    return tasks.release_if(drop_if_cancelled);
+  }
+
+  bool try_pop_local(Worker &self, detail::TaskNode *&node, size_t &level) {
+    for (size_t i = self.occupancy.highest(); i != self.occupancy.npos;
+         i = self.occupancy.highest()) {
+      if (self.deques[i].pop(node)) {
+        level = i;
+        return true;
+      }
+      // Only the owner pushes onto its deques, so an empty deque stays empty
+      self.occupancy.clear(i);
+    }
+    return false;
+  }
+
+  // One stealing round: try every worker at the highest stealable level
+  bool try_steal(Worker &self, detail::TaskNode *&node, size_t &level) {
+    for (size_t i = stealable_.highest(); serves(i, self.min_level); i = stealable_.highest()) {
+      if (try_steal_at(self, node, i)) {
+        level = i;
+        return true;
+      }
+      if (stealable_.test(i))
+        return false;
+    }
+    return false;
+  }
+
+  // Tries every worker at level `i`, clearing its stealable bit if all are empty
+  bool try_steal_at(Worker &self, detail::TaskNode *&node, size_t i) {
+    const size_t n = workers_.size();
+    for (size_t k = 0; k < n; ++k) {
+      const size_t victim = (self.next_victim + k) % n;
+      if (!workers_[victim]->ready.load(std::memory_order_acquire))
+        continue;
+      if (workers_[victim]->deques[i].steal(node)) {
+        self.next_victim = victim;
+        return true;
+      }
+    }
+    // Nothing left at this level; restore the bit if a push raced with the round
+    stealable_.clear(i);
+    for (auto &worker : workers_) {
+      if (worker->ready.load(std::memory_order_acquire) && !worker->deques[i].empty()) {
+        stealable_.set(i);
+        return false;
+      }
+    }
+    return false;
+  }
+
+  // Pops from the highest non-empty queue (or producer lane) that `self` serves
+  bool try_pop_highest(Worker &self, Task &t, size_t &level) {
+    // Jump straight to the highest non-empty queue
+    size_t i = highest_shared();
+    while (serves(i, self.min_level)) {
+      if (try_pop_level(self, t, i)) {
+        level = i;
+        return true;
+      }
+      // Lanes that other workers are draining keep their bit; look lower
+      i = has_lanes && lane_levels_.test(i) ? highest_shared(i) : highest_shared();
+    }
+    return false;
+  }
+
+  // Pops from the shared queue at level `i`, else from one of its producer lanes
+  bool try_pop_level(Worker &self, Task &t, size_t i) {
+    if (occupancy_.test(i) && try_pop_at(t, i))
+      return true;
+    if (!has_lanes || !lane_levels_.test(i))
+      return false;
+    if (try_pop_lane(self, t, i))
+      return true;
+    lane_levels_.clear(i);
+    if (!lanes_with_work_[i].empty())
+      lane_levels_.set(i);
+    return false;
+  }
+
+  // Pops from a producer lane at level `i`, visiting the lanes round-robin
+  // so that every producer is served; lanes locked by another worker are skipped
+  bool try_pop_lane(Worker &self, Task &t, size_t i) {
+    auto &producers = lanes_with_work_[i];
+    const size_t last = self.next_lane;
+    const auto visit = [&](size_t p) {
+      LaneRing &ring = lanes_[p].rings[i];
+      if (!ring.try_lock())
+        return false;
+      const bool popped = ring.try_pop(t);
+      ring.unlock();
+      if (popped) {
+        self.next_lane = p;
+        return true;
+      }
+      mark_lane_if_empty(p, i);
+      return false;
+    };
+    for (size_t p = producers.highest_below(last); p != OccupancyBitmap::npos;
+         p = producers.highest_below(p)) {
+      if (visit(p))
+        return true;
+    }
+    for (size_t p = producers.highest(); p != OccupancyBitmap::npos && p >= last;
+         p = producers.highest_below(p)) {
+      if (visit(p))
+        return true;
+    }
+    return false;
+  }
+
+  // Clear the bit of an empty producer lane; see `mark_if_empty`
+  void mark_lane_if_empty(size_t producer, size_t i) {
+    lanes_with_work_[i].clear(producer);
+    if (!lanes_[producer].rings[i].empty())
+      lanes_with_work_[i].set(producer);
+  }
+
+  // Pops from the queue at level `i`, clearing its occupancy bit if it is empty
+  bool try_pop_at(Task &t, size_t i) {
+    if (priority_queues_[i].try_pop(t)) {
+      if (bounded)
+        room_[i].notify(1);
+      return true;
+    }
+    mark_if_empty(i);
+    return false;
+  }
+
+  // Wrap-around safe comparison of virtual times
+  static bool before(uint64_t a, uint64_t b) { return static_cast<int64_t>(a - b) < 0; }
+
+  // Virtual time at which the next task of `level` starts; a level that was
+  // idle restarts at the current virtual time instead of using up credit
+  uint64_t start_of(size_t level, uint64_t now) const {
+    const uint64_t pass = pass_[level].load(std::memory_order_relaxed);
+    return before(pass, now) ? now : pass;
+  }
+
+  // Of `best` and the levels set in `bits` at or above `min_level`, the one
+  // whose next task starts first in virtual time; ties go to the higher level
+  size_t earliest_level(const OccupancyBitmap &bits, size_t min_level, uint64_t now, size_t best,
+                        uint64_t &best_start) const {
+    for (size_t i = bits.highest(); serves(i, min_level); i = bits.highest_below(i)) {
+      const uint64_t start = start_of(i, now);
+      if (best == OccupancyBitmap::npos || before(start, best_start) ||
+          (start == best_start && i > best)) {
+        best = i;
+        best_start = start;
+      }
+    }
+    return best;
+  }
+
+  // Pops from the shared queue (or producer lane) that `self` serves whose
+  // next task starts first in virtual time
+  bool try_pop_weighted(Worker &self, Task &t, size_t &level) {
+    while (true) {
+      const uint64_t now = virtual_time_.load(std::memory_order_relaxed);
+      uint64_t start = 0;
+      size_t i = earliest_level(occupancy_, self.min_level, now, OccupancyBitmap::npos, start);
+      if (has_lanes)
+        i = earliest_level(lane_levels_, self.min_level, now, i, start);
+      if (i == OccupancyBitmap::npos)
+        return false;
+      if (try_pop_level(self, t, i)) {
+        level = i;
+        return true;
+      }
+      // Lanes that other workers are draining
+      if (has_lanes && lane_levels_.test(i))
+        return false;
+    }
+  }
+
+  // Advances the virtual time of `level` past a task of `cost` that starts now
+  void charge(size_t level, uint64_t cost) {
+    const uint64_t now = virtual_time_.load(std::memory_order_relaxed);
+    const uint64_t stride = stride_[level].load(std::memory_order_relaxed);
+    uint64_t pass = pass_[level].load(std::memory_order_relaxed);
+    uint64_t start;
+    do {
+      start = before(pass, now) ? now : pass;
+    } while (!pass_[level].compare_exchange_weak(pass, start + stride * cost,
+                                                 std::memory_order_relaxed));
+    // The scheduler's virtual time is the latest start among running tasks
+    uint64_t current = now;
+    while (before(current, start) &&
+           !virtual_time_.compare_exchange_weak(current, start, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Clear the occupancy bit of an empty queue
+  //
+  // A producer may push between the failed pop and the clear, so the queue is
+  // checked again afterwards and the bit restored if it is no longer empty.
+  void mark_if_empty(size_t i) {
+    occupancy_.clear(i);
+    if (!priority_queues_[i].empty())
+      occupancy_.set(i);
+  }
+
+  void count_enqueued(size_t level, size_t count) {
+    if (elastic)
+      queued_.fetch_add(static_cast<int64_t>(count), std::memory_order_relaxed);
+    if (metrics::value)
+      level_metrics_[level].enqueued.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void count_dropped(size_t level, size_t count) {
+    if (tracing::value && count > 0)
+      trace(trace_event::drop, 0, level, count);
+    if (elastic && count > 0)
+      queued_.fetch_sub(static_cast<int64_t>(count), std::memory_order_relaxed);
+    if (metrics::value && count > 0)
+      level_metrics_[level].dropped.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void count_rejected(size_t level) {
+    if (metrics::value)
+      level_metrics_[level].rejected.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void count_cancelled(size_t level, size_t count) {
+    if (elastic && count > 0)
+      queued_.fetch_sub(static_cast<int64_t>(count), std::memory_order_relaxed);
+    if (metrics::value && count > 0)
+      level_metrics_[level].cancelled.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void trace(trace_event type, uint64_t id, size_t level, uint64_t arg = 0) {
+    if (tracing::value)
+      tracer_->record(type, id, level, arg);
+  }
+
+  // Gives `task` a trace id and records that it is being enqueued
+  void trace_enqueue(Task &task, size_t level) {
+    if (!tracing::value)
+      return;
+    task.trace_id_ = tracer_->next_id();
+    trace(trace_event::enqueue, task.trace_id_, level, 1);
+  }
+
+  static size_t checked_levels(size_t levels) {
+    if (levels == 0)
+      throw std::invalid_argument("psched: a scheduler needs at least one priority level");
+    if (static_levels != dynamic_queues && levels != static_levels)
+      throw std::invalid_argument("psched: number of levels is fixed by queues<count>");
+    return levels;
+  }
+
+  // Enqueue a task at a level known to be in range
+  // Tasks scheduled from inside a running task stay on the worker's own
+  // deque, unless the worker is reserved for higher levels or the queues are
+  // bounded (deques would hold tasks beyond the bound)
+  Worker *local_worker(size_t level) const {
+    Worker *self = current_worker_;
+    if (!stealing::value || bounded || !self || self->scheduler != this || level < self->min_level)
+      return nullptr;
+    return self;
+  }
+
+  bool try_push_local(size_t level, Task &task) {
+    Worker *self = local_worker(level);
+    if (!self)
+      return false;
+    task.save_arrival_time();
+    self->deques[level].push(self->pool.allocate(std::move(task)));
+    self->occupancy.set(level);
+    stealable_.set(level);
+    count_enqueued(level, 1);
+    notify(level, 1);
+    return true;
+  }
+
+  // Pushes `task` once its queue has room, waiting until `until` at the most;
+  // `task` is left untouched if this fails
+  bool push_when_not_full(size_t level, Task &task, std::chrono::steady_clock::time_point until) {
+    auto &queue = priority_queues_[level];
+    if (queue.try_push_if_not_full(std::move(task)))
+      return true;
+    if (!bounded)
+      return false;
+    while (true) {
+      const auto key = room_[level].prepare_wait();
+      if (queue.try_push_if_not_full(std::move(task))) {
+        room_[level].cancel_wait();
+        return true;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (!running_ || now >= until) {
+        room_[level].cancel_wait();
+        return false;
+      }
+      if (until == std::chrono::steady_clock::time_point::max())
+        room_[level].commit_wait(key);
+      else
+        room_[level].commit_wait_for(key, until - now);
+    }
+  }
+
+  // Runs `task` on the calling worker as if it had been scheduled at `level`
+  // and dequeued right away, skipping the queue; fails unless the caller is a
+  // worker of this scheduler that serves `level` and no task waits at a
+  // higher level
+  bool run_here(size_t level, Task &task) {
+    Worker *self = current_worker_;
+    level = clamp(level);
+    if (!self || self->scheduler != this || level < self->min_level)
+      return false;
+    const auto above = [level](size_t highest) {
+      return highest != OccupancyBitmap::npos && highest > level;
+    };
+    if (above(highest_shared()) ||
+        (stealing::value && (above(stealable_.highest()) || above(self->occupancy.highest()))))
+      return false;
+    trace_enqueue(task, level);
+    task.save_arrival_time();
+    count_enqueued(level, 1);
+    execute(*self, task, level);
+    return true;
+  }
+
+  // Pushes `task` once its queue has room, from a worker: waiting could wait
+  // for itself, so the worker runs queued tasks, highest priority first, until
+  // the task fits; fails once the scheduler is stopping
+  bool push_from_worker(Worker &self, size_t level, Task &task) {
+    Task next;
+    while (!priority_queues_[level].try_push_if_not_full(std::move(task))) {
+      if (!running_)
+        return false;
+      // Queues this worker does not serve are drained by other workers
+      if (!try_run_one(self, next))
+        std::this_thread::yield();
+    }
+    return true;
+  }
+
+  void schedule_at(size_t level, Task &&task) {
+    trace_enqueue(task, level);
+    if (try_push_local(level, task))
+      return;
+
+    // Enqueue task
+    size_t discarded = 0;
+    if (!blocking) {
+      priority_queues_[level].try_push(std::move(task), discarded);
+    } else if (current_worker_ && current_worker_->scheduler == this) {
+      if (!push_from_worker(*current_worker_, level, task)) {
+        task.drop();
+        discarded = 1;
+      }
+    } else if (!push_when_not_full(level, task, std::chrono::steady_clock::time_point::max())) {
+      // Only fails once the scheduler is stopping
+      task.drop();
+      discarded = 1;
+    }
+    occupancy_.set(level);
+    wake_aging(level);
+    count_enqueued(level, 1);
+    count_dropped(level, discarded);
+
+    // Wake up a parked worker, if any
+    notify(level, 1);
+  }
+
+  // Pushes onto the lane of a registered producer, or onto the shared queue
+  // if the lane is full
+  void schedule_on_lane(size_t producer, size_t level, Task &&task) {
+    uint64_t id = 0;
+    if (tracing::value)
+      task.trace_id_ = id = tracer_->next_id();
+    task.save_arrival_time();
+    if (!lanes_[producer].rings[level].try_push(std::move(task)))
+      return schedule_at(level, std::move(task));
+    trace(trace_event::enqueue, id, level, 1);
+    lanes_with_work_[level].set(producer);
+    lane_levels_.set(level);
+    wake_aging(level);
+    count_enqueued(level, 1);
+    notify(level, 1);
+  }
+
+  void unregister_producer(size_t producer) {
+    std::lock_guard<std::mutex> lock{lanes_mutex_};
+    lanes_[producer].registered = false;
+  }
+
+  // Schedules the next turn of the strand of `key`; if a bounded queue
+  // discards the turn, the strand's tasks are discarded with it
+  void schedule_turn(uint64_t key, size_t level) {
+    Task turn([this, key] { run_turn(key); });
+    turn.on_dropped([this, key](const TaskStats &) { strands_.drop(key); });
+    schedule_at(level, std::move(turn));
+  }
+
+  // Runs a batch of tasks from the strand of `key`, yielding the worker to
+  // other tasks if more are left
+  void run_turn(uint64_t key) {
+    Task task;
+    size_t level;
+    strands_.take_front(key, task);
+    for (size_t n = 1;; ++n) {
+      task();
+      const bool more = n < detail::StrandTable::batch_size;
+      if (!strands_.advance(key, level, more ? &task : nullptr))
+        return;
+      if (!more)
+        break;
+    }
+    schedule_turn(key, level);
+  }
+
+  // Enqueues `task` unless `level` is over its admission limit or its queue
+  // stays full until `until`; never discards a task
+  bool try_schedule_at(size_t level, Task &&task, std::chrono::steady_clock::time_point until) {
+    if (!admission_[level].try_acquire()) {
+      count_rejected(level);
+      return false;
+    }
+    trace_enqueue(task, level);
+    if (try_push_local(level, task))
+      return true;
+    if (!push_when_not_full(level, task, until)) {
+      count_rejected(level);
+      return false;
+    }
+    occupancy_.set(level);
+    wake_aging(level);
+    count_enqueued(level, 1);
+    notify(level, 1);
+    return true;
+  }
+
+  template <class Iterator> void schedule_bulk_at(size_t level, Iterator first, Iterator last) {
+    size_t count = 0;
+    if (Worker *self = local_worker(level)) {
+      const auto now = TaskClock::now();
+      for (; first != last; ++first, ++count) {
+        detail::TaskNode *node = self->pool.allocate(Task(*first));
+        node->task.stats_.arrival_time = now;
+        self->deques[level].push(node);
+      }
+      self->occupancy.set(level);
+      stealable_.set(level);
+    } else {
+      size_t discarded = 0;
+      count = priority_queues_[level].try_push_bulk(first, last, discarded);
+      occupancy_.set(level);
+      wake_aging(level);
+      count_dropped(level, discarded);
+    }
+    count_enqueued(level, count);
+    trace(trace_event::enqueue, 0, level, count);
+
+    notify(level, count);
+  }
+
+  // Levels above the highest one are clamped to it
+  size_t clamp(size_t level) const { return std::min(level, levels_ - 1); }
+
+  // Does the scheduler run an aging thread? Without timestamps every task
+  // would look starved; weighted fair queuing starves no level
+  bool ages() const { return levels_ > 1 && TaskClock::enabled && !fair; }
+
+  TimerWheel<resolution, TimerDispatch> &timers() {
+    std::call_once(timers_started_, [this] {
+      timers_.reset(new TimerWheel<resolution, TimerDispatch>(TimerDispatch{this}, levels_));
+    });
+    return *timers_;
+  }
+
+  template <class priority> static void check_priority() {
+    static_assert(static_levels == dynamic_queues || priority::value < static_levels,
+                  "priority out of range");
+  }
+
+public:
+  // `levels` is only needed with `queues<dynamic_queues>`
+  explicit PriorityScheduler(size_t levels = static_levels)
+      : levels_(checked_levels(levels)), priority_queues_(new Queue[levels_]),
+        occupancy_(levels_), stealable_(levels_),
+        level_metrics_(metrics::value ? new detail::SharedLevelMetrics[levels_] : nullptr),
+        room_(bounded ? new EventCount[levels_] : nullptr),
+        admission_(new detail::AdmissionLimit[levels_]),
+        pass_(fair ? new std::atomic<uint64_t>[levels_] : nullptr),
+        stride_(fair ? new std::atomic<uint64_t>[levels_] : nullptr),
+        tracer_(tracing::value ? new Tracer<>(tracing::capacity) : nullptr),
+        lanes_(has_lanes ? new Lane[lanes::value] : nullptr), lane_levels_(levels_) {
+    for (size_t i = 0; has_lanes && i < levels_; ++i)
+      lanes_with_work_.emplace_back(lanes::value);
+    for (size_t i = 0; fair && i < levels_; ++i) {
+      pass_[i].store(0, std::memory_order_relaxed);
+      stride_[i].store(stride_scale / service::weight_of(i), std::memory_order_relaxed);
+    }
+    for (size_t lot = 0; lot < number_of_lots; ++lot) {
+      lot_min_level_[lot] = std::min(groups::min_level_of(lot), levels_ - 1);
+      wake_order_[lot] = lot;
+    }
+    std::stable_sort(wake_order_, wake_order_ + number_of_lots, [this](size_t a, size_t b) {
+      return lot_min_level_[a] > lot_min_level_[b];
+    });
+    running_ = true;
+    workers_.resize(max_workers);
+    threads_.resize(max_workers);
+    // Every worker exists up front, so that it can be looked at while its
+    // thread is not running; its thread allocates the rest (see `set_up`)
+    for (size_t n = 0; n != max_workers; ++n)
+      workers_[n].reset(new Worker(this, n, groups::placement(n)));
+    for (size_t n = 0; n != threads::value; ++n) {
+      threads_[n] = std::thread([this, n] { start(n); });
+    }
+    while (started_.load(std::memory_order_acquire) != threads::value)
+      std::this_thread::yield();
+    if (ages())
+      aging_thread_ = std::thread([this] {
+        if (tracing::value)
+          tracer_->register_thread("aging");
+        age();
+      });
+    if (elastic)
+      pool_thread_ = std::thread([this] { manage_pool(); });
+  }
+
+  ~PriorityScheduler() { stop(); }
+
+  size_t levels() const { return levels_; }
+
+  // Schedules a copy of `task`; the same Task can be scheduled again later
+  template <class priority> void schedule(Task &task) { schedule<priority>(Task(task)); }
+
+  template <class priority> void schedule(const Task &task) { schedule<priority>(Task(task)); }
+
+  // Schedules a callable directly, e.g., `schedule<priority<1>>([] { ... })`
+  template <class priority, class F,
+            class = typename std::enable_if<
+                !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+  void schedule(F &&fn) {
+    schedule<priority>(Task(std::forward<F>(fn)));
+  }
+
+  template <class priority> void schedule(Task &&task) {
+    check_priority<priority>();
+    schedule_at(static_levels == dynamic_queues ? clamp(priority::value) : priority::value,
+                std::move(task));
+  }
+
+  // Schedules at a priority level computed at runtime; levels above the
+  // highest one are clamped to it
+  void schedule(size_t level, Task &&task) { schedule_at(clamp(level), std::move(task)); }
+
+  void schedule(size_t level, const Task &task) { schedule_at(clamp(level), Task(task)); }
+
+  template <class F, class = typename std::enable_if<
+                         !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+  void schedule(size_t level, F &&fn) {
+    schedule_at(clamp(level), Task(std::forward<F>(fn)));
+  }
+
+  // Scheduling handle of one producer thread, with a private lane per level
+  //
+  // Returned by `register_producer`. A producer's tasks go onto its own
+  // lanes, without a lock, unless a lane is full, in which case they go onto
+  // the shared queue. A Producer must not be used by two threads at the same
+  // time; destroying it frees its lanes for another producer, and the tasks
+  // still in them run as usual.
+  class Producer {
+    PriorityScheduler *scheduler_;
+    size_t index_;
+
+    friend class PriorityScheduler;
+    Producer(PriorityScheduler *scheduler, size_t index) : scheduler_(scheduler), index_(index) {}
+
+  public:
+    Producer(Producer &&other) noexcept : scheduler_(other.scheduler_), index_(other.index_) {
+      other.scheduler_ = nullptr;
+    }
+
+    Producer &operator=(Producer &&) = delete;
+
+    ~Producer() {
+      if (scheduler_)
+        scheduler_->unregister_producer(index_);
+    }
+
+    template <class priority, class F> void schedule(F &&fn) {
+      check_priority<priority>();
+      schedule(priority::value, std::forward<F>(fn));
+    }
+
+    template <class F> void schedule(size_t level, F &&fn) {
+      scheduler_->schedule_on_lane(index_, scheduler_->clamp(level), Task(std::forward<F>(fn)));
+    }
+  };
+
+  // Registers the calling producer thread; requires the `producer_lanes` option
+  //
+  // Throws std::out_of_range if `producer_lanes<N>` producers are already
+  // registered.
+  Producer register_producer() {
+    static_assert(has_lanes, "register_producer needs the producer_lanes option");
+    std::lock_guard<std::mutex> lock{lanes_mutex_};
+    for (size_t p = 0; p < lanes::value; ++p) {
+      Lane &lane = lanes_[p];
+      if (lane.registered)
+        continue;
+      if (!lane.rings)
+        lane.rings.reset(new LaneRing[levels_]);
+      lane.registered = true;
+      return Producer(this, p);
+    }
+    throw std::out_of_range("psched: every producer lane is taken (see producer_lanes<N>)");
+  }
+
+  // Schedules a task (or callable) on the strand of `key`
+  //
+  // Tasks scheduled with the same key never run at the same time and start in
+  // the order they were scheduled, so they can share state without a lock;
+  // tasks with different keys run in parallel. A worker that picks up a key
+  // runs up to 16 of its tasks in a row before yielding. Metrics count each
+  // such batch as a single task.
+  template <class priority, class F> void schedule(uint64_t key, F &&fn) {
+    check_priority<priority>();
+    schedule(priority::value, key, std::forward<F>(fn));
+  }
+
+  template <class F> void schedule(size_t level, uint64_t key, F &&fn) {
+    level = clamp(level);
+    if (strands_.push(key, Task(std::forward<F>(fn)), level))
+      schedule_turn(key, level);
+  }
+
+  // Schedules a task (or callable) unless it would overload `priority`
+  //
+  // Returns false, without discarding any queued task, if the level is over
+  // its admission limit (see `limit_admission`) or its bounded queue is full.
+  // A refused task is dropped without calling its `on_dropped` callback; the
+  // caller is expected to handle the refusal, e.g., by replying "busy".
+  template <class priority, class F> bool try_schedule(F &&fn) {
+    check_priority<priority>();
+    return try_schedule(priority::value, std::forward<F>(fn));
+  }
+
+  template <class F> bool try_schedule(size_t level, F &&fn) {
+    return try_schedule_at(clamp(level), Task(std::forward<F>(fn)),
+                           std::chrono::steady_clock::time_point::min());
+  }
+
+  // Like `try_schedule`, but waits up to `timeout` for room in a full queue
+  template <class priority, class Rep, class Period, class F>
+  bool try_schedule_for(std::chrono::duration<Rep, Period> timeout, F &&fn) {
+    check_priority<priority>();
+    return try_schedule_for(priority::value, timeout, std::forward<F>(fn));
+  }
+
+  template <class Rep, class Period, class F>
+  bool try_schedule_for(size_t level, std::chrono::duration<Rep, Period> timeout, F &&fn) {
+    return try_schedule_at(
+        clamp(level), Task(std::forward<F>(fn)),
+        std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+  }
+
+  // Limits `try_schedule` at `priority` to `tasks_per_second`, with bursts of
+  // up to `burst` tasks; a rate of zero removes the limit
+  //
+  // The limit is a token bucket kept in a single atomic. `schedule`, and the
+  // tasks the scheduler creates itself (continuations, graph nodes, timers),
+  // are never refused.
+  template <class priority> void limit_admission(double tasks_per_second, size_t burst = 1) {
+    check_priority<priority>();
+    limit_admission(priority::value, tasks_per_second, burst);
+  }
+
+  void limit_admission(size_t level, double tasks_per_second, size_t burst = 1) {
+    admission_[clamp(level)].set(tasks_per_second, burst);
+  }
+
+  // Changes the weight of `priority` (weighted fair queuing only)
+  //
+  // Takes effect from the next task run at the level; virtual time already
+  // used up is not rescaled.
+  template <class priority> void set_weight(size_t weight) {
+    check_priority<priority>();
+    set_weight(priority::value, weight);
+  }
+
+  void set_weight(size_t level, size_t weight) {
+    static_assert(fair, "set_weight needs the weighted_fair_queuing option");
+    if (weight == 0 || weight > stride_scale)
+      throw std::invalid_argument("psched: a weight must be between 1 and 2^20");
+    stride_[clamp(level)].store(stride_scale / weight, std::memory_order_relaxed);
+  }
+
+  // Schedules a task (or callable) that can be withdrawn until it starts
+  //
+  // Cancelling the returned token makes the worker that dequeues the task
+  // skip it and call its `on_dropped` callback. The task can keep a copy of the token to stop early once it has
+  // started. To cancel several tasks at once, give them the same token with
+  // `Task::set_cancellation` and schedule them as usual.
+  template <class priority, class F> CancellationToken schedule_cancellable(F &&fn) {
+    check_priority<priority>();
+    return schedule_cancellable(priority::value, std::forward<F>(fn));
+  }
+
+  template <class F> CancellationToken schedule_cancellable(size_t level, F &&fn) {
+    CancellationToken token;
+    Task task(std::forward<F>(fn));
+    task.set_cancellation(token);
+    schedule_at(clamp(level), std::move(task));
+    return token;
+  }
+
+  // Schedules `fn(args...)` and returns a Future for its result
+  //
+  // The callable, its arguments and the result share a single allocation; an
+  // exception thrown by `fn` is rethrown by `Future::get()`.
+  template <class priority, class F, class... Args> auto submit(F &&fn, Args &&... args) {
+    check_priority<priority>();
+    return submit(priority::value, std::forward<F>(fn), std::forward<Args>(args)...);
+  }
+
+  template <class F, class... Args> auto submit(size_t level, F &&fn, Args &&... args) {
+    auto body = [fn = typename std::decay<F>::type(std::forward<F>(fn)),
+                 arguments = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+      return std::apply(fn, std::move(arguments));
+    };
+    typedef decltype(body()) R;
+    auto state = Future<R>::make_state(std::move(body));
+    schedule_at(clamp(level), detail::fulfilling_task(state));
+    return Future<R>(std::move(state));
+  }
+
+#if defined(PSCHED_HAS_COROUTINES)
+  // Awaitable that resumes the calling coroutine as a task at `priority`
+  //
+  //   co_await scheduler.resume_on<priority<2>>();
+  //   // ... now running on a worker, at priority 2
+  template <class priority> detail::ResumeOn<PriorityScheduler> resume_on() {
+    check_priority<priority>();
+    return resume_on(priority::value);
+  }
+
+  detail::ResumeOn<PriorityScheduler> resume_on(size_t level) {
+    return detail::ResumeOn<PriorityScheduler>{*this, clamp(level)};
+  }
+
+  // Runs a CoTask on a worker at `priority` and returns a Future for its result
+  //
+  // Every time the coroutine suspends on `resume_on`, it is resumed by the
+  // worker that picks up its task; otherwise it runs until it completes.
+  template <class priority, class T> Future<T> spawn(CoTask<T> task) {
+    check_priority<priority>();
+    return spawn(priority::value, std::move(task));
+  }
+
+  template <class T> Future<T> spawn(size_t level, CoTask<T> task) {
+    typedef typename detail::state_type<T>::type stored_type;
+    detail::StateRef<stored_type> state(new detail::FutureState<stored_type>());
+    detail::drive(*this, clamp(level), std::move(task), state);
+    return Future<T>(std::move(state));
+  }
+#endif
+
+  // Schedules every task in [first, last) with a single queue operation and
+  // wakes up at most one idle worker per task
+  //
+  // With `discard::block`, tasks are pushed one at a time, waiting for room.
+  template <class priority, class Iterator> void schedule_bulk(Iterator first, Iterator last) {
+    check_priority<priority>();
+    schedule_bulk(static_levels == dynamic_queues ? clamp(priority::value) : priority::value,
+                  first, last);
+  }
+
+  template <class Iterator> void schedule_bulk(size_t level, Iterator first, Iterator last) {
+    level = clamp(level);
+    if (blocking) {
+      for (; first != last; ++first)
+        schedule_at(level, Task(*first));
+      return;
+    }
+    schedule_bulk_at(level, first, last);
+  }
+
+  template <class priority> void schedule_bulk(std::initializer_list<Task> tasks) {
+    schedule_bulk<priority>(tasks.begin(), tasks.end());
+  }
+
+  // Schedules every task in a container; tasks are moved out of an rvalue container
+  template <class priority, class Range> void schedule_bulk(Range &&tasks) {
+    if constexpr (std::is_lvalue_reference<Range>::value) {
+      schedule_bulk<priority>(std::begin(tasks), std::end(tasks));
+    } else {
+      schedule_bulk<priority>(std::make_move_iterator(std::begin(tasks)),
+                              std::make_move_iterator(std::end(tasks)));
+    }
+  }
+
+  // Schedules `task` once `delay` has elapsed
+  //
+  // All timers share one thread running a hierarchical timing wheel, so
+  // adding a timer is O(1). Expirations fire on a tick boundary of the
+  // `timer_resolution` option (1ms by default) and never early.
+  template <class priority, class Rep, class Period, class F>
+  Timer schedule_after(std::chrono::duration<Rep, Period> delay, F &&task) {
+    check_priority<priority>();
+    return schedule_after(priority::value, delay, std::forward<F>(task));
+  }
+
+  template <class Rep, class Period, class F>
+  Timer schedule_after(size_t level, std::chrono::duration<Rep, Period> delay, F &&task) {
+    return timers().add(Task(std::forward<F>(task)), clamp(level),
+                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay),
+                        std::chrono::steady_clock::duration::zero(), timer_mode::fixed_rate);
+  }
+
+  // Schedules `task` every `period`, starting one period from now
+  //
+  // With `timer_mode::fixed_rate`, expirations stay on the original grid and
+  // periods missed while the timer thread fell behind are counted as overruns.
+  // With `timer_mode::fixed_delay`, the next period starts when a run completes
+  // or is discarded by a bounded queue (counted as an overrun).
+  template <class priority, class Rep, class Period, class F>
+  Timer schedule_every(std::chrono::duration<Rep, Period> period, F &&task,
+                       timer_mode mode = timer_mode::fixed_rate) {
+    check_priority<priority>();
+    return schedule_every(priority::value, period, std::forward<F>(task), mode);
+  }
+
+  template <class Rep, class Period, class F>
+  Timer schedule_every(size_t level, std::chrono::duration<Rep, Period> period, F &&task,
+                       timer_mode mode = timer_mode::fixed_rate) {
+    const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+    if (interval <= std::chrono::steady_clock::duration::zero())
+      throw std::invalid_argument("psched: a periodic timer needs a positive period");
+    Task periodic(std::forward<F>(task));
+    // Every expiration runs a copy of the task
+    if (!periodic.can_copy())
+      throw std::invalid_argument("psched: a periodic timer needs a copyable task");
+    return timers().add(std::move(periodic), clamp(level), interval, interval, mode);
+  }
+
+  // Merges the per-worker histograms and counters of every priority level
+  //
+  // Workers keep running while the snapshot is taken, so counters read at
+  // slightly different times may not add up exactly. Requires the
+  // `collect_metrics` option; otherwise every level reads as zero.
+  MetricsSnapshot metrics_snapshot() const {
+    MetricsSnapshot snapshot;
+    snapshot.levels.resize(levels_);
+    snapshot.pool.workers = active_workers_.load(std::memory_order_relaxed);
+    snapshot.pool.started = workers_started_.load(std::memory_order_relaxed);
+    snapshot.pool.retired = workers_retired_.load(std::memory_order_relaxed);
+    if (!metrics::value)
+      return snapshot;
+    for (size_t i = 0; i < levels_; ++i) {
+      auto &level = snapshot.levels[i];
+      level_metrics_[i].merge_into(level);
+      for (auto &worker : workers_) {
+        if (worker->ready.load(std::memory_order_acquire))
+          worker->metrics[i].merge_into(level);
+      }
+      level.executed = level.turnaround_time.count;
+    }
+    return snapshot;
+  }
+
+  // Writes the events recorded so far as Chrome trace-event JSON, which can
+  // be opened in Perfetto or chrome://tracing; requires the `trace_events`
+  // option. Workers keep running and recording meanwhile.
+  void write_trace(std::ostream &out) const {
+    static_assert(tracing::value, "write_trace needs the trace_events option");
+    tracer_->write(out);
+  }
+
+  void stop() {
+    // Stop timers first so no expiration races with the workers shutting down
+    if (timers_)
+      timers_->stop();
+    {
+      std::lock_guard<std::mutex> lock{background_mutex_};
+      background_running_ = false;
+    }
+    background_wakeup_.notify_all();
+    aging_idle_.notify_one();
+    if (aging_thread_.joinable())
+      aging_thread_.join();
+    if (pool_thread_.joinable())
+      pool_thread_.join();
     running_ = false;
-    ready_.notify_all();
-    for (auto &q : priority_queues_)
-      q.done();
+    for (size_t lot = 0; lot < number_of_lots; ++lot)
+      idle_workers_[lot].notify_all();
+    // Producers blocked on a full queue give up
+    for (size_t i = 0; bounded && i < levels_; ++i)
+      room_[i].notify_all();
+    for (size_t i = 0; i < levels_; ++i)
+      priority_queues_[i].done();
     for (auto &t : threads_)
       if (t.joinable())
         t.join();
@@ -0,0 +1,61 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <psched/priority_scheduler.h>
+#include <thread>
+#if defined(__linux__)
+#include <sys/resource.h>
+#endif
+using namespace psched;
+
+typedef aging_policy<task_starvation_after<std::chrono::milliseconds, 5>, increment_priority_by<1>>
+    fast_aging;
+
+#if defined(__linux__)
+// Voluntary context switches of the whole process so far
+static long context_switches() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw;
+}
+#endif
+
+// An idle scheduler does not wake up every aging interval
+static void parks_when_idle() {
+#if defined(__linux__)
+  PriorityScheduler<threads<2>, queues<3>, aging_policy<>> scheduler;
+  // Let the workers and the aging thread settle
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  const long before = context_switches();
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  // The default interval (1ms) would take about 200 wake-ups
+  CHECK(context_switches() - before < 20);
+#endif
+}
+
+// A task scheduled after the aging thread parked is still promoted
+static void wakes_up_for_new_tasks() {
+  PriorityScheduler<threads<1>, queues<3>, fast_aging, collect_metrics<true>> scheduler;
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  std::atomic<bool> release{false};
+  std::atomic<bool> started{false};
+  scheduler.schedule<priority<2>>([&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  std::atomic<bool> ran{false};
+  scheduler.schedule<priority<0>>([&ran] { ran = true; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  release = true;
+  while (!ran)
+    std::this_thread::yield();
+  CHECK(scheduler.metrics_snapshot().levels[0].promoted == 1);
+}
+
+int main() {
+  parks_when_idle();
+  wakes_up_for_new_tasks();
+}
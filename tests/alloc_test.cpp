@@ -0,0 +1,159 @@
+#include "check.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <psched/priority_scheduler.h>
+#include <thread>
+using namespace psched;
+
+// Calls to any form of global operator new, on any thread
+static std::atomic<size_t> allocations{0};
+
+void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  const size_t align = static_cast<size_t>(alignment);
+  // aligned_alloc wants a multiple of the alignment
+  if (void *p = std::aligned_alloc(align, (size + align - 1) / align * align))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size ? size : 1);
+}
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+
+// GCC cannot see that the replacements above allocate with malloc
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
+
+// Long enough that the aging thread never promotes anything during a test
+typedef aging_policy<task_starvation_after<std::chrono::seconds, 60>> no_aging;
+
+constexpr size_t round_size = 256;
+
+// Queues `round_size` tasks across the levels behind a busy worker, then
+// releases it and waits for all of them: every queue reaches this round's peak
+template <class Scheduler> static void fill_and_drain(Scheduler &scheduler) {
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+  std::atomic<size_t> done{0};
+  scheduler.schedule(2, [&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  for (size_t i = 0; i < round_size; ++i)
+    scheduler.schedule(i % 3, [&done] { done.fetch_add(1); });
+  release = true;
+  while (done != round_size)
+    std::this_thread::yield();
+}
+
+// Once a first round has grown the pools, a second round of the same size
+// makes no allocation
+template <class Scheduler> static void steady_state_does_not_allocate() {
+  Scheduler scheduler;
+  fill_and_drain(scheduler);
+  const size_t before = allocations.load();
+  fill_and_drain(scheduler);
+  fill_and_drain(scheduler);
+  CHECK(allocations.load() == before);
+}
+
+// The same with every task scheduled from inside a running task, onto the
+// worker's own deques, while the other worker steals
+static void work_stealing_does_not_allocate() {
+  PriorityScheduler<threads<2>, queues<3>, no_aging, work_stealing<>> scheduler;
+  // Schedules a round from inside `spawners` tasks that wait for one another,
+  // so that each runs on a different worker
+  auto round = [&scheduler](size_t spawners) {
+    std::atomic<size_t> started{0};
+    std::atomic<size_t> done{0};
+    for (size_t s = 0; s < spawners; ++s) {
+      scheduler.schedule(2, [&] {
+        started.fetch_add(1);
+        while (started != spawners)
+          std::this_thread::yield();
+        for (size_t i = 0; i < round_size; ++i)
+          scheduler.schedule(i % 3, [&done] { done.fetch_add(1); });
+      });
+    }
+    while (done != spawners * round_size)
+      std::this_thread::yield();
+  };
+  // Either worker may run a later round, so grow the deques of both
+  round(2);
+  const size_t before = allocations.load();
+  round(1);
+  round(1);
+  CHECK(allocations.load() == before);
+}
+
+// A Task stores a small callable inline; only one that does not fit goes to
+// the heap
+static void task_creation() {
+  int counter = 0;
+  size_t before = allocations.load();
+  {
+    Task task([&counter] { counter += 1; });
+    task();
+  }
+  CHECK(allocations.load() == before);
+  CHECK(counter == 1);
+
+  std::array<char, 1024> large{};
+  before = allocations.load();
+  {
+    Task task([large, &counter] { counter += large[0] + 1; });
+    task();
+  }
+  CHECK(allocations.load() == before + 1);
+  CHECK(counter == 2);
+}
+
+int main() {
+  task_creation();
+  // Unbounded queues, node pools
+  steady_state_does_not_allocate<PriorityScheduler<threads<1>, queues<3>, no_aging>>();
+  // Bounded rings
+  steady_state_does_not_allocate<PriorityScheduler<
+      threads<1>, queues<3, maintain_size<round_size, discard::block>>, no_aging>>();
+  // Bounded deadline queues
+  steady_state_does_not_allocate<
+      PriorityScheduler<threads<1>, queues<3, maintain_size<round_size, discard::block>>,
+                        no_aging, earliest_deadline_first<>>>();
+  // Unbounded deadline queues
+  steady_state_does_not_allocate<
+      PriorityScheduler<threads<1>, queues<3>, no_aging, earliest_deadline_first<>>>();
+  work_stealing_does_not_allocate();
+}
@@ -0,0 +1,137 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <psched/priority_scheduler.h>
+#include <thread>
+#include <vector>
+using namespace psched;
+typedef std::chrono::steady_clock Clock;
+
+typedef queues<1, maintain_size<2, discard::block>> blocking_queue;
+
+// Keeps the only worker busy until `release` is set
+struct Occupy {
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+
+  template <class Scheduler> void on(Scheduler &scheduler, size_t level = 0) {
+    scheduler.schedule(level, [this] {
+      started = true;
+      while (!release)
+        std::this_thread::yield();
+    });
+    while (!started)
+      std::this_thread::yield();
+  }
+};
+
+// `try_schedule` refuses a task once the queue is full, without dropping any
+// queued task; `try_schedule_for` waits for room up to its timeout
+static void try_schedule_when_full() {
+  PriorityScheduler<threads<1>, blocking_queue, aging_policy<>, collect_metrics<true>> scheduler;
+  Occupy occupy;
+  occupy.on(scheduler);
+  std::atomic<size_t> ran{0};
+  CHECK(scheduler.try_schedule<priority<0>>([&ran] { ran += 1; }));
+  CHECK(scheduler.try_schedule<priority<0>>([&ran] { ran += 1; }));
+  CHECK(!scheduler.try_schedule<priority<0>>([&ran] { ran += 1; }));
+  const auto start = Clock::now();
+  CHECK(!scheduler.try_schedule_for<priority<0>>(std::chrono::milliseconds(20),
+                                                 [&ran] { ran += 1; }));
+  CHECK(Clock::now() - start >= std::chrono::milliseconds(20));
+  // Room is made while waiting
+  std::thread releaser([&occupy] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    occupy.release = true;
+  });
+  CHECK(scheduler.try_schedule_for<priority<0>>(std::chrono::seconds(10), [&ran] { ran += 1; }));
+  releaser.join();
+  while (ran < 3)
+    std::this_thread::yield();
+  const auto level = scheduler.metrics_snapshot().levels[0];
+  CHECK(level.rejected == 2);
+  CHECK(level.dropped == 0);
+}
+
+// `schedule` onto a full `discard::block` queue waits until a worker has made
+// room, and drops nothing
+static void schedule_blocks_when_full() {
+  PriorityScheduler<threads<1>, blocking_queue, aging_policy<>> scheduler;
+  Occupy occupy;
+  occupy.on(scheduler);
+  std::atomic<size_t> ran{0};
+  std::atomic<size_t> dropped{0};
+  auto counted = [&] {
+    Task task([&ran] { ran += 1; });
+    task.on_dropped([&dropped](const TaskStats &) { dropped += 1; });
+    return task;
+  };
+  scheduler.schedule<priority<0>>(counted());
+  scheduler.schedule<priority<0>>(counted());
+  std::atomic<bool> returned{false};
+  std::thread producer([&] {
+    scheduler.schedule<priority<0>>(counted());
+    returned = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  CHECK(!returned);
+  occupy.release = true;
+  producer.join();
+  while (ran < 3)
+    std::this_thread::yield();
+  CHECK(dropped == 0);
+}
+
+// A worker scheduling onto a full queue runs queued tasks through the usual
+// path (in order, counted in the metrics) until its task fits
+static void worker_runs_queued_tasks_when_full() {
+  PriorityScheduler<threads<1>, blocking_queue, aging_policy<>, collect_metrics<true>> scheduler;
+  std::vector<int> order;
+  std::atomic<bool> done{false};
+  scheduler.schedule<priority<0>>([&] {
+    for (int i = 0; i < 100; ++i)
+      scheduler.schedule<priority<0>>([&order, i] { order.push_back(i); });
+    scheduler.schedule<priority<0>>([&done] { done = true; });
+  });
+  while (!done)
+    std::this_thread::yield();
+  CHECK(order.size() == 100);
+  for (int i = 0; i < 100; ++i)
+    CHECK(order[i] == i);
+  const auto level = scheduler.metrics_snapshot().levels[0];
+  CHECK(level.dropped == 0);
+  CHECK(level.executed == 102);
+}
+
+// An aging thread waiting for room to promote a task does not hold up the
+// pool manager, which starts a worker to make that room
+static void aging_does_not_block_pool() {
+  typedef aging_policy<task_starvation_after<std::chrono::milliseconds, 5>> fast_aging;
+  typedef elastic_pool<2, 64, retire_after<>, blocked_after<std::chrono::milliseconds, 20>> pool;
+  PriorityScheduler<threads<1>, queues<2, maintain_size<1, discard::block>>, fast_aging, pool>
+      scheduler;
+  std::atomic<bool> promoted_ran{false};
+  std::atomic<bool> timed_out{false};
+  std::atomic<bool> started{false};
+  scheduler.schedule<priority<1>>([&] {
+    started = true;
+    const auto deadline = Clock::now() + std::chrono::seconds(5);
+    while (!promoted_ran && !(timed_out = Clock::now() > deadline))
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  // Fill level 1, then starve a task at level 0: promoting it waits for room
+  scheduler.schedule<priority<1>>([] {});
+  scheduler.schedule<priority<0>>([&promoted_ran] { promoted_ran = true; });
+  while (!promoted_ran && !timed_out)
+    std::this_thread::yield();
+  CHECK(!timed_out);
+}
+
+int main() {
+  try_schedule_when_full();
+  schedule_blocks_when_full();
+  worker_runs_queued_tasks_when_full();
+  aging_does_not_block_pool();
+}
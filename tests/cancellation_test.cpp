@@ -0,0 +1,130 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <psched/priority_scheduler.h>
+#include <thread>
+using namespace psched;
+
+// Keeps the only worker busy until `release` is set
+struct Occupy {
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+
+  template <class Scheduler> void on(Scheduler &scheduler, size_t level = 0) {
+    scheduler.schedule(level, [this] {
+      started = true;
+      while (!release)
+        std::this_thread::yield();
+    });
+    while (!started)
+      std::this_thread::yield();
+  }
+};
+
+// Waits for a task scheduled after the others at `level` to run
+template <class Scheduler> static void drain(Scheduler &scheduler, size_t level = 0) {
+  std::atomic<bool> done{false};
+  scheduler.schedule(level, [&done] { done = true; });
+  while (!done)
+    std::this_thread::yield();
+}
+
+// A task cancelled while queued is skipped and its `on_dropped` callback runs;
+// the tasks around it run as usual
+static void queued_task_is_skipped() {
+  PriorityScheduler<threads<1>, queues<1>, aging_policy<>, collect_metrics<true>> scheduler;
+  Occupy occupy;
+  occupy.on(scheduler);
+  std::atomic<size_t> ran{0};
+  std::atomic<bool> cancelled_ran{false};
+  std::atomic<size_t> dropped{0};
+  scheduler.schedule<priority<0>>([&ran] { ran += 1; });
+  Task task([&cancelled_ran] { cancelled_ran = true; });
+  task.on_dropped([&dropped](const TaskStats &) { dropped += 1; });
+  CancellationToken token = scheduler.schedule_cancellable<priority<0>>(std::move(task));
+  scheduler.schedule<priority<0>>([&ran] { ran += 1; });
+  token.cancel();
+  occupy.release = true;
+  drain(scheduler);
+  CHECK(!cancelled_ran);
+  CHECK(dropped == 1);
+  CHECK(ran == 2);
+  const auto level = scheduler.metrics_snapshot().levels[0];
+  CHECK(level.cancelled == 1);
+  CHECK(level.dropped == 0);
+}
+
+// One token cancels every task that shares it
+static void shared_token() {
+  PriorityScheduler<threads<1>, queues<2>, aging_policy<>> scheduler;
+  Occupy occupy;
+  occupy.on(scheduler);
+  CancellationToken token;
+  std::atomic<size_t> ran{0};
+  std::atomic<size_t> dropped{0};
+  for (size_t i = 0; i < 6; ++i) {
+    Task task([&ran] { ran += 1; });
+    task.on_dropped([&dropped](const TaskStats &) { dropped += 1; });
+    task.set_cancellation(token);
+    scheduler.schedule(i % 2, std::move(task));
+  }
+  token.cancel();
+  occupy.release = true;
+  drain(scheduler);
+  CHECK(ran == 0);
+  CHECK(dropped == 6);
+}
+
+// A running task is not interrupted, but can poll the token and stop early;
+// it then completes as usual
+static void running_task_polls_token() {
+  PriorityScheduler<threads<1>, queues<1>, aging_policy<>> scheduler;
+  CancellationToken token;
+  std::atomic<bool> started{false};
+  std::atomic<bool> completed{false};
+  std::atomic<bool> dropped{false};
+  Task task([&started, token] {
+    started = true;
+    while (!token.is_cancelled())
+      std::this_thread::yield();
+  });
+  task.on_complete([&completed](const TaskStats &) { completed = true; });
+  task.on_dropped([&dropped](const TaskStats &) { dropped = true; });
+  task.set_cancellation(token);
+  scheduler.schedule<priority<0>>(std::move(task));
+  while (!started)
+    std::this_thread::yield();
+  token.cancel();
+  while (!completed)
+    std::this_thread::yield();
+  CHECK(!dropped);
+}
+
+// The aging thread drops a cancelled starved task instead of promoting it
+static void cancelled_task_is_not_promoted() {
+  typedef aging_policy<task_starvation_after<std::chrono::milliseconds, 5>> fast_aging;
+  PriorityScheduler<threads<1>, queues<2>, fast_aging, collect_metrics<true>> scheduler;
+  Occupy occupy;
+  occupy.on(scheduler, 1);
+  std::atomic<bool> ran{false};
+  std::atomic<bool> dropped{false};
+  Task task([&ran] { ran = true; });
+  task.on_dropped([&dropped](const TaskStats &) { dropped = true; });
+  scheduler.schedule_cancellable<priority<0>>(std::move(task)).cancel();
+  // Only the aging thread can reach the task while the worker is busy
+  while (!dropped)
+    std::this_thread::yield();
+  occupy.release = true;
+  drain(scheduler, 1);
+  CHECK(!ran);
+  const auto levels = scheduler.metrics_snapshot().levels;
+  CHECK(levels[0].cancelled == 1);
+  CHECK(levels[0].promoted == 0);
+}
+
+int main() {
+  queued_task_is_skipped();
+  shared_token();
+  running_task_polls_token();
+  cancelled_task_is_not_promoted();
+}
@@ -0,0 +1,102 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <psched/priority_scheduler.h>
+#include <thread>
+using namespace psched;
+
+// Long enough that the aging thread never promotes (and so never frees) a
+// task that fills a queue during a test
+typedef aging_policy<task_starvation_after<std::chrono::seconds, 60>> no_aging;
+
+typedef PriorityScheduler<threads<1>, queues<3, maintain_size<2, discard::newest_task>>, no_aging>
+    Scheduler;
+
+// Counts its live instances, to check that coroutine frames are destroyed
+struct Tracked {
+  static std::atomic<int> alive;
+  Tracked() { alive += 1; }
+  Tracked(const Tracked &) { alive += 1; }
+  ~Tracked() { alive -= 1; }
+};
+std::atomic<int> Tracked::alive{0};
+
+template <class T> static bool is_broken(Future<T> future) {
+  try {
+    future.get();
+  } catch (const std::future_error &e) {
+    return e.code() == std::future_errc::broken_promise;
+  }
+  return false;
+}
+
+static CoTask<int> hop(Scheduler &scheduler, Tracked) {
+  Tracked local;
+  co_await scheduler.resume_on<priority<2>>();
+  co_await scheduler.resume_on<priority<0>>();
+  co_return 42;
+}
+
+static CoTask<int> outer(Scheduler &scheduler, Tracked tracked) {
+  Tracked local;
+  co_return co_await hop(scheduler, tracked);
+}
+
+// Keeps the only worker busy until `release` is set
+static void occupy(Scheduler &scheduler, std::atomic<bool> &release) {
+  std::atomic<bool> started{false};
+  scheduler.schedule<priority<2>>([&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+}
+
+// A coroutine hops between levels and returns its result
+static void runs() {
+  {
+    Scheduler scheduler;
+    CHECK(scheduler.spawn<priority<1>>(outer(scheduler, Tracked())).get() == 42);
+  }
+  CHECK(Tracked::alive == 0);
+}
+
+// The task that starts a spawned coroutine is discarded
+static void discarded_start() {
+  {
+    Scheduler scheduler;
+    std::atomic<bool> release{false};
+    occupy(scheduler, release);
+    scheduler.schedule<priority<1>>([] {});
+    scheduler.schedule<priority<1>>([] {});
+    auto result = scheduler.spawn<priority<1>>(outer(scheduler, Tracked()));
+    CHECK(is_broken(std::move(result)));
+    release = true;
+  }
+  CHECK(Tracked::alive == 0);
+}
+
+// The task that resumes a nested coroutine after a hop is discarded
+static void discarded_resume() {
+  {
+    Scheduler scheduler;
+    std::atomic<bool> release{false};
+    occupy(scheduler, release);
+    // Level 0 is full when the coroutine hops there
+    scheduler.schedule<priority<0>>([] {});
+    scheduler.schedule<priority<0>>([] {});
+    auto result = scheduler.spawn<priority<2>>(outer(scheduler, Tracked()));
+    release = true;
+    CHECK(is_broken(std::move(result)));
+  }
+  CHECK(Tracked::alive == 0);
+}
+
+int main() {
+  runs();
+  discarded_start();
+  discarded_resume();
+}
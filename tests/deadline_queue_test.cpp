@@ -0,0 +1,113 @@
+#include "check.h"
+#include <chrono>
+#include <psched/deadline_queue.h>
+#include <random>
+#include <thread>
+#include <vector>
+using namespace psched;
+typedef std::chrono::steady_clock Clock;
+
+// Task that appends `id` to `log` when run, and `-id` when dropped
+static Task logging_task(int id, std::vector<int> &log, int64_t deadline_ms) {
+  Task task([id, &log] { log.push_back(id); });
+  task.on_dropped([id, &log](const TaskStats &) { log.push_back(-id); });
+  if (deadline_ms >= 0)
+    task.set_deadline(Clock::time_point(std::chrono::milliseconds(deadline_ms)));
+  return task;
+}
+
+template <class Queue> static void run_all(Queue &queue) {
+  Task task;
+  while (queue.try_pop(task))
+    task();
+}
+
+// Earliest deadline first, arrival order among equal deadlines, then tasks
+// without a deadline
+static void deadline_order() {
+  DeadlineQueue<queues<1>> queue;
+  std::vector<int> log;
+  size_t discarded;
+  queue.try_push(logging_task(1, log, -1), discarded);
+  queue.try_push(logging_task(2, log, 30), discarded);
+  queue.try_push(logging_task(3, log, 10), discarded);
+  queue.try_push(logging_task(4, log, 30), discarded);
+  queue.try_push(logging_task(5, log, -1), discarded);
+  queue.try_push(logging_task(6, log, 20), discarded);
+  run_all(queue);
+  CHECK((log == std::vector<int>{3, 6, 2, 4, 1, 5}));
+}
+
+// A full queue under discard::oldest_task drops the first arrival, whatever
+// its deadline, and keeps popping in deadline order
+static void drops_oldest() {
+  typedef queues<1, maintain_size<64, discard::oldest_task>> bounded;
+  DeadlineQueue<bounded> queue;
+  std::vector<int> log;
+  std::mt19937 random(7);
+  std::uniform_int_distribution<int> deadline(0, 1000);
+  std::vector<int> deadlines;
+  size_t discarded;
+  size_t total = 0;
+  for (int id = 1; id <= 1000; ++id) {
+    deadlines.push_back(deadline(random));
+    queue.try_push(logging_task(id, log, deadlines.back()), discarded);
+    total += discarded;
+    // Interleave pops so that removals happen all over the heap
+    if (id % 5 == 0) {
+      Task task;
+      CHECK(queue.try_pop(task));
+      task();
+    }
+  }
+  // Drops happen in arrival order
+  int last_dropped = 0;
+  size_t dropped = 0;
+  for (int id : log) {
+    if (id < 0) {
+      CHECK(-id > last_dropped);
+      last_dropped = -id;
+      dropped += 1;
+    }
+  }
+  CHECK(dropped == total);
+  // The survivors (the last push is followed by a pop) are newer than every
+  // dropped task, and pop in deadline order
+  log.clear();
+  run_all(queue);
+  CHECK(log.size() == 63);
+  for (size_t i = 1; i < log.size(); ++i) {
+    const int a = deadlines[log[i - 1] - 1];
+    const int b = deadlines[log[i] - 1];
+    CHECK(a < b || (a == b && log[i - 1] < log[i]));
+  }
+  for (int id : log)
+    CHECK(id > last_dropped);
+}
+
+// Aging takes the tasks that arrived before the cutoff, oldest first
+static void arrived_before() {
+  DeadlineQueue<queues<1>> queue;
+  std::vector<int> log;
+  size_t discarded;
+  for (int id = 1; id <= 5; ++id)
+    queue.try_push(logging_task(id, log, 100 - id), discarded);
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  const auto cutoff = TaskClock::now();
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  queue.try_push(logging_task(6, log, 0), discarded);
+  std::vector<Task> starved;
+  CHECK(queue.pop_arrived_before(cutoff, starved) == 5);
+  for (auto &task : starved)
+    task();
+  CHECK((log == std::vector<int>{1, 2, 3, 4, 5}));
+  run_all(queue);
+  CHECK(log.back() == 6);
+  CHECK(queue.empty());
+}
+
+int main() {
+  deadline_order();
+  drops_oldest();
+  arrived_before();
+}
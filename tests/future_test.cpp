@@ -0,0 +1,129 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <psched/priority_scheduler.h>
+#include <thread>
+using namespace psched;
+
+// Is `future` failed with std::future_errc::broken_promise?
+template <class T> static bool is_broken(Future<T> future) {
+  try {
+    future.get();
+  } catch (const std::future_error &e) {
+    return e.code() == std::future_errc::broken_promise;
+  }
+  return false;
+}
+
+// The result, or the exception, of a task reaches `get()`
+static void results() {
+  PriorityScheduler<threads<2>, queues<3>, aging_policy<>> scheduler;
+  auto sum = scheduler.submit<priority<1>>([](int a, int b) { return a + b; }, 2, 3);
+  CHECK(sum.get() == 5);
+  auto doubled = scheduler.submit<priority<0>>([] { return 21; })
+                     .then<priority<2>>(scheduler, [](int x) { return 2 * x; });
+  CHECK(doubled.get() == 42);
+  auto failed = scheduler.submit<priority<1>>([]() -> int { throw std::runtime_error("x"); });
+  bool threw = false;
+  try {
+    failed.get();
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+// A submitted task discarded by a bounded queue breaks its future
+template <discard discard_policy> static void discarded_submit() {
+  PriorityScheduler<threads<1>, queues<1, maintain_size<2, discard_policy>>, aging_policy<>>
+      scheduler;
+  // Keep the only worker busy so the queue fills up
+  std::atomic<bool> release{false};
+  std::atomic<bool> started{false};
+  scheduler.schedule(0, [&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  auto first = scheduler.submit(0, [] { return 1; });
+  auto second = scheduler.submit(0, [] { return 2; });
+  auto third = scheduler.submit(0, [] { return 3; });
+  release = true;
+  if (discard_policy == discard::newest_task) {
+    CHECK(first.get() == 1);
+    CHECK(second.get() == 2);
+    CHECK(is_broken(std::move(third)));
+  } else {
+    CHECK(is_broken(std::move(first)));
+    CHECK(second.get() == 2);
+    CHECK(third.get() == 3);
+  }
+}
+
+// A continuation discarded by a bounded queue breaks its future
+static void discarded_continuation() {
+  PriorityScheduler<threads<1>, queues<1, maintain_size<2, discard::newest_task>>, aging_policy<>>
+      scheduler;
+  std::atomic<bool> release{false};
+  std::atomic<bool> started{false};
+  scheduler.schedule<priority<0>>([&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  // The continuation is scheduled while two tasks fill the queue
+  auto first = scheduler.submit<priority<0>>([] { return 1; });
+  auto second = scheduler.submit<priority<0>>([] { return 2; });
+  Future<int> antecedent;
+  {
+    PriorityScheduler<threads<1>, queues<1>, aging_policy<>> other;
+    antecedent = other.submit<priority<0>>([] { return 1; });
+    antecedent.wait();
+  }
+  auto next = antecedent.then<priority<0>>(scheduler, [](int x) { return x + 1; });
+  release = true;
+  CHECK(first.get() == 1);
+  CHECK(second.get() == 2);
+  CHECK(is_broken(std::move(next)));
+}
+
+// Tasks still waiting for room are discarded by stop() under discard::block
+static void blocked_submit_at_stop() {
+  Future<int> blocked;
+  std::atomic<bool> release{false};
+  {
+    PriorityScheduler<threads<1>, queues<1, maintain_size<2, discard::block>>, aging_policy<>>
+        scheduler;
+    std::atomic<bool> started{false};
+    scheduler.schedule<priority<0>>([&] {
+      started = true;
+      while (!release)
+        std::this_thread::yield();
+    });
+    while (!started)
+      std::this_thread::yield();
+    auto first = scheduler.submit<priority<0>>([] { return 1; });
+    auto second = scheduler.submit<priority<0>>([] { return 2; });
+    std::thread producer([&] { blocked = scheduler.submit<priority<0>>([] { return 3; }); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::thread stopper([&] { scheduler.stop(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    release = true;
+    producer.join();
+    stopper.join();
+  }
+  CHECK(is_broken(std::move(blocked)));
+}
+
+int main() {
+  results();
+  discarded_submit<discard::newest_task>();
+  discarded_submit<discard::oldest_task>();
+  discarded_continuation();
+  blocked_submit_at_stop();
+}
@@ -0,0 +1,113 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <psched/priority_scheduler.h>
+#include <stdint.h>
+#include <thread>
+using namespace psched;
+typedef std::chrono::nanoseconds ns;
+
+// Histogram of the given values, each recorded `times` times
+template <class... Values> static HistogramSnapshot histogram_of(uint64_t times, Values... values) {
+  detail::LatencyHistogram histogram;
+  for (uint64_t value : {uint64_t(values)...})
+    for (uint64_t i = 0; i < times; ++i)
+      histogram.record(ns(value));
+  HistogramSnapshot snapshot;
+  histogram.merge_into(snapshot);
+  return snapshot;
+}
+
+// True if a reported value is at least `value` and within 12.5% of it
+static bool close_to(ns reported, uint64_t value) {
+  const uint64_t r = static_cast<uint64_t>(reported.count());
+  return r >= value && r <= value + value / 8;
+}
+
+// Every value maps to a bucket whose upper bound is within 12.5% above it,
+// and the buckets are in the order of the values
+static void buckets() {
+  size_t previous = 0;
+  for (uint64_t value = 0; value < (uint64_t(1) << 20); ++value) {
+    const size_t bucket = HistogramSnapshot::bucket_of(value);
+    CHECK(bucket == previous || bucket == previous + 1);
+    CHECK(close_to(ns(HistogramSnapshot::upper_bound(bucket)), value));
+    previous = bucket;
+  }
+  for (size_t bit = 20; bit < HistogramSnapshot::max_bit + 1; ++bit) {
+    const uint64_t value = (uint64_t(1) << bit) + 12345;
+    CHECK(close_to(ns(HistogramSnapshot::upper_bound(HistogramSnapshot::bucket_of(value))), value));
+  }
+  // Longer durations saturate in the last bucket
+  CHECK(HistogramSnapshot::bucket_of(UINT64_MAX) == HistogramSnapshot::buckets - 1);
+}
+
+// Percentiles of known inputs
+static void percentiles() {
+  CHECK(HistogramSnapshot().percentile(0.5) == ns(0));
+  // Small values are exact
+  auto small = histogram_of(1, 0, 1, 2, 3, 4, 5, 6, 7);
+  CHECK(small.count == 8);
+  CHECK(small.percentile(0.0) == ns(0));
+  CHECK(small.percentile(0.5) == ns(3));
+  CHECK(small.percentile(1.0) == ns(7));
+  CHECK(small.mean() == ns(3));
+  // 90% fast, 10% slow
+  auto bimodal = histogram_of(9, 100);
+  const auto slow = histogram_of(1, 1000000);
+  for (size_t i = 0; i < HistogramSnapshot::buckets; ++i)
+    bimodal.counts[i] += slow.counts[i];
+  bimodal.count += slow.count;
+  CHECK(close_to(bimodal.percentile(0.5), 100));
+  CHECK(close_to(bimodal.percentile(0.9), 100));
+  CHECK(close_to(bimodal.percentile(0.95), 1000000));
+  CHECK(close_to(bimodal.percentile(0.99), 1000000));
+  // A uniform distribution of 1..1000
+  detail::LatencyHistogram uniform;
+  for (uint64_t value = 1; value <= 1000; ++value)
+    uniform.record(ns(value));
+  HistogramSnapshot snapshot;
+  uniform.merge_into(snapshot);
+  CHECK(snapshot.count == 1000);
+  CHECK(snapshot.total == 500500);
+  CHECK(close_to(snapshot.percentile(0.5), 500));
+  CHECK(close_to(snapshot.percentile(0.9), 900));
+  CHECK(close_to(snapshot.percentile(0.99), 990));
+  CHECK(close_to(snapshot.percentile(1.0), 1000));
+  // Merging adds up counts
+  uniform.merge_into(snapshot);
+  CHECK(snapshot.count == 2000);
+  CHECK(close_to(snapshot.percentile(0.5), 500));
+}
+
+// The scheduler records the time each task ran
+static void scheduler_records_burst_time() {
+  PriorityScheduler<threads<1>, queues<2>, aging_policy<>, collect_metrics<true>> scheduler;
+  std::atomic<size_t> done{0};
+  for (int i = 0; i < 5; ++i) {
+    scheduler.schedule<priority<1>>([&done] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      done += 1;
+    });
+  }
+  while (done < 5)
+    std::this_thread::yield();
+  // The last task's metrics are recorded once it has returned
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  auto levels = scheduler.metrics_snapshot().levels;
+  while (levels[1].executed < 5 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+    levels = scheduler.metrics_snapshot().levels;
+  }
+  CHECK(levels[0].executed == 0);
+  CHECK(levels[1].executed == 5);
+  CHECK(levels[1].burst_time.count == 5);
+  CHECK(levels[1].burst_time.percentile(0.0) >= std::chrono::milliseconds(2));
+  CHECK(levels[1].turnaround_time.percentile(1.0) >= levels[1].burst_time.percentile(1.0));
+}
+
+int main() {
+  buckets();
+  percentiles();
+  scheduler_records_burst_time();
+}
@@ -0,0 +1,124 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <psched/occupancy_bitmap.h>
+#include <psched/priority_scheduler.h>
+#include <thread>
+#include <vector>
+using namespace psched;
+
+// Long enough that the aging thread never promotes anything during a test
+typedef aging_policy<task_starvation_after<std::chrono::seconds, 60>> no_aging;
+
+// `highest` and `highest_below` find set bits across word boundaries
+static void lookups() {
+  OccupancyBitmap bitmap(130);
+  CHECK(bitmap.empty());
+  CHECK(bitmap.highest() == OccupancyBitmap::npos);
+  for (size_t level : {0, 63, 64, 65, 129})
+    bitmap.set(level);
+  CHECK(bitmap.test(64));
+  CHECK(!bitmap.test(66));
+  CHECK(bitmap.highest() == 129);
+  CHECK(bitmap.highest_below(129) == 65);
+  CHECK(bitmap.highest_below(65) == 64);
+  CHECK(bitmap.highest_below(64) == 63);
+  CHECK(bitmap.highest_below(63) == 0);
+  CHECK(bitmap.highest_below(0) == OccupancyBitmap::npos);
+  bitmap.clear(129);
+  bitmap.clear(64);
+  CHECK(bitmap.highest() == 65);
+  CHECK(bitmap.highest_below(65) == 63);
+  for (size_t level : {0, 63, 65})
+    bitmap.clear(level);
+  CHECK(bitmap.empty());
+}
+
+// Producers count items into levels and set their bits; consumers take items
+// from the highest set level and clear a bit when its level looks empty, then
+// re-check, as the scheduler does. No item is ever left behind a clear bit.
+static void no_lost_set() {
+  constexpr size_t levels = 70;
+  constexpr size_t per_producer = 100000;
+  OccupancyBitmap bitmap(levels);
+  std::unique_ptr<std::atomic<size_t>[]> items(new std::atomic<size_t>[levels]);
+  for (size_t i = 0; i < levels; ++i)
+    items[i] = 0;
+  std::atomic<size_t> consumed{0};
+  std::atomic<bool> stalled{false};
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < 2; ++p) {
+    threads.emplace_back([&, p] {
+      for (size_t i = 0; i < per_producer; ++i) {
+        const size_t level = (i * 7 + p * 31) % levels;
+        items[level] += 1;
+        bitmap.set(level);
+      }
+    });
+  }
+  for (size_t c = 0; c < 2; ++c) {
+    threads.emplace_back([&] {
+      auto idle_since = std::chrono::steady_clock::now();
+      while (consumed < 2 * per_producer && !stalled) {
+        const size_t level = bitmap.highest();
+        if (level == OccupancyBitmap::npos) {
+          // An empty bitmap while items remain must only be transient
+          if (std::chrono::steady_clock::now() - idle_since > std::chrono::seconds(5))
+            stalled = true;
+          std::this_thread::yield();
+          continue;
+        }
+        idle_since = std::chrono::steady_clock::now();
+        size_t n = items[level].load();
+        while (n > 0 && !items[level].compare_exchange_weak(n, n - 1)) {
+        }
+        if (n > 0) {
+          consumed += 1;
+          continue;
+        }
+        bitmap.clear(level);
+        if (items[level].load() > 0)
+          bitmap.set(level);
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  CHECK(!stalled);
+  CHECK(consumed == 2 * per_producer);
+}
+
+// A scheduler with more levels than bits in a word runs tasks in priority
+// order across the words
+static void scheduler_across_words() {
+  PriorityScheduler<threads<1>, queues<130>, no_aging> scheduler;
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+  scheduler.schedule(129, [&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  std::vector<size_t> order;
+  std::atomic<bool> done{false};
+  for (size_t level : {3, 64, 129, 0, 63, 100, 65}) {
+    scheduler.schedule(level, [&order, &done, level] {
+      order.push_back(level);
+      if (level == 0)
+        done = true;
+    });
+  }
+  release = true;
+  while (!done)
+    std::this_thread::yield();
+  CHECK((order == std::vector<size_t>{129, 100, 65, 64, 63, 3, 0}));
+}
+
+int main() {
+  lookups();
+  no_lost_set();
+  scheduler_across_words();
+}
@@ -0,0 +1,122 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <psched/event_count.h>
+#include <psched/priority_scheduler.h>
+#include <thread>
+#include <vector>
+using namespace psched;
+typedef std::chrono::steady_clock Clock;
+
+// Long enough that the aging thread never promotes anything during a test
+typedef aging_policy<task_starvation_after<std::chrono::seconds, 60>> no_aging;
+
+// Idle workers park right away
+typedef idle_policy<spin<0>, yield<0>> park_now;
+
+// Waits until `done` holds, up to 5s; returns false on a timeout, which means
+// that a wake-up was lost
+template <class Condition> static bool wait_for(Condition done) {
+  const auto deadline = Clock::now() + std::chrono::seconds(5);
+  while (!done()) {
+    if (Clock::now() > deadline)
+      return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+// A waiter that re-checks its condition between `prepare_wait` and
+// `commit_wait` never sleeps through a notification
+static void event_count_does_not_lose_wakeups() {
+  constexpr size_t events = 100000;
+  EventCount event_count;
+  std::atomic<size_t> posted{0};
+  std::atomic<bool> lost{false};
+  std::thread waiter([&] {
+    for (size_t consumed = 0; consumed < events;) {
+      if (posted > consumed) {
+        consumed += 1;
+        continue;
+      }
+      const auto key = event_count.prepare_wait();
+      if (posted > consumed) {
+        event_count.cancel_wait();
+        continue;
+      }
+      if (!event_count.commit_wait_for(key, std::chrono::seconds(5)) && posted == consumed) {
+        lost = true;
+        return;
+      }
+    }
+  });
+  for (size_t i = 0; i < events; ++i) {
+    posted += 1;
+    event_count.notify_one();
+  }
+  waiter.join();
+  CHECK(!lost);
+}
+
+// Tasks scheduled one at a time, each once the workers have gone idle, wake
+// a parked worker every time
+static void parked_workers_wake_up() {
+  PriorityScheduler<threads<2>, queues<3>, no_aging, park_now> scheduler;
+  for (size_t round = 0; round < 2000; ++round) {
+    // Now and then, leave the workers time to park
+    if (round % 100 == 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::atomic<bool> ran{false};
+    scheduler.schedule(round % 3, [&ran] { ran = true; });
+    CHECK(wait_for([&ran] { return ran.load(); }));
+  }
+}
+
+// A task scheduled by a worker wakes another worker while the first one
+// stays busy
+static void worker_wakes_parked_worker() {
+  PriorityScheduler<threads<2>, queues<2>, no_aging, park_now> scheduler;
+  for (size_t round = 0; round < 500; ++round) {
+    std::atomic<bool> ran{false};
+    std::atomic<bool> release{false};
+    std::atomic<bool> finished{false};
+    scheduler.schedule<priority<1>>([&] {
+      scheduler.schedule<priority<0>>([&ran] { ran = true; });
+      while (!release)
+        std::this_thread::yield();
+      finished = true;
+    });
+    CHECK(wait_for([&ran] { return ran.load(); }));
+    release = true;
+    CHECK(wait_for([&finished] { return finished.load(); }));
+  }
+}
+
+// Bursts from several producers, separated by pauses in which the workers
+// park, all run
+static void bursts() {
+  PriorityScheduler<threads<3>, queues<3>, no_aging, park_now> scheduler;
+  constexpr size_t producers = 3;
+  constexpr size_t per_producer = 3000;
+  std::atomic<size_t> ran{0};
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < producers; ++p) {
+    threads.emplace_back([&] {
+      for (size_t i = 0; i < per_producer; ++i) {
+        if (i % 500 == 0)
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        scheduler.schedule(i % 3, [&ran] { ran += 1; });
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  CHECK(wait_for([&ran] { return ran == producers * per_producer; }));
+}
+
+int main() {
+  event_count_does_not_lose_wakeups();
+  parked_workers_wake_up();
+  worker_wakes_parked_worker();
+  bursts();
+}
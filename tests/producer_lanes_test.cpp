@@ -0,0 +1,132 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <psched/priority_scheduler.h>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+using namespace psched;
+
+// Long enough that the aging thread never promotes anything during a test
+typedef aging_policy<task_starvation_after<std::chrono::seconds, 60>> no_aging;
+
+// Keeps the only worker busy until `release` is set
+struct Occupy {
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+
+  template <class Scheduler> void on(Scheduler &scheduler) {
+    scheduler.schedule(0, [this] {
+      started = true;
+      while (!release)
+        std::this_thread::yield();
+    });
+    while (!started)
+      std::this_thread::yield();
+  }
+};
+
+// A producer's tasks fill its lane first, then go onto the shared queue,
+// where a bounded queue drops the overflow; the worker drains both
+static void lane_falls_back_when_full() {
+  PriorityScheduler<threads<1>, queues<1, maintain_size<2, discard::newest_task>>,
+                    aging_policy<>, producer_lanes<1, 4>>
+      scheduler;
+  Occupy occupy;
+  occupy.on(scheduler);
+  std::atomic<size_t> ran{0};
+  std::atomic<size_t> dropped{0};
+  {
+    auto producer = scheduler.register_producer();
+    for (int i = 0; i < 8; ++i) {
+      Task task([&ran] { ran += 1; });
+      task.on_dropped([&dropped](const TaskStats &) { dropped += 1; });
+      producer.schedule<priority<0>>(std::move(task));
+    }
+  }
+  // 4 in the lane, 2 in the shared queue
+  CHECK(dropped == 2);
+  occupy.release = true;
+  while (ran < 6)
+    std::this_thread::yield();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  CHECK(ran == 6);
+}
+
+// Lanes are drained in priority order
+static void lanes_follow_priorities() {
+  PriorityScheduler<threads<1>, queues<3>, no_aging, producer_lanes<1>> scheduler;
+  Occupy occupy;
+  occupy.on(scheduler);
+  std::vector<int> order;
+  std::atomic<bool> done{false};
+  {
+    auto producer = scheduler.register_producer();
+    producer.schedule<priority<0>>([&] {
+      order.push_back(0);
+      done = true;
+    });
+    producer.schedule<priority<2>>([&order] { order.push_back(2); });
+    producer.schedule<priority<1>>([&order] { order.push_back(1); });
+  }
+  occupy.release = true;
+  while (!done)
+    std::this_thread::yield();
+  CHECK((order == std::vector<int>{2, 1, 0}));
+}
+
+// Only `producer_lanes<N>` producers register at once; a lane is free again
+// once its Producer is destroyed
+static void registration() {
+  PriorityScheduler<threads<1>, queues<1>, aging_policy<>, producer_lanes<2>> scheduler;
+  auto first = scheduler.register_producer();
+  {
+    auto second = scheduler.register_producer();
+    bool thrown = false;
+    try {
+      scheduler.register_producer();
+    } catch (const std::out_of_range &) {
+      thrown = true;
+    }
+    CHECK(thrown);
+  }
+  auto third = scheduler.register_producer();
+  std::atomic<size_t> ran{0};
+  first.schedule<priority<0>>([&ran] { ran += 1; });
+  third.schedule<priority<0>>([&ran] { ran += 1; });
+  while (ran < 2)
+    std::this_thread::yield();
+}
+
+// Every task of concurrent producers runs once, with lanes overflowing onto
+// the shared queue and shared producers alongside
+static void concurrent_producers() {
+  PriorityScheduler<threads<2>, queues<2>, aging_policy<>, producer_lanes<3, 16>> scheduler;
+  constexpr size_t per_producer = 20000;
+  std::atomic<size_t> ran{0};
+  std::vector<std::thread> producers;
+  for (int p = 0; p < 3; ++p) {
+    producers.emplace_back([&] {
+      auto producer = scheduler.register_producer();
+      for (size_t i = 0; i < per_producer; ++i)
+        producer.schedule(i % 2, [&ran] { ran += 1; });
+    });
+  }
+  producers.emplace_back([&] {
+    for (size_t i = 0; i < per_producer; ++i)
+      scheduler.schedule(i % 2, [&ran] { ran += 1; });
+  });
+  for (auto &producer : producers)
+    producer.join();
+  while (ran < 4 * per_producer)
+    std::this_thread::yield();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  CHECK(ran == 4 * per_producer);
+}
+
+int main() {
+  lane_falls_back_when_full();
+  lanes_follow_priorities();
+  registration();
+  concurrent_producers();
+}
@@ -0,0 +1,87 @@
+#include "check.h"
+#include <atomic>
+#include <memory>
+#include <psched/priority_scheduler.h>
+#include <thread>
+#include <vector>
+using namespace psched;
+
+// Tasks of one key never overlap and run in the order they were scheduled,
+// across priorities and producers of other keys
+static void serial_fifo_per_key() {
+  PriorityScheduler<threads<4>, queues<3>, aging_policy<>> scheduler;
+  constexpr size_t keys = 16;
+  constexpr size_t per_key = 2000;
+  std::unique_ptr<std::atomic<bool>[]> running(new std::atomic<bool>[keys]);
+  std::vector<size_t> next(keys, 0); // Only touched by the tasks of each key
+  std::atomic<bool> overlap{false};
+  std::atomic<bool> out_of_order{false};
+  std::atomic<size_t> done{0};
+  for (size_t key = 0; key < keys; ++key)
+    running[key] = false;
+  // One producer per half of the keys
+  std::vector<std::thread> producers;
+  for (size_t half = 0; half < 2; ++half) {
+    producers.emplace_back([&, half] {
+      for (size_t i = 0; i < per_key; ++i) {
+        for (size_t key = half; key < keys; key += 2) {
+          scheduler.schedule(i % 3, key, [&, key, i] {
+            if (running[key].exchange(true))
+              overlap = true;
+            if (next[key] != i)
+              out_of_order = true;
+            next[key] = i + 1;
+            running[key] = false;
+            done += 1;
+          });
+        }
+      }
+    });
+  }
+  for (auto &producer : producers)
+    producer.join();
+  while (done < keys * per_key)
+    std::this_thread::yield();
+  CHECK(!overlap);
+  CHECK(!out_of_order);
+}
+
+// If a bounded queue discards a strand's turn, the strand's tasks are dropped
+// and the key can be used again once there is room
+static void discarded_turn() {
+  PriorityScheduler<threads<1>, queues<1, maintain_size<1, discard::newest_task>>, aging_policy<>>
+      scheduler;
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+  scheduler.schedule<priority<0>>([&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  std::atomic<bool> filler_ran{false};
+  scheduler.schedule<priority<0>>([&filler_ran] { filler_ran = true; }); // The queue is now full
+  std::atomic<size_t> ran{0};
+  std::atomic<size_t> dropped{0};
+  for (int i = 0; i < 3; ++i) {
+    Task task([&ran] { ran += 1; });
+    task.on_dropped([&dropped](const TaskStats &) { dropped += 1; });
+    scheduler.schedule<priority<0>>(7, std::move(task));
+  }
+  // Each task found its strand idle, and its turn was discarded with it
+  CHECK(dropped == 3);
+  CHECK(ran == 0);
+  release = true;
+  while (!filler_ran)
+    std::this_thread::yield();
+  std::atomic<bool> again{false};
+  scheduler.schedule<priority<0>>(7, [&again] { again = true; });
+  while (!again)
+    std::this_thread::yield();
+}
+
+int main() {
+  serial_fifo_per_key();
+  discarded_turn();
+}
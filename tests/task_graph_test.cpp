@@ -0,0 +1,150 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <psched/priority_scheduler.h>
+#include <thread>
+#include <vector>
+using namespace psched;
+
+// Long enough that the aging thread never promotes anything during a test
+typedef aging_policy<task_starvation_after<std::chrono::seconds, 60>> no_aging;
+
+// Every node runs after its predecessors, and the future becomes ready at the end
+static void dependency_order() {
+  PriorityScheduler<threads<4>, queues<3>, aging_policy<>, work_stealing<>> scheduler;
+  TaskGraph graph;
+  std::mutex mutex;
+  std::vector<size_t> order;
+  std::vector<TaskGraph::NodeId> nodes;
+  for (size_t i = 0; i < 64; ++i) {
+    nodes.push_back(graph.add(i % 3, [&mutex, &order, i] {
+      std::lock_guard<std::mutex> lock{mutex};
+      order.push_back(i);
+    }));
+  }
+  // Node i depends on nodes i / 2 and i - 1
+  for (size_t i = 1; i < nodes.size(); ++i) {
+    graph.precede(nodes[i - 1], nodes[i]);
+    if (i / 2 != i - 1)
+      graph.precede(nodes[i / 2], nodes[i]);
+  }
+  for (int run = 0; run < 3; ++run) {
+    order.clear();
+    graph.run(scheduler).get();
+    CHECK(order.size() == nodes.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      CHECK(order[i] == i);
+  }
+}
+
+// Nodes go through the scheduler, so metrics count them
+static void nodes_are_scheduled() {
+  PriorityScheduler<threads<2>, queues<3>, no_aging, collect_metrics<true>> scheduler;
+  TaskGraph graph;
+  auto a = graph.add<priority<0>>([] {});
+  auto b = graph.add<priority<1>>([] {});
+  auto c = graph.add<priority<2>>([] {});
+  graph.precede(a, b);
+  graph.precede(b, c);
+  graph.run(scheduler).get();
+  // The metrics of a task are recorded once it has returned
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  auto metrics = scheduler.metrics_snapshot();
+  while (metrics.levels[0].executed + metrics.levels[1].executed + metrics.levels[2].executed < 3 &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+    metrics = scheduler.metrics_snapshot();
+  }
+  for (size_t level = 0; level < 3; ++level)
+    CHECK(metrics.levels[level].executed == 1);
+}
+
+// A node discarded by a bounded queue fails the run instead of leaving it
+// pending, and the nodes that depend on it do not run
+static void discarded_node() {
+  PriorityScheduler<threads<1>, queues<1, maintain_size<2, discard::newest_task>>, aging_policy<>>
+      scheduler;
+  std::atomic<bool> release{false};
+  std::atomic<bool> started{false};
+  scheduler.schedule<priority<0>>([&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  TaskGraph graph;
+  std::atomic<int> sources{0};
+  std::atomic<bool> sink_ran{false};
+  auto sink = graph.add<priority<0>>([&sink_ran] { sink_ran = true; });
+  for (int i = 0; i < 3; ++i)
+    graph.precede(graph.add<priority<0>>([&sources] { sources += 1; }), sink);
+  // Only two of the three sources fit in the queue
+  auto done = graph.run(scheduler);
+  release = true;
+  bool broken = false;
+  try {
+    done.get();
+  } catch (const std::future_error &e) {
+    broken = e.code() == std::future_errc::broken_promise;
+  }
+  CHECK(broken);
+  CHECK(sources == 2);
+  CHECK(!sink_ran);
+}
+
+// The worker that finishes a node runs its ready successor next, ahead of
+// tasks already queued at the same level
+static void successor_is_handed_off() {
+  PriorityScheduler<threads<1>, queues<1>, aging_policy<>> scheduler;
+  std::atomic<bool> release{false};
+  std::atomic<bool> started{false};
+  scheduler.schedule<priority<0>>([&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  std::vector<char> order;
+  TaskGraph graph;
+  auto a = graph.add<priority<0>>([&order] { order.push_back('a'); });
+  auto b = graph.add<priority<0>>([&order] { order.push_back('b'); });
+  graph.precede(a, b);
+  auto done = graph.run(scheduler);
+  std::atomic<bool> last{false};
+  scheduler.schedule<priority<0>>([&order, &last] {
+    order.push_back('x');
+    last = true;
+  });
+  release = true;
+  done.get();
+  while (!last)
+    std::this_thread::yield();
+  CHECK((order == std::vector<char>{'a', 'b', 'x'}));
+}
+
+// A long chain of hand-offs runs in a loop, not nested on the stack
+static void long_chain() {
+  PriorityScheduler<threads<2>, queues<1>, aging_policy<>> scheduler;
+  TaskGraph graph;
+  size_t count = 0;
+  TaskGraph::NodeId last = graph.add<priority<0>>([&count] { count += 1; });
+  for (size_t i = 1; i < 200000; ++i) {
+    auto next = graph.add<priority<0>>([&count] { count += 1; });
+    graph.precede(last, next);
+    last = next;
+  }
+  graph.run(scheduler).get();
+  CHECK(count == 200000);
+}
+
+int main() {
+  dependency_order();
+  nodes_are_scheduled();
+  discarded_node();
+  successor_is_handed_off();
+  long_chain();
+}
@@ -0,0 +1,116 @@
+#include "check.h"
+#include <atomic>
+#include <psched/priority_scheduler.h>
+#include <thread>
+#include <vector>
+using namespace psched;
+
+// Task that appends `id` to `log` when run, and `-id` when dropped
+static Task logging_task(int id, std::vector<int> &log) {
+  Task task([id, &log] { log.push_back(id); });
+  task.on_dropped([id, &log](const TaskStats &) { log.push_back(-id); });
+  return task;
+}
+
+template <class Queue> static void run_all(Queue &queue) {
+  Task task;
+  while (queue.try_pop(task))
+    task();
+}
+
+// A bounded queue of size 1 holds exactly one task under either policy
+template <discard policy> static void holds_one_task() {
+  TaskQueue<queues<1, maintain_size<1, policy>>> queue;
+  std::vector<int> log;
+  size_t discarded;
+  size_t total = 0;
+  for (int id = 1; id <= 3; ++id) {
+    queue.try_push(logging_task(id, log), discarded);
+    total += discarded;
+  }
+  std::vector<Task> bulk;
+  bulk.push_back(logging_task(4, log));
+  bulk.push_back(logging_task(5, log));
+  queue.try_push_bulk(bulk.begin(), bulk.end(), discarded);
+  total += discarded;
+  CHECK(total == 4);
+  run_all(queue);
+  if (policy == discard::newest_task)
+    CHECK((log == std::vector<int>{-2, -3, -4, -5, 1}));
+  else
+    CHECK((log == std::vector<int>{-1, -2, -3, -4, 5}));
+  // Room again once the task has been popped
+  log.clear();
+  CHECK(queue.try_push_if_not_full(logging_task(6, log)));
+  CHECK(!queue.try_push_if_not_full(logging_task(7, log)));
+  run_all(queue);
+  CHECK((log == std::vector<int>{6}));
+}
+
+// Under concurrent producers and a consumer, every task pushed onto a queue
+// of size 1 either runs or is dropped, exactly once
+static void single_task_under_contention() {
+  TaskQueue<queues<1, maintain_size<1, discard::newest_task>>> queue;
+  std::atomic<size_t> ran{0};
+  std::atomic<size_t> dropped{0};
+  std::atomic<size_t> producing{4};
+  const size_t per_producer = 20000;
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < 4; ++p) {
+    threads.emplace_back([&] {
+      for (size_t i = 0; i < per_producer; ++i) {
+        Task task([&ran] { ran += 1; });
+        task.on_dropped([&dropped](const TaskStats &) { dropped += 1; });
+        size_t discarded;
+        queue.try_push(std::move(task), discarded);
+      }
+      producing -= 1;
+    });
+  }
+  threads.emplace_back([&] {
+    Task task;
+    while (producing > 0 || !queue.empty()) {
+      if (queue.try_pop(task))
+        task();
+    }
+  });
+  for (auto &t : threads)
+    t.join();
+  CHECK(ran + dropped == 4 * per_producer);
+}
+
+// The bound applies to the scheduler: with its worker busy, a queue of size 1
+// runs one of three waiting tasks and drops the others
+static void scheduler_holds_one_task() {
+  PriorityScheduler<threads<1>, queues<1, maintain_size<1, discard::newest_task>>,
+                    aging_policy<>>
+      scheduler;
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+  scheduler.schedule<priority<0>>([&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  std::atomic<size_t> ran{0};
+  std::atomic<size_t> dropped{0};
+  for (int i = 0; i < 3; ++i) {
+    Task task([&ran] { ran += 1; });
+    task.on_dropped([&dropped](const TaskStats &) { dropped += 1; });
+    scheduler.schedule<priority<0>>(std::move(task));
+  }
+  release = true;
+  while (ran + dropped < 3)
+    std::this_thread::yield();
+  CHECK(ran == 1);
+  CHECK(dropped == 2);
+}
+
+int main() {
+  holds_one_task<discard::newest_task>();
+  holds_one_task<discard::oldest_task>();
+  single_task_under_contention();
+  scheduler_holds_one_task();
+}
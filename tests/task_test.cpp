@@ -0,0 +1,68 @@
+#include "check.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <psched/priority_scheduler.h>
+#include <stdexcept>
+#include <thread>
+using namespace psched;
+
+// A callable that captures a std::unique_ptr can be stored, moved and run,
+// inline or on the heap, but copying it throws
+static void move_only_callables() {
+  int result = 0;
+  Task task([value = std::make_unique<int>(1), &result] { result += *value; });
+  Task moved(std::move(task));
+  moved();
+  CHECK(result == 1);
+  bool threw = false;
+  try {
+    Task copy(moved);
+  } catch (const std::logic_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+
+  std::array<char, 256> large{};
+  Task heap([value = std::make_unique<int>(2), large, &result] { result += *value + large[0]; });
+  Task moved_heap(std::move(heap));
+  moved_heap();
+  CHECK(result == 3);
+
+  // Copyable callables still copy
+  Task copyable([&result] { result += 1; });
+  Task copy(copyable);
+  copy();
+  copyable();
+  CHECK(result == 5);
+}
+
+// Move-only callables go through the scheduler, futures and one-shot timers;
+// a periodic timer, which runs copies of its task, refuses them
+static void move_only_scheduling() {
+  PriorityScheduler<threads<2>, queues<2>, aging_policy<>> scheduler;
+  std::atomic<int> ran{0};
+  scheduler.schedule<priority<1>>([value = std::make_unique<int>(1), &ran] { ran += *value; });
+  auto future =
+      scheduler.submit<priority<0>>([value = std::make_unique<int>(2)] { return *value; });
+  CHECK(future.get() == 2);
+  auto one = std::make_unique<int>(1);
+  scheduler.schedule_after<priority<0>>(std::chrono::milliseconds(1),
+                                        [value = std::move(one), &ran] { ran += *value; });
+  while (ran < 2)
+    std::this_thread::yield();
+  bool threw = false;
+  try {
+    scheduler.schedule_every<priority<0>>(std::chrono::milliseconds(1),
+                                          [value = std::make_unique<int>(1)] {});
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+int main() {
+  move_only_callables();
+  move_only_scheduling();
+}
@@ -0,0 +1,98 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <psched/priority_scheduler.h>
+#include <random>
+#include <thread>
+using namespace psched;
+typedef std::chrono::steady_clock Clock;
+
+// No one-shot timer expires before its delay, whether the wheel was idle or
+// already timing other timers when it was added
+static void never_early() {
+  PriorityScheduler<threads<2>, queues<2>, aging_policy<>> scheduler;
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> gap(0, 1500);
+  // Delays shorter than, equal to and longer than the 1ms tick
+  const std::chrono::microseconds delays[] = {std::chrono::microseconds(300),
+                                              std::chrono::microseconds(500),
+                                              std::chrono::microseconds(1000),
+                                              std::chrono::microseconds(2500)};
+  std::atomic<size_t> early{0};
+  std::atomic<size_t> fired{0};
+  const size_t trials = 200;
+  for (size_t i = 0; i < trials; ++i) {
+    // Land anywhere within a tick
+    std::this_thread::sleep_for(std::chrono::microseconds(gap(random)));
+    const auto delay = delays[i % 4];
+    const auto scheduled = Clock::now();
+    scheduler.schedule_after<priority<1>>(delay, [&, delay, scheduled] {
+      if (Clock::now() - scheduled < delay)
+        early += 1;
+      fired += 1;
+    });
+    // Every third timer is added while the previous ones are pending
+    if (i % 3 != 0) {
+      while (fired < i + 1)
+        std::this_thread::yield();
+    }
+  }
+  while (fired < trials)
+    std::this_thread::yield();
+  CHECK(early == 0);
+}
+
+// Periodic timers keep firing at about their period and stop when cancelled
+static void periodic() {
+  PriorityScheduler<threads<2>, queues<2>, aging_policy<>> scheduler;
+  std::atomic<size_t> runs{0};
+  const auto start = Clock::now();
+  Timer timer = scheduler.schedule_every<priority<0>>(std::chrono::milliseconds(2),
+                                                      [&runs] { runs += 1; });
+  while (runs < 10)
+    std::this_thread::yield();
+  CHECK(Clock::now() - start >= std::chrono::milliseconds(20));
+  timer.cancel();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  const size_t after_cancel = runs;
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  CHECK(runs == after_cancel);
+}
+
+// A fixed-delay timer whose run is discarded by a full queue is re-armed and
+// fires again once there is room
+static void rearms_when_dropped() {
+  PriorityScheduler<threads<1>, queues<1, maintain_size<2, discard::newest_task>>,
+                    aging_policy<>>
+      scheduler;
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+  auto occupy = [&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  };
+  scheduler.schedule<priority<0>>(occupy);
+  while (!started)
+    std::this_thread::yield();
+  // Fill the queue behind the busy worker
+  scheduler.schedule<priority<0>>([] {});
+  scheduler.schedule<priority<0>>([] {});
+  std::atomic<size_t> runs{0};
+  Timer timer = scheduler.schedule_every<priority<0>>(
+      std::chrono::milliseconds(2), [&runs] { runs += 1; }, timer_mode::fixed_delay);
+  while (timer.stats().overruns == 0)
+    std::this_thread::yield();
+  release = true;
+  const auto deadline = Clock::now() + std::chrono::seconds(5);
+  while (runs < 3 && Clock::now() < deadline)
+    std::this_thread::yield();
+  CHECK(runs >= 3);
+  timer.cancel();
+}
+
+int main() {
+  never_early();
+  periodic();
+  rearms_when_dropped();
+}
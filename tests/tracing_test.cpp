@@ -0,0 +1,70 @@
+#include "check.h"
+#include <psched/tracing.h>
+#include <sstream>
+#include <string>
+#include <thread>
+using namespace psched;
+
+// Number of occurrences of `needle` in `text`
+static size_t count(const std::string &text, const std::string &needle) {
+  size_t n = 0;
+  for (size_t i = text.find(needle); i != std::string::npos; i = text.find(needle, i + 1))
+    n += 1;
+  return n;
+}
+
+static std::string json_of(const Tracer<> &tracer) {
+  std::ostringstream out;
+  tracer.write(out);
+  return out.str();
+}
+
+// Thread names are escaped in the JSON, and written whole however long
+static void names_are_escaped() {
+  Tracer<> tracer(16);
+  const std::string long_name(300, 'x');
+  std::thread([&tracer] {
+    tracer.register_thread("say \"hi\" \\ bye\n");
+    tracer.record(trace_event::park, 0, 0);
+  }).join();
+  std::thread([&tracer, &long_name] {
+    tracer.register_thread(long_name);
+    tracer.record(trace_event::park, 0, 0);
+  }).join();
+  const std::string json = json_of(tracer);
+  CHECK(count(json, "\"name\":\"say \\\"hi\\\" \\\\ bye\\u000a\"") == 1);
+  CHECK(count(json, "\"name\":\"" + long_name + "\"") == 1);
+}
+
+// A thread that unregisters before it exits hands its ring over to the next
+// thread; other threads keep theirs
+static void rings_are_reused() {
+  Tracer<> tracer(16);
+  auto record = [&tracer](const std::string &name, bool unregister) {
+    std::thread([&tracer, &name, unregister] {
+      tracer.register_thread(name);
+      tracer.record(trace_event::park, 0, 0);
+      tracer.record(trace_event::unpark, 0, 0);
+      if (unregister)
+        tracer.unregister_thread();
+    }).join();
+  };
+  record("first", true);
+  CHECK(count(json_of(tracer), "\"name\":\"first\"") == 1);
+  record("second", true);
+  record("third", false);
+  record("fourth", false);
+  const std::string json = json_of(tracer);
+  CHECK(count(json, "thread_name") == 2);
+  CHECK(count(json, "\"name\":\"first\"") == 0);
+  CHECK(count(json, "\"name\":\"second\"") == 0);
+  CHECK(count(json, "\"name\":\"third\"") == 1);
+  CHECK(count(json, "\"name\":\"fourth\"") == 1);
+  // Each track has only its own thread's events
+  CHECK(count(json, "\"name\":\"parked\"") == 2);
+}
+
+int main() {
+  names_are_escaped();
+  rings_are_reused();
+}
@@ -0,0 +1,87 @@
+#include "check.h"
+#include <atomic>
+#include <psched/priority_scheduler.h>
+#include <thread>
+#include <vector>
+using namespace psched;
+
+// Queues `per_level` tasks at every level behind the only worker, then
+// returns the levels of the tasks in the order they ran
+template <class Scheduler>
+static std::vector<size_t> run_backlog(Scheduler &scheduler, size_t levels, size_t per_level,
+                                       uint32_t cost_of_level_0 = 1) {
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+  scheduler.schedule(levels - 1, [&] {
+    started = true;
+    while (!release)
+      std::this_thread::yield();
+  });
+  while (!started)
+    std::this_thread::yield();
+  std::vector<size_t> order;
+  std::atomic<size_t> done{0};
+  for (size_t i = 0; i < per_level; ++i) {
+    for (size_t level = 0; level < levels; ++level) {
+      Task task([&order, &done, level] {
+        order.push_back(level);
+        done += 1;
+      });
+      if (level == 0)
+        task.set_cost(cost_of_level_0);
+      scheduler.schedule(level, std::move(task));
+    }
+  }
+  release = true;
+  while (done < levels * per_level)
+    std::this_thread::yield();
+  return order;
+}
+
+// Tasks run at each level of `first` tasks
+static std::vector<size_t> shares(const std::vector<size_t> &order, size_t levels, size_t first) {
+  std::vector<size_t> counts(levels);
+  for (size_t i = 0; i < first; ++i)
+    counts[order[i]] += 1;
+  return counts;
+}
+
+static bool near(size_t value, size_t expected) {
+  return value + expected / 20 + 1 >= expected && value <= expected + expected / 20 + 1;
+}
+
+// While every level has tasks, each gets a share of the runs proportional to
+// its weight
+static void proportional_to_weights() {
+  PriorityScheduler<threads<1>, queues<3>, aging_policy<>, weighted_fair_queuing<1, 2, 4>>
+      scheduler;
+  const auto order = run_backlog(scheduler, 3, 1000);
+  // Level 2 runs out after 1000 tasks, at about 1750 runs
+  const auto counts = shares(order, 3, 1400);
+  CHECK(near(counts[0], 200));
+  CHECK(near(counts[1], 400));
+  CHECK(near(counts[2], 800));
+}
+
+// Weights changed at run time take effect
+static void changed_weights() {
+  PriorityScheduler<threads<1>, queues<2>, aging_policy<>, weighted_fair_queuing<1, 1>> scheduler;
+  scheduler.set_weight<priority<0>>(3);
+  const auto counts = shares(run_backlog(scheduler, 2, 1000), 2, 1000);
+  CHECK(near(counts[0], 750));
+  CHECK(near(counts[1], 250));
+}
+
+// Tasks with a cost of 0 still use up their level's share
+static void zero_cost_does_not_starve() {
+  PriorityScheduler<threads<1>, queues<2>, aging_policy<>, weighted_fair_queuing<1, 1>> scheduler;
+  const auto counts = shares(run_backlog(scheduler, 2, 500, 0), 2, 500);
+  CHECK(near(counts[0], 250));
+  CHECK(near(counts[1], 250));
+}
+
+int main() {
+  proportional_to_weights();
+  changed_weights();
+  zero_cost_does_not_starve();
+}
@@ -0,0 +1,79 @@
+#include "check.h"
+#include <atomic>
+#include <chrono>
+#include <psched/priority_scheduler.h>
+#include <thread>
+using namespace psched;
+
+// Tasks scheduled from inside a task still count against a bounded queue and
+// are discarded by its policy
+static void bounded_queues_apply_to_workers() {
+  PriorityScheduler<threads<1>, queues<1, maintain_size<4, discard::newest_task>>, aging_policy<>,
+                    work_stealing<>>
+      scheduler;
+  std::atomic<size_t> ran{0};
+  std::atomic<size_t> dropped{0};
+  std::atomic<bool> scheduled{false};
+  scheduler.schedule<priority<0>>([&] {
+    // The only worker is busy here, so nothing is dequeued meanwhile
+    for (size_t i = 0; i < 1000; ++i) {
+      Task task([&ran] { ran += 1; });
+      task.on_dropped([&dropped](const TaskStats &) { dropped += 1; });
+      scheduler.schedule<priority<0>>(std::move(task));
+    }
+    scheduled = true;
+  });
+  while (!scheduled || ran + dropped < 1000)
+    std::this_thread::yield();
+  CHECK(ran == 4);
+  CHECK(dropped == 996);
+}
+
+// Tasks spawned by tasks all run, on whichever worker
+static void unbounded_fan_out() {
+  PriorityScheduler<threads<2>, queues<3>, aging_policy<>, work_stealing<>> scheduler;
+  std::atomic<size_t> ran{0};
+  scheduler.schedule<priority<1>>([&] {
+    for (size_t i = 0; i < 1000; ++i)
+      scheduler.schedule(i % 3, [&] {
+        scheduler.schedule(0, [&ran] { ran += 1; });
+      });
+  });
+  while (ran < 1000)
+    std::this_thread::yield();
+}
+
+// An extra worker of an elastic pool, which sets itself up on its own
+// thread, steals the tasks queued on a blocked worker's deques; the metrics
+// of workers that have not started yet are left out
+static void extra_workers_steal() {
+  typedef elastic_pool<2, 1, retire_after<std::chrono::milliseconds, 50>,
+                       blocked_after<std::chrono::milliseconds, 10>>
+      pool;
+  PriorityScheduler<threads<1>, queues<2>, aging_policy<>, work_stealing<>, pool,
+                    collect_metrics<true>>
+      scheduler;
+  CHECK(scheduler.metrics_snapshot().pool.workers == 1);
+  std::atomic<size_t> ran{0};
+  std::atomic<bool> timed_out{false};
+  scheduler.schedule<priority<1>>([&] {
+    for (int i = 0; i < 50; ++i)
+      scheduler.schedule<priority<0>>([&ran] { ran += 1; });
+    // Blocked until the extra worker has run every task
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (ran < 50 && !(timed_out = std::chrono::steady_clock::now() > deadline))
+      std::this_thread::yield();
+  });
+  while (ran < 50 && !timed_out)
+    std::this_thread::yield();
+  CHECK(!timed_out);
+  const auto metrics = scheduler.metrics_snapshot();
+  CHECK(metrics.pool.started >= 1);
+  CHECK(metrics.levels[0].stolen >= 1);
+}
+
+int main() {
+  bounded_queues_apply_to_workers();
+  unbounded_fan_out();
+  extra_workers_steal();
+}